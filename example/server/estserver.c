@@ -15,9 +15,6 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <stdint.h>
-#ifndef DISABLE_TSEARCH
-#include <search.h>
-#endif
 #include <getopt.h>
 #include <openssl/err.h>
 #include <openssl/engine.h>
@@ -47,9 +44,7 @@ static int pop = 0;
 static int v6 = 0;
 static int srp = 0;
 static int enforce_csr = 0;
-#ifndef DISABLE_TSEARCH
 static int manual_enroll = 0;
-#endif
 static int tcp_port = 8085;
 static int http_digest_auth = 0;
 static int http_auth_disable = 0;
@@ -141,9 +136,7 @@ static void show_usage_and_exit (void)
             "  -r <value>   HTTP realm to present to clients\n"
             "  -l           Enable CRL checks\n"
             "  -t           Enable check for binding client PoP to the TLS UID\n"
-#ifndef DISABLE_TSEARCH
             "  -m <seconds> Simulate manual CA enrollment\n"
-#endif
             "  -n           Disable HTTP authentication (TLS client auth required)\n"
             "  -o           Disable HTTP authentication when TLS client auth succeeds\n"
             "  -h           Use HTTP Digest auth instead of Basic auth\n"
@@ -153,7 +146,7 @@ static void show_usage_and_exit (void)
 #endif
 	    "  -f           Runs EST Server in FIPS MODE = ON\n"
 	    "  -6           Enable IPv6\n"
-            "  -w           Dump the CSR to '/tmp/csr.p10' allowing for manual attribute capture on server\n"
+            "  -w           Dump the DER encoded CSR to '/tmp/csr.p10' allowing for manual attribute capture on server\n"
 	    "  -?           Print this help message and exit\n"
 	    "  --srp <file> Enable TLS-SRP authentication of client using the specified SRP parameters file\n"
 	    "  --enforce-csr  Enable CSR attributes enforcement. The client must provide all the attributes in the CSR.\n"
@@ -162,122 +155,6 @@ static void show_usage_and_exit (void)
 }
 
 
-#ifndef DISABLE_TSEARCH
-/*
- * The functions in this section implement a simple lookup table
- * to correlate incoming cert requests after a retry operation.
- * We use this to simulate the manual-enrollment mode on the CA.
- *
- * FIXME: we need a cleanup routine to clear the tree when this
- *        server shuts down.  Currently any remaining entries
- *        in the table will not be released, resulting in a memory
- *        leak in the valgrind output.
- */
-typedef struct {
-    unsigned char  *data;  //this will hold the pub key from the cert request
-    int		    length;
-} LOOKUP_ENTRY;
-LOOKUP_ENTRY *lookup_root = NULL;
-
-/*
- * Used to compare two entries in the lookup table to correlate
- * incoming cert reqeuests in the case of a retry operation.
- * We use the public key from the cert as the index into the 
- * lookup table.
- */
-int compare (const void *pa, const void *pb)
-{
-    LOOKUP_ENTRY *a = (LOOKUP_ENTRY *)pa;
-    LOOKUP_ENTRY *b = (LOOKUP_ENTRY *)pb;
-    if (a->length > b->length) return 1;
-    if (a->length < b->length) return -1;
-    return (memcmp(a->data, b->data, a->length));
-}
-
-/*
- * We use a simple lookup table to simulate manual enrollment
- * of certs by the CA.  This is the case where an operator
- * needs to review each cert request and approve it (e.g.
- * auto-enrollment is off).  
- *
- * Return 1 if a match was found and the enrollment operation
- * should proceed.  Return 0 if no match was found, in which
- * case we'll add the public key from the cert request into
- * our lookup table so it can be correlated later.
- */
-int lookup_pkcs10_request(unsigned char *pkcs10, int p10_len)
-{
-    X509_REQ *req = NULL;
-    BIO *in = NULL;
-    BIO *out = NULL;
-    BIO *b64;
-    EVP_PKEY *pkey;
-    BUF_MEM *bptr;
-    int rv;
-    LOOKUP_ENTRY *l;
-    LOOKUP_ENTRY *n;
-
-    /*
-     * Decode the request into an X509_REQ structure
-     */
-    b64 = BIO_new(BIO_f_base64());
-    in = BIO_new_mem_buf(pkcs10, p10_len);
-    in = BIO_push(b64, in);
-    if ((req = d2i_X509_REQ_bio(in, NULL)) == NULL) {
-	/* Unable to parse the request, just let this fall through
-	 * and the enrollment will fail */
-	rv = 1;
-	goto DONE;
-    }
-
-    /*
-     * Get the public key from the request, this will be our index into
-     * the lookup table.  Frankly, I'm not sure how a real CA
-     * would do this lookup.  But this should be good enough for
-     * testing the retry-after logic.
-     */
-    pkey = X509_PUBKEY_get(req->req_info->pubkey);
-    if (!pkey) {
-	rv = 1;
-	goto DONE;
-    }
-    out = BIO_new(BIO_s_mem());
-    PEM_write_bio_PUBKEY(out, pkey);
-    BIO_get_mem_ptr(out, &bptr);
-
-    /*
-     * see if we can find a match for this public key
-     */
-    n = malloc(sizeof(LOOKUP_ENTRY));
-    n->data = malloc(bptr->length);
-    n->length = bptr->length;
-    memcpy(n->data, bptr->data, n->length);
-    l = tfind(n, (void **)&lookup_root, compare);
-    if (l) {
-	/* We have a match, allow the enrollment */
-	rv = 1;	
-	tdelete(n, (void **)&lookup_root, compare);
-	if (verbose) printf("\nRemoving key from lookup table:\n");
-	dumpbin((unsigned char*)n->data, n->length);
-	free(n->data);
-	free(n);
-    } else {
-	/* Not a match, add it to the list and return */
-	l = tsearch(n, (void **)&lookup_root, compare);
-	rv = 0;
-	if (verbose) printf("\nAdding key to lookup table:\n");
-	dumpbin((unsigned char*)n->data, n->length);
-    }
-DONE:
-    if (out) BIO_free_all(out);
-    if (in) BIO_free_all(in);
-    if (req) X509_REQ_free(req);
-    if (pkey) EVP_PKEY_free(pkey);
-
-    return (rv);
-}
-#endif
-
 /*
  * Trivial utility function to extract the string
  * value of the subject name from a cert.
@@ -315,9 +192,10 @@ pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
  * Callback function used by EST stack to process a PKCS10
  * enrollment request with the CA.  The parameters are:
  *
- *   pkcs10	Contains the CSR that should be sent to
- *              the CA to be signed.
- *   pkcs10_len Length of the CSR char array
+ *   req	Contains the CSR that should be sent to
+ *              the CA to be signed, already decoded by libest.
+ *   der        DER encoding of the CSR
+ *   der_len    Length of the DER encoding
  *   pcks7	Should contain the signed PKCS7 certificate
  *              from the CA server.  You'll need allocate
  *              space and copy the cert into this char array.
@@ -329,7 +207,7 @@ pthread_mutex_t m = PTHREAD_MUTEX_INITIALIZER;
  *              itself during the TLS handshake, this parameter will
  *              contain that certificate.
  */
-int process_pkcs10_enrollment (unsigned char * pkcs10, int p10_len, 
+int process_pkcs10_enrollment (X509_REQ *req, unsigned char *der, int der_len,
                                unsigned char **pkcs7, int *pkcs7_len,
 			       char *user_id, X509 *peer_cert,
 			       void *app_data)
@@ -339,6 +217,7 @@ int process_pkcs10_enrollment (unsigned char * pkcs10, int p10_len,
     int rc;
     char sn[64];
     char file_name[MAX_FILENAME_LEN];
+    EVP_PKEY *pub_key;
 
     if (verbose) {
 	/*
@@ -357,39 +236,6 @@ int process_pkcs10_enrollment (unsigned char * pkcs10, int p10_len,
 	}
     }
 
-    /*
-     * If we're simulating manual certificate enrollment, 
-     * the CA will not automatically sign the cert request.
-     * We'll attempt to lookup in our local table if this
-     * cert has already been sent to us, if not, add it
-     * to the table and send the 'retry' message back to the
-     * client.  But if this cert request has been seen in the
-     * past, then we'll continue with the enrollment.
-     * To summarize, we're simulating manual enrollment by
-     * forcing the client to request twice, and we'll automatically
-     * enroll on the second request.
-     */
-#ifndef DISABLE_TSEARCH
-    if (manual_enroll) {
-	if (lookup_pkcs10_request(pkcs10, p10_len)) {
-	    /*
-	     * We've seen this cert request in the past.  
-	     * Remove it from the lookup table and allow
-	     * the enrollment to continue.  
-	     * Fall-thru to enrollment logic below
-	     */
-	} else {
-	    /* 
-	     * Couldn't find this request, it's the first time
-	     * we've seen it.  Therefore, send the retry
-	     * response.
-	     */
-	    return (EST_ERR_CA_ENROLL_RETRY);
-	}
-
-    }
-#endif
-
     rc = pthread_mutex_lock(&m);
     if (rc) {
         printf("\nmutex lock failed rc=%d", rc);
@@ -398,13 +244,13 @@ int process_pkcs10_enrollment (unsigned char * pkcs10, int p10_len,
 
     if (write_csr) {
         /*
-         * Dump out pkcs10 to a file, this will contain a list of the OIDs in the CSR.
+         * Dump out the DER encoded pkcs10 to a file, this will contain a list of the OIDs in the CSR.
          */
         snprintf(file_name, MAX_FILENAME_LEN, "/tmp/csr.p10");
-        write_binary_file(file_name, pkcs10, p10_len);        
+        write_binary_file(file_name, der, der_len);        
     }    
     
-    result = ossl_simple_enroll(pkcs10, p10_len);
+    result = ossl_simple_enroll_req(req);
     rc = pthread_mutex_unlock(&m);
     if (rc) {
         printf("\nmutex unlock failed rc=%d", rc);
@@ -417,6 +263,29 @@ int process_pkcs10_enrollment (unsigned char * pkcs10, int p10_len,
      * free the BIO.
      */
     *pkcs7_len = BIO_get_mem_data(result, (char**)&buf);
+
+    /*
+     * If we're simulating manual certificate enrollment, 
+     * the CA will not hand out the cert right away.  We
+     * post it to the pending table in libest and send the
+     * 'retry' message back to the client.  libest answers
+     * the client's next attempt with the cert, without
+     * calling us again.
+     */
+    if (manual_enroll) {
+	pub_key = X509_REQ_get_pubkey(req);
+	rc = est_server_approve_pending(ectx, pub_key, (unsigned char*)buf, 
+		                        *pkcs7_len);
+	EVP_PKEY_free(pub_key);
+	BIO_free_all(result);
+	*pkcs7_len = 0;
+	if (rc != EST_ERR_NONE) {
+	    printf("\nUnable to post pending enrollment rc=%d", rc);
+	    return (EST_ERR_CA_ENROLL_FAIL);
+	}
+	return (EST_ERR_CA_ENROLL_RETRY);
+    }
+
     if (*pkcs7_len > 0 && *pkcs7_len < MAX_CERT_LEN) {
         *pkcs7 = malloc(*pkcs7_len);
         memcpy(*pkcs7, buf, *pkcs7_len);
@@ -668,12 +537,10 @@ int main (int argc, char **argv)
 		enforce_csr = 1;
             }
 	    break;
-#ifndef DISABLE_TSEARCH
         case 'm':
             manual_enroll = 1;
 	    retry_period = atoi(optarg);            
             break;
-#endif
         case 'h':
             http_digest_auth = 1;
             break;
@@ -848,6 +715,13 @@ int main (int argc, char **argv)
     if (verbose) printf("\nRetry period being set to: %d \n", retry_period);
     est_server_set_retry_period(ectx, retry_period);
 
+    if (manual_enroll) {
+	if (est_server_enable_pending_table(ectx, 1024, 3600)) {
+	    printf("\nUnable to enable the pending enrollment table.  Aborting!!!\n");
+	    exit(1);
+	}
+    }
+
     if (crl) {
 	est_enable_crl(ectx);
     }
@@ -873,7 +747,7 @@ int main (int argc, char **argv)
 	}
     }
 
-    if (est_set_ca_enroll_cb(ectx, &process_pkcs10_enrollment)) {
+    if (est_set_ca_enroll_csr_cb(ectx, &process_pkcs10_enrollment)) {
         printf("\nUnable to set EST pkcs10 enrollment callback.  Aborting!!!\n");
         exit(1);
     }
@@ -883,7 +757,7 @@ int main (int argc, char **argv)
      * CA would need to implement the requirements in section
      * 4.2 of the EST draft.
      */
-    if (est_set_ca_reenroll_cb(ectx, &process_pkcs10_enrollment)) {
+    if (est_set_ca_reenroll_csr_cb(ectx, &process_pkcs10_enrollment)) {
         printf("\nUnable to set EST pkcs10 enrollment callback.  Aborting!!!\n");
         exit(1);
     }
@@ -2113,7 +2113,7 @@ static int certify (X509 **xret, char *inptr, EVP_PKEY *pkey, X509 *x509,
 	     int email_dn, char *startdate, char *enddate,
 	     long days, int batch, char *ext_sect, CONF *lconf, int verbose,
 	     unsigned long certopt, unsigned long nameopt, int default_op,
-	     int ext_copy, int selfsign, int p10len)
+	     int ext_copy, int selfsign, int p10len, X509_REQ *p10req)
 {
 	X509_REQ *req=NULL;
 	BIO *in=NULL;
@@ -2121,6 +2121,10 @@ static int certify (X509 **xret, char *inptr, EVP_PKEY *pkey, X509 *x509,
 	EVP_PKEY *pktmp=NULL;
 	int ok= -1,i;
 
+	if (p10req) {
+		//Request was already decoded by the caller
+		req = p10req;
+	} else {
         b64 = BIO_new(BIO_f_base64());
 	in = BIO_new_mem_buf(inptr, p10len);
 	in = BIO_push(b64, in);
@@ -2132,6 +2136,7 @@ static int certify (X509 **xret, char *inptr, EVP_PKEY *pkey, X509 *x509,
 		BIO_printf(bio_err,"Error reading certificate request\n");
 		goto err;
 		}
+	}
 	if (verbose)
 		X509_REQ_print(bio_err,req);
 
@@ -2171,7 +2176,7 @@ static int certify (X509 **xret, char *inptr, EVP_PKEY *pkey, X509 *x509,
 		certopt, nameopt, default_op, ext_copy, selfsign);
 
 err:
-	if (req != NULL) X509_REQ_free(req);
+	if (req != NULL && req != p10req) X509_REQ_free(req);
 	if (in != NULL) BIO_free_all(in);
 	return(ok);
 }
@@ -2293,7 +2298,7 @@ static int check_time_format(const char *str)
  * Please accept my apology in advance for the poor formatting 
  * in the code below.
  */
-BIO * ossl_simple_enroll (const char *p10buf, int p10len)
+static BIO * ossl_enroll (const char *p10buf, int p10len, X509_REQ *p10req)
 {
 	char *configfile = NULL;
 	char *keyfile = NULL;
@@ -2791,12 +2796,12 @@ BIO * ossl_simple_enroll (const char *p10buf, int p10len)
 			goto err;
 		}
 
-		if (inptr != NULL) {
+		if (inptr != NULL || p10req != NULL) {
 			total++;
 			j=certify(&x,inptr,pkey,x509p,dgst,sigopts, attribs,db,
 				serial,subj,chtype,multirdn,email_dn,startdate,enddate,days,batch,
 				extensions,conf,verbose, certopt, nameopt,
-				default_op, ext_copy, selfsign, p10len);
+				default_op, ext_copy, selfsign, p10len, p10req);
 			if (j <= 0) goto err;
 			if (j > 0) {
 				total_done++;
@@ -2903,6 +2908,20 @@ err:
 	return retval;
 }
 
+BIO * ossl_simple_enroll (const char *p10buf, int p10len)
+{
+	return (ossl_enroll(p10buf, p10len, NULL));
+}
+
+/*
+ * Same as ossl_simple_enroll(), for a request that has
+ * already been decoded by the EST stack.
+ */
+BIO * ossl_simple_enroll_req (X509_REQ *req)
+{
+	return (ossl_enroll(NULL, 0, req));
+}
+
 
 
 
@@ -12,5 +12,6 @@
 #define HEADER_OSSL_SRV_H 
 
 BIO * ossl_simple_enroll(unsigned char *p10buf, int p10len);
+BIO * ossl_simple_enroll_req(X509_REQ *req);
 
 #endif
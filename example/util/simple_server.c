@@ -11,9 +11,6 @@
  */
 #include <stdio.h>
 #include <unistd.h>
-#ifndef DISABLE_PTHREADS
-#include <pthread.h>
-#endif
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -30,97 +27,19 @@ volatile int stop_flag = 0;
 int sock;                 
 static int tcp_port = 8085;
 static int family = AF_INET;
-volatile int num_threads; 
 static EST_CTX *ctx;
-#ifndef DISABLE_PTHREADS
-pthread_mutex_t mutex;    
-pthread_cond_t cond;      
-int queue[20];
-volatile int head;     
-volatile int tail;     
-pthread_cond_t full;   
-pthread_cond_t empty;  
-
-typedef void * (*thread_func_t)(void *);
 
-#define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
+/*
+ * The number of worker threads started by est_server_run()
+ */
 #define NUM_WORKER_THREADS 5
 
-
-static int grab_work (int *sp)
-{
-    pthread_mutex_lock(&mutex);
-
-    // Check for new work
-    while (head == tail && stop_flag == 0) {
-        pthread_cond_wait(&full, &mutex);
-    }
-
-    if (head > tail) {
-        *sp = queue[tail % ARRAY_SIZE(queue)];
-        tail++;
-
-        // Keep our pointers aligned
-        while (tail > (int)ARRAY_SIZE(queue)) {
-            tail -= ARRAY_SIZE(queue);
-            head -= ARRAY_SIZE(queue);
-        }
-    }
-
-    pthread_cond_signal(&empty);
-    pthread_mutex_unlock(&mutex);
-
-    return !stop_flag;
-}
-
-static void * worker_thread (void* data)
-{
-    int sock = 0;
-
-    while (grab_work(&sock)) {
-	/*
-	 * Both SERVER and PROXY modes use the
-	 * same entry point to hand off the socket
-	 * to libest
-	 */
-        est_server_handle_request(ctx, sock);
-        close(sock);
-    }
-
-    // Tell the boss that we're finishing 
-    pthread_mutex_lock(&mutex);
-    num_threads--;
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&mutex);
-    return NULL;
-}
-
-
-static void process_socket (int fd)
-{
-    pthread_mutex_lock(&mutex);
-
-    // Check if work queue is full and wait
-    while (stop_flag == 0 && head - tail >= (int)ARRAY_SIZE(queue)) {
-        pthread_cond_wait(&empty, &mutex);
-    }
-
-    if (head - tail < (int)ARRAY_SIZE(queue)) {
-	// Put the accepted socket on to the work queue
-        queue[head % ARRAY_SIZE(queue)] = fd;
-        head++;
-    }
-
-    pthread_cond_signal(&full);
-    pthread_mutex_unlock(&mutex);
-}
-#else
+#ifdef DISABLE_PTHREADS
 static void process_socket (int fd)
 {
     est_server_handle_request(ctx, fd);
     close(fd);
 }
-#endif
 
 static void * master_thread (void *data)
 {
@@ -209,37 +128,9 @@ static void * master_thread (void *data)
     close(sock);
     freeaddrinfo(aiptr);
 
-#ifndef DISABLE_PTHREADS
-    // Notify all the workers that it's time to shutdown
-    pthread_cond_broadcast(&full);
-
-    // Wait for the workers to finish
-    pthread_mutex_lock(&mutex);
-    while (num_threads > 0) {
-        pthread_cond_wait(&cond, &mutex);
-    }
-    pthread_mutex_unlock(&mutex);
-
-    pthread_mutex_destroy(&mutex);
-    pthread_cond_destroy(&cond);
-    pthread_cond_destroy(&empty);
-    pthread_cond_destroy(&full);
-#endif
-
     stop_flag = 2;
     return NULL;
 }
-
-#ifndef DISABLE_PTHREADS
-static int start_thread (thread_func_t func)
-{
-    pthread_t thread_id;
-    pthread_attr_t attr;
-
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    return pthread_create(&thread_id, &attr, func, 0);
-}
 #endif
 
 static void catch_int(int signo)
@@ -251,11 +142,11 @@ static void catch_int(int signo)
 /*
  * This is the entry point into the Simple TCP server.
  * This is designed to work with either the EST server
- * or EST proxy example applications.  This creates
- * a multi-threaded TCP server.  It opens a socket,
- * waits for incoming connections on the socket,
- * and dispatches work to a separate thread to process
- * the incoming EST request.
+ * or EST proxy example applications.  When pthreads
+ * are available, the listener and worker threads
+ * built into libest are started with est_server_run().
+ * Otherwise this opens a socket and processes each
+ * incoming EST request on the current thread.
  *
  * Parameters:
  *     ectx	Pointer to the EST_CTX that was provided from
@@ -269,10 +160,6 @@ static void catch_int(int signo)
  */
 void start_simple_server (EST_CTX *ectx, int port, int delay, int v6)
 {
-#ifndef DISABLE_PTHREADS
-    int i;
-#endif
-
     /*
      * Save a global reference to the context.
      * This code only supports running a single 
@@ -290,23 +177,10 @@ void start_simple_server (EST_CTX *ectx, int port, int delay, int v6)
     signal(SIGINT, catch_int);
 
 #ifndef DISABLE_PTHREADS
-    pthread_mutex_init(&mutex, NULL);
-    pthread_cond_init(&cond, NULL);
-    pthread_cond_init(&empty, NULL);
-    pthread_cond_init(&full, NULL);
-
-    // Start master (listening) thread
-    start_thread(master_thread);
-
-    // Start worker threads
-    for (i = 0; i < NUM_WORKER_THREADS; i++) {
-        if (start_thread(worker_thread) != 0) {
-            printf("\nCannot start worker thread: %d\n", errno);
-        } else {
-	    pthread_mutex_lock(&mutex);
-            num_threads++;
-	    pthread_mutex_unlock(&mutex);
-        }
+    est_server_set_listen_family(ctx, family);
+    if (est_server_run(ctx, tcp_port, NUM_WORKER_THREADS) != EST_ERR_NONE) {
+        printf("\nUnable to start EST server on port %d\n", tcp_port);
+        return;
     }
 #else
     /*
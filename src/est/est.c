@@ -16,6 +16,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#ifndef DISABLE_PTHREADS
+#include <pthread.h>
+#endif
 #ifndef DISABLE_BACKTRACE 
 #include <execinfo.h>
 #endif
@@ -32,9 +38,40 @@ const char *EST_ERR_STRINGS[] = {
 };
 
 static void (*est_log_func)(char *, va_list) = NULL;
-static EST_LOG_LEVEL est_desired_log_lvl = EST_LOG_LVL_ERR;
+EST_LOG_LEVEL est_desired_log_lvl = EST_LOG_LVL_ERR;
 static int est_backtrace_enabled = 0;
 
+static const char *est_log_lvl_names[] = { "", "ERROR", "WARNING", "INFO" };
+
+#ifndef DISABLE_PTHREADS
+/*
+ * Asynchronous logging.  Messages are formatted by the
+ * thread that logs them into a slot of a fixed size ring,
+ * and written out by a background drain thread.  Producers
+ * claim a slot with a compare-and-swap on the head counter
+ * and publish it by bumping the slot's sequence number, so
+ * logging never blocks on the output.  When the ring is
+ * full the message is dropped and counted.  Producers are
+ * counted in est_log_writers while they touch the ring, so
+ * the ring is only freed once none are left.
+ */
+typedef struct {
+    volatile unsigned int seq;
+    char msg[EST_LOG_SLOT_LEN];
+} EST_LOG_SLOT;
+
+static EST_LOG_SLOT *est_log_ring = NULL;
+static volatile int est_log_async = 0;
+static volatile int est_log_writers = 0;
+static unsigned int est_log_ring_mask = 0;
+static volatile unsigned int est_log_head = 0;
+static unsigned int est_log_tail = 0;
+static volatile int est_log_drain_run = 0;
+static pthread_t est_log_drain_thread;
+static volatile uint64_t est_log_drops = 0;
+static uint64_t est_log_drops_reported = 0;
+#endif
+
 /*
  * This is our default logger routine, which just
  * dumps log data to stderr.  The application can
@@ -67,6 +104,148 @@ static void est_log_msg (char *format, ...)
     va_end(arguments);
 }
 
+#ifndef DISABLE_PTHREADS
+/*
+ * Claims a ring slot for a new message.  Returns NULL
+ * when the ring is full, in which case the message is
+ * dropped.
+ */
+static EST_LOG_SLOT *est_log_claim (unsigned int *pos)
+{
+    EST_LOG_SLOT *slot;
+    unsigned int p = est_log_head;
+    int dif;
+
+    for (;;) {
+        slot = &est_log_ring[p & est_log_ring_mask];
+        dif = (int)(slot->seq - p);
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap(&est_log_head, p, p + 1)) {
+                *pos = p;
+                return (slot);
+            }
+        } else if (dif < 0) {
+            __sync_fetch_and_add(&est_log_drops, 1);
+            return (NULL);
+        }
+        p = est_log_head;
+    }
+}
+
+static void est_log_publish (EST_LOG_SLOT *slot, unsigned int pos)
+{
+    __sync_synchronize();
+    slot->seq = pos + 1;
+}
+
+/*
+ * Writes out every message that has been published so far.
+ * Only the drain thread calls this while it is running.
+ * Returns the number of messages written.
+ */
+static int est_log_drain (void)
+{
+    EST_LOG_SLOT *slot;
+    uint64_t drops;
+    int n = 0;
+    int to_stderr = (est_log_func == NULL ||
+                     est_log_func == &est_logger_stderr);
+
+    for (;;) {
+        slot = &est_log_ring[est_log_tail & est_log_ring_mask];
+        if ((int)(slot->seq - (est_log_tail + 1)) < 0) {
+            break;
+        }
+        __sync_synchronize();
+        if (to_stderr) {
+            fputs(slot->msg, stderr);
+        } else {
+            est_log_msg("%s", slot->msg);
+        }
+        __sync_synchronize();
+        slot->seq = est_log_tail + est_log_ring_mask + 1;
+        est_log_tail++;
+        n++;
+    }
+
+    drops = est_log_drops;
+    if (drops != est_log_drops_reported) {
+        est_log_msg("\n***EST [WARNING]--> %llu log messages dropped",
+                    (unsigned long long)(drops - est_log_drops_reported));
+        est_log_drops_reported = drops;
+    }
+    if (n && to_stderr) {
+        fflush(stderr);
+    }
+    return (n);
+}
+
+static void *est_log_drain_main (void *arg)
+{
+    struct timespec ts = { 0, 1000000 };
+
+    while (est_log_drain_run) {
+        if (!est_log_drain()) {
+            nanosleep(&ts, NULL);
+        }
+    }
+    est_log_drain();
+    return (NULL);
+}
+#endif
+
+/*
+ * Hands one log message to the logger, either directly or
+ * through the ring when asynchronous logging is enabled.
+ * The header and the message are delivered together.
+ */
+static void est_log_emit (const char *hdr, char *format, va_list ap)
+{
+#ifndef DISABLE_PTHREADS
+    EST_LOG_SLOT *slot;
+    unsigned int pos;
+    int n = 0;
+
+    /*
+     * Announce ourselves before looking at est_log_async, the
+     * disable path clears the flag before waiting for the
+     * writer count to drop to zero.
+     */
+    __sync_fetch_and_add(&est_log_writers, 1);
+    if (est_log_async) {
+        slot = est_log_claim(&pos);
+        if (slot) {
+            if (hdr) {
+                n = snprintf(slot->msg, EST_LOG_SLOT_LEN, "%s", hdr);
+                if (n >= EST_LOG_SLOT_LEN) {
+                    n = EST_LOG_SLOT_LEN - 1;
+                }
+            }
+            vsnprintf(slot->msg + n, EST_LOG_SLOT_LEN - n, format, ap);
+            est_log_publish(slot, pos);
+        }
+        __sync_fetch_and_sub(&est_log_writers, 1);
+        return;
+    }
+    __sync_fetch_and_sub(&est_log_writers, 1);
+#endif
+
+    if (est_log_func == NULL || est_log_func == &est_logger_stderr) {
+        flockfile(stderr);
+        if (hdr) {
+            fputs(hdr, stderr);
+        }
+        vfprintf(stderr, format, ap);
+        fflush(stderr);
+        funlockfile(stderr);
+    } else {
+        if (hdr) {
+            est_log_msg("%s", hdr);
+        }
+        (*est_log_func)(format, ap);
+    }
+}
+
 /*
  * Global function to be called to log something
  */
@@ -81,18 +260,42 @@ void est_log (EST_LOG_LEVEL lvl, char *format, ...)
         return;
     }
 
-    /*
-     * Pull the arguments from the stack and invoke
-     * the logger function
-     */
     va_start(arguments, format);
-    if (est_log_func != NULL) {
-        (*est_log_func)(format, arguments);
-    } else {
-        est_logger_stderr(format, arguments);
-    }
+    est_log_emit(NULL, format, arguments);
     va_end(arguments);
+}
+
+/*
+ * Called by the EST_LOG_* macros once the level has been
+ * found to be enabled.  The location header is formatted
+ * together with the message, and a backtrace follows
+ * warnings and errors when enabled.
+ */
+void est_log_at (EST_LOG_LEVEL lvl, const char *func, int line,
+                 char *format, ...)
+{
+    va_list arguments;
+    char hdr[EST_LOG_HDR_LEN];
+
+    snprintf(hdr, sizeof(hdr), "\n***EST [%s][%s:%d]--> ",
+             est_log_lvl_names[lvl], func, line);
+
+    va_start(arguments, format);
+    est_log_emit(hdr, format, arguments);
+    va_end(arguments);
+
+    if (lvl <= EST_LOG_LVL_WARN) {
+        est_log_backtrace();
+    }
+}
+
+static void est_log_line (char *format, ...)
+{
+    va_list arguments;
 
+    va_start(arguments, format);
+    est_log_emit(NULL, format, arguments);
+    va_end(arguments);
 }
 
 /*
@@ -112,10 +315,9 @@ void est_log_backtrace (void)
         frames = backtrace(callstack, 128);
         strs = backtrace_symbols(callstack, frames);
         for (i = 0; i < frames; ++i) {
-	    est_log_msg("\n%s", strs[i]);
-            //fprintf(stderr, "%s\n", strs[i]);
+	    est_log_line("\n%s", strs[i]);
         }
-	est_log_msg("\n\n");
+	est_log_line("\n\n");
         free(strs);
     }
 #endif
@@ -220,6 +422,117 @@ void est_enable_backtrace (int enable)
     est_backtrace_enabled = enable;
 }
 
+/*! @brief est_enable_async_logger() moves the writing of EST log
+    messages off the calling threads.
+ 
+    @param queue_len Number of messages that may be waiting to be
+                     written.  Rounded up to a power of two, and must
+                     be between 1 and EST_LOG_QUEUE_MAX.
+ 
+    Once enabled, a log message is formatted into a queue entry by
+    the thread that logs it and a background thread hands it to the
+    logger installed with est_init_logger().  Logging threads never
+    wait on the logger.  When the queue is full the message is
+    dropped; the number of dropped messages is reported through the
+    logger and can be read with est_get_log_drops().  Messages longer
+    than EST_LOG_SLOT_LEN are truncated.
+
+    This setting is global to the library and may be enabled or
+    disabled at any time, but not from two threads at once.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_enable_async_logger (int queue_len)
+{
+#ifndef DISABLE_PTHREADS
+    EST_LOG_SLOT *ring;
+    unsigned int size = 1, i;
+
+    if (queue_len < 1 || queue_len > EST_LOG_QUEUE_MAX) {
+        EST_LOG_ERR("Invalid log queue length (%d)", queue_len);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    if (est_log_async) {
+        EST_LOG_ERR("Asynchronous logging is already enabled");
+        return (EST_ERR_BAD_MODE);
+    }
+    while (size < (unsigned int)queue_len) {
+        size <<= 1;
+    }
+
+    ring = malloc(size * sizeof(EST_LOG_SLOT));
+    if (!ring) {
+        EST_LOG_ERR("malloc failed");
+        return (EST_ERR_MALLOC);
+    }
+    for (i = 0; i < size; i++) {
+        ring[i].seq = i;
+    }
+    est_log_ring = ring;
+    est_log_head = 0;
+    est_log_tail = 0;
+    est_log_ring_mask = size - 1;
+
+    est_log_drain_run = 1;
+    if (pthread_create(&est_log_drain_thread, NULL, est_log_drain_main, NULL)) {
+        est_log_drain_run = 0;
+        est_log_ring = NULL;
+        free(ring);
+        EST_LOG_ERR("Unable to start the log thread");
+        return (EST_ERR_SYSCALL);
+    }
+    __sync_synchronize();
+    est_log_async = 1;
+    return (EST_ERR_NONE);
+#else
+    EST_LOG_ERR("Asynchronous logging requires pthreads");
+    return (EST_ERR_BAD_MODE);
+#endif
+}
+
+/*! @brief est_disable_async_logger() stops the background log thread
+    started by est_enable_async_logger().  Messages still queued are
+    written before this returns, and later messages are written by the
+    calling thread again.  Threads that are logging while this is
+    called are waited for, so it is safe to disable the queue while
+    the server is running.
+ 
+    @return void.
+ */
+void est_disable_async_logger (void)
+{
+#ifndef DISABLE_PTHREADS
+    struct timespec ts = { 0, 100000 };
+
+    if (!est_log_async) {
+        return;
+    }
+    est_log_async = 0;
+    __sync_synchronize();
+    while (est_log_writers) {
+        nanosleep(&ts, NULL);
+    }
+    est_log_drain_run = 0;
+    pthread_join(est_log_drain_thread, NULL);
+    free(est_log_ring);
+    est_log_ring = NULL;
+#endif
+}
+
+/*! @brief est_get_log_drops() returns the number of log messages
+    dropped because the asynchronous log queue was full.
+ 
+    @return uint64_t.
+ */
+uint64_t est_get_log_drops (void)
+{
+#ifndef DISABLE_PTHREADS
+    return (est_log_drops);
+#else
+    return (0);
+#endif
+}
+
 /*! @brief est_read_x509_request() is a helper function that reads
  *  a char* and converts it to an OpenSSL X509_REQ*.  The char* data
  *  can be either PEM or DER encoded.   
@@ -561,9 +874,80 @@ EST_ERROR est_load_ca_certs (EST_CTX *ctx, unsigned char *raw, int size)
     memcpy(ctx->ca_certs, retval, ctx->ca_certs_len);
     BIO_free_all(cacerts);
     BIO_free(in);
+
+    est_update_cacerts_resp(ctx);
     return (EST_ERR_NONE);
 }
 
+/*
+ * Small spin lock for data that is only held for a few
+ * instructions, such as swapping a pointer or updating a
+ * reference count.  A waiter spins briefly and then yields
+ * the CPU, in case the holder has been preempted.  The lock
+ * is a volatile int initialized to zero.
+ */
+void est_spin_lock (volatile int *lock)
+{
+    int spins;
+
+    while (__sync_lock_test_and_set(lock, 1)) {
+        spins = 0;
+        while (*lock) {
+            if (++spins == EST_SPIN_LIMIT) {
+                sched_yield();
+                spins = 0;
+            }
+        }
+    }
+}
+
+void est_spin_unlock (volatile int *lock)
+{
+    __sync_lock_release(lock);
+}
+
+/*
+ * Renders the complete HTTP response for /cacerts from the PKCS7
+ * data on the context, so that the response isn't formatted on
+ * every request.  Requests in progress keep using the previous
+ * response until they drop their reference to it.  If rendering
+ * fails the response is built per request instead.
+ */
+void est_update_cacerts_resp (EST_CTX *ctx)
+{
+    EST_HTTP_RESP *new_resp = NULL, *old_resp;
+
+    if (ctx->ca_certs) {
+        new_resp = est_http_resp_new_200(EST_HTTP_CT_PKCS7, ctx->ca_certs,
+                                         ctx->ca_certs_len);
+    }
+
+    est_spin_lock(&ctx->cacerts_resp_lock);
+    old_resp = ctx->cacerts_resp;
+    ctx->cacerts_resp = new_resp;
+    est_spin_unlock(&ctx->cacerts_resp_lock);
+
+    est_http_resp_release(old_resp);
+}
+
+/*
+ * Returns a reference to the pre-rendered /cacerts response, or
+ * NULL if there isn't one.  The caller must release the reference
+ * with est_http_resp_release().
+ */
+EST_HTTP_RESP *est_get_cacerts_resp (EST_CTX *ctx)
+{
+    EST_HTTP_RESP *resp;
+
+    est_spin_lock(&ctx->cacerts_resp_lock);
+    resp = ctx->cacerts_resp;
+    if (resp) {
+        est_http_resp_hold(resp);
+    }
+    est_spin_unlock(&ctx->cacerts_resp_lock);
+    return (resp);
+}
+
 /*
  * Takes a char array containing the PEM encoded CA certificates,
  * both implicit and explict certs.  These are decoded and loaded
@@ -674,6 +1058,20 @@ EST_ERROR est_destroy (EST_CTX *ctx)
         free(ctx->ca_certs);
     }
 
+    est_http_resp_release(ctx->cacerts_resp);
+    est_server_free_session_cache(ctx);
+    est_server_free_enroll_batch(ctx);
+    est_server_free_csrattrs_sets(ctx);
+    est_server_free_csrattrs_cache(ctx);
+    est_server_free_nonces(ctx);
+    est_server_free_pending(ctx);
+    est_server_free_enroll_cache(ctx);
+    est_stats_free(ctx);
+
+    if (ctx->enroll_chain) {
+        free(ctx->enroll_chain);
+    }
+
     if (ctx->retrieved_ca_certs) {
         free(ctx->retrieved_ca_certs);
     }
@@ -708,10 +1106,13 @@ EST_ERROR est_destroy (EST_CTX *ctx)
          * SSL_get1_session() has been called, so now it needs to be explictly
          * freed to get its ref count decrememnted.
          */
+        est_client_drop_conn(ctx);
         if (ctx->sess) {
             SSL_SESSION_free(ctx->sess);
         }
-        SSL_CTX_free(ctx->ssl_ctx);
+        if (!ctx->shared_ssl_ctx) {
+            SSL_CTX_free(ctx->ssl_ctx);
+        }
     }
 
     if (ctx->est_mode == EST_PROXY) {
@@ -864,6 +1265,44 @@ int est_base64_decode (const char *src, char *dst, int dst_size)
 
 
 
+/*
+ * Copies the finished message the TLS unique ID is derived
+ * from and returns its length.  RFC5929 states the *first*
+ * finished message is used.  When session resumption is used,
+ * the server sends the first finished message.  Normally the
+ * client sends the first finished messaged.
+ */
+int est_get_tls_finished (SSL *ssl, int is_client, char *finished, int max)
+{
+    int len;
+
+    if ((is_client && !SSL_session_reused(ssl)) ||
+        (!is_client && SSL_session_reused(ssl))) {
+        len = (int) SSL_get_finished(ssl, finished, max);
+    } else {
+        len = (int) SSL_get_peer_finished(ssl, finished, max);
+    }
+    return (len > max ? max : len);
+}
+
+/*
+ * Encodes a finished message using the channel binding rules.
+ * uid must have room for EST_TLS_UID_LEN bytes, the result is
+ * NUL terminated.
+ */
+EST_ERROR est_encode_tls_uid (const char *finished, int len, char *uid)
+{
+    int enc_len = ((len + 2) / 3) * 4;
+
+    if (len <= 0 || enc_len != EST_TLS_UID_LEN - 1) {
+        EST_LOG_WARN("TLS UID length mismatch (%d/%d)", enc_len + 1,
+                     EST_TLS_UID_LEN);
+        return (EST_ERR_AUTH_FAIL_TLSUID);
+    }
+    EVP_EncodeBlock((unsigned char *)uid, (const unsigned char *)finished, len);
+    return (EST_ERR_NONE);
+}
+
 /*
  * Given an SSL session, get the TLS unique ID from the
  * peer finished message.  This uses the OpenSSL API
@@ -876,46 +1315,19 @@ int est_base64_decode (const char *src, char *dst, int dst_size)
 char * est_get_tls_uid (SSL *ssl, int is_client)
 {
     char finished[MAX_FINISHED];
-    BIO *bio = NULL, *b64 = NULL;
-    BUF_MEM *bptr = NULL;
     int len;
-    char *rv = NULL;
+    char *rv;
 
-    /*
-     * RFC5929 states the *first* finished message is used
-     * to derive the tls-unique-id.  When session resumption
-     * is used, the server sends the first finished message.
-     * Normally the client sends the first finished messaged.
-     */
-    if ((is_client && !SSL_session_reused(ssl)) ||
-        (!is_client && SSL_session_reused(ssl))) {
-        len = (int) SSL_get_finished(ssl, finished, MAX_FINISHED);
-    } else {
-        len = (int) SSL_get_peer_finished(ssl, finished, MAX_FINISHED);
+    len = est_get_tls_finished(ssl, is_client, finished, MAX_FINISHED);
+    rv = malloc(EST_TLS_UID_LEN);
+    if (!rv) {
+        return (NULL);
     }
-
-    b64 = BIO_new(BIO_f_base64());
-    bio = BIO_new(BIO_s_mem());
-    (void)BIO_flush(bio);
-    bio = BIO_push(b64, bio);
-    BIO_write(bio, finished, len);
-    (void)BIO_flush(bio);
-    BIO_get_mem_ptr(bio, &bptr);
-
-    /*
-     * Be aware that OpenSSL adds a newline character at the
-     * end of the base64 encoded data
-     */
-    if (bptr->length != EST_TLS_UID_LEN) {
-        EST_LOG_WARN("TLS UID length mismatch (%d/%d)", bptr->length,
-                     EST_TLS_UID_LEN);
-    } else {
-        rv = malloc(EST_TLS_UID_LEN + 1);
-        memcpy(rv, bptr->data, EST_TLS_UID_LEN);
-        rv[EST_TLS_UID_LEN-1] = '\0';
-        EST_LOG_INFO("TLS UID was found");
+    if (est_encode_tls_uid(finished, len, rv) != EST_ERR_NONE) {
+        free(rv);
+        return (NULL);
     }
-    BIO_free_all(bio);
+    EST_LOG_INFO("TLS UID was found");
     return rv;
 }
 
@@ -1371,3 +1783,356 @@ EST_ERROR est_get_attributes_helper (unsigned char **der_ptr, int *der_len, int
     return (EST_ERR_NONE);
 }
 
+
+/*
+ * Request statistics
+ *
+ * Counters are kept in a fixed number of shards.  Each thread sticks
+ * to one shard, so threads rarely touch the same cache lines, and the
+ * counters are updated with atomic adds, so no lock is taken when a
+ * request is counted.  A snapshot sums the shards.
+ */
+#define EST_STATS_SHARDS 16
+
+struct est_stats_shard {
+    EST_STATS s;
+    /* Keep neighbouring shards off each other's cache lines */
+    char pad[64 - sizeof(EST_STATS) % 64];
+};
+
+static volatile int est_stats_next_shard = 0;
+static __thread int est_stats_thread_shard = -1;
+
+static const char *est_stats_uri_names[EST_STATS_URI_MAX] = {
+    "cacerts", "simpleenroll", "simplereenroll", "csrattrs", "other"
+};
+static const char *est_stats_stage_names[EST_STATS_STAGE_MAX] = {
+    "auth", "csr", "ca", "response"
+};
+static const char *est_stats_auth_names[EST_STATS_AUTH_MAX] = {
+    "cert", "http", "srp", "pending", "failed"
+};
+
+/*
+ * Allocates the counters for a server or proxy context
+ */
+EST_ERROR est_stats_new (EST_CTX *ctx)
+{
+    ctx->stats = calloc(EST_STATS_SHARDS, sizeof(struct est_stats_shard));
+    if (!ctx->stats) {
+        EST_LOG_ERR("malloc failed");
+        return (EST_ERR_MALLOC);
+    }
+    return (EST_ERR_NONE);
+}
+
+void est_stats_free (EST_CTX *ctx)
+{
+    free(ctx->stats);
+    ctx->stats = NULL;
+}
+
+static EST_STATS *est_stats_shard (EST_CTX *ctx)
+{
+    if (est_stats_thread_shard < 0) {
+        est_stats_thread_shard =
+            __sync_fetch_and_add(&est_stats_next_shard, 1) % EST_STATS_SHARDS;
+    }
+    return (&ctx->stats[est_stats_thread_shard].s);
+}
+
+/*
+ * Returns a monotonic timestamp in microseconds, used as the
+ * start value for est_stats_request() and est_stats_stage()
+ */
+uint64_t est_stats_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+EST_STATS_URI est_stats_uri (const char *uri)
+{
+    if (!uri) {
+        return (EST_STATS_URI_OTHER);
+    }
+    if (!strncmp(uri, EST_CACERTS_URI, EST_URI_MAX_LEN)) {
+        return (EST_STATS_URI_CACERTS);
+    }
+    if (!strncmp(uri, EST_SIMPLE_ENROLL_URI, EST_URI_MAX_LEN)) {
+        return (EST_STATS_URI_SIMPLE_ENROLL);
+    }
+    if (!strncmp(uri, EST_RE_ENROLL_URI, EST_URI_MAX_LEN)) {
+        return (EST_STATS_URI_SIMPLE_REENROLL);
+    }
+    if (!strncmp(uri, EST_CSR_ATTRS_URI, EST_URI_MAX_LEN)) {
+        return (EST_STATS_URI_CSRATTRS);
+    }
+    return (EST_STATS_URI_OTHER);
+}
+
+static void est_stats_hist_add (EST_STATS_HIST *hist, uint64_t start)
+{
+    uint64_t usecs = est_stats_now() - start;
+    uint64_t bound = EST_STATS_HIST_BASE_USECS;
+    int b = 0;
+
+    while (usecs > bound && b < EST_STATS_HIST_BUCKETS - 1) {
+        bound <<= 1;
+        b++;
+    }
+    __sync_fetch_and_add(&hist->buckets[b], 1);
+    __sync_fetch_and_add(&hist->count, 1);
+    __sync_fetch_and_add(&hist->sum_usecs, usecs);
+}
+
+/*
+ * Counts a request handed to the EST layer and records the time
+ * since start in the latency histogram for its URI
+ */
+void est_stats_request (EST_CTX *ctx, EST_STATS_URI uri, uint64_t start)
+{
+    EST_STATS *s;
+
+    if (!ctx->stats) {
+        return;
+    }
+    s = est_stats_shard(ctx);
+    __sync_fetch_and_add(&s->requests[uri], 1);
+    est_stats_hist_add(&s->uri_latency[uri], start);
+}
+
+void est_stats_stage (EST_CTX *ctx, EST_STATS_STAGE stage, uint64_t start)
+{
+    if (!ctx->stats) {
+        return;
+    }
+    est_stats_hist_add(&est_stats_shard(ctx)->stage_latency[stage], start);
+}
+
+void est_stats_status (EST_CTX *ctx, int status)
+{
+    if (!ctx->stats) {
+        return;
+    }
+    if (status < 0 || status >= EST_STATS_STATUS_MAX) {
+        status = 0;
+    }
+    __sync_fetch_and_add(&est_stats_shard(ctx)->status[status], 1);
+}
+
+void est_stats_auth (EST_CTX *ctx, EST_AUTH_STATE state)
+{
+    EST_STATS_AUTH a;
+
+    if (!ctx->stats) {
+        return;
+    }
+    switch (state) {
+    case EST_CERT_AUTH:
+        a = EST_STATS_AUTH_CERT;
+        break;
+    case EST_HTTP_AUTH:
+        a = EST_STATS_AUTH_HTTP;
+        break;
+    case EST_SRP_AUTH:
+        a = EST_STATS_AUTH_SRP;
+        break;
+    case EST_HTTP_AUTH_PENDING:
+        a = EST_STATS_AUTH_PENDING;
+        break;
+    case EST_UNAUTHORIZED:
+    default:
+        a = EST_STATS_AUTH_FAILED;
+        break;
+    }
+    __sync_fetch_and_add(&est_stats_shard(ctx)->auth[a], 1);
+}
+
+void est_stats_tls_failure (EST_CTX *ctx)
+{
+    if (!ctx->stats) {
+        return;
+    }
+    __sync_fetch_and_add(&est_stats_shard(ctx)->tls_handshake_failures, 1);
+}
+
+void est_stats_bytes (EST_CTX *ctx, int64_t in, int64_t out)
+{
+    EST_STATS *s;
+
+    if (!ctx->stats) {
+        return;
+    }
+    s = est_stats_shard(ctx);
+    if (in > 0) {
+        __sync_fetch_and_add(&s->bytes_in, (uint64_t)in);
+    }
+    if (out > 0) {
+        __sync_fetch_and_add(&s->bytes_out, (uint64_t)out);
+    }
+}
+
+/*
+ * Sums the shards into stats.  Every member of EST_STATS is
+ * a uint64_t, so the structure is summed as an array.
+ */
+EST_ERROR est_stats_get (EST_CTX *ctx, EST_STATS *stats)
+{
+    const uint64_t *src;
+    uint64_t *dst = (uint64_t*)stats;
+    int i, j;
+
+    if (!stats) {
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    memset(stats, 0, sizeof(EST_STATS));
+    if (!ctx->stats) {
+        return (EST_ERR_NONE);
+    }
+    for (i = 0; i < EST_STATS_SHARDS; i++) {
+        src = (const uint64_t*)&ctx->stats[i].s;
+        for (j = 0; j < (int)(sizeof(EST_STATS) / sizeof(uint64_t)); j++) {
+            dst[j] += src[j];
+        }
+    }
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Appends to the exposition text, tracking the length the
+ * complete text needs even after the buffer is full
+ */
+static void est_stats_printf (char *buf, int max, int *len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(*len < max ? buf + *len : NULL,
+                  *len < max ? max - *len : 0, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        *len += n;
+    }
+}
+
+static void est_stats_print_hist (char *buf, int max, int *len,
+                                   const char *name, const char *label,
+                                   const char *value, const EST_STATS_HIST *h)
+{
+    uint64_t cum = 0;
+    uint64_t bound = EST_STATS_HIST_BASE_USECS;
+    int b;
+
+    for (b = 0; b < EST_STATS_HIST_BUCKETS - 1; b++) {
+        cum += h->buckets[b];
+        est_stats_printf(buf, max, len, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n",
+                         name, label, value, bound / 1e6,
+                         (unsigned long long)cum);
+        bound <<= 1;
+    }
+    cum += h->buckets[b];
+    est_stats_printf(buf, max, len, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n",
+                     name, label, value, (unsigned long long)cum);
+    est_stats_printf(buf, max, len, "%s_sum{%s=\"%s\"} %.6f\n",
+                     name, label, value, h->sum_usecs / 1e6);
+    est_stats_printf(buf, max, len, "%s_count{%s=\"%s\"} %llu\n",
+                     name, label, value, (unsigned long long)h->count);
+}
+
+/*! @brief est_stats_to_prometheus() formats the counters retrieved using
+    est_server_get_stats() or est_proxy_get_stats() as text in the
+    Prometheus exposition format.
+
+    @param stats Counters to format
+    @param buf Buffer receiving the NUL terminated text
+    @param len On input the size of buf.  On return the length of the
+           text, not counting the NUL, or the buffer size needed when
+           buf was too small.
+
+    The metrics are named est_requests_total, est_responses_total,
+    est_auth_total, est_tls_handshake_failures_total,
+    est_received_bytes_total, est_sent_bytes_total,
+    est_request_duration_seconds and est_stage_duration_seconds.
+    An application serving a metrics endpoint can return the text
+    as is.
+
+    @return EST_ERROR.  EST_ERR_READ_BUFFER_TOO_SMALL is returned when
+    the text doesn't fit in buf.
+ */
+EST_ERROR est_stats_to_prometheus (const EST_STATS *stats, char *buf, int *len)
+{
+    int max, n = 0;
+    int i;
+
+    if (!stats || !buf || !len || *len <= 0) {
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    max = *len;
+
+    est_stats_printf(buf, max, &n,
+                     "# HELP est_requests_total EST requests by URI.\n"
+                     "# TYPE est_requests_total counter\n");
+    for (i = 0; i < EST_STATS_URI_MAX; i++) {
+        est_stats_printf(buf, max, &n, "est_requests_total{uri=\"%s\"} %llu\n",
+                         est_stats_uri_names[i],
+                         (unsigned long long)stats->requests[i]);
+    }
+    est_stats_printf(buf, max, &n,
+                     "# HELP est_responses_total HTTP responses by status code.\n"
+                     "# TYPE est_responses_total counter\n");
+    for (i = 0; i < EST_STATS_STATUS_MAX; i++) {
+        if (stats->status[i]) {
+            est_stats_printf(buf, max, &n, "est_responses_total{code=\"%d\"} %llu\n",
+                             i, (unsigned long long)stats->status[i]);
+        }
+    }
+    est_stats_printf(buf, max, &n,
+                     "# HELP est_auth_total Client authentication outcomes.\n"
+                     "# TYPE est_auth_total counter\n");
+    for (i = 0; i < EST_STATS_AUTH_MAX; i++) {
+        est_stats_printf(buf, max, &n, "est_auth_total{result=\"%s\"} %llu\n",
+                         est_stats_auth_names[i],
+                         (unsigned long long)stats->auth[i]);
+    }
+    est_stats_printf(buf, max, &n,
+                     "# HELP est_tls_handshake_failures_total Failed TLS handshakes.\n"
+                     "# TYPE est_tls_handshake_failures_total counter\n"
+                     "est_tls_handshake_failures_total %llu\n"
+                     "# HELP est_received_bytes_total HTTP request bytes received.\n"
+                     "# TYPE est_received_bytes_total counter\n"
+                     "est_received_bytes_total %llu\n"
+                     "# HELP est_sent_bytes_total HTTP response bytes sent.\n"
+                     "# TYPE est_sent_bytes_total counter\n"
+                     "est_sent_bytes_total %llu\n",
+                     (unsigned long long)stats->tls_handshake_failures,
+                     (unsigned long long)stats->bytes_in,
+                     (unsigned long long)stats->bytes_out);
+    est_stats_printf(buf, max, &n,
+                     "# HELP est_request_duration_seconds Time spent in the EST layer by URI.\n"
+                     "# TYPE est_request_duration_seconds histogram\n");
+    for (i = 0; i < EST_STATS_URI_MAX; i++) {
+        est_stats_print_hist(buf, max, &n, "est_request_duration_seconds",
+                             "uri", est_stats_uri_names[i],
+                             &stats->uri_latency[i]);
+    }
+    est_stats_printf(buf, max, &n,
+                     "# HELP est_stage_duration_seconds Time spent in each enroll stage.\n"
+                     "# TYPE est_stage_duration_seconds histogram\n");
+    for (i = 0; i < EST_STATS_STAGE_MAX; i++) {
+        est_stats_print_hist(buf, max, &n, "est_stage_duration_seconds",
+                             "stage", est_stats_stage_names[i],
+                             &stats->stage_latency[i]);
+    }
+
+    if (n >= max) {
+        /* Room for the NUL as well */
+        *len = n + 1;
+        return (EST_ERR_READ_BUFFER_TOO_SMALL);
+    }
+    *len = n;
+    return (EST_ERR_NONE);
+}
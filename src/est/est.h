@@ -15,6 +15,7 @@
 #include <openssl/engine.h>
 #include <openssl/conf.h>
 #include <openssl/srp.h>
+#include <stdint.h>
 
 #ifdef  __cplusplus
 extern "C" {
@@ -98,7 +99,8 @@ typedef enum {
     E(EST_ERR_SRP_USERID_BAD) \
     E(EST_ERR_SRP_PWD_BAD) \
     E(EST_ERR_CB_FAILED) \
-    E(EST_ERR_UNKNOWN)
+    E(EST_ERR_UNKNOWN) \
+    E(EST_ERR_PENDING_FULL)
 
 #define GENERATE_ENUM(ENUM) ENUM,
 #define GENERATE_STRING(STRING) #STRING,
@@ -175,6 +177,7 @@ typedef enum {
 \n EST_ERR_SRP_USERID_BAD  The SRP user ID was not accepted.
 \n EST_ERR_SRP_PWD_BAD  The SRP password was not accepted.
 \n EST_ERR_CB_FAILED  The application layer call-back facility failed.
+\n EST_ERR_PENDING_FULL  The pending enrollment table had no room for the CA's answer.
 \n EST_ERR_LAST  Last error in the enum definition. Should never be used.
 */
 typedef enum {
@@ -218,6 +221,12 @@ typedef enum {
     EST_LOG_LVL_INFO
 } EST_LOG_LEVEL;
 
+/*
+ * Limits for asynchronous logging, see est_enable_async_logger()
+ */
+#define EST_LOG_QUEUE_MAX 65536
+#define EST_LOG_SLOT_LEN 512
+
 #define MAX_REALM 255
 #define MAX_NONCE 64
 #define MAX_UIDPWD 30
@@ -292,6 +301,257 @@ typedef struct {
  */
 typedef struct est_ctx EST_CTX;
 
+/*! @struct EST_SERVER_CONN
+ *  @brief This structure holds the state of a single client connection
+ *         being processed by an EST server or proxy on behalf of an
+ *         application that drives its own event loop.  None of the members
+ *         are publically accessible.  A connection is created using
+ *         est_server_conn_new(), advanced using est_server_conn_on_event(),
+ *         and released using est_server_conn_free().
+ */
+typedef struct mg_connection EST_SERVER_CONN;
+
+/*
+ * Socket events used with est_server_conn_on_event() and
+ * est_client_op_continue().  These may be OR'd together.
+ */
+#define EST_CONN_EV_READ    0x01
+#define EST_CONN_EV_WRITE   0x02
+#define EST_CONN_EV_CLOSED  0x04
+#define EST_CONN_EV_ENROLL  0x08
+
+/*! @struct EST_ENROLL_REQ
+ *  @brief This structure holds an enrollment request that has been
+ *         handed to the CA through one of the asynchronous enrollment
+ *         handlers.  None of the members are publically accessible.
+ *         The application finishes the request by invoking either
+ *         est_server_enroll_complete() or est_server_enroll_fail().
+ */
+typedef struct est_enroll_req EST_ENROLL_REQ;
+
+/*! @struct EST_ENROLL_ITEM
+ *  @brief One enrollment request in a batch handed to the handler
+ *         installed with est_set_ca_enroll_batch_cb().  The handler
+ *         fills in the last three members for every item.
+ *  @var EST_ENROLL_ITEM::csr
+ *	The decoded certificate request
+ *  @var EST_ENROLL_ITEM::der
+ *	DER encoding of the certificate request
+ *  @var EST_ENROLL_ITEM::user_id
+ *	User ID from HTTP authentication, empty when not used
+ *  @var EST_ENROLL_ITEM::peer_cert
+ *	Certificate the client authenticated with, may be NULL
+ *  @var EST_ENROLL_ITEM::reenroll
+ *	Non-zero for a re-enroll request
+ *  @var EST_ENROLL_ITEM::pkcs7
+ *	Base64 encoded PKCS7 response allocated with malloc(), owned
+ *	by libest once the handler returns
+ *  @var EST_ENROLL_ITEM::rv
+ *	EST_ERR_NONE when pkcs7 is set, EST_ERR_CA_ENROLL_RETRY to
+ *	ask the client to retry later, any other value rejects the
+ *	request.  EST_ERR_CA_ENROLL_FAIL on entry.
+ */
+typedef struct {
+    X509_REQ *csr;
+    unsigned char *der;
+    int der_len;
+    char *user_id;
+    X509 *peer_cert;
+    int reenroll;
+    unsigned char *pkcs7;
+    int pkcs7_len;
+    EST_ERROR rv;
+} EST_ENROLL_ITEM;
+
+/* Limits for est_set_ca_enroll_batch_cb() */
+#define EST_ENROLL_BATCH_MAX      1024
+#define EST_ENROLL_BATCH_WAIT_MAX 10000
+
+/* Lifetime of an HTTP digest nonce, see est_server_set_auth_nonce_lifetime() */
+#define EST_NONCE_LIFETIME_DEF 300
+#define EST_NONCE_LIFETIME_MIN 1
+#define EST_NONCE_LIFETIME_MAX 86400
+
+/* Longest lifetime accepted by est_server_set_csrattrs_cache_ttl() */
+#define EST_CSRATTRS_CACHE_TTL_MAX 86400
+
+/* Limits for est_server_enable_pending_table() */
+#define EST_PENDING_ENTRIES_MAX  1048576
+#define EST_PENDING_LIFETIME_MAX 604800
+
+/* Limits for est_server_set_enroll_cache() */
+#define EST_ENROLL_CACHE_ENTRIES_MAX 1048576
+#define EST_ENROLL_CACHE_WINDOW_MAX  86400
+
+/* Size of a key passed to est_server_add_ticket_key() */
+#define EST_TICKET_KEY_LEN  48
+
+/* Most worker slots accepted by est_client_pool_new() */
+#define EST_CLIENT_POOL_SLOTS_MAX 1024
+
+/* Limits for est_client_set_batch_window() */
+#define EST_CLIENT_BATCH_WINDOW_DEF 8
+#define EST_CLIENT_BATCH_WINDOW_MAX 64
+
+/*! @struct EST_CLIENT_POOL
+ *  @brief This structure holds a set of EST client contexts that share
+ *         one configuration and trust store, so that enrollments can be
+ *         made from many threads at once.  None of the members are
+ *         publically accessible.  A pool is created using
+ *         est_client_pool_new() and released using
+ *         est_client_pool_destroy().
+ */
+typedef struct est_client_pool EST_CLIENT_POOL;
+
+/*! @struct EST_CLIENT_RESULT
+ *  @brief The outcome of an enrollment made through an EST_CLIENT_POOL,
+ *         est_client_enroll_batch() or an EST_CLIENT_OP.  It's released
+ *         using est_client_result_free().
+ *  @var EST_CLIENT_RESULT::rv
+ *	EST_ERR_NONE when pkcs7 holds the new certificate,
+ *	EST_ERR_CA_ENROLL_RETRY when the CA asked for a retry, otherwise
+ *	the reason the enrollment failed
+ *  @var EST_CLIENT_RESULT::pkcs7
+ *	Base64 encoded PKCS7 holding the new certificate, NUL terminated,
+ *	NULL when the CA asked for a retry
+ *  @var EST_CLIENT_RESULT::pkcs7_len
+ *	Length of pkcs7, not counting the NUL
+ *  @var EST_CLIENT_RESULT::retry_after_delay
+ *	Seconds the CA asked the client to wait before retrying
+ *  @var EST_CLIENT_RESULT::retry_after_date
+ *	Time the CA asked the client to retry at, not currently used
+ */
+typedef struct {
+    EST_ERROR rv;
+    unsigned char *pkcs7;
+    int pkcs7_len;
+    int retry_after_delay;
+    time_t retry_after_date;
+} EST_CLIENT_RESULT;
+
+/*! @struct EST_CLIENT_OP
+ *  @brief This structure holds the state of a single EST request made
+ *         by a client application that drives its own event loop.  None
+ *         of the members are publically accessible.  An operation is
+ *         created using est_client_op_start(), advanced using
+ *         est_client_op_continue(), and released using
+ *         est_client_op_free().
+ */
+typedef struct est_client_op EST_CLIENT_OP;
+
+/*! @enum EST_CLIENT_OP_TYPE
+ *  @brief The request made by an EST_CLIENT_OP
+ *  @var EST_CLIENT_OP_CACERTS
+ *	Retrieve the CA certificates, see est_client_get_cacerts()
+ *  @var EST_CLIENT_OP_ENROLL
+ *	Simple enroll of a CSR, see est_client_enroll_csr()
+ *  @var EST_CLIENT_OP_REENROLL
+ *	Simple re-enroll of a CSR
+ */
+typedef enum {
+    EST_CLIENT_OP_CACERTS = 0,
+    EST_CLIENT_OP_ENROLL,
+    EST_CLIENT_OP_REENROLL
+} EST_CLIENT_OP_TYPE;
+
+/*! @enum EST_STATS_URI
+ *  @brief The request URIs counted separately in EST_STATS.
+ */
+typedef enum {
+    EST_STATS_URI_CACERTS = 0,
+    EST_STATS_URI_SIMPLE_ENROLL,
+    EST_STATS_URI_SIMPLE_REENROLL,
+    EST_STATS_URI_CSRATTRS,
+    EST_STATS_URI_OTHER,
+    EST_STATS_URI_MAX
+} EST_STATS_URI;
+
+/*! @enum EST_STATS_STAGE
+ *  @brief The stages of an enroll request timed in EST_STATS.
+ *  @var EST_STATS_STAGE_AUTH
+ *	Certificate, HTTP or SRP authentication of the client
+ *  @var EST_STATS_STAGE_CSR
+ *	Decoding the CSR and checking it, including proof of possession
+ *  @var EST_STATS_STAGE_CA
+ *	The enroll callback, or the upstream EST server in proxy mode
+ *  @var EST_STATS_STAGE_RESPONSE
+ *	Sending the response to the client
+ */
+typedef enum {
+    EST_STATS_STAGE_AUTH = 0,
+    EST_STATS_STAGE_CSR,
+    EST_STATS_STAGE_CA,
+    EST_STATS_STAGE_RESPONSE,
+    EST_STATS_STAGE_MAX
+} EST_STATS_STAGE;
+
+/*! @enum EST_STATS_AUTH
+ *  @brief Outcomes of client authentication counted in EST_STATS.
+ */
+typedef enum {
+    EST_STATS_AUTH_CERT = 0,
+    EST_STATS_AUTH_HTTP,
+    EST_STATS_AUTH_SRP,
+    EST_STATS_AUTH_PENDING,
+    EST_STATS_AUTH_FAILED,
+    EST_STATS_AUTH_MAX
+} EST_STATS_AUTH;
+
+/*
+ * Bucket i of a latency histogram counts the samples of at most
+ * (EST_STATS_HIST_BASE_USECS << i) microseconds that didn't fit
+ * in a lower bucket.  The last bucket counts all longer samples.
+ */
+#define EST_STATS_HIST_BUCKETS	    20
+#define EST_STATS_HIST_BASE_USECS   100
+#define EST_STATS_STATUS_MAX	    600
+
+/*! @struct EST_STATS_HIST
+ *  @brief A latency histogram.
+ *  @var EST_STATS_HIST::buckets
+ *	Number of samples in each bucket, these are not cumulative
+ *  @var EST_STATS_HIST::count
+ *	Total number of samples
+ *  @var EST_STATS_HIST::sum_usecs
+ *	Sum of all samples in microseconds
+ */
+typedef struct {
+    uint64_t buckets[EST_STATS_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_usecs;
+} EST_STATS_HIST;
+
+/*! @struct EST_STATS
+ *  @brief Counters kept by an EST server or proxy, retrieved using
+ *         est_server_get_stats() or est_proxy_get_stats().  All values
+ *         count from the time the context was created.
+ *  @var EST_STATS::requests
+ *	Requests handed to the EST layer, by URI
+ *  @var EST_STATS::status
+ *	Responses sent, indexed by HTTP status code
+ *  @var EST_STATS::auth
+ *	Client authentication outcomes
+ *  @var EST_STATS::tls_handshake_failures
+ *	Connections dropped because the TLS handshake failed
+ *  @var EST_STATS::bytes_in
+ *	HTTP request bytes received, headers and body
+ *  @var EST_STATS::bytes_out
+ *	HTTP response bytes sent, headers and body
+ *  @var EST_STATS::uri_latency
+ *	Time spent in the EST layer for each request, by URI
+ *  @var EST_STATS::stage_latency
+ *	Time spent in each stage of enroll requests
+ */
+typedef struct {
+    uint64_t requests[EST_STATS_URI_MAX];
+    uint64_t status[EST_STATS_STATUS_MAX];
+    uint64_t auth[EST_STATS_AUTH_MAX];
+    uint64_t tls_handshake_failures;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    EST_STATS_HIST uri_latency[EST_STATS_URI_MAX];
+    EST_STATS_HIST stage_latency[EST_STATS_STAGE_MAX];
+} EST_STATS;
 
 /*
  * Begin the public API prototypes
@@ -301,8 +561,12 @@ EST_ERROR est_init_logger(EST_LOG_LEVEL lvl, void (*loggerfunc)(char *, va_list)
 int est_get_api_level(void); 
 const char * est_get_version(void); 
 void est_enable_backtrace(int enable);
+EST_ERROR est_enable_async_logger(int queue_len);
+void est_disable_async_logger(void);
+uint64_t est_get_log_drops(void);
 EST_ERROR est_set_ex_data(EST_CTX *ctx, void *ex_data);
 void * est_get_ex_data(EST_CTX *ctx);
+EST_ERROR est_stats_to_prometheus(const EST_STATS *stats, char *buf, int *len);
 EST_CTX * est_server_init(unsigned char *ca_chain, int ca_chain_len,
                           unsigned char *cacerts_resp_chain, int cacerts_resp_chain_len,
 			  EST_CERT_FORMAT cert_format,
@@ -316,6 +580,7 @@ EST_CTX * est_proxy_init(unsigned char *ca_chain, int ca_chain_len,
                          char *uid, char *pwd);
 EST_ERROR est_destroy(EST_CTX *ctx);
 EST_ERROR est_server_set_auth_mode(EST_CTX *ctx, EST_HTTP_AUTH_MODE amode);
+EST_ERROR est_server_set_auth_nonce_lifetime(EST_CTX *ctx, int seconds);
 char *est_server_generate_auth_digest(EST_HTTP_AUTH_HDR *ah, char *HA1);
 EST_ERROR est_server_start(EST_CTX *ctx);
 EST_ERROR est_server_stop(EST_CTX *ctx);
@@ -323,11 +588,36 @@ EST_ERROR est_server_enable_srp(EST_CTX *ctx, int (*cb)(SSL *s, int *ad, void *a
 EST_ERROR est_server_enable_pop(EST_CTX *ctx);
 EST_ERROR est_server_disable_pop(EST_CTX *ctx);
 EST_ERROR est_server_handle_request(EST_CTX *ctx, int fd);
+EST_SERVER_CONN *est_server_conn_new(EST_CTX *ctx, int fd);
+int est_server_conn_on_event(EST_SERVER_CONN *conn, int events);
+void est_server_conn_free(EST_SERVER_CONN *conn);
 EST_ERROR est_server_set_dh_parms(EST_CTX *ctx, DH *dh);
 EST_ERROR est_server_init_csrattrs(EST_CTX *ctx, char *csrattrs, int crsattrs_len);
 EST_ERROR est_server_set_retry_period(EST_CTX *ctx, int seconds);
 EST_ERROR est_server_set_ecdhe_curve(EST_CTX *ctx, int nid);
 EST_ERROR est_server_enforce_csrattr(EST_CTX *ctx);
+EST_ERROR est_server_run(EST_CTX *ctx, int port, int nthreads);
+EST_ERROR est_server_set_listen_backlog(EST_CTX *ctx, int backlog);
+EST_ERROR est_server_set_listen_family(EST_CTX *ctx, int family);
+EST_ERROR est_server_set_worker_queue_len(EST_CTX *ctx, int len);
+EST_ERROR est_server_set_conn_pool_size(EST_CTX *ctx, int size);
+EST_ERROR est_server_set_max_content_len(EST_CTX *ctx, int len);
+EST_ERROR est_server_set_session_cache_cb(EST_CTX *ctx,
+                int (*new_cb)(const unsigned char *id, int id_len,
+                              const unsigned char *der, int der_len,
+                              time_t expires, void *arg),
+                int (*get_cb)(const unsigned char *id, int id_len,
+                              unsigned char *der, int der_max, void *arg),
+                void (*remove_cb)(const unsigned char *id, int id_len,
+                                  void *arg),
+                void *arg);
+EST_ERROR est_server_set_shm_session_cache(EST_CTX *ctx, const char *path,
+                                           int entries);
+EST_ERROR est_server_add_ticket_key(EST_CTX *ctx, const unsigned char *key,
+                                    int key_len);
+EST_ERROR est_server_get_stats(EST_CTX *ctx, EST_STATS *stats);
+EST_ERROR est_server_get_conn_pool_stats(EST_CTX *ctx, int *idle, int *in_use,
+                                         int *high_water);
 /*
  * EST proxy specific functions
  */
@@ -336,6 +626,7 @@ EST_ERROR est_proxy_stop(EST_CTX *ctx);
 EST_ERROR est_proxy_set_server(EST_CTX *ctx, const char *server, int port);
 EST_ERROR est_proxy_set_auth_mode(EST_CTX *ctx, EST_HTTP_AUTH_MODE amode);
 EST_ERROR est_proxy_set_read_timeout(EST_CTX *ctx, int timeout);
+EST_ERROR est_proxy_get_stats(EST_CTX *ctx, EST_STATS *stats);
 
 /*
  * The following functions are used by an EST client
@@ -353,6 +644,8 @@ EST_ERROR est_client_provision_cert(EST_CTX *ctx, char *cn,
 EST_ERROR est_client_enroll(EST_CTX *ctx, char *cn, int *pkcs7_len,
                             EVP_PKEY *new_public_key);
 EST_ERROR est_client_enroll_csr(EST_CTX *ctx, X509_REQ *csr, int *pkcs7_len, EVP_PKEY *priv_key);
+EST_ERROR est_client_enroll_batch(EST_CTX *ctx, X509_REQ **csrs, int n,
+                                  EST_CLIENT_RESULT **results);
 EST_ERROR est_client_reenroll(EST_CTX *ctx, X509 *cert, int *pkcs7_len, EVP_PKEY *priv_key);
 EST_ERROR est_client_copy_enrolled_cert(EST_CTX *ctx, unsigned char *pkcs7);
 EST_ERROR est_client_get_csrattrs(EST_CTX *ctx, unsigned char **csr_data, int *csr_len);
@@ -362,10 +655,41 @@ EST_ERROR est_client_set_sign_digest(EST_CTX *ctx, int nid);
 EST_ERROR est_client_copy_retry_after(EST_CTX *ctx, int *retry_delay,
                                        time_t *retry_time);
 EST_ERROR est_client_set_read_timeout(EST_CTX *ctx, int timeout);
+EST_ERROR est_client_set_keep_alive(EST_CTX *ctx, int enable);
+EST_ERROR est_client_set_batch_window(EST_CTX *ctx, int window);
 EST_ERROR est_client_enable_basic_auth_hint(EST_CTX *ctx);
 EST_ERROR est_client_force_pop(EST_CTX *ctx);
 EST_ERROR est_client_unforce_pop(EST_CTX *ctx);
 EST_ERROR est_client_enable_srp(EST_CTX *ctx, int strength, char *uid, char *pwd); 
+EST_CLIENT_POOL *est_client_pool_new(unsigned char *ca_chain, int ca_chain_len,
+                                     EST_CERT_FORMAT cert_format,
+                                     int (*cert_verify_cb)(X509 *, int),
+                                     int slots);
+EST_ERROR est_client_pool_set_server(EST_CLIENT_POOL *pool, const char *server,
+                                     int port);
+EST_ERROR est_client_pool_set_auth(EST_CLIENT_POOL *pool, const char *uid,
+                                   const char *pwd, X509 *client_cert,
+                                   EVP_PKEY *private_key);
+EST_ERROR est_client_pool_set_read_timeout(EST_CLIENT_POOL *pool, int timeout);
+EST_ERROR est_client_pool_enroll(EST_CLIENT_POOL *pool, char *cn,
+                                 EVP_PKEY *new_public_key,
+                                 EST_CLIENT_RESULT **result);
+EST_ERROR est_client_pool_enroll_csr(EST_CLIENT_POOL *pool, X509_REQ *csr,
+                                     EVP_PKEY *priv_key,
+                                     EST_CLIENT_RESULT **result);
+EST_ERROR est_client_pool_reenroll(EST_CLIENT_POOL *pool, X509 *cert,
+                                   EVP_PKEY *priv_key,
+                                   EST_CLIENT_RESULT **result);
+void est_client_result_free(EST_CLIENT_RESULT *result);
+void est_client_pool_destroy(EST_CLIENT_POOL *pool);
+EST_ERROR est_client_op_start(EST_CTX *ctx, EST_CLIENT_OP_TYPE type,
+                              X509_REQ *csr, EVP_PKEY *priv_key,
+                              EST_CLIENT_OP **op);
+int est_client_op_get_fd(EST_CLIENT_OP *op);
+int est_client_op_continue(EST_CLIENT_OP *op, int events);
+EST_ERROR est_client_op_get_result(EST_CLIENT_OP *op,
+                                   EST_CLIENT_RESULT **result);
+void est_client_op_free(EST_CLIENT_OP *op);
 
 /*
  * The following callback entry points must be set by the application
@@ -377,7 +701,60 @@ EST_ERROR est_set_ca_enroll_cb(EST_CTX *ctx, int (*cb)(unsigned char * pkcs10,
 EST_ERROR est_set_ca_reenroll_cb(EST_CTX *ctx, int (*cb)(unsigned char * pkcs10, 
 	                         int p10_len, unsigned char **pkcs7, int *pkcs7_len, 
 				 char *user_id, X509 *peer_cert, void *ex_data));
+EST_ERROR est_set_ca_enroll_csr_cb(EST_CTX *ctx,
+                                   int (*cb)(X509_REQ *csr,
+                                             unsigned char *der, int der_len,
+                                             unsigned char **pkcs7, int *pkcs7_len,
+                                             char *user_id, X509 *peer_cert,
+                                             void *ex_data));
+EST_ERROR est_set_ca_reenroll_csr_cb(EST_CTX *ctx,
+                                     int (*cb)(X509_REQ *csr,
+                                               unsigned char *der, int der_len,
+                                               unsigned char **pkcs7, int *pkcs7_len,
+                                               char *user_id, X509 *peer_cert,
+                                               void *ex_data));
+EST_ERROR est_set_ca_enroll_x509_cb(EST_CTX *ctx,
+                                    int (*cb)(X509_REQ *csr,
+                                              unsigned char *der, int der_len,
+                                              X509 **cert,
+                                              char *user_id, X509 *peer_cert,
+                                              void *ex_data));
+EST_ERROR est_set_ca_reenroll_x509_cb(EST_CTX *ctx,
+                                      int (*cb)(X509_REQ *csr,
+                                                unsigned char *der, int der_len,
+                                                X509 **cert,
+                                                char *user_id, X509 *peer_cert,
+                                                void *ex_data));
+EST_ERROR est_server_set_enroll_chain(EST_CTX *ctx, STACK_OF(X509) *chain);
+EST_ERROR est_set_ca_enroll_async_cb(EST_CTX *ctx,
+                                     int (*cb)(EST_ENROLL_REQ *req, X509_REQ *csr,
+                                               unsigned char *der, int der_len,
+                                               char *user_id, X509 *peer_cert,
+                                               void *ex_data));
+EST_ERROR est_set_ca_reenroll_async_cb(EST_CTX *ctx,
+                                       int (*cb)(EST_ENROLL_REQ *req, X509_REQ *csr,
+                                                 unsigned char *der, int der_len,
+                                                 char *user_id, X509 *peer_cert,
+                                                 void *ex_data));
+EST_ERROR est_server_set_enroll_wakeup_cb(EST_CTX *ctx,
+                                          void (*cb)(EST_SERVER_CONN *conn,
+                                                     void *ex_data));
+EST_ERROR est_set_ca_enroll_batch_cb(EST_CTX *ctx,
+                                     int (*cb)(EST_ENROLL_ITEM *items, int count,
+                                               void *ex_data),
+                                     int max_batch, int max_wait_ms);
+EST_ERROR est_server_enroll_complete(EST_ENROLL_REQ *req, unsigned char *pkcs7,
+                                     int pkcs7_len);
+EST_ERROR est_server_enroll_fail(EST_ENROLL_REQ *req, EST_ERROR code);
+EST_ERROR est_server_enable_pending_table(EST_CTX *ctx, int max_entries,
+                                         int lifetime);
+EST_ERROR est_server_approve_pending(EST_CTX *ctx, EVP_PKEY *pub_key,
+                                     unsigned char *pkcs7, int pkcs7_len);
+EST_ERROR est_server_reject_pending(EST_CTX *ctx, EVP_PKEY *pub_key);
+EST_ERROR est_server_set_enroll_cache(EST_CTX *ctx, int max_entries,
+                                      int window);
 EST_ERROR est_set_csr_cb(EST_CTX * ctx, unsigned char *(*cb)(int*csr_len, void *ex_data));
+EST_ERROR est_server_set_csrattrs_cache_ttl(EST_CTX *ctx, int seconds);
 EST_ERROR est_set_http_auth_cb(EST_CTX * ctx, int (*cb)(EST_CTX*, EST_HTTP_AUTH_HDR*, X509*, void*));
 EST_ERROR est_set_http_auth_required(EST_CTX * ctx, EST_HTTP_AUTH_REQUIRED required);
 EST_ERROR est_add_attributes_helper(X509_REQ *req, int nid, void *string, int chtype);
@@ -22,6 +22,12 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#ifndef DISABLE_PTHREADS
+#include <pthread.h>
+#endif
 #include <openssl/ssl.h>
 #include <openssl/rand.h>
 #include "est.h"
@@ -878,7 +884,8 @@ EST_ERROR est_client_init_ssl_ctx (EST_CTX *ctx)
  * It uses the tokens that were parsed from the HTTP
  * server response earlier to calculate the digest.
  */
-static unsigned char *est_client_generate_auth_digest (EST_CTX *ctx, char *uri)
+static unsigned char *est_client_generate_auth_digest (EST_CTX *ctx, char *uri,
+                                                       char *nonce_cnt)
 {
     EVP_MD_CTX *mdctx;
     const EVP_MD *md = EVP_md5();
@@ -888,7 +895,6 @@ static unsigned char *est_client_generate_auth_digest (EST_CTX *ctx, char *uri)
     uint8_t ha2[EVP_MAX_MD_SIZE];
     unsigned int ha2_len;
     char ha2_str[EST_MAX_MD5_DIGEST_STR_LEN];
-    char nonce_cnt[9] = "00000001";
     unsigned char digest[EVP_MAX_MD_SIZE];
     unsigned int d_len;
     unsigned char *rv;
@@ -972,6 +978,7 @@ static void est_client_add_auth_hdr (EST_CTX *ctx, char *hdr, char *uri)
     int hdr_len;
     unsigned char *digest;
     unsigned char client_random[8];
+    char nonce_cnt[MAX_NC];
     char both[MAX_UIDPWD*2+2]; /* both UID and PWD + ":" + /0 */
     char both_b64[2*2*MAX_UIDPWD];
 
@@ -1001,7 +1008,14 @@ static void est_client_add_auth_hdr (EST_CTX *ctx, char *hdr, char *uri)
         
         est_hex_to_str(ctx->c_nonce, client_random, 8);
 
-        digest = est_client_generate_auth_digest(ctx, uri);
+        /*
+         * The server nonce is reused for as long as the server
+         * accepts it, each request with the next nonce count.
+         */
+        ctx->nonce_count++;
+        snprintf(nonce_cnt, MAX_NC, "%08x", ctx->nonce_count);
+
+        digest = est_client_generate_auth_digest(ctx, uri, nonce_cnt);
         if (digest == NULL) {
             EST_LOG_ERR("Error while generating digest");
             /* Force hdr to a null string */
@@ -1011,12 +1025,13 @@ static void est_client_add_auth_hdr (EST_CTX *ctx, char *hdr, char *uri)
         }
             
         snprintf(hdr + hdr_len, EST_HTTP_REQ_TOTAL_LEN-hdr_len,
-                 "Authorization: Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", cnonce=\"%s\", nc=00000001, qop=\"auth\", response=\"%s\"\r\n",
+                 "Authorization: Digest username=\"%s\", realm=\"%s\", nonce=\"%s\", uri=\"%s\", cnonce=\"%s\", nc=%s, qop=\"auth\", response=\"%s\"\r\n",
                 ctx->userid,
                 ctx->realm,
                 ctx->s_nonce,
                 uri,
                 ctx->c_nonce,
+                nonce_cnt,
                 digest);
         memset(digest, 0, EST_MAX_MD5_DIGEST_STR_LEN);
         memset(ctx->c_nonce, 0, MAX_NONCE);
@@ -1043,11 +1058,12 @@ static int est_client_build_cacerts_header (EST_CTX *ctx, char *hdr)
 
     snprintf(hdr, EST_HTTP_REQ_TOTAL_LEN, "GET %s HTTP/1.1\r\n"
             "User-Agent: %s\r\n"
-            "Connection: close\r\n"
+            "Connection: %s\r\n"
             "Host: %s:%d\r\n"
             "Accept: */*\r\n",
             EST_CACERTS_URI,
             EST_HTTP_HDR_EST_CLIENT,
+            ctx->keep_alive ? "keep-alive" : "close",
             ctx->est_server, ctx->est_port_num);
     hdr_len = (int) strnlen(hdr, EST_HTTP_REQ_TOTAL_LEN);
     if (hdr_len == EST_HTTP_REQ_TOTAL_LEN) {
@@ -1072,11 +1088,12 @@ static int est_client_build_csr_header (EST_CTX *ctx, char *hdr)
 
     snprintf(hdr, EST_HTTP_REQ_TOTAL_LEN,"GET %s HTTP/1.1\r\n"
             "User-Agent: %s\r\n"
-            "Connection: close\r\n"
+            "Connection: %s\r\n"
             "Host: %s:%d\r\n"
             "Accept: */*\r\n",
             EST_CSR_ATTRS_URI,
             EST_HTTP_HDR_EST_CLIENT,
+            ctx->keep_alive ? "keep-alive" : "close",
             ctx->est_server, ctx->est_port_num);
     est_client_add_auth_hdr(ctx, hdr, EST_SIMPLE_ENROLL_URI);
     hdr_len = (int) strnlen(hdr, EST_HTTP_REQ_TOTAL_LEN);
@@ -1135,13 +1152,6 @@ static int est_client_send_csrattrs_request (EST_CTX *ctx, SSL *ssl,
     snprintf(http_data + hdr_len, EST_HTTP_REQ_TOTAL_LEN-hdr_len, "\r\n");
     hdr_len += 2;
 
-    /*
-     * no data is being sent so go ahead and terminate the HTTP request
-     */
-    snprintf(http_data + hdr_len, EST_HTTP_REQ_TOTAL_LEN-hdr_len, "\r\n");
-    hdr_len += 2;
-
-
     /*
      * Send the request to the server and wait for a response
      */
@@ -1194,13 +1204,14 @@ static int est_client_build_enroll_header (EST_CTX *ctx, char *hdr, int pkcs10_l
 
     snprintf(hdr, EST_HTTP_REQ_TOTAL_LEN, "POST %s HTTP/1.1\r\n"
             "User-Agent: %s\r\n"
-            "Connection: close\r\n"
+            "Connection: %s\r\n"
             "Host: %s:%d\r\n"
             "Accept: */*\r\n"
             "Content-Type: application/pkcs10\r\n"
             "Content-Length: %d\r\n",
             EST_SIMPLE_ENROLL_URI,
             EST_HTTP_HDR_EST_CLIENT,
+            ctx->keep_alive ? "keep-alive" : "close",
             ctx->est_server, ctx->est_port_num, pkcs10_len);
     est_client_add_auth_hdr(ctx, hdr, EST_SIMPLE_ENROLL_URI);
     hdr_len = (int) strnlen(hdr, EST_HTTP_REQ_TOTAL_LEN);
@@ -1227,13 +1238,14 @@ static int est_client_build_reenroll_header (EST_CTX *ctx, char *hdr, int pkcs10
 
     snprintf(hdr, EST_HTTP_REQ_TOTAL_LEN, "POST %s HTTP/1.1\r\n"
             "User-Agent: %s\r\n"
-            "Connection: close\r\n"
+            "Connection: %s\r\n"
             "Host: %s:%d\r\n"
             "Accept: */*\r\n"
             "Content-Type: application/pkcs10\r\n"
             "Content-Length: %d\r\n",
             EST_RE_ENROLL_URI,
             EST_HTTP_HDR_EST_CLIENT,
+            ctx->keep_alive ? "keep-alive" : "close",
             ctx->est_server, ctx->est_port_num, pkcs10_len);
     est_client_add_auth_hdr(ctx, hdr, EST_SIMPLE_ENROLL_URI);
     hdr_len = (int) strnlen(hdr, EST_HTTP_REQ_TOTAL_LEN);
@@ -1245,38 +1257,23 @@ static int est_client_build_reenroll_header (EST_CTX *ctx, char *hdr, int pkcs10
 }
 
 /*
- * This function sends the HTTP request for a Simple Enroll
- * The CSR (pkcs10) is already built at this point.  This
- * function simply creates the HTTP header and body and puts
- * it on the wire.  It then waits for a response from the
- * server and copies the response to a buffer provided by
- * the caller
+ * This function builds the HTTP request for a Simple Enroll,
+ * header and body, in a buffer allocated here that the caller
+ * frees.  The CSR (pkcs10) is already built at this point.
  *
  * Parameters:
  *	ctx:	    EST context
- *	ssl:	    SSL context
  *	bptr:	    pointer containing PKCS10 CSR
- *	pkcs7:	    pointer that will receive the pkcs7 response
- *	pkcs7_len:  length of pkcs7 response
  *	reenroll:   Set to 1 to do a reenroll instead of an enroll
- *
+ *	req_len:    receives the length of the request
+ *	rv:	    receives the reason when NULL is returned
  */
-int est_client_send_enroll_request (EST_CTX *ctx, SSL *ssl, BUF_MEM *bptr,
-                                    unsigned char *pkcs7, int *pkcs7_len,
-				    int reenroll)
+static char *est_client_build_enroll_request (EST_CTX *ctx, BUF_MEM *bptr,
+                                              int reenroll, int *req_len,
+                                              EST_ERROR *rv)
 {
     char        *http_data;
     int hdr_len;
-    int write_size;
-    unsigned char *enroll_buf = NULL;
-    int enroll_buf_len = 0;
-    int rv;
-
-    /*
-     * Assume the enroll will fail, set return length to zero
-     * to be defensive.
-     */
-    *pkcs7_len = 0;
 
     /*
      * Build the HTTP request
@@ -1288,7 +1285,8 @@ int est_client_send_enroll_request (EST_CTX *ctx, SSL *ssl, BUF_MEM *bptr,
     http_data = malloc(EST_HTTP_REQ_TOTAL_LEN);
     if (http_data == NULL) {
         EST_LOG_ERR("Unable to allocate memory for http_data");
-        return EST_ERR_MALLOC;
+        *rv = EST_ERR_MALLOC;
+        return (NULL);
     }
 
     if (!reenroll) {
@@ -1302,7 +1300,8 @@ int est_client_send_enroll_request (EST_CTX *ctx, SSL *ssl, BUF_MEM *bptr,
     if (hdr_len == 0) {
         EST_LOG_ERR("Enroll HTTP header could not be built correctly");
         free(http_data);
-        return (EST_ERR_HTTP_CANNOT_BUILD_HEADER);
+        *rv = EST_ERR_HTTP_CANNOT_BUILD_HEADER;
+        return (NULL);
     }
         
     /*
@@ -1317,12 +1316,52 @@ int est_client_send_enroll_request (EST_CTX *ctx, SSL *ssl, BUF_MEM *bptr,
     memcpy(http_data + hdr_len, bptr->data, bptr->length);
     hdr_len += bptr->length;
 
+    *req_len = hdr_len;
+    *rv = EST_ERR_NONE;
+    return (http_data);
+}
+
+/*
+ * This function sends the HTTP request for a Simple Enroll
+ * The CSR (pkcs10) is already built at this point.  This
+ * function simply creates the HTTP header and body and puts
+ * it on the wire.  It then waits for a response from the
+ * server and copies the response to a buffer provided by
+ * the caller
+ *
+ * Parameters:
+ *	ctx:	    EST context
+ *	ssl:	    SSL context
+ *	bptr:	    pointer containing PKCS10 CSR
+ *	pkcs7:	    receives the pkcs7 response, NUL terminated,
+ *	            which the caller frees
+ *	pkcs7_len:  length of pkcs7 response
+ *	reenroll:   Set to 1 to do a reenroll instead of an enroll
+ *
+ */
+int est_client_send_enroll_request (EST_CTX *ctx, SSL *ssl, BUF_MEM *bptr,
+                                    unsigned char **pkcs7, int *pkcs7_len,
+				    int reenroll)
+{
+    char        *http_data;
+    int hdr_len;
+    int write_size;
+    unsigned char *enroll_buf = NULL;
+    int enroll_buf_len = 0;
+    EST_ERROR rv;
+
     /*
-     * terminate the HTTP request
+     * Assume the enroll will fail, set return length to zero
+     * to be defensive.
      */
-    snprintf(http_data + hdr_len, EST_HTTP_REQ_TOTAL_LEN-hdr_len,"\r\n");
-    hdr_len += 2;
+    *pkcs7 = NULL;
+    *pkcs7_len = 0;
 
+    http_data = est_client_build_enroll_request(ctx, bptr, reenroll,
+                                                &hdr_len, &rv);
+    if (!http_data) {
+        return (rv);
+    }
 
     /*
      * Send the request to the server and wait for a response
@@ -1343,17 +1382,18 @@ int est_client_send_enroll_request (EST_CTX *ctx, SSL *ssl, BUF_MEM *bptr,
                                  &enroll_buf, &enroll_buf_len);
         switch (rv) {
         case EST_ERR_NONE:
-            memcpy(pkcs7, enroll_buf, enroll_buf_len);
+            *pkcs7 = enroll_buf;
             *pkcs7_len = enroll_buf_len;
             break;
         case EST_ERR_AUTH_FAIL:
             EST_LOG_WARN("HTTP auth failure");
+            free(enroll_buf);
             break;
         default:
             EST_LOG_ERR("EST request failed: %d (%s)", rv, EST_ERR_NUM_TO_STR(rv));
+            free(enroll_buf);
             break;
         }
-        free(enroll_buf);
     }
     free(http_data);
     return (rv);
@@ -1452,32 +1492,26 @@ static void est_client_clear_csr_pop (X509_REQ *csr)
 
 
 /*
- * This function does the work of converting the X509_REQ* to
- * the base64 encoded DER format as specified in the EST RFC.
- * Once converted to the proper format, this routine will
- * forward the request to the server, check the response,
- * and save the cert on the local context where it can be
- * retrieved later by the application layer.
+ * This function converts the X509_REQ* to the base64 encoded
+ * DER format as specified in the EST RFC.  The encoding is held
+ * in the BIO returned, bptr points into it.  The caller frees
+ * the BIO with BIO_free_all().
  */
-static EST_ERROR est_client_enroll_req (EST_CTX *ctx, SSL *ssl, X509_REQ *req, 
-	                                int *pkcs7_len, int reenroll)
+static BIO *est_client_encode_csr (X509_REQ *req, BUF_MEM **bptr)
 {
-    EST_ERROR    rv = EST_ERR_NONE;
     BIO         *p10out = NULL, *b64;
-    BUF_MEM     *bptr = NULL;
-    unsigned char *recv_buf;
-    unsigned char *new_cert_buf;
-    int          new_cert_buf_len;
 
     /*
      * Grab the PKCS10 PEM encoded data
      */
     b64 = BIO_new(BIO_f_base64());
     p10out = BIO_new(BIO_s_mem());
-    if (!p10out) {
+    if (!b64 || !p10out) {
         EST_LOG_ERR("BIO_new failed");
 	ossl_dump_ssl_errors();
-        return EST_ERR_MALLOC;
+        BIO_free(b64);
+        BIO_free(p10out);
+        return (NULL);
     }
     p10out = BIO_push(b64, p10out);
 
@@ -1487,20 +1521,39 @@ static EST_ERROR est_client_enroll_req (EST_CTX *ctx, SSL *ssl, X509_REQ *req,
     req->req_info->enc.modified = 1; 
     i2d_X509_REQ_bio(p10out, req);
     (void)BIO_flush(p10out);
-    BIO_get_mem_ptr(p10out, &bptr);
+    BIO_get_mem_ptr(p10out, bptr);
+    return (p10out);
+}
+
+/*
+ * This function does the work of converting the X509_REQ* to
+ * the base64 encoded DER format as specified in the EST RFC.
+ * Once converted to the proper format, this routine will
+ * forward the request to the server, check the response,
+ * and save the cert on the local context where it can be
+ * retrieved later by the application layer.
+ */
+static EST_ERROR est_client_enroll_req (EST_CTX *ctx, SSL *ssl, X509_REQ *req, 
+	                                int *pkcs7_len, int reenroll)
+{
+    EST_ERROR    rv = EST_ERR_NONE;
+    BIO         *p10out;
+    BUF_MEM     *bptr = NULL;
+    unsigned char *new_cert_buf = NULL;
+    int          new_cert_buf_len;
+
+    p10out = est_client_encode_csr(req, &bptr);
+    if (!p10out) {
+        return EST_ERR_MALLOC;
+    }
 
-    /*
-     * Get the buffer in which to place the entire response from the server
-     */
-    recv_buf = malloc(EST_CA_MAX);
-    new_cert_buf = recv_buf; 
     new_cert_buf_len = 0;
 
     /*
      * Send the PKCS10 as an HTTP request to the EST server
      */
     rv = est_client_send_enroll_request(ctx, ssl, bptr,
-                                        new_cert_buf, &new_cert_buf_len, 
+                                        &new_cert_buf, &new_cert_buf_len, 
 					reenroll);
     switch (rv) {
 
@@ -1516,23 +1569,16 @@ static EST_ERROR est_client_enroll_req (EST_CTX *ctx, SSL *ssl, X509_REQ *req,
         }
 
         /*
-         * Resize the buffer holding the retrieved client certificate and link
-         * it into the ctx.  Get rid of the http hdr and any extra space on
-         * the back.
+         * Link the buffer holding the retrieved client certificate
+         * into the ctx, it already comes NUL terminated without the
+         * http hdr.
          */
         if (ctx->enrolled_client_cert != NULL){
             free(ctx->enrolled_client_cert);
         }
-        ctx->enrolled_client_cert = malloc(new_cert_buf_len+1);
-        if (ctx->enrolled_client_cert == NULL) {
-            
-            EST_LOG_ERR("Unable to allocate newly enrolled client certificate buffer");
-            rv = EST_ERR_MALLOC;
-            break;
-        }
-        ctx->enrolled_client_cert[new_cert_buf_len] = '\0';
-        memcpy(ctx->enrolled_client_cert, new_cert_buf, new_cert_buf_len);
+        ctx->enrolled_client_cert = new_cert_buf;
         ctx->enrolled_client_cert_len = new_cert_buf_len;
+        new_cert_buf = NULL;
 
         /*
          * pass back the length of this newly enrolled cert
@@ -1554,33 +1600,21 @@ static EST_ERROR est_client_enroll_req (EST_CTX *ctx, SSL *ssl, X509_REQ *req,
         break;
     }
 
-    if (recv_buf) {
-        free(recv_buf);
+    if (new_cert_buf) {
+        free(new_cert_buf);
     }
     BIO_free_all(p10out);
     return (rv);
 }
 
-/*  est_client_enroll_pkcs10() This function implements the Simple Enroll
- *  flow. It signs the CSR that was provided and then sends the CSR
- *  to the EST server and retrieves the pkcs7 response.
- *
- *  Parameters:
- *    ctx    EST context
- *    ssl    SSL context being used for this EST session
- *    csr    Pointer to X509_REQ object containing the PKCS10 CSR
- *    pkcs7_len  pointer to an integer in which the length of the recieved
- *               pkcs7 response is placed.
- *    priv_key Pointer to the private key used to sign the CSR.
- *    reenroll Set to 1 to do a reenroll instead of an enroll
- *
- *  Returns EST_ERROR  
+/*
+ * Signs the CSR for the TLS session in ssl, with the proof-of-possession
+ * value of the session embedded in it when the server requires one.
+ * A PoP value left from an earlier session is removed first.
  */
-static EST_ERROR est_client_enroll_pkcs10 (EST_CTX *ctx, SSL *ssl, X509_REQ *csr,
-                                           int *pkcs7_len, EVP_PKEY *priv_key,
-                                           int reenroll)
+static EST_ERROR est_client_sign_csr (EST_CTX *ctx, SSL *ssl, X509_REQ *csr,
+                                      EVP_PKEY *priv_key)
 {
-    EST_ERROR    rv = EST_ERR_NONE;
     char        *tls_uid;
     int          ossl_rv;
 
@@ -1620,6 +1654,34 @@ static EST_ERROR est_client_enroll_pkcs10 (EST_CTX *ctx, SSL *ssl, X509_REQ *csr
         ossl_dump_ssl_errors();
         return (EST_ERR_X509_SIGN);
     }
+    return (EST_ERR_NONE);
+}
+
+/*  est_client_enroll_pkcs10() This function implements the Simple Enroll
+ *  flow. It signs the CSR that was provided and then sends the CSR
+ *  to the EST server and retrieves the pkcs7 response.
+ *
+ *  Parameters:
+ *    ctx    EST context
+ *    ssl    SSL context being used for this EST session
+ *    csr    Pointer to X509_REQ object containing the PKCS10 CSR
+ *    pkcs7_len  pointer to an integer in which the length of the recieved
+ *               pkcs7 response is placed.
+ *    priv_key Pointer to the private key used to sign the CSR.
+ *    reenroll Set to 1 to do a reenroll instead of an enroll
+ *
+ *  Returns EST_ERROR  
+ */
+static EST_ERROR est_client_enroll_pkcs10 (EST_CTX *ctx, SSL *ssl, X509_REQ *csr,
+                                           int *pkcs7_len, EVP_PKEY *priv_key,
+                                           int reenroll)
+{
+    EST_ERROR    rv;
+
+    rv = est_client_sign_csr(ctx, ssl, csr, priv_key);
+    if (rv != EST_ERR_NONE) {
+        return (rv);
+    }
 
     rv = est_client_enroll_req(ctx, ssl, csr, pkcs7_len, reenroll);
 
@@ -2117,6 +2179,58 @@ static EST_ERROR est_client_check_fqdn (EST_CTX *ctx, SSL *ssl)
     }
 }
 
+/*
+ * Checks that a connection held since the previous operation can
+ * carry another request.  The server has nothing to say between
+ * responses, anything readable on the socket means it closed the
+ * connection or is about to.
+ */
+static int est_client_conn_alive (SSL *ssl)
+{
+    struct timeval timeout;
+    fd_set set;
+    int fd;
+
+    if (SSL_pending(ssl) > 0) {
+        return (0);
+    }
+    fd = SSL_get_fd(ssl);
+    if (fd < 0) {
+        return (0);
+    }
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    return (select(fd + 1, &set, NULL, NULL, &timeout) == 0);
+}
+
+/*
+ * Throws away data read past the end of the last response, it
+ * belongs to the connection it was read from
+ */
+static void est_client_drop_extra (EST_CTX *ctx)
+{
+    if (ctx->rx_extra) {
+        free(ctx->rx_extra);
+        ctx->rx_extra = NULL;
+    }
+    ctx->rx_extra_len = 0;
+}
+
+/*
+ * Closes the connection held for keep-alive, if any
+ */
+void est_client_drop_conn (EST_CTX *ctx)
+{
+    if (ctx->ka_ssl) {
+        SSL_shutdown(ctx->ka_ssl);
+        SSL_free(ctx->ka_ssl);
+        ctx->ka_ssl = NULL;
+    }
+    est_client_drop_extra(ctx);
+}
+
 /*
  * This function will open a TCP socket and establish a TLS session
  * with the EST server.  This should be called after est_client_init().
@@ -2143,6 +2257,23 @@ EST_ERROR est_client_connect (EST_CTX *ctx, SSL **ssl)
         return EST_ERR_NO_CTX;
     }
 
+    /*
+     * Reuse the connection left open by the previous operation,
+     * unless the server has closed it in the meantime
+     */
+    ctx->ka_reusable = 0;
+    if (ctx->ka_ssl) {
+        *ssl = ctx->ka_ssl;
+        ctx->ka_ssl = NULL;
+        if (est_client_conn_alive(*ssl)) {
+            EST_LOG_INFO("Reusing the connection to the EST server");
+            return (EST_ERR_NONE);
+        }
+        EST_LOG_INFO("EST server closed the connection, reconnecting");
+        SSL_free(*ssl);
+        *ssl = NULL;
+    }
+
     s_ctx = ctx->ssl_ctx;
 
     /* 
@@ -2248,36 +2379,63 @@ EST_ERROR est_client_connect (EST_CTX *ctx, SSL **ssl)
 }
 
 /*
- * This function will close the TLS session and the underlying socket.
- *
- * Parameters:
- *	ssl:	    Pointer to SSL context that has been set up for this connection
- *                  to the EST server.
+ * Caches the TLS session of ssl in the context, so the next connection
+ * can resume it
  */
-void est_client_disconnect (EST_CTX *ctx, SSL **ssl)
+static void est_client_save_session (EST_CTX *ctx, SSL *ssl)
 {
     SSL_SESSION *new_sess;
-    
-    if (!*ssl) {
-        return;
-    }
 
     /*
      * if first disconnect, get the session id to cache it away to use for
      * session resumption.
      */
     if (!ctx->sess) {
-	ctx->sess = SSL_get1_session(*ssl);
+	ctx->sess = SSL_get1_session(ssl);
     } else {
         /*
          * if not the first time to disconnect, see if the session id changed.
          * If it did, officially re-obtain it with a get1 call and cache it away
          */
-        new_sess = SSL_get0_session(*ssl);
+        new_sess = SSL_get0_session(ssl);
         if (new_sess != ctx->sess) {
-            ctx->sess = SSL_get1_session(*ssl);
+            SSL_SESSION_free(ctx->sess);
+            ctx->sess = SSL_get1_session(ssl);
         }
     }
+}
+
+/*
+ * This function will close the TLS session and the underlying socket.
+ * With keep-alive enabled a connection the server left open is held
+ * in the context instead, see est_client_connect().
+ *
+ * Parameters:
+ *	ssl:	    Pointer to SSL context that has been set up for this connection
+ *                  to the EST server.
+ */
+void est_client_disconnect (EST_CTX *ctx, SSL **ssl)
+{
+    if (!*ssl) {
+        return;
+    }
+
+    est_client_save_session(ctx, *ssl);
+
+    /*
+     * Hold on to the connection for the next operation when the
+     * server agreed to keep it open and sent nothing more
+     */
+    if (ctx->rx_extra) {
+        est_client_drop_extra(ctx);
+        ctx->ka_reusable = 0;
+    }
+    if (ctx->keep_alive && ctx->ka_reusable && !ctx->ka_ssl) {
+        ctx->ka_ssl = *ssl;
+        ctx->ka_reusable = 0;
+        *ssl = NULL;
+        return;
+    }
     
     SSL_shutdown(*ssl);
     SSL_free(*ssl);
@@ -2324,12 +2482,6 @@ static int est_client_send_cacerts_request (EST_CTX *ctx, SSL *ssl,
     snprintf(http_data + hdr_len, EST_HTTP_REQ_TOTAL_LEN-hdr_len,"\r\n");
     hdr_len += 2;
 
-    /*
-     * no data is being sent so go ahead and terminate the HTTP request
-     */
-    snprintf(http_data + hdr_len,EST_HTTP_REQ_TOTAL_LEN-hdr_len, "\r\n");
-    hdr_len += 2;
-    
     /*
      * Send the request to the server and wait for a response
      */
@@ -2367,24 +2519,15 @@ static int est_client_send_cacerts_request (EST_CTX *ctx, SSL *ssl,
             }
             
             /*
-             * Resize the buffer holding the retrieved CA cert and link it
-             * into the ctx.  Get rid of the http hdr and any extra space on
-             * the back.
+             * Link the buffer holding the retrieved CA cert into the
+             * ctx, it already comes NUL terminated without the http hdr.
              */
             if (ctx->retrieved_ca_certs != NULL){
                 free(ctx->retrieved_ca_certs);
             }
-            ctx->retrieved_ca_certs = malloc(ca_certs_buf_len+1);
-            if (ctx->retrieved_ca_certs == NULL) {
-                
-                EST_LOG_ERR("Unable to allocate CA certs buffer");
-                rv = EST_ERR_MALLOC;
-                break;
-            }
-            
-            ctx->retrieved_ca_certs[ca_certs_buf_len] = '\0';
-            memcpy(ctx->retrieved_ca_certs, ca_certs_buf, ca_certs_buf_len);
+            ctx->retrieved_ca_certs = ca_certs_buf;
             ctx->retrieved_ca_certs_len = ca_certs_buf_len;
+            ca_certs_buf = NULL;
 
             /*
              * Verify the returned CA cert chain
@@ -2592,43 +2735,418 @@ err:
 }
 
 
-/*! @brief est_client_enroll() performs the simple enroll request with the EST
-     server
- 
-    @param ctx Pointer to an EST context
-    @param cn Pointer to the Common Name value to be used in the enrollment
-    request.
-    @param pkcs7_len Pointer to an integer to hold the length of the PKCS7
-    buffer.
-    @param new_public_key Pointer an EVP_PKEY structure that holds the
-    client's key pair to be used in the simple enroll request .  The public
-    key is included in the Certificate Signing Request (CSR) sent to the CA
-    Server, and the private key is used to sign the request.
- 
-    @return EST_ERROR
+/*
+ * Progress of one request of a batch
+ */
+typedef enum {
+    EST_BATCH_PENDING = 0,  /* Waiting to be sent */
+    EST_BATCH_SENT,         /* Sent, the response hasn't been read */
+    EST_BATCH_DONE
+} EST_BATCH_STATE;
+
+typedef struct {
+    BIO *p10out;            /* Base64 DER encoding of the CSR */
+    BUF_MEM *bptr;
+    EST_BATCH_STATE state;
+    int tries;              /* Times a response was waited for */
+} EST_BATCH_ITEM;
 
-    est_client_enroll() connects to the EST server, builds a simple enroll
-    request using the Common Name passed in cn, establishes a SSL/TLS
-    connection to the EST server that was configured with the previous call to
-    est_client_set_server(), and sends the simple enroll request.  The
-    response is stored in the EST context and the length is passed back to the
-    application through the pkcs7_len parameter of this function.  The
-    application can then allocate a correctly sized buffer and call
-    est_client_copy_enrolled_cert() to retrieve the new client certificate
-    from the context.
+/*
+ * Times a request of a batch is sent before giving up on it, an
+ * anonymous attempt, one with credentials and one after the
+ * server declared the digest nonce stale
  */
-EST_ERROR est_client_enroll (EST_CTX *ctx, char *cn, int *pkcs7_len,
-                             EVP_PKEY *new_public_key)
+#define EST_BATCH_TRIES_MAX 3
+
+/*
+ * The server may close the connection while requests of a batch
+ * are still being written, writing to it or shutting it down
+ * mustn't raise SIGPIPE in the application.  The signal is blocked
+ * in this thread while a batch runs, est_client_unblock_sigpipe()
+ * discards one the batch caused and restores the signal mask.
+ */
+static void est_client_block_sigpipe (sigset_t *old_set, int *was_pending)
 {
-    EST_ERROR rv;
-    SSL *ssl = NULL;
+    sigset_t pipe_set, pending;
+
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+#ifndef DISABLE_PTHREADS
+    pthread_sigmask(SIG_BLOCK, &pipe_set, old_set);
+#else
+    sigprocmask(SIG_BLOCK, &pipe_set, old_set);
+#endif
+    sigpending(&pending);
+    *was_pending = sigismember(&pending, SIGPIPE);
+}
 
-    if (!ctx) {
-        return (EST_ERR_NO_CTX);
-    }
+static void est_client_unblock_sigpipe (sigset_t *old_set, int was_pending)
+{
+    sigset_t pipe_set, pending;
+    int sig;
+
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    sigpending(&pending);
+    if (!was_pending && sigismember(&pending, SIGPIPE)) {
+        sigwait(&pipe_set, &sig);
+    }
+#ifndef DISABLE_PTHREADS
+    pthread_sigmask(SIG_SETMASK, old_set, NULL);
+#else
+    sigprocmask(SIG_SETMASK, old_set, NULL);
+#endif
+}
 
-    if (!new_public_key) {
-        return (EST_ERR_NO_KEY);
+/*
+ * Waits for the response to the oldest request in flight to start
+ * arriving.  Returns 0 when the server closed the connection
+ * instead or didn't answer within the read timeout.
+ */
+static int est_client_batch_wait (EST_CTX *ctx, SSL *ssl)
+{
+    struct timeval timeout;
+    fd_set set;
+    int fd;
+    char peek_buf;
+
+    if (ctx->rx_extra_len > 0 || SSL_pending(ssl) > 0) {
+        return (1);
+    }
+    fd = SSL_get_fd(ssl);
+    if (fd < 0) {
+        return (0);
+    }
+    timeout.tv_sec = ctx->read_timeout;
+    timeout.tv_usec = 0;
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    if (select(fd + 1, &set, NULL, NULL, &timeout) <= 0) {
+        EST_LOG_ERR("Socket read timeout.  No data received from server.");
+        return (0);
+    }
+    return (SSL_peek(ssl, &peek_buf, 1) > 0);
+}
+
+/*! @brief est_client_enroll_batch() performs a simple enroll for each of
+    a set of CSRs, pipelining the requests over a single connection.
+
+    @param ctx Pointer to an EST context
+    @param csrs Array of n signed certificate requests
+    @param n Number of CSRs
+    @param results Array of n pointers, each receives the outcome of the
+    CSR at the same index.  The results are released with
+    est_client_result_free().
+
+    @return EST_ERROR
+
+    est_client_enroll_batch() is meant for bulk provisioning, where
+    enrolling the CSRs one at a time with est_client_enroll_csr() leaves
+    the connection idle while the CA handles each of them.  Up to the
+    number of requests set with est_client_set_batch_window() are
+    written back to back before the first response is read, and the
+    responses are matched to the requests in the order they were sent.
+    Until the server has accepted a request the window is one, so the
+    HTTP authentication scheme is learnt from a single challenge.  It
+    also drops to one after a connection is lost with requests in
+    flight, until a response gets through again.
+
+    Each request is handled on its own.  Its result holds the PKCS7 on
+    success, or the retry delay when the CA asked for a retry, and the
+    rv member says which.  A request the server challenged for
+    credentials is sent again with them.  When the server closes the
+    connection, as it does after a retry-after or an error status, the
+    requests still unanswered are sent again on a new connection.  The
+    return value is EST_ERR_NONE when every request got an answer, the
+    outcome of each is in its rv, otherwise it's the error that ended
+    the batch, which the requests left unanswered also carry.
+
+    The CSRs must already be signed and they are sent as they are.  They
+    can't carry the proof-of-possession value of a TLS session, so the
+    server must not require it.  As with est_client_enroll_csr(), the
+    CSRs must be valid X509_REQ structures.
+ */
+EST_ERROR est_client_enroll_batch (EST_CTX *ctx, X509_REQ **csrs, int n,
+                                   EST_CLIENT_RESULT **results)
+{
+    EST_BATCH_ITEM *items = NULL;
+    int *inflight = NULL;
+    int cap, head = 0, inflight_cnt = 0;
+    int window = 1;
+    int done_cnt = 0;
+    int keep_alive;
+    int lost;
+    int write_failed = 0;
+    sigset_t sig_mask;
+    int sigpipe_pending;
+    SSL *ssl = NULL;
+    EST_ERROR rv = EST_ERR_NONE;
+    EST_ERROR item_rv;
+    char *http_data;
+    int req_len;
+    unsigned char *pkcs7;
+    int pkcs7_len;
+    int i, j;
+
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+    if (!ctx->est_client_initialized) {
+        return (EST_ERR_CLIENT_NOT_INITIALIZED);
+    }
+    if (!csrs || !results || n <= 0) {
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    for (i = 0; i < n; i++) {
+        results[i] = NULL;
+        if (!csrs[i]) {
+            return (EST_ERR_NO_CSR);
+        }
+    }
+
+    cap = ctx->batch_window;
+    items = calloc(n, sizeof(EST_BATCH_ITEM));
+    inflight = malloc(cap * sizeof(int));
+    if (!items || !inflight) {
+        EST_LOG_ERR("Unable to allocate memory for the batch");
+        rv = EST_ERR_MALLOC;
+        goto err;
+    }
+    for (i = 0; i < n; i++) {
+        results[i] = calloc(1, sizeof(EST_CLIENT_RESULT));
+        if (!results[i]) {
+            EST_LOG_ERR("Unable to allocate memory for the batch");
+            rv = EST_ERR_MALLOC;
+            goto err;
+        }
+        items[i].p10out = est_client_encode_csr(csrs[i], &items[i].bptr);
+        if (!items[i].p10out) {
+            rv = EST_ERR_MALLOC;
+            goto err;
+        }
+    }
+
+    /*
+     * Every request asks the server to keep the connection open
+     */
+    keep_alive = ctx->keep_alive;
+    ctx->keep_alive = 1;
+    est_client_block_sigpipe(&sig_mask, &sigpipe_pending);
+
+    while (done_cnt < n) {
+        if (!ssl) {
+            rv = est_client_connect(ctx, &ssl);
+            if (rv != EST_ERR_NONE) {
+                break;
+            }
+            write_failed = 0;
+        }
+
+        /*
+         * Fill the window, oldest requests first.  Once a write
+         * fails the server is closing the connection, the responses
+         * it sent before that are still read.
+         */
+        lost = 0;
+        for (i = 0; i < n && inflight_cnt < window && !write_failed; i++) {
+            if (items[i].state != EST_BATCH_PENDING) {
+                continue;
+            }
+            http_data = est_client_build_enroll_request(ctx, items[i].bptr, 0,
+                                                        &req_len, &item_rv);
+            if (!http_data) {
+                items[i].state = EST_BATCH_DONE;
+                results[i]->rv = item_rv;
+                done_cnt++;
+                continue;
+            }
+            if (SSL_write(ssl, http_data, req_len) <= 0) {
+                EST_LOG_WARN("TLS write failed, the server closed the connection");
+                ossl_dump_ssl_errors();
+                free(http_data);
+                if (!inflight_cnt &&
+                    ++items[i].tries >= EST_BATCH_TRIES_MAX) {
+                    items[i].state = EST_BATCH_DONE;
+                    results[i]->rv = EST_ERR_SSL_WRITE;
+                    done_cnt++;
+                }
+                write_failed = 1;
+                break;
+            }
+            free(http_data);
+            items[i].state = EST_BATCH_SENT;
+            inflight[(head + inflight_cnt) % cap] = i;
+            inflight_cnt++;
+        }
+        if (!inflight_cnt) {
+            if (write_failed) {
+                ctx->ka_reusable = 0;
+                est_client_disconnect(ctx, &ssl);
+            }
+            continue;
+        }
+
+        /*
+         * Read the response to the oldest request
+         */
+        i = inflight[head];
+        head = (head + 1) % cap;
+        inflight_cnt--;
+        items[i].tries++;
+
+        if (!est_client_batch_wait(ctx, ssl)) {
+            item_rv = EST_ERR_SSL_READ;
+            lost = 1;
+        } else {
+            item_rv = est_io_get_response(ctx, ssl, EST_SIMPLE_ENROLL,
+                                          &pkcs7, &pkcs7_len);
+            if (item_rv == EST_ERR_SSL_READ) {
+                lost = 1;
+            }
+        }
+        EST_LOG_INFO("Batch request %d answered: %d (%s)", i, item_rv,
+                     EST_ERR_NUM_TO_STR(item_rv));
+
+        switch (item_rv) {
+        case EST_ERR_NONE:
+            window = cap;
+            if (!pkcs7_len) {
+                EST_LOG_ERR("Buffer containing newly enrolled client certificate is zero bytes in length");
+                item_rv = EST_ERR_ZERO_LENGTH_BUF;
+                break;
+            }
+            results[i]->pkcs7 = pkcs7;
+            results[i]->pkcs7_len = pkcs7_len;
+            break;
+        case EST_ERR_CA_ENROLL_RETRY:
+            window = cap;
+            results[i]->retry_after_delay = ctx->retry_after_delay;
+            results[i]->retry_after_date = ctx->retry_after_date;
+            ctx->retry_after_delay = 0;
+            ctx->retry_after_date = 0;
+            break;
+        case EST_ERR_AUTH_FAIL:
+            /*
+             * Learn the new challenge on its own before
+             * pipelining again
+             */
+            window = 1;
+            if (ctx->auth_mode == AUTH_DIGEST && (FIPS_mode())) {
+                EST_LOG_ERR("HTTP digest auth not allowed while in FIPS mode");
+                item_rv = EST_ERR_BAD_MODE;
+            } else if ((ctx->auth_mode == AUTH_DIGEST ||
+                        ctx->auth_mode == AUTH_BASIC) &&
+                       items[i].tries < EST_BATCH_TRIES_MAX) {
+                items[i].state = EST_BATCH_PENDING;
+            }
+            break;
+        default:
+            break;
+        }
+        if (lost) {
+            /*
+             * A server closing a connection that holds unread
+             * requests resets it, which can take the last response
+             * with it.  Send one request at a time until a response
+             * makes it through again.
+             */
+            window = 1;
+            if (items[i].tries < EST_BATCH_TRIES_MAX) {
+                items[i].state = EST_BATCH_PENDING;
+            }
+        }
+        if (items[i].state == EST_BATCH_SENT) {
+            items[i].state = EST_BATCH_DONE;
+            results[i]->rv = item_rv;
+            done_cnt++;
+        }
+
+        /*
+         * Requests sent after a response that closes the connection
+         * are never answered, they go out again on a new one
+         */
+        if (lost || !ctx->ka_reusable) {
+            EST_LOG_INFO("Batch connection closed, %d requests to resend",
+                         inflight_cnt);
+            for (j = 0; j < inflight_cnt; j++) {
+                items[inflight[(head + j) % cap]].state = EST_BATCH_PENDING;
+            }
+            head = inflight_cnt = 0;
+            ctx->ka_reusable = 0;
+            est_client_disconnect(ctx, &ssl);
+        }
+    }
+
+    ctx->keep_alive = keep_alive;
+    est_client_disconnect(ctx, &ssl);
+    est_client_unblock_sigpipe(&sig_mask, sigpipe_pending);
+
+    for (i = 0; i < n; i++) {
+        if (items[i].state != EST_BATCH_DONE) {
+            results[i]->rv = rv;
+        }
+    }
+
+err:
+    if (items) {
+        for (i = 0; i < n; i++) {
+            if (items[i].p10out) {
+                BIO_free_all(items[i].p10out);
+            }
+        }
+        free(items);
+    }
+    if (inflight) {
+        free(inflight);
+    }
+    if (rv == EST_ERR_MALLOC) {
+        for (i = 0; i < n; i++) {
+            est_client_result_free(results[i]);
+            results[i] = NULL;
+        }
+    }
+    return (rv);
+}
+
+
+/*! @brief est_client_enroll() performs the simple enroll request with the EST
+     server
+ 
+    @param ctx Pointer to an EST context
+    @param cn Pointer to the Common Name value to be used in the enrollment
+    request.
+    @param pkcs7_len Pointer to an integer to hold the length of the PKCS7
+    buffer.
+    @param new_public_key Pointer an EVP_PKEY structure that holds the
+    client's key pair to be used in the simple enroll request .  The public
+    key is included in the Certificate Signing Request (CSR) sent to the CA
+    Server, and the private key is used to sign the request.
+ 
+    @return EST_ERROR
+
+    est_client_enroll() connects to the EST server, builds a simple enroll
+    request using the Common Name passed in cn, establishes a SSL/TLS
+    connection to the EST server that was configured with the previous call to
+    est_client_set_server(), and sends the simple enroll request.  The
+    response is stored in the EST context and the length is passed back to the
+    application through the pkcs7_len parameter of this function.  The
+    application can then allocate a correctly sized buffer and call
+    est_client_copy_enrolled_cert() to retrieve the new client certificate
+    from the context.
+ */
+EST_ERROR est_client_enroll (EST_CTX *ctx, char *cn, int *pkcs7_len,
+                             EVP_PKEY *new_public_key)
+{
+    EST_ERROR rv;
+    SSL *ssl = NULL;
+
+    if (!ctx) {
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (!new_public_key) {
+        return (EST_ERR_NO_KEY);
     }
 
     if (!ctx->est_client_initialized) {
@@ -3399,6 +3917,12 @@ EST_ERROR est_client_set_auth (EST_CTX *ctx, const char *uid, const char *pwd,
      */
     ctx->client_key = private_key;
     ctx->client_cert = client_cert;
+
+    /*
+     * A held connection was authenticated with the previous
+     * certificate
+     */
+    est_client_drop_conn(ctx);
     
     /*
      * Load the client cert if it's available
@@ -3548,6 +4072,7 @@ EST_CTX *est_client_init (unsigned char *ca_chain, int ca_chain_len,
      * For now, hard code the socket read timeout to 10 seconds
      */
     ctx->read_timeout = EST_SSL_READ_TIMEOUT_DEF;
+    ctx->batch_window = EST_CLIENT_BATCH_WINDOW_DEF;
 
     /*
      * We use SHA-256 as the default hash algorithm
@@ -3611,6 +4136,7 @@ EST_ERROR est_client_set_server (EST_CTX *ctx, const char *server, int port)
     strncpy(ctx->est_server, server, EST_MAX_SERVERNAME_LEN);
 
     ctx->est_port_num = port;
+    est_client_drop_conn(ctx);
 
     return EST_ERR_NONE;
 }
@@ -3786,6 +4312,84 @@ EST_ERROR est_client_unforce_pop (EST_CTX *ctx)
 }
 
 
+/*! @brief est_client_set_keep_alive() is used by an application to
+    have the client keep its connection to the EST server open between
+    operations.
+
+    @param ctx Pointer to the EST context
+    @param enable Non-zero to reuse the connection, zero to open a new
+    connection for each operation, which is the default.
+
+    Each of est_client_get_cacerts(), est_client_get_csrattrs(),
+    est_client_enroll() and est_client_reenroll() normally opens a TCP
+    connection and performs a TLS handshake of its own.  With keep-alive
+    enabled the connection is held in the context after an operation
+    completes, as long as the server agreed to keep it open, and the
+    next operation sends its request on it.  A connection the server
+    closed in the meantime is noticed before it is used and a new one
+    is opened in its place, the application does not see the difference.
+    est_client_provision_cert() then needs a single handshake.
+
+    The held connection is closed by est_destroy(), when keep-alive is
+    disabled, and when the server or the client credentials change.
+    The context must still not be shared between threads.
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_client_set_keep_alive (EST_CTX *ctx, int enable)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (ctx->est_mode != EST_CLIENT) {
+        return (EST_ERR_BAD_MODE);
+    }
+
+    ctx->keep_alive = enable ? 1 : 0;
+    if (!ctx->keep_alive) {
+        est_client_drop_conn(ctx);
+    }
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_client_set_batch_window() is used by an application to set
+    how many requests est_client_enroll_batch() has in flight at once.
+
+    @param ctx Pointer to the EST context
+    @param window Number of requests written before waiting for the
+    oldest response.  The minimum value is 1, which sends the requests
+    one at a time over a single connection, and the maximum value is
+    EST_CLIENT_BATCH_WINDOW_MAX.  The default is
+    EST_CLIENT_BATCH_WINDOW_DEF.
+
+    A larger window hides more of the round trip time and of the time
+    the CA takes for each request, but holds more requests that have to
+    be sent again when the server closes the connection.
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_client_set_batch_window (EST_CTX *ctx, int window)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (ctx->est_mode != EST_CLIENT) {
+        return (EST_ERR_BAD_MODE);
+    }
+
+    if (window < 1 || window > EST_CLIENT_BATCH_WINDOW_MAX) {
+	EST_LOG_ERR("Invalid batch window passed: %d ", window);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    ctx->batch_window = window;
+    return (EST_ERR_NONE);
+}
+
 /*! @brief est_client_set_read_timeout() is used by an application to set
     timeout value of read operations.  After the EST client sends a request to
     the EST server it will attempt to read the response from the server.  This
@@ -3815,3 +4419,1171 @@ EST_ERROR est_client_set_read_timeout (EST_CTX *ctx, int timeout)
     ctx->read_timeout = timeout;
     return (EST_ERR_NONE);
 }
+
+/*****************************************************************************
+* EST Client pool
+*****************************************************************************/
+/*
+ * A pool is a set of client contexts, one per worker slot.  Slot 0
+ * is created by est_client_init() and owns the SSL_CTX, which holds
+ * the trust store and the client's TLS identity.  The other slots
+ * borrow it, so the trust anchors are parsed once.  Each slot keeps
+ * its own connection, TLS session and HTTP auth state, and is used
+ * by one thread at a time.
+ */
+struct est_client_pool {
+    EST_CTX **slots;
+    int slot_cnt;
+    int *free_slots;        /* Stack of idle slots, most recent on top */
+    int free_cnt;
+#ifndef DISABLE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t slot_free;
+#endif
+};
+
+typedef enum {
+    EST_POOL_OP_ENROLL,
+    EST_POOL_OP_ENROLL_CSR,
+    EST_POOL_OP_REENROLL
+} EST_POOL_OP;
+
+/*
+ * Creates a client context that uses the SSL_CTX of the pool's
+ * first slot
+ */
+static EST_CTX *est_client_pool_slot_new (EST_CTX *owner)
+{
+    EST_CTX *ctx;
+
+    ctx = malloc(sizeof(EST_CTX));
+    if (!ctx) {
+        EST_LOG_ERR("Unable to allocate memory for EST Context");
+        return (NULL);
+    }
+    memset(ctx, 0, sizeof(EST_CTX));
+    ctx->est_mode = EST_CLIENT;
+    ctx->ssl_ctx = owner->ssl_ctx;
+    ctx->shared_ssl_ctx = 1;
+    ctx->manual_cert_verify_cb = owner->manual_cert_verify_cb;
+    ctx->read_timeout = owner->read_timeout;
+    ctx->signing_digest = owner->signing_digest;
+    ctx->keep_alive = 1;
+    ctx->est_client_initialized = 1;
+    return (ctx);
+}
+
+/*! @brief est_client_pool_new() is used by an application to create
+    a pool of EST client contexts that can be used from many threads.
+
+    @param ca_chain Required char buffer containing CA certificates as raw
+    byte data, to be used for authenticating the EST server
+    @param ca_chain_len length of ca_chain char buffer.
+    @param cert_format defines the format of the certificates, only
+    EST_CERT_FORMAT_PEM is supported
+    @param cert_verify_cb Callback invoked when a server identity
+    certificate has failed verification, see est_client_init().  It
+    may be invoked from any thread using the pool.
+    @param slots Number of enrollments that can be in progress at once,
+    from 1 to EST_CLIENT_POOL_SLOTS_MAX
+
+    An EST_CTX created by est_client_init() holds the state of the
+    operation in progress and must not be shared between threads.  A
+    pool holds one client context per slot.  The trust store and the
+    TLS configuration are loaded once and shared by every slot, each
+    slot keeps its own connection to the EST server, with keep-alive
+    enabled, and its own TLS session.
+
+    The pool is configured with est_client_pool_set_server() and
+    est_client_pool_set_auth().  After that est_client_pool_enroll(),
+    est_client_pool_enroll_csr() and est_client_pool_reenroll() may be
+    invoked from any thread.  A call waits for an idle slot when all of
+    them are busy.  Each call passes back its own EST_CLIENT_RESULT
+    rather than leaving the certificate on a context.
+
+    Since every slot holds a connection open, an EST server that
+    dedicates a thread to each connection needs more threads than the
+    pool has slots.
+
+    The slots share one SSL_CTX and are used concurrently.  With
+    OpenSSL versions before 1.1.0 the application must install the
+    OpenSSL locking callbacks, CRYPTO_set_locking_callback() and
+    CRYPTO_set_id_callback(), before creating the pool, the same way
+    the example EST server does.  A warning is logged when no locking
+    callback is installed.
+
+    @return EST_CLIENT_POOL.  If error, NULL.
+ */
+EST_CLIENT_POOL *est_client_pool_new (unsigned char *ca_chain, int ca_chain_len,
+                                      EST_CERT_FORMAT cert_format,
+                                      int (*cert_verify_cb)(X509 *, int),
+                                      int slots)
+{
+    EST_CLIENT_POOL *pool;
+    int i;
+
+    if (slots < 1 || slots > EST_CLIENT_POOL_SLOTS_MAX) {
+        EST_LOG_ERR("Invalid number of pool slots: %d", slots);
+        return (NULL);
+    }
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (!CRYPTO_get_locking_callback()) {
+        EST_LOG_WARN("OpenSSL locking callback not set, the client pool is not thread safe");
+    }
+#endif
+
+    pool = malloc(sizeof(EST_CLIENT_POOL));
+    if (!pool) {
+        EST_LOG_ERR("Unable to allocate memory for EST client pool");
+        return (NULL);
+    }
+    memset(pool, 0, sizeof(EST_CLIENT_POOL));
+    pool->slots = calloc(slots, sizeof(EST_CTX *));
+    pool->free_slots = calloc(slots, sizeof(int));
+    if (!pool->slots || !pool->free_slots) {
+        EST_LOG_ERR("Unable to allocate memory for EST client pool");
+        free(pool->slots);
+        free(pool->free_slots);
+        free(pool);
+        return (NULL);
+    }
+#ifndef DISABLE_PTHREADS
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->slot_free, NULL);
+#endif
+
+    pool->slots[0] = est_client_init(ca_chain, ca_chain_len, cert_format,
+                                     cert_verify_cb);
+    if (!pool->slots[0]) {
+        est_client_pool_destroy(pool);
+        return (NULL);
+    }
+    pool->slots[0]->keep_alive = 1;
+    pool->slot_cnt = 1;
+    for (i = 1; i < slots; i++) {
+        pool->slots[i] = est_client_pool_slot_new(pool->slots[0]);
+        if (!pool->slots[i]) {
+            est_client_pool_destroy(pool);
+            return (NULL);
+        }
+        pool->slot_cnt++;
+    }
+
+    /*
+     * Slot 0 ends up on top of the stack
+     */
+    for (i = 0; i < slots; i++) {
+        pool->free_slots[i] = slots - 1 - i;
+    }
+    pool->free_cnt = slots;
+    return (pool);
+}
+
+/*! @brief est_client_pool_set_server() sets the address/port of the EST
+    server for every slot of a pool, see est_client_set_server().
+
+    @param pool Pointer to the client pool
+    @param server Name of the EST server to connect to
+    @param port TCP port on the EST server to connect
+
+    This must be called before any enrollment is made through the pool,
+    or while none are in progress.
+
+    @return EST_ERROR
+ */
+EST_ERROR est_client_pool_set_server (EST_CLIENT_POOL *pool, const char *server,
+                                      int port)
+{
+    EST_ERROR rv;
+    int i;
+
+    if (!pool) {
+	EST_LOG_ERR("Null pool");
+        return (EST_ERR_NO_CTX);
+    }
+
+    for (i = 0; i < pool->slot_cnt; i++) {
+        rv = est_client_set_server(pool->slots[i], server, port);
+        if (rv != EST_ERR_NONE) {
+            return (rv);
+        }
+    }
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_client_pool_set_auth() sets the credentials every slot of
+    a pool uses with the EST server, see est_client_set_auth().
+
+    @param pool Pointer to the client pool
+    @param uid User ID for HTTP authentication, may be NULL
+    @param pwd Password for HTTP authentication, may be NULL
+    @param client_cert Certificate for TLS authentication, may be NULL
+    @param private_key Private key for client_cert, may be NULL
+
+    The certificate and key are loaded once into the TLS configuration
+    the slots share.  They must remain valid until the pool is destroyed.
+    This must be called before any enrollment is made through the pool,
+    or while none are in progress.
+
+    @return EST_ERROR
+ */
+EST_ERROR est_client_pool_set_auth (EST_CLIENT_POOL *pool, const char *uid,
+                                    const char *pwd, X509 *client_cert,
+                                    EVP_PKEY *private_key)
+{
+    EST_CTX *ctx;
+    EST_ERROR rv;
+    int i;
+
+    if (!pool) {
+	EST_LOG_ERR("Null pool");
+        return (EST_ERR_NO_CTX);
+    }
+
+    rv = est_client_set_auth(pool->slots[0], uid, pwd, client_cert,
+                             private_key);
+    if (rv != EST_ERR_NONE) {
+        return (rv);
+    }
+    for (i = 1; i < pool->slot_cnt; i++) {
+        ctx = pool->slots[i];
+        est_client_set_uid_pw(ctx, uid, pwd);
+        ctx->auth_mode = AUTH_NONE;
+        ctx->client_key = private_key;
+        ctx->client_cert = client_cert;
+        est_client_drop_conn(ctx);
+    }
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_client_pool_set_read_timeout() sets the read timeout for
+    every slot of a pool, see est_client_set_read_timeout().
+
+    @param pool Pointer to the client pool
+    @param timeout Read timeout in seconds, from EST_SSL_READ_TIMEOUT_MIN
+    to EST_SSL_READ_TIMEOUT_MAX
+
+    @return EST_ERROR
+ */
+EST_ERROR est_client_pool_set_read_timeout (EST_CLIENT_POOL *pool, int timeout)
+{
+    EST_ERROR rv;
+    int i;
+
+    if (!pool) {
+	EST_LOG_ERR("Null pool");
+        return (EST_ERR_NO_CTX);
+    }
+
+    for (i = 0; i < pool->slot_cnt; i++) {
+        rv = est_client_set_read_timeout(pool->slots[i], timeout);
+        if (rv != EST_ERR_NONE) {
+            return (rv);
+        }
+    }
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Takes an idle slot off the stack, waiting for one when they're
+ * all busy.  The most recently used slot is handed out first, it's
+ * the one most likely to still have a connection open.
+ */
+static int est_client_pool_get (EST_CLIENT_POOL *pool)
+{
+    int slot = -1;
+
+#ifndef DISABLE_PTHREADS
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->free_cnt) {
+        pthread_cond_wait(&pool->slot_free, &pool->lock);
+    }
+#endif
+    if (pool->free_cnt) {
+        slot = pool->free_slots[--pool->free_cnt];
+    }
+#ifndef DISABLE_PTHREADS
+    pthread_mutex_unlock(&pool->lock);
+#endif
+    return (slot);
+}
+
+static void est_client_pool_put (EST_CLIENT_POOL *pool, int slot)
+{
+#ifndef DISABLE_PTHREADS
+    pthread_mutex_lock(&pool->lock);
+#endif
+    pool->free_slots[pool->free_cnt++] = slot;
+#ifndef DISABLE_PTHREADS
+    pthread_cond_signal(&pool->slot_free);
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+/*
+ * Runs one enrollment on an idle slot and moves its outcome from
+ * the slot's context into a new result
+ */
+static EST_ERROR est_client_pool_run (EST_CLIENT_POOL *pool, EST_POOL_OP op,
+                                      char *cn, X509_REQ *csr, X509 *cert,
+                                      EVP_PKEY *key, EST_CLIENT_RESULT **result)
+{
+    EST_CLIENT_RESULT *res;
+    EST_CTX *ctx;
+    EST_ERROR rv;
+    int pkcs7_len = 0;
+    int slot;
+
+    if (!pool) {
+	EST_LOG_ERR("Null pool");
+        return (EST_ERR_NO_CTX);
+    }
+    if (!result) {
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    *result = NULL;
+
+    slot = est_client_pool_get(pool);
+    if (slot < 0) {
+        EST_LOG_ERR("No idle slot in the client pool");
+        return (EST_ERR_BAD_MODE);
+    }
+    ctx = pool->slots[slot];
+
+    switch (op) {
+    case EST_POOL_OP_ENROLL:
+        rv = est_client_enroll(ctx, cn, &pkcs7_len, key);
+        break;
+    case EST_POOL_OP_ENROLL_CSR:
+        rv = est_client_enroll_csr(ctx, csr, &pkcs7_len, key);
+        break;
+    default:
+        rv = est_client_reenroll(ctx, cert, &pkcs7_len, key);
+        break;
+    }
+
+    if (rv == EST_ERR_NONE || rv == EST_ERR_CA_ENROLL_RETRY) {
+        res = malloc(sizeof(EST_CLIENT_RESULT));
+        if (!res) {
+            EST_LOG_ERR("Unable to allocate memory for the result");
+            rv = EST_ERR_MALLOC;
+        } else {
+            memset(res, 0, sizeof(EST_CLIENT_RESULT));
+            if (rv == EST_ERR_NONE) {
+                res->pkcs7 = ctx->enrolled_client_cert;
+                res->pkcs7_len = ctx->enrolled_client_cert_len;
+                ctx->enrolled_client_cert = NULL;
+                ctx->enrolled_client_cert_len = 0;
+            } else {
+                res->retry_after_delay = ctx->retry_after_delay;
+                res->retry_after_date = ctx->retry_after_date;
+            }
+            res->rv = rv;
+            *result = res;
+        }
+    }
+    ctx->retry_after_delay = 0;
+    ctx->retry_after_date = 0;
+
+    est_client_pool_put(pool, slot);
+    return (rv);
+}
+
+/*! @brief est_client_pool_enroll() performs a simple enroll through an
+    idle slot of a pool, see est_client_enroll().
+
+    @param pool Pointer to the client pool
+    @param cn Common Name to use in the enrollment request
+    @param new_public_key Key pair to put in the request and sign it with
+    @param result Receives the outcome of the request, when EST_ERR_NONE
+    or EST_ERR_CA_ENROLL_RETRY is returned.  It's released with
+    est_client_result_free().
+
+    This may be invoked from any thread.
+
+    @return EST_ERROR
+ */
+EST_ERROR est_client_pool_enroll (EST_CLIENT_POOL *pool, char *cn,
+                                  EVP_PKEY *new_public_key,
+                                  EST_CLIENT_RESULT **result)
+{
+    return (est_client_pool_run(pool, EST_POOL_OP_ENROLL, cn, NULL, NULL,
+                                new_public_key, result));
+}
+
+/*! @brief est_client_pool_enroll_csr() performs a simple enroll of a CSR
+    through an idle slot of a pool, see est_client_enroll_csr().
+
+    @param pool Pointer to the client pool
+    @param csr The certificate request
+    @param priv_key Key to sign the CSR with, NULL when it's already signed
+    @param result Receives the outcome of the request, as for
+    est_client_pool_enroll()
+
+    This may be invoked from any thread.
+
+    @return EST_ERROR
+ */
+EST_ERROR est_client_pool_enroll_csr (EST_CLIENT_POOL *pool, X509_REQ *csr,
+                                      EVP_PKEY *priv_key,
+                                      EST_CLIENT_RESULT **result)
+{
+    return (est_client_pool_run(pool, EST_POOL_OP_ENROLL_CSR, NULL, csr, NULL,
+                                priv_key, result));
+}
+
+/*! @brief est_client_pool_reenroll() performs a simple re-enroll through
+    an idle slot of a pool, see est_client_reenroll().
+
+    @param pool Pointer to the client pool
+    @param cert The certificate to renew
+    @param priv_key Private key of cert
+    @param result Receives the outcome of the request, as for
+    est_client_pool_enroll()
+
+    This may be invoked from any thread.
+
+    @return EST_ERROR
+ */
+EST_ERROR est_client_pool_reenroll (EST_CLIENT_POOL *pool, X509 *cert,
+                                    EVP_PKEY *priv_key,
+                                    EST_CLIENT_RESULT **result)
+{
+    return (est_client_pool_run(pool, EST_POOL_OP_REENROLL, NULL, NULL, cert,
+                                priv_key, result));
+}
+
+/*! @brief est_client_result_free() releases a result passed back by one
+    of the client pool enrollment functions, by est_client_enroll_batch()
+    or by est_client_op_get_result().
+
+    @param result The result, may be NULL
+ */
+void est_client_result_free (EST_CLIENT_RESULT *result)
+{
+    if (!result) {
+        return;
+    }
+    if (result->pkcs7) {
+        free(result->pkcs7);
+    }
+    free(result);
+}
+
+/*! @brief est_client_pool_destroy() closes the connections held by a
+    client pool and frees it.
+
+    @param pool The client pool, may be NULL
+
+    No enrollment may be in progress on the pool.
+ */
+void est_client_pool_destroy (EST_CLIENT_POOL *pool)
+{
+    int i;
+
+    if (!pool) {
+        return;
+    }
+
+    /*
+     * The first slot owns the SSL_CTX the others use
+     */
+    for (i = pool->slot_cnt - 1; i >= 0; i--) {
+        est_destroy(pool->slots[i]);
+    }
+#ifndef DISABLE_PTHREADS
+    pthread_cond_destroy(&pool->slot_free);
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    free(pool->free_slots);
+    free(pool->slots);
+    free(pool);
+}
+
+/*
+ * Steps of an operation driven by est_client_op_continue()
+ */
+typedef enum {
+    EST_OP_CONNECT = 0,     /* Opening a connection to the next address */
+    EST_OP_CONNECTING,      /* Waiting for connect() to finish */
+    EST_OP_HANDSHAKE,
+    EST_OP_SEND,
+    EST_OP_RECV,
+    EST_OP_DONE
+} EST_OP_STATE;
+
+struct est_client_op {
+    EST_CTX *ctx;
+    EST_CLIENT_OP_TYPE type;
+    EST_OP_STATE state;
+    X509_REQ *csr;              /* Signed again for each connection */
+    EVP_PKEY *priv_key;
+    struct addrinfo *addrs;     /* Addresses of the EST server */
+    struct addrinfo *ai;        /* Address being connected to */
+    int sock;
+    SSL *ssl;
+    EST_HTTP_AUTH_MODE auth_mode; /* Mode the request was sent with */
+    int tries;                  /* Times the request was sent */
+    char *req;
+    int req_len;
+    unsigned char *rx;          /* Response read so far, NUL terminated */
+    int rx_size;
+    int rx_cnt;
+    int rx_len;                 /* Length of the response, 0 until known */
+    EST_ERROR rv;
+    EST_CLIENT_RESULT *result;
+};
+
+/*
+ * Closes the connection of an operation, the socket is closed along
+ * with the TLS session that holds it
+ */
+static void est_client_op_close (EST_CLIENT_OP *op)
+{
+    if (op->ssl) {
+        if (SSL_is_init_finished(op->ssl)) {
+            est_client_save_session(op->ctx, op->ssl);
+            SSL_shutdown(op->ssl);
+        }
+        SSL_free(op->ssl);
+        op->ssl = NULL;
+    } else if (op->sock >= 0) {
+        close(op->sock);
+    }
+    op->sock = -1;
+    if (op->req) {
+        free(op->req);
+        op->req = NULL;
+    }
+    if (op->rx) {
+        free(op->rx);
+        op->rx = NULL;
+    }
+    op->rx_size = op->rx_cnt = op->rx_len = 0;
+}
+
+static void est_client_op_finish (EST_CLIENT_OP *op, EST_ERROR rv)
+{
+    est_client_op_close(op);
+    op->rv = rv;
+    op->state = EST_OP_DONE;
+}
+
+/*
+ * Works out which socket event the TLS call that returned ssl_rv is
+ * waiting for, when it failed for good the operation ends with err
+ */
+static int est_client_op_wait (EST_CLIENT_OP *op, int ssl_rv, EST_ERROR err)
+{
+    switch (SSL_get_error(op->ssl, ssl_rv)) {
+    case SSL_ERROR_WANT_READ:
+        return (EST_CONN_EV_READ);
+    case SSL_ERROR_WANT_WRITE:
+        return (EST_CONN_EV_WRITE);
+    default:
+        ossl_dump_ssl_errors();
+        est_client_op_finish(op, err);
+        return (0);
+    }
+}
+
+/*
+ * Starts a non-blocking connect to the next address of the server
+ */
+static int est_client_op_connect (EST_CLIENT_OP *op)
+{
+    int oval = 1;
+    int flags;
+
+    for (; op->ai; op->ai = op->ai->ai_next) {
+        op->sock = socket(op->ai->ai_family, op->ai->ai_socktype,
+                          op->ai->ai_protocol);
+        if (op->sock < 0) {
+            continue;
+        }
+        flags = fcntl(op->sock, F_GETFL, 0);
+        if (setsockopt(op->sock, SOL_SOCKET, SO_KEEPALIVE, (char *)&oval,
+                       sizeof(oval)) < 0 || flags < 0 ||
+            fcntl(op->sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+            close(op->sock);
+            op->sock = -1;
+            continue;
+        }
+        if (connect(op->sock, op->ai->ai_addr, op->ai->ai_addrlen) == 0) {
+            op->state = EST_OP_HANDSHAKE;
+            return (0);
+        }
+        if (errno == EINPROGRESS) {
+            op->state = EST_OP_CONNECTING;
+            return (EST_CONN_EV_WRITE);
+        }
+        close(op->sock);
+        op->sock = -1;
+    }
+    EST_LOG_ERR("Unable to connect to EST server at address %s",
+                op->ctx->est_server);
+    est_client_op_finish(op, EST_ERR_IP_CONNECT);
+    return (0);
+}
+
+/*
+ * Checks on a connect() in progress, the next address is tried
+ * when it failed
+ */
+static int est_client_op_connecting (EST_CLIENT_OP *op)
+{
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if (getsockopt(op->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        err = errno;
+    }
+    if (!err) {
+        len = sizeof(peer);
+        if (getpeername(op->sock, (struct sockaddr *)&peer, &len) == 0) {
+            op->state = EST_OP_HANDSHAKE;
+            return (0);
+        }
+        if (errno == ENOTCONN) {
+            return (EST_CONN_EV_WRITE);
+        }
+    }
+    close(op->sock);
+    op->sock = -1;
+    op->ai = op->ai->ai_next;
+    op->state = EST_OP_CONNECT;
+    return (0);
+}
+
+/*
+ * Builds the HTTP request once the TLS session is up, the CSR is
+ * signed for this session
+ */
+static EST_ERROR est_client_op_build_request (EST_CLIENT_OP *op)
+{
+    EST_CTX *ctx = op->ctx;
+    EST_ERROR rv = EST_ERR_NONE;
+    BIO *p10out;
+    BUF_MEM *bptr = NULL;
+    int hdr_len;
+
+    op->auth_mode = ctx->auth_mode;
+    if (op->type == EST_CLIENT_OP_CACERTS) {
+        op->req = malloc(EST_HTTP_REQ_TOTAL_LEN);
+        if (!op->req) {
+            EST_LOG_ERR("Unable to allocate memory for http_data");
+            return (EST_ERR_MALLOC);
+        }
+        hdr_len = est_client_build_cacerts_header(ctx, op->req);
+        snprintf(op->req + hdr_len, EST_HTTP_REQ_TOTAL_LEN-hdr_len, "\r\n");
+        op->req_len = hdr_len + 2;
+        return (EST_ERR_NONE);
+    }
+
+    if (op->priv_key) {
+        rv = est_client_sign_csr(ctx, op->ssl, op->csr, op->priv_key);
+        if (rv != EST_ERR_NONE) {
+            return (rv);
+        }
+    }
+    p10out = est_client_encode_csr(op->csr, &bptr);
+    if (!p10out) {
+        return (EST_ERR_MALLOC);
+    }
+    op->req = est_client_build_enroll_request(ctx, bptr,
+                                              op->type == EST_CLIENT_OP_REENROLL,
+                                              &op->req_len, &rv);
+    BIO_free_all(p10out);
+    return (rv);
+}
+
+static int est_client_op_handshake (EST_CLIENT_OP *op)
+{
+    EST_CTX *ctx = op->ctx;
+    BIO *tcp;
+    EST_ERROR rv;
+    int rc;
+
+    if (!op->ssl) {
+        tcp = BIO_new_socket(op->sock, BIO_CLOSE);
+        if (!tcp) {
+            EST_LOG_ERR("Error creating TLS context");
+            ossl_dump_ssl_errors();
+            est_client_op_finish(op, EST_ERR_SSL_NEW);
+            return (0);
+        }
+        op->ssl = SSL_new(ctx->ssl_ctx);
+        if (!op->ssl) {
+            EST_LOG_ERR("Error creating TLS context");
+            ossl_dump_ssl_errors();
+            BIO_free_all(tcp);
+            op->sock = -1;
+            est_client_op_finish(op, EST_ERR_SSL_NEW);
+            return (0);
+        }
+        SSL_set_ex_data(op->ssl, e_ctx_ssl_exdata_index, ctx);
+        SSL_set_bio(op->ssl, tcp, tcp);
+        if (ctx->sess) {
+            SSL_set_session(op->ssl, ctx->sess);
+        }
+    }
+
+    rc = SSL_connect(op->ssl);
+    if (rc <= 0) {
+        return (est_client_op_wait(op, rc, EST_ERR_SSL_CONNECT));
+    }
+
+    /*
+     * Check the server name against its certificate, see
+     * est_client_connect()
+     */
+    if (est_client_check_fqdn(ctx, op->ssl)) {
+        EST_LOG_WARN("EST server name did not match FQDN in server certificate.");
+        est_client_op_finish(op, EST_ERR_FQDN_MISMATCH);
+        return (0);
+    }
+
+    rv = est_client_op_build_request(op);
+    if (rv != EST_ERR_NONE) {
+        est_client_op_finish(op, rv);
+        return (0);
+    }
+    op->tries++;
+    op->state = EST_OP_SEND;
+    return (0);
+}
+
+static int est_client_op_send (EST_CLIENT_OP *op)
+{
+    int rc;
+
+    /*
+     * A write that has to wait is repeated with the same arguments
+     */
+    rc = SSL_write(op->ssl, op->req, op->req_len);
+    if (rc <= 0) {
+        return (est_client_op_wait(op, rc, EST_ERR_SSL_WRITE));
+    }
+    EST_LOG_INFO("TLS wrote %d bytes, attempted %d bytes\n", rc, op->req_len);
+    free(op->req);
+    op->req = NULL;
+    op->state = EST_OP_RECV;
+    return (0);
+}
+
+/*
+ * Handles the response once it has been read.  The operation is over
+ * unless the server asked for credentials, the request is then sent
+ * again with them on a new connection.
+ */
+static void est_client_op_response (EST_CLIENT_OP *op)
+{
+    EST_CTX *ctx = op->ctx;
+    EST_OPERATION est_op;
+    unsigned char *buf = NULL;
+    int len = 0;
+    int complete;
+    EST_ERROR rv;
+
+    switch (op->type) {
+    case EST_CLIENT_OP_CACERTS:
+        est_op = EST_GET_CACERTS;
+        break;
+    case EST_CLIENT_OP_REENROLL:
+        est_op = EST_RE_ENROLL;
+        break;
+    default:
+        est_op = EST_SIMPLE_ENROLL;
+        break;
+    }
+
+    /*
+     * Anything read past the response is dropped along with the
+     * connection
+     */
+    complete = op->rx_len > 0 && op->rx_cnt >= op->rx_len;
+    if (complete) {
+        op->rx_cnt = op->rx_len;
+        op->rx[op->rx_cnt] = '\0';
+    }
+
+    /*
+     * The request was sent with the authentication mode the context
+     * had then, other operations may have changed it since
+     */
+    ctx->auth_mode = op->auth_mode;
+    rv = est_io_parse_response(ctx, est_op, op->rx, op->rx_cnt, complete,
+                               &buf, &len);
+    op->rx = NULL;
+    est_client_op_close(op);
+    ctx->ka_reusable = 0;
+
+    switch (rv) {
+    case EST_ERR_NONE:
+        if (len == 0) {
+            EST_LOG_ERR("Response is zero bytes in length");
+            rv = EST_ERR_ZERO_LENGTH_BUF;
+            break;
+        }
+        if (est_op == EST_GET_CACERTS) {
+            rv = verify_cacert_resp(ctx, buf, &len);
+            if (rv != EST_ERR_NONE) {
+                EST_LOG_ERR("Returned CACerts chain was invalid");
+                break;
+            }
+        }
+        op->result = malloc(sizeof(EST_CLIENT_RESULT));
+        if (!op->result) {
+            EST_LOG_ERR("Unable to allocate memory for the result");
+            rv = EST_ERR_MALLOC;
+            break;
+        }
+        memset(op->result, 0, sizeof(EST_CLIENT_RESULT));
+        op->result->pkcs7 = buf;
+        op->result->pkcs7_len = len;
+        buf = NULL;
+        break;
+    case EST_ERR_CA_ENROLL_RETRY:
+        op->result = malloc(sizeof(EST_CLIENT_RESULT));
+        if (!op->result) {
+            EST_LOG_ERR("Unable to allocate memory for the result");
+            rv = EST_ERR_MALLOC;
+            break;
+        }
+        memset(op->result, 0, sizeof(EST_CLIENT_RESULT));
+        op->result->retry_after_delay = ctx->retry_after_delay;
+        op->result->retry_after_date = ctx->retry_after_date;
+        break;
+    case EST_ERR_AUTH_FAIL:
+        if (ctx->auth_mode == AUTH_DIGEST && (FIPS_mode())) {
+            EST_LOG_ERR("HTTP digest auth not allowed while in FIPS mode");
+            rv = EST_ERR_BAD_MODE;
+        } else if ((ctx->auth_mode == AUTH_DIGEST ||
+                    ctx->auth_mode == AUTH_BASIC) &&
+                   op->tries < EST_BATCH_TRIES_MAX) {
+            EST_LOG_INFO("HTTP Auth failed, trying again with digest/basic parameters");
+            op->ai = op->addrs;
+            op->state = EST_OP_CONNECT;
+            return;
+        }
+        break;
+    default:
+        EST_LOG_ERR("EST request failed: %d (%s)", rv, EST_ERR_NUM_TO_STR(rv));
+        break;
+    }
+    ctx->retry_after_delay = 0;
+    ctx->retry_after_date = 0;
+
+    if (op->result) {
+        op->result->rv = rv;
+    }
+    if (buf) {
+        free(buf);
+    }
+    est_client_op_finish(op, rv);
+}
+
+/*
+ * Reads as much of the response as has arrived, the buffer grows as
+ * in est_io_read_raw()
+ */
+static int est_client_op_recv (EST_CLIENT_OP *op)
+{
+    unsigned char *new_rx;
+    int new_size;
+    int rc;
+
+    for (;;) {
+        new_size = op->rx_size;
+        if (op->rx_len > 0) {
+            if (op->rx_len + 1 > op->rx_size) {
+                new_size = op->rx_len + 1;
+            }
+        } else if (!op->rx_size) {
+            new_size = EST_IO_READ_CHUNK;
+        } else if (op->rx_cnt + 1 == op->rx_size) {
+            if (op->rx_size >= EST_CA_MAX) {
+                EST_LOG_ERR("Buffer too small for received message");
+                est_client_op_finish(op, EST_ERR_READ_BUFFER_TOO_SMALL);
+                return (0);
+            }
+            new_size = op->rx_size * 2;
+            if (new_size > EST_CA_MAX) {
+                new_size = EST_CA_MAX;
+            }
+        }
+        if (new_size != op->rx_size) {
+            new_rx = realloc(op->rx, new_size);
+            if (!new_rx) {
+                EST_LOG_ERR("Unable to allocate memory");
+                est_client_op_finish(op, EST_ERR_MALLOC);
+                return (0);
+            }
+            op->rx = new_rx;
+            op->rx_size = new_size;
+            op->rx[op->rx_cnt] = '\0';
+        }
+
+        rc = SSL_read(op->ssl, op->rx + op->rx_cnt,
+                      op->rx_size - 1 - op->rx_cnt);
+        if (rc < 0) {
+            return (est_client_op_wait(op, rc, EST_ERR_SSL_READ));
+        }
+        if (rc == 0) {
+            /*
+             * The server closed the connection
+             */
+            break;
+        }
+        op->rx_cnt += rc;
+        op->rx[op->rx_cnt] = '\0';
+        if (!op->rx_len) {
+            op->rx_len = est_io_response_len(op->rx, op->rx_cnt);
+        }
+        if (op->rx_len > 0 && op->rx_cnt >= op->rx_len) {
+            break;
+        }
+    }
+
+    est_client_op_response(op);
+    return (0);
+}
+
+/*! @brief est_client_op_start() is used by an application with its own
+    event loop to begin an EST request without blocking.
+
+    @param ctx Pointer to an EST context, from est_client_init()
+    @param type The request to make
+    @param csr The certificate request, for EST_CLIENT_OP_ENROLL and
+    EST_CLIENT_OP_REENROLL
+    @param priv_key Key to sign the CSR with, NULL when it's already
+    signed, as for est_client_enroll_csr()
+    @param op Receives the new operation
+
+    The CSR and the key must remain valid until the operation is
+    released, and the CSR must not be shared with another operation in
+    progress since it's signed again for each connection made.
+
+    No I/O is performed by this call, other than looking up the address
+    of the EST server, which blocks unless it was set as an IP address.
+    The application then invokes est_client_op_continue(), passing zero
+    for the events, to open the connection and learn which socket
+    events to wait for.  The operation owns its socket, which
+    est_client_op_get_fd() passes back.
+
+    Many operations may be in progress on a context at once, they all
+    use its configuration and they must be driven from a single thread.
+    No other request may be made on the context while they are in
+    progress.  The operations don't time out on their own, the
+    application releases an operation it gave up on with
+    est_client_op_free().
+
+    @return EST_ERROR
+ */
+EST_ERROR est_client_op_start (EST_CTX *ctx, EST_CLIENT_OP_TYPE type,
+                               X509_REQ *csr, EVP_PKEY *priv_key,
+                               EST_CLIENT_OP **op)
+{
+    EST_CLIENT_OP *new_op;
+    struct addrinfo hints;
+    char portstr[12];
+    EST_ERROR rv;
+    int rc;
+
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+    if (ctx->est_mode != EST_CLIENT) {
+        return (EST_ERR_BAD_MODE);
+    }
+    if (!op) {
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    *op = NULL;
+    if (!ctx->est_client_initialized) {
+        return (EST_ERR_CLIENT_NOT_INITIALIZED);
+    }
+    if (type != EST_CLIENT_OP_CACERTS && type != EST_CLIENT_OP_ENROLL &&
+        type != EST_CLIENT_OP_REENROLL) {
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    if (type != EST_CLIENT_OP_CACERTS) {
+        if (!csr) {
+            return (EST_ERR_NO_CSR);
+        }
+        if (priv_key) {
+            rv = est_client_check_csr(csr);
+            if (rv != EST_ERR_NONE) {
+                return (rv);
+            }
+        }
+    }
+
+    new_op = malloc(sizeof(EST_CLIENT_OP));
+    if (!new_op) {
+        EST_LOG_ERR("Unable to allocate memory for the operation");
+        return (EST_ERR_MALLOC);
+    }
+    memset(new_op, 0, sizeof(EST_CLIENT_OP));
+    new_op->ctx = ctx;
+    new_op->type = type;
+    new_op->priv_key = priv_key;
+    new_op->sock = -1;
+    new_op->state = EST_OP_CONNECT;
+
+    if (type != EST_CLIENT_OP_CACERTS) {
+        new_op->csr = csr;
+    }
+
+    snprintf(portstr, sizeof(portstr), "%u", ctx->est_port_num);
+    memset(&hints, '\0', sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;  
+    if ((rc = getaddrinfo(ctx->est_server, portstr, &hints, &new_op->addrs))) {
+        EST_LOG_ERR("Unable to lookup hostname %s. %s", 
+		ctx->est_server, gai_strerror(rc));
+        new_op->addrs = NULL;
+        est_client_op_free(new_op);
+        return (EST_ERR_IP_GETADDR);
+    }
+    new_op->ai = new_op->addrs;
+
+    *op = new_op;
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_client_op_get_fd() passes back the socket of an operation,
+    for the application to wait on.
+
+    @param op Pointer to the operation from est_client_op_start()
+
+    The socket changes when the operation moves on to another address
+    of the server, or opens a new connection to answer an HTTP
+    authentication challenge, so it should be fetched again after each
+    invocation of est_client_op_continue().  The application must not
+    close it.
+
+    @return The socket, -1 when the operation has none
+ */
+int est_client_op_get_fd (EST_CLIENT_OP *op)
+{
+    if (!op) {
+        return (-1);
+    }
+    return (op->sock);
+}
+
+/*! @brief est_client_op_continue() advances an operation created with
+    est_client_op_start() as far as it can go without blocking.
+
+    @param op Pointer to the operation from est_client_op_start()
+    @param events The EST_CONN_EV_READ and/or EST_CONN_EV_WRITE events
+                  reported by the application's event loop for the
+                  socket, or zero on the first invocation.
+
+    Each invocation performs as much of the connection setup, TLS
+    handshake, request transmission and response processing as the
+    socket allows.  The operation keeps its own state, so the events
+    parameter is only informational; it is always safe to invoke this
+    function again.
+
+    @return The socket events the application should wait for before
+            invoking this function again.  EST_CONN_EV_CLOSED is
+            returned once the operation is finished, at which point its
+            outcome is available from est_client_op_get_result().
+ */
+int est_client_op_continue (EST_CLIENT_OP *op, int events)
+{
+    sigset_t old_set;
+    int was_pending;
+    int wanted = 0;
+
+    if (!op) {
+        return (EST_CONN_EV_CLOSED);
+    }
+    (void)events;
+
+    /*
+     * The server may close the connection while the request is
+     * written, see est_client_block_sigpipe()
+     */
+    est_client_block_sigpipe(&old_set, &was_pending);
+    while (!wanted && op->state != EST_OP_DONE) {
+        ERR_clear_error();
+        switch (op->state) {
+        case EST_OP_CONNECT:
+            wanted = est_client_op_connect(op);
+            break;
+        case EST_OP_CONNECTING:
+            wanted = est_client_op_connecting(op);
+            break;
+        case EST_OP_HANDSHAKE:
+            wanted = est_client_op_handshake(op);
+            break;
+        case EST_OP_SEND:
+            wanted = est_client_op_send(op);
+            break;
+        default:
+            wanted = est_client_op_recv(op);
+            break;
+        }
+    }
+    est_client_unblock_sigpipe(&old_set, was_pending);
+
+    if (op->state == EST_OP_DONE) {
+        return (EST_CONN_EV_CLOSED);
+    }
+    return (wanted);
+}
+
+/*! @brief est_client_op_get_result() passes back the outcome of a
+    finished operation.
+
+    @param op Pointer to the operation from est_client_op_start()
+    @param result Receives the outcome, when EST_ERR_NONE or
+    EST_ERR_CA_ENROLL_RETRY is returned.  For an enrollment its pkcs7
+    member holds the new certificate, for EST_CLIENT_OP_CACERTS the
+    verified CA certificates, as est_client_copy_cacerts() would.  It
+    belongs to the caller from then on, who releases it with
+    est_client_result_free().  A result can only be passed back once.
+
+    @return EST_ERROR, EST_ERR_BAD_MODE while the operation is still in
+    progress
+ */
+EST_ERROR est_client_op_get_result (EST_CLIENT_OP *op,
+                                    EST_CLIENT_RESULT **result)
+{
+    if (!op) {
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    if (op->state != EST_OP_DONE) {
+        EST_LOG_ERR("Operation is still in progress");
+        return (EST_ERR_BAD_MODE);
+    }
+    if (result) {
+        *result = op->result;
+        op->result = NULL;
+    }
+    return (op->rv);
+}
+
+/*! @brief est_client_op_free() releases an operation, closing its
+    connection if it's still in progress.
+
+    @param op The operation, may be NULL
+ */
+void est_client_op_free (EST_CLIENT_OP *op)
+{
+    if (!op) {
+        return;
+    }
+    est_client_op_close(op);
+    if (op->addrs) {
+        freeaddrinfo(op->addrs);
+    }
+    est_client_result_free(op->result);
+    free(op);
+}
@@ -683,7 +683,7 @@ static char * HTNextField (char ** pstr)
  * a valid authentication response in future HTTP
  * requests.
  */
-static EST_ERROR est_io_parse_auth_tokens (EST_CTX *ctx, char *hdr)
+static EST_ERROR est_io_parse_auth_tokens (EST_CTX *ctx, char *hdr, int *stale)
 {
     int rv = EST_ERR_NONE;
     char *p = hdr;
@@ -706,6 +706,7 @@ static EST_ERROR est_io_parse_auth_tokens (EST_CTX *ctx, char *hdr)
         } else if (!strcasecmp(token, "nonce")) {
             if ((value = HTNextField(&p))) {
                 strncpy(ctx->s_nonce, value, MAX_NONCE);
+                ctx->nonce_count = 0;
             } else {
                 rv = EST_ERR_INVALID_TOKEN;
             }
@@ -717,6 +718,12 @@ static EST_ERROR est_io_parse_auth_tokens (EST_CTX *ctx, char *hdr)
             } else {
                 rv = EST_ERR_INVALID_TOKEN;
             }
+        } else if (!strcasecmp(token, "stale")) {
+            if ((value = HTNextField(&p))) {
+                *stale = !strcasecmp(value, "true");
+            } else {
+                rv = EST_ERR_INVALID_TOKEN;
+            }
         } else if (!strcasecmp(token, "algorithm")) {
             if ((value = HTNextField(&p)) && strcasecmp(value, "md5")) {
                 EST_LOG_ERR("Unsupported digest algorithm: %s", value);
@@ -852,15 +859,17 @@ static int est_io_parse_response_status_code (unsigned char *buf)
  * context.  If there is no WWW-Authenticate header, or the values in the
  * header are invalid, it will set the auth_mode to a failure setting.  If
  * there are multiple Authenticate headers, only the first one will be
- * processed.
+ * processed.  Returns 1 when the server is only asking for the
+ * request to be sent again with a new digest nonce.
  */
-static void est_io_parse_http_auth_request (EST_CTX *ctx,
-                                            HTTP_HEADER *hdrs,
-                                            int hdr_cnt)
+static int est_io_parse_http_auth_request (EST_CTX *ctx,
+                                           HTTP_HEADER *hdrs,
+                                           int hdr_cnt)
 {
     int i;
     EST_ERROR rv;
     int auth_found = 0;
+    int stale = 0;
 
     /*
      * Walk the headers looking for the WWW-Authenticate.  We'll
@@ -875,7 +884,7 @@ static void est_io_parse_http_auth_request (EST_CTX *ctx,
             if (!strncmp(hdrs[i].value, "Basic", 5)) {
                 ctx->auth_mode = AUTH_BASIC;
                 /* Parse the realm */
-                rv = est_io_parse_auth_tokens(ctx, hdrs[i].value);
+                rv = est_io_parse_auth_tokens(ctx, hdrs[i].value, &stale);
                 if (rv != EST_ERR_NONE) {
                     ctx->auth_mode = AUTH_FAIL;
                 }    
@@ -883,7 +892,7 @@ static void est_io_parse_http_auth_request (EST_CTX *ctx,
             if (!strncmp(hdrs[i].value, "Digest", 6)) {
                 ctx->auth_mode = AUTH_DIGEST;
                 /* Parse the realm and nonce */
-                rv = est_io_parse_auth_tokens(ctx, hdrs[i].value);
+                rv = est_io_parse_auth_tokens(ctx, hdrs[i].value, &stale);
                 if (rv != EST_ERR_NONE) {
                     ctx->auth_mode = AUTH_FAIL;
                 }    
@@ -900,7 +909,7 @@ static void est_io_parse_http_auth_request (EST_CTX *ctx,
         EST_LOG_ERR("No WWW-Authenticate header found");
         ctx->auth_mode = AUTH_FAIL;
     }    
-    return;
+    return (stale && ctx->auth_mode == AUTH_DIGEST);
 }
 
 
@@ -1108,6 +1117,13 @@ static int est_ssl_read (SSL *ssl, unsigned char *buf, int buf_max,
     int read_fd;
     int rv;
     
+    /*
+     * Data OpenSSL already decrypted won't show up on the socket
+     */
+    if (SSL_pending(ssl) > 0) {
+        return (SSL_read(ssl, buf, buf_max));
+    }
+
     /*
      * load up the timeval struct to be passed to the select
      */
@@ -1127,86 +1143,195 @@ static int est_ssl_read (SSL *ssl, unsigned char *buf, int buf_max,
     return (SSL_read(ssl, buf, buf_max));    
 }
 
+/*
+ * Works out the length of the HTTP response in buf once its headers
+ * have arrived.  Returns 0 while the headers are incomplete, -1 when
+ * the response has no Content-Length and ends when the server closes
+ * the connection, otherwise the length of the headers and the body.
+ */
+int est_io_response_len (unsigned char *buf, int len)
+{
+    char *p = (char *)buf;
+    char *end = NULL;
+    long cl = -1;
+    int i, status;
+
+    for (i = 3; i < len; i++) {
+        if (buf[i] == '\n' && buf[i - 1] == '\r' &&
+            buf[i - 2] == '\n' && buf[i - 3] == '\r') {
+            end = p + i + 1;
+            break;
+        }
+    }
+    if (!end) {
+        return (0);
+    }
+
+    /*
+     * These never have a body
+     */
+    status = len > 12 ? atoi(p + 9) : 0;
+    if ((status >= 100 && status < 200) || status == 204 || status == 304) {
+        return (end - p);
+    }
+
+    while (p < end) {
+        p = memchr(p, '\n', end - p);
+        if (!p) {
+            break;
+        }
+        p++;
+        if (end - p > 15 && !strncasecmp(p, "Content-Length:", 15)) {
+            cl = strtol(p + 15, NULL, 10);
+            break;
+        }
+    }
+    if (cl < 0 || cl > EST_CA_MAX) {
+        return (-1);
+    }
+    return ((end - (char *)buf) + (int)cl);
+}
 
 /*
  * This function extracts data from the SSL context and puts
- * it into a buffer.
+ * it into a buffer allocated here, which the caller frees.
+ * The buffer starts small and grows as the response arrives,
+ * once the headers give the length of the response it's sized
+ * to fit it exactly.  The data read is always NUL terminated.
+ * Reading stops at the end of the response when its length is
+ * known, complete is then set and the connection can carry
+ * another request.
+ *
+ * When requests are pipelined the last read may run into the next
+ * response.  Those bytes are kept in the context and the next call
+ * starts from them.
  */
-static int est_io_read_raw (SSL *ssl, unsigned char *buf, int buf_max,
-                            int *read_cnt, int sock_read_timeout)
+static int est_io_read_raw (EST_CTX *ctx, SSL *ssl, unsigned char **buf,
+                            int *read_cnt, int *complete)
 {
+    unsigned char *data, *new_data;
+    int buf_size = EST_IO_READ_CHUNK;
+    int new_size;
     int cur_cnt;
+    int resp_len = 0;
     char peek_read_buf;
 
+    *buf = NULL;
     *read_cnt = 0;
-    cur_cnt  = est_ssl_read(ssl, buf, buf_max, sock_read_timeout);
-    if (cur_cnt < 0) {
-        EST_LOG_ERR("TLS read error 1");
-	ossl_dump_ssl_errors();
-        return (EST_ERR_SSL_READ);
+    *complete = 0;
+    if (ctx->rx_extra_len + 1 > buf_size) {
+        buf_size = ctx->rx_extra_len + 1;
+    }
+    data = malloc(buf_size);
+    if (!data) {
+        EST_LOG_ERR("Unable to allocate memory");
+        return (EST_ERR_MALLOC);
+    }
+    data[0] = '\0';
+
+    if (ctx->rx_extra) {
+        memcpy(data, ctx->rx_extra, ctx->rx_extra_len);
+        *read_cnt = ctx->rx_extra_len;
+        data[*read_cnt] = '\0';
+        free(ctx->rx_extra);
+        ctx->rx_extra = NULL;
+        ctx->rx_extra_len = 0;
+        resp_len = est_io_response_len(data, *read_cnt);
     }
-    *read_cnt += cur_cnt;
 
     /*
      * Multiple calls to SSL_read may be required to get the full
      * HTTP payload.
      */
-    while (cur_cnt > 0 && *read_cnt < buf_max) {
-        cur_cnt = est_ssl_read(ssl, (buf + *read_cnt), (buf_max - *read_cnt),
-                               sock_read_timeout);
+    while (resp_len <= 0 || *read_cnt < resp_len) {
+        new_size = buf_size;
+        if (resp_len > 0) {
+            if (resp_len + 1 > buf_size) {
+                new_size = resp_len + 1;
+            }
+        } else if (*read_cnt + 1 == buf_size) {
+            if (buf_size >= EST_CA_MAX) {
+                if (SSL_peek(ssl, &peek_read_buf, 1) > 0) {
+                    EST_LOG_ERR("Buffer too small for received message");
+                    free(data);
+                    return (EST_ERR_READ_BUFFER_TOO_SMALL);
+                }
+                break;
+            }
+            new_size = buf_size * 2;
+            if (new_size > EST_CA_MAX) {
+                new_size = EST_CA_MAX;
+            }
+        }
+        if (new_size != buf_size) {
+            new_data = realloc(data, new_size);
+            if (!new_data) {
+                EST_LOG_ERR("Unable to allocate memory");
+                free(data);
+                return (EST_ERR_MALLOC);
+            }
+            data = new_data;
+            buf_size = new_size;
+        }
+
+        cur_cnt = est_ssl_read(ssl, data + *read_cnt,
+                               buf_size - 1 - *read_cnt, ctx->read_timeout);
         if (cur_cnt < 0) {
             EST_LOG_ERR("TLS read error");
 	    ossl_dump_ssl_errors();
+            free(data);
             return (EST_ERR_SSL_READ);
         }
+        if (cur_cnt == 0) {
+            break;
+        }
         *read_cnt += cur_cnt;
+        data[*read_cnt] = '\0';
+
+        if (!resp_len) {
+            resp_len = est_io_response_len(data, *read_cnt);
+        }
     }
 
-    if ((*read_cnt == buf_max) && SSL_peek(ssl, &peek_read_buf, 1)) {
-        EST_LOG_ERR("Buffer too small for received message");
-        return(EST_ERR_READ_BUFFER_TOO_SMALL);
+    if (resp_len > 0 && *read_cnt >= resp_len) {
+        if (*read_cnt > resp_len) {
+            ctx->rx_extra = malloc(*read_cnt - resp_len);
+            if (!ctx->rx_extra) {
+                EST_LOG_ERR("Unable to allocate memory");
+                free(data);
+                return (EST_ERR_MALLOC);
+            }
+            ctx->rx_extra_len = *read_cnt - resp_len;
+            memcpy(ctx->rx_extra, data + resp_len, ctx->rx_extra_len);
+            *read_cnt = resp_len;
+            data[resp_len] = '\0';
+        }
+        *complete = 1;
     }
-    
+
+    *buf = data;
     return (EST_ERR_NONE);
 }
 
 /*
- * This function provides the primary entry point into
- * this module.  It's used by the EST client to read the
- * HTTP response from the server.  The data is read from
- * the SSL context and HTTP parsing is invoked.
- *
- * If EST_ERR_NONE is returned then the raw_buf buffer must
- * be freed by the caller, otherwise, it is freed here.
+ * Parses an HTTP response read into raw_buf, which is NUL
+ * terminated.  complete says whether the whole response was read.
+ * raw_buf is consumed, on EST_ERR_NONE the payload is moved to its
+ * start and it's passed back in buf, otherwise it's freed here.
  */
-EST_ERROR est_io_get_response (EST_CTX *ctx, SSL *ssl, EST_OPERATION op,
-                               unsigned char **buf, int *payload_len)
+EST_ERROR est_io_parse_response (EST_CTX *ctx, EST_OPERATION op,
+                                 unsigned char *raw_buf, int raw_len,
+                                 int complete, unsigned char **buf,
+                                 int *payload_len)
 {
     int rv = EST_ERR_NONE;
     HTTP_HEADER *hdrs;
     int hdr_cnt;
     int http_status;
-    unsigned char *raw_buf, *payload_buf, *payload;    
-    int raw_len = 0;
-    
+    unsigned char *payload;
+    int i;
 
-    raw_buf = malloc(EST_CA_MAX);
-    if (raw_buf == NULL) {
-        EST_LOG_ERR("Unable to allocate memory");
-        return EST_ERR_MALLOC;
-    }
-    memset(raw_buf, 0, EST_CA_MAX);
     payload = raw_buf;
-    
-    /*
-     * Read the raw data from the SSL connection
-     */
-    rv = est_io_read_raw(ssl, raw_buf, EST_CA_MAX, &raw_len, ctx->read_timeout);
-    if (rv != EST_ERR_NONE) {
-        EST_LOG_INFO("No valid response to process");
-        free(raw_buf);
-        return (rv);
-    }
     if (raw_len <= 0) {
         EST_LOG_WARN("Received empty HTTP response from server");
         free(raw_buf);
@@ -1222,6 +1347,21 @@ EST_ERROR est_io_get_response (EST_CTX *ctx, SSL *ssl, EST_OPERATION op,
     hdrs = parse_http_headers(&payload, &hdr_cnt);
     EST_LOG_INFO("HTTP status %d received", http_status);
 
+    /*
+     * The connection can be used again when the whole response
+     * was read and the server didn't say it's closing.  Servers
+     * commonly drop the connection after a retry-after or an
+     * error status, so only a success response keeps it.
+     */
+    ctx->ka_reusable = complete && hdrs && http_status >= 200 &&
+                       http_status < 300 && http_status != 202;
+    for (i = 0; hdrs && i < hdr_cnt; i++) {
+        if (!strcasecmp(hdrs[i].name, "Connection") &&
+            !strcasecmp(hdrs[i].value, "close")) {
+            ctx->ka_reusable = 0;
+        }
+    }
+
     /*
      * Check the Status header first to see
      * if the server accepted our request.
@@ -1253,7 +1393,17 @@ EST_ERROR est_io_get_response (EST_CTX *ctx, SSL *ssl, EST_OPERATION op,
     case 401:
         /* Server is requesting user auth credentials */
         EST_LOG_INFO("EST server requesting user authentication");
-        /* Check if we've already tried authenticating, if so, then bail */
+        /*
+         * Check if we've already tried authenticating, if so, then bail.
+         * A digest nonce the server no longer accepts doesn't count,
+         * the request is retried with the new nonce.
+         */
+        if (ctx->auth_mode == AUTH_DIGEST &&
+            est_io_parse_http_auth_request(ctx, hdrs, hdr_cnt)) {
+            EST_LOG_INFO("Digest nonce is stale, retrying with a new nonce");
+            rv = EST_ERR_AUTH_FAIL;
+            break;
+        }
         if (ctx->auth_mode == AUTH_DIGEST ||
             ctx->auth_mode == AUTH_BASIC) {
             ctx->auth_mode = AUTH_FAIL;
@@ -1293,19 +1443,20 @@ EST_ERROR est_io_get_response (EST_CTX *ctx, SSL *ssl, EST_OPERATION op,
         } else if (*payload_len == 0) {
             *payload_len = 0;
             *buf = NULL;
+        } else if (raw_len - (int)(payload - raw_buf) < *payload_len) {
+            EST_LOG_ERR("Response is shorter than its Content-Length");
+            rv = EST_ERR_UNKNOWN;
+            *payload_len = 0;
+            *buf = NULL;
         } else {
             /*
-             * Allocate the buffer to hold the payload to be passed back
+             * Pass back the buffer the response was read into, the
+             * payload is moved down over the HTTP headers
              */
-            payload_buf = malloc(*payload_len);   
-            if (!payload_buf) {
-                EST_LOG_ERR("Unable to allocate memory");
-                free(raw_buf);
-                free(hdrs);
-                return EST_ERR_MALLOC;
-            }
-            memcpy(payload_buf, payload, *payload_len);
-            *buf = payload_buf;
+            memmove(raw_buf, payload, *payload_len);
+            raw_buf[*payload_len] = '\0';
+            *buf = raw_buf;
+            raw_buf = NULL;
         }
     }
     
@@ -1317,3 +1468,33 @@ EST_ERROR est_io_get_response (EST_CTX *ctx, SSL *ssl, EST_OPERATION op,
     }
     return (rv);
 }
+
+/*
+ * This function provides the primary entry point into
+ * this module.  It's used by the EST client to read the
+ * HTTP response from the server.  The data is read from
+ * the SSL context and HTTP parsing is invoked.
+ *
+ * If EST_ERR_NONE is returned then the payload buffer passed
+ * back in buf must be freed by the caller, otherwise, it is
+ * freed here.  The payload is NUL terminated.
+ */
+EST_ERROR est_io_get_response (EST_CTX *ctx, SSL *ssl, EST_OPERATION op,
+                               unsigned char **buf, int *payload_len)
+{
+    EST_ERROR rv;
+    unsigned char *raw_buf;
+    int raw_len = 0;
+    int complete;
+
+    /*
+     * Read the raw data from the SSL connection
+     */
+    rv = est_io_read_raw(ctx, ssl, &raw_buf, &raw_len, &complete);
+    if (rv != EST_ERR_NONE) {
+        EST_LOG_INFO("No valid response to process");
+        return (rv);
+    }
+    return (est_io_parse_response(ctx, op, raw_buf, raw_len, complete,
+                                  buf, payload_len));
+}
@@ -17,7 +17,7 @@
  * Version identifiers.  These should be updated appropriately
  * for each release.
  */
-#define EST_API_LEVEL       3  //Update this whenever there's a change to the public API
+#define EST_API_LEVEL       4  //Update this whenever there's a change to the public API
 #define EST_VER_STRING      PACKAGE_STRING
 
 #define EST_URI_MAX_LEN     32
@@ -26,11 +26,38 @@
 #define EST_TLS_UID_LEN     17
 #define EST_RAW_CSR_LEN_MAX 8192
 
+/* Spins before a waiter on an est_spin_lock() yields the CPU */
+#define EST_SPIN_LIMIT      1000
+
+/* Initial size of the buffer an HTTP response is read into */
+#define EST_IO_READ_CHUNK   4096
+
 /* The retry-after values below are in seconds */
 #define EST_RETRY_PERIOD_DEF	3600 
 #define EST_RETRY_PERIOD_MIN	60 
 #define EST_RETRY_PERIOD_MAX	3600*48 
 
+/* Limits for the listener and worker pool in est_server_run() */
+#define EST_WORKER_THREADS_MAX	    256
+#define EST_WORKER_QUEUE_LEN_DEF    32
+#define EST_WORKER_QUEUE_LEN_MAX    4096
+
+/* Number of released server connections kept for reuse */
+#define EST_CONN_POOL_DEF	    32
+#define EST_CONN_POOL_MAX	    65536
+
+/* Limits on the size of an incoming HTTP request body */
+#define EST_MAX_CONTENT_LEN_DEF	    65536
+#define EST_MAX_CONTENT_LEN_MAX	    (1024*1024)
+
+/* TLS session resumption across server processes */
+#define EST_SESS_DER_MAX	    4000
+#define EST_SHM_SESS_ENTRIES_MAX    (1024*1024)
+#define EST_TICKET_KEYS_MAX	    4
+
+/* Seconds before a failed CSR attributes cache refresh is retried */
+#define EST_CSRATTRS_CACHE_RETRY    30
+
 #define EST_TLS_VERIFY_DEPTH	    7
 /*
  * Cipher suite filter for OpenSSL
@@ -149,6 +176,27 @@ typedef struct {
 
 typedef struct mg_context EST_MG_CONTEXT;
 
+/*
+ * A complete HTTP response, header and body, rendered ahead of time.
+ * The data is read-only once built, so a single copy is shared by all
+ * threads.  Each user holds a reference, see est_http_resp_hold().
+ */
+typedef struct est_http_resp {
+    volatile int refcnt;
+    int len;
+    char data[1];
+} EST_HTTP_RESP;
+
+/*
+ * Session ticket key, in the same 48 byte layout used by
+ * other TLS servers so key files can be shared with them.
+ */
+typedef struct {
+    unsigned char name[16];
+    unsigned char hmac_key[16];
+    unsigned char aes_key[16];
+} EST_TICKET_KEY;
+
 /*
  * This context is global for the EST instance, which could
  * be a client, server, or both (proxy).  It stores global
@@ -170,6 +218,7 @@ struct est_ctx {
     X509_STORE      *trusted_certs_store;
     char realm[MAX_REALM+1];
     SSL_CTX         *ssl_ctx;
+    int              shared_ssl_ctx; /* ssl_ctx belongs to another context */
     int              enable_crl;
 
     /*
@@ -183,6 +232,32 @@ struct est_ctx {
 	                          unsigned char **pkcs7, int *cert_len,
 				  char *user_id, X509 *peer_cert,
 				  void *ex_data);
+    int (*est_enroll_csr_cb)(X509_REQ *csr, unsigned char *der, int der_len,
+	                     unsigned char **pkcs7, int *cert_len,
+			     char *user_id, X509 *peer_cert,
+			     void *ex_data);
+    int (*est_reenroll_csr_cb)(X509_REQ *csr, unsigned char *der, int der_len,
+	                       unsigned char **pkcs7, int *cert_len,
+			       char *user_id, X509 *peer_cert,
+			       void *ex_data);
+    int (*est_enroll_x509_cb)(X509_REQ *csr, unsigned char *der, int der_len,
+	                      X509 **cert, char *user_id, X509 *peer_cert,
+			      void *ex_data);
+    int (*est_reenroll_x509_cb)(X509_REQ *csr, unsigned char *der, int der_len,
+	                        X509 **cert, char *user_id, X509 *peer_cert,
+				void *ex_data);
+    unsigned char *enroll_chain; /* See est_server_set_enroll_chain() */
+    int enroll_chain_len;
+    int (*est_enroll_async_cb)(EST_ENROLL_REQ *req, X509_REQ *csr,
+	                       unsigned char *der, int der_len,
+			       char *user_id, X509 *peer_cert,
+			       void *ex_data);
+    int (*est_reenroll_async_cb)(EST_ENROLL_REQ *req, X509_REQ *csr,
+	                         unsigned char *der, int der_len,
+				 char *user_id, X509 *peer_cert,
+				 void *ex_data);
+    void (*est_enroll_wakeup_cb)(EST_SERVER_CONN *conn, void *ex_data);
+    struct est_enroll_batch *enroll_batch; /* See est_set_ca_enroll_batch_cb() */
     unsigned char *(*est_get_csr_cb)(int *csr_len, void *ex_data);
     int (*est_http_auth_cb)(struct est_ctx *ctx, EST_HTTP_AUTH_HDR *ah, 
 	                    X509 *peer_cert, void *ex_data);
@@ -199,7 +274,14 @@ struct est_ctx {
     char password[MAX_UIDPWD+1];
     char s_nonce[MAX_NONCE+1];
     char c_nonce[MAX_NONCE+1];
+    unsigned int nonce_count;   /* Requests sent so far with s_nonce */
     SSL_SESSION *sess;
+    int  keep_alive;            /* See est_client_set_keep_alive() */
+    SSL *ka_ssl;                /* Connection held between operations */
+    int  ka_reusable;           /* The last response left it usable */
+    unsigned char *rx_extra;    /* Read past the end of the last response */
+    int  rx_extra_len;
+    int  batch_window;          /* See est_client_set_batch_window() */
     int  read_timeout;
     int  (*manual_cert_verify_cb)(X509 *cur_cert, int openssl_cert_error);
     const EVP_MD *signing_digest;
@@ -233,17 +315,95 @@ struct est_ctx {
     int enable_srp;
     int (*est_srp_username_cb)(SSL *s, int *ad, void *arg);
     int enforce_csrattrs; /* Used to force the client to provide the CSR attrs in the CSR */
+    int listen_backlog;   /* listen() backlog used by est_server_run() */
+    int listen_family;    /* AF_INET or AF_INET6, used by est_server_run() */
+    int worker_queue_len; /* Per-worker queue of accepted sockets */
+    int conn_pool_size;   /* Max number of idle connections kept for reuse */
+    int max_content_len;  /* Largest request body accepted by the server */
+    /* External TLS session cache, see est_server_set_session_cache_cb() */
+    int (*sess_new_cb)(const unsigned char *id, int id_len,
+                       const unsigned char *der, int der_len,
+                       time_t expires, void *arg);
+    int (*sess_get_cb)(const unsigned char *id, int id_len,
+                       unsigned char *der, int der_max, void *arg);
+    void (*sess_remove_cb)(const unsigned char *id, int id_len, void *arg);
+    void *sess_cb_arg;
+    void *shm_sess_cache;       /* Mapping created by est_server_set_shm_session_cache() */
+    size_t shm_sess_cache_size;
+    struct est_stats_shard *stats;  /* Request counters, see est_stats_new() */
+    EST_TICKET_KEY ticket_keys[EST_TICKET_KEYS_MAX]; /* Newest key first */
+    int num_ticket_keys;
+    volatile int ticket_keys_lock;
+    struct est_oid_set *csrattrs_set;    /* Compiled from server_csrattrs */
+    struct est_oid_set *csrattrs_cb_set; /* Last attributes from est_get_csr_cb */
+    volatile int csrattrs_set_lock;      /* Guards swapping either set */
+    struct est_nonce_table *nonces; /* Digest nonces issued by the server */
+    int nonce_lifetime;             /* See est_server_set_auth_nonce_lifetime() */
+    struct est_pending_table *pending; /* See est_server_enable_pending_table() */
+    struct est_enroll_cache *enroll_cache; /* See est_server_set_enroll_cache() */
+    int csrattrs_cache_ttl;              /* See est_server_set_csrattrs_cache_ttl() */
+    struct est_csrattrs_cache *csrattrs_cache;
+    EST_HTTP_RESP *cacerts_resp;    /* Pre-rendered /cacerts response */
+    volatile int cacerts_resp_lock; /* Guards swapping cacerts_resp */
 };
 
 #define EST_MAX_ATTR_LEN    128 
 /*
- * This is used to build a linked list of the attributes
- * present in the client's CSR.
+ * The OIDs a server requires in each CSR, compiled once from the
+ * configured base64 attributes.  Each entry points at the content
+ * octets of one OID in der, and the entries are sorted so every
+ * OID found in a CSR costs a single binary search.  The set and
+ * its buffers are one allocation, shared by requests in flight
+ * through the reference count.
  */
-typedef struct est_oid_list {
-    char		    oid[EST_MAX_ATTR_LEN];
-    struct est_oid_list    *next;
-} EST_OID_LIST;
+#define EST_OID_SET_MAX 512
+typedef struct est_oid {
+    const unsigned char *data;
+    int                  len;
+} EST_OID;
+
+typedef struct est_oid_set {
+    int            refs;
+    char          *src;      /* Base64 text the set was compiled from */
+    int            src_len;
+    unsigned char *der;      /* Decoded attributes */
+    EST_OID       *oids;
+    int            count;
+} EST_OID_SET;
+
+/*
+ * A client CSR, decoded once when the request arrives.  The
+ * DER and the parsed request are shared by every stage of the
+ * enrollment.
+ */
+typedef struct est_csr {
+    unsigned char *der;
+    int            der_len;
+    X509_REQ      *req;
+    unsigned char  cache_key[SHA256_DIGEST_LENGTH]; /* See est_server_set_enroll_cache() */
+    int            cache_key_set;
+    unsigned char  requester[SHA256_DIGEST_LENGTH]; /* See est_server_enable_pending_table() */
+    int            requester_set;
+} EST_CSR;
+
+/*
+ * What the TLS session says about a client.  The server works
+ * this out on the first request of a connection and reuses it
+ * for the requests that follow, see est_server_conn_auth().
+ * The finished message tls-unique is derived from identifies
+ * the handshake, so a renegotiation is noticed.
+ */
+#define EST_TLS_FINISHED_MAX 64
+typedef struct est_conn_auth {
+    int           valid;
+    char          finished[EST_TLS_FINISHED_MAX];
+    int           finished_len;
+    X509         *peer;          /* Client certificate, or NULL */
+    int           verify_result; /* SSL_get_verify_result() for peer */
+    int           client_is_ra;  /* peer has the id-kp-cmcRA usage */
+    int           tls_uid_valid;
+    char          tls_uid[EST_TLS_UID_LEN];
+} EST_CONN_AUTH;
 
 /*
  * Index used to link the EST Ctx into the SSL structures
@@ -252,64 +412,113 @@ int e_ctx_ssl_exdata_index;
 
 
 void est_log (EST_LOG_LEVEL lvl, char *format, ...);
+void est_log_at (EST_LOG_LEVEL lvl, const char *func, int line,
+                 char *format, ...);
 void est_log_backtrace (void);
+extern EST_LOG_LEVEL est_desired_log_lvl;
 
-#ifndef EST_LOG_INFO
-#define EST_LOG_INFO(...) do { \
-        est_log(EST_LOG_LVL_INFO, "\n***EST [INFO][%s:%d]--> ", \
-                __FUNCTION__, __LINE__); \
-        est_log(EST_LOG_LVL_INFO, __VA_ARGS__); \
+/*
+ * Least urgent level that is compiled into the library.  The
+ * EST_LOG_* macros for less urgent levels reduce to nothing, e.g.
+ * build with -DEST_LOG_MIN_LVL=1 to keep only the error messages.
+ * Levels that are compiled in are still filtered at run time by
+ * est_init_logger() before any arguments are evaluated.
+ */
+#ifndef EST_LOG_MIN_LVL
+#define EST_LOG_MIN_LVL EST_LOG_LVL_INFO
+#endif
+
+#define EST_LOG_HDR_LEN 128
+
+#define EST_LOG_AT(lvl, ...) do { \
+        if ((lvl) <= EST_LOG_MIN_LVL && (lvl) <= est_desired_log_lvl) { \
+            est_log_at((lvl), __FUNCTION__, __LINE__, __VA_ARGS__); \
+        } \
 } while (0)
+
+#ifndef EST_LOG_INFO
+#define EST_LOG_INFO(...) EST_LOG_AT(EST_LOG_LVL_INFO, __VA_ARGS__)
 #endif
 
 #ifndef EST_LOG_WARN
-#define EST_LOG_WARN(...) do { \
-        est_log(EST_LOG_LVL_WARN, "\n***EST [WARNING][%s:%d]--> ", \
-                __FUNCTION__, __LINE__); \
-        est_log(EST_LOG_LVL_WARN, __VA_ARGS__); \
-        est_log_backtrace(); \
-} while (0)
+#define EST_LOG_WARN(...) EST_LOG_AT(EST_LOG_LVL_WARN, __VA_ARGS__)
 #endif
 
 #ifndef EST_LOG_ERR
-#define EST_LOG_ERR(...) do { \
-        est_log(EST_LOG_LVL_ERR, "\n***EST [ERROR][%s:%d]--> ", \
-                __FUNCTION__, __LINE__); \
-        est_log(EST_LOG_LVL_ERR, __VA_ARGS__); \
-        est_log_backtrace(); \
-} while (0)
+#define EST_LOG_ERR(...) EST_LOG_AT(EST_LOG_LVL_ERR, __VA_ARGS__)
 #endif
 
 
 /* From est.c */
 char * est_get_tls_uid(SSL *ssl, int is_client);
+int est_get_tls_finished(SSL *ssl, int is_client, char *finished, int max);
+EST_ERROR est_encode_tls_uid(const char *finished, int len, char *uid);
 EST_ERROR est_load_ca_certs(EST_CTX *ctx, unsigned char *raw, int size);
 
 EST_ERROR est_load_trusted_certs(EST_CTX *ctx, unsigned char *certs, int certs_len);
+void est_update_cacerts_resp(EST_CTX *ctx);
+void est_spin_lock(volatile int *lock);
+void est_spin_unlock(volatile int *lock);
+EST_HTTP_RESP *est_get_cacerts_resp(EST_CTX *ctx);
 void est_log(EST_LOG_LEVEL lvl, char *format, ...);
 void est_log_version(void);
 void est_hex_to_str(char *dst, unsigned char *src, int len);
 void est_base64_encode(const unsigned char *src, int src_len, char *dst);
 int est_base64_decode(const char *src, char *dst, int max_len);
+EST_ERROR est_stats_new(EST_CTX *ctx);
+void est_stats_free(EST_CTX *ctx);
+EST_ERROR est_stats_get(EST_CTX *ctx, EST_STATS *stats);
+uint64_t est_stats_now(void);
+EST_STATS_URI est_stats_uri(const char *uri);
+void est_stats_request(EST_CTX *ctx, EST_STATS_URI uri, uint64_t start);
+void est_stats_stage(EST_CTX *ctx, EST_STATS_STAGE stage, uint64_t start);
+void est_stats_status(EST_CTX *ctx, int status);
+void est_stats_auth(EST_CTX *ctx, EST_AUTH_STATE state);
+void est_stats_tls_failure(EST_CTX *ctx);
+void est_stats_bytes(EST_CTX *ctx, int64_t in, int64_t out);
 
 /* From est_server.c */
 int est_http_request(EST_CTX *ctx, void *http_ctx,
                      char *method, char *uri,
                      char *body, int body_len, const char *ct);
+void est_server_free_enroll_batch(EST_CTX *ctx);
+void est_server_free_csrattrs_sets(EST_CTX *ctx);
+void est_server_free_csrattrs_cache(EST_CTX *ctx);
+void est_server_free_nonces(EST_CTX *ctx);
+void est_server_free_pending(EST_CTX *ctx);
+void est_server_free_enroll_cache(EST_CTX *ctx);
+
+/* From est_server_http.c */
+EST_ERROR est_send_http_200(void *http_ctx, const char *content_type,
+                            const void *body, int body_len);
+EST_HTTP_RESP *est_http_resp_alloc_200(const char *content_type,
+                                       int body_len, char **body);
+EST_HTTP_RESP *est_http_resp_new_200(const char *content_type,
+                                     const void *body, int body_len);
+void est_http_resp_hold(EST_HTTP_RESP *resp);
+void est_http_resp_release(EST_HTTP_RESP *resp);
+EST_ERROR est_send_http_resp(void *http_ctx, EST_HTTP_RESP *resp);
+void est_server_free_session_cache(EST_CTX *ctx);
 
 /* From est_client.c */
 EST_ERROR est_client_init_ssl_ctx(EST_CTX *ctx);
 EST_ERROR est_client_connect(EST_CTX *ctx, SSL **ssl);
 int est_client_send_enroll_request(EST_CTX *ctx, SSL *ssl, BUF_MEM *bptr,
-                                   unsigned char *pkcs7, int *pkcs7_len,
+                                   unsigned char **pkcs7, int *pkcs7_len,
 				   int reenroll);
 void est_client_disconnect(EST_CTX *ctx, SSL **ssl);
+void est_client_drop_conn(EST_CTX *ctx);
 int est_client_set_cert_and_key(SSL_CTX *ctx, X509 *cert, EVP_PKEY *key);
 EST_ERROR est_client_set_uid_pw(EST_CTX *ctx, const char *uid, const char *pwd);
 
 /* From est_client_http.c */
 EST_ERROR est_io_get_response (EST_CTX *ctx, SSL *ssl, EST_OPERATION op,
                          unsigned char **buf, int *payload_len);
+EST_ERROR est_io_parse_response (EST_CTX *ctx, EST_OPERATION op,
+                                 unsigned char *raw_buf, int raw_len,
+                                 int complete, unsigned char **buf,
+                                 int *payload_len);
+int est_io_response_len (unsigned char *buf, int len);
 
 /* From est_proxy.c */
 EST_ERROR est_proxy_http_request(EST_CTX *ctx, void *http_ctx,
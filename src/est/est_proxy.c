@@ -253,35 +253,16 @@ static EST_ERROR est_proxy_propagate_retry (EST_CTX *ctx, void *http_ctx)
  */
 static EST_ERROR est_proxy_propagate_pkcs7 (void *http_ctx, unsigned char *pkcs7, int pkcs7_len)
 {
-    char http_hdr[EST_HTTP_HDR_MAX];
-    int hdrlen;
-
-    /*
-     * Send HTTP header
-     */
-    snprintf(http_hdr, EST_HTTP_HDR_MAX, "%s%s%s%s", EST_HTTP_HDR_200, EST_HTTP_HDR_EOL,
-             EST_HTTP_HDR_STAT_200, EST_HTTP_HDR_EOL);
-    hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-    snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %s%s", EST_HTTP_HDR_CT,
-             EST_HTTP_CT_PKCS7_CO, EST_HTTP_HDR_EOL);
-    hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-    snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %s%s", EST_HTTP_HDR_CE,
-             EST_HTTP_CE_BASE64, EST_HTTP_HDR_EOL);
-    hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-    snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %d%s%s", EST_HTTP_HDR_CL,
-             pkcs7_len, EST_HTTP_HDR_EOL, EST_HTTP_HDR_EOL);
-    if (!mg_write(http_ctx, http_hdr, strnlen(http_hdr, EST_HTTP_HDR_MAX))) {
-            return (EST_ERR_HTTP_WRITE);
-    }
+    EST_ERROR rv;
 
     /*
-     * Send the signed PKCS7 certificate in the body
+     * Send HTTP header and the signed PKCS7 certificate in the body
      */
-    if (!mg_write(http_ctx, pkcs7, pkcs7_len)) {
+    rv = est_send_http_200(http_ctx, EST_HTTP_CT_PKCS7_CO, pkcs7, pkcs7_len);
+    if (rv != EST_ERR_NONE) {
         EST_LOG_ERR("HTTP write error while propagating pkcs7");
-        return (EST_ERR_HTTP_WRITE);
     }
-    return (EST_ERR_NONE);
+    return (rv);
 }
 
 
@@ -366,10 +347,11 @@ EST_ERROR est_proxy_retrieve_cacerts (EST_CTX *ctx, unsigned char **cacerts_rtn,
  * to enroll the CSR in the *pkcs10 buffer. Upon success
  * it will return the X509 cert in the *pkcs7 buffer.  The
  * length of the returned cert will be in *pkcs7_len.  
- * The *pkcs7 buffer should be allocated by the caller.
+ * The *pkcs7 buffer is allocated here and should be freed
+ * by the caller.
  */
 static EST_ERROR est_proxy_send_enroll_request (EST_CTX *clnt_ctx, 
-	                                        BUF_MEM *pkcs10, unsigned char *pkcs7,
+	                                        BUF_MEM *pkcs10, unsigned char **pkcs7,
 						int *pkcs7_len, int reenroll)
 {
     EST_ERROR rv;
@@ -412,10 +394,12 @@ static EST_ERROR est_proxy_handle_simple_enroll (EST_CTX *ctx, void *http_ctx,
 {
     EST_ERROR rv;
     BUF_MEM *pkcs10;
-    unsigned char *pkcs7;
+    unsigned char *pkcs7 = NULL;
     int pkcs7_len = 0;
-    X509_REQ *csr = NULL;
+    EST_CSR *csr = NULL;
     EST_CTX *client_ctx;
+    EST_AUTH_STATE auth;
+    uint64_t start;
     
     /*
      * Make sure the client has sent us a PKCS10 CSR request
@@ -427,7 +411,11 @@ static EST_ERROR est_proxy_handle_simple_enroll (EST_CTX *ctx, void *http_ctx,
     /*
      * Authenticate the client
      */
-    switch (est_enroll_auth(ctx, http_ctx, ssl, reenroll)) {
+    start = est_stats_now();
+    auth = est_enroll_auth(ctx, http_ctx, ssl, reenroll);
+    est_stats_stage(ctx, EST_STATS_STAGE_AUTH, start);
+    est_stats_auth(ctx, auth);
+    switch (auth) {
     case EST_HTTP_AUTH:
     case EST_SRP_AUTH:
     case EST_CERT_AUTH:
@@ -444,7 +432,8 @@ static EST_ERROR est_proxy_handle_simple_enroll (EST_CTX *ctx, void *http_ctx,
     /*
      * Parse the PKCS10 CSR from the client
      */
-    csr = est_server_parse_csr((unsigned char*)body, body_len);
+    start = est_stats_now();
+    csr = est_server_csr_decode((unsigned char*)body, body_len);
     if (!csr) {
 	EST_LOG_ERR("Unable to parse the PKCS10 CSR sent by the client");
 	return (EST_ERR_BAD_PKCS10);
@@ -453,9 +442,9 @@ static EST_ERROR est_proxy_handle_simple_enroll (EST_CTX *ctx, void *http_ctx,
     /*
      * Perform a sanity check on the CSR
      */
-    if (est_server_check_csr(csr)) {
+    if (est_server_check_csr(csr->req)) {
 	EST_LOG_ERR("PKCS10 CSR sent by the client failed sanity check");
-	X509_REQ_free(csr);
+	est_server_csr_free(csr);
 	return (EST_ERR_BAD_PKCS10);
     }
 
@@ -463,12 +452,13 @@ static EST_ERROR est_proxy_handle_simple_enroll (EST_CTX *ctx, void *http_ctx,
      * Do the PoP check (Proof of Possession).  The challenge password
      * in the pkcs10 request should match the TLS unique ID.
      */
-    rv = est_tls_uid_auth(ctx, ssl, csr);
-    X509_REQ_free(csr);
+    rv = est_tls_uid_auth(ctx, http_ctx, ssl, csr->req);
+    est_server_csr_free(csr);
 
     if (rv != EST_ERR_NONE) {
         return (EST_ERR_AUTH_FAIL_TLSUID);
     }
+    est_stats_stage(ctx, EST_STATS_STAGE_CSR, start);
 
     /*
      * body now points to the pkcs10 data, pass
@@ -490,16 +480,11 @@ static EST_ERROR est_proxy_handle_simple_enroll (EST_CTX *ctx, void *http_ctx,
 	return (EST_ERR_NO_CTX);
     }
 
-    /*
-     * Allocate some space to hold the cert that we
-     * expect to receive from the EST server.
-     */
-    pkcs7 = malloc(EST_CA_MAX); 
-
     /*
      * Attempt to enroll the CSR from the client
      */
-    rv = est_proxy_send_enroll_request(client_ctx, pkcs10, pkcs7, &pkcs7_len, reenroll);
+    start = est_stats_now();
+    rv = est_proxy_send_enroll_request(client_ctx, pkcs10, &pkcs7, &pkcs7_len, reenroll);
 
     /*
      * Handle any errors that likely occurred
@@ -510,7 +495,7 @@ static EST_ERROR est_proxy_handle_simple_enroll (EST_CTX *ctx, void *http_ctx,
             /* Try one more time if we're doing Digest auth */
             EST_LOG_INFO("HTTP Auth failed, trying again with digest/basic parameters");
 
-            rv = est_proxy_send_enroll_request(client_ctx, pkcs10, pkcs7, &pkcs7_len, reenroll);
+            rv = est_proxy_send_enroll_request(client_ctx, pkcs10, &pkcs7, &pkcs7_len, reenroll);
 	    if (rv == EST_ERR_CA_ENROLL_RETRY) {
 	        rv = est_proxy_propagate_retry(client_ctx, http_ctx);
 	    } else if (rv != EST_ERR_NONE) {
@@ -526,6 +511,8 @@ static EST_ERROR est_proxy_handle_simple_enroll (EST_CTX *ctx, void *http_ctx,
 	break;
     }
 
+    est_stats_stage(ctx, EST_STATS_STAGE_CA, start);
+
     /*
      * Prevent OpenSSL from freeing our data
      */
@@ -536,7 +523,9 @@ static EST_ERROR est_proxy_handle_simple_enroll (EST_CTX *ctx, void *http_ctx,
      * it back to the EST client
      */
     if (pkcs7_len > 0) {
+        start = est_stats_now();
         rv = est_proxy_propagate_pkcs7(http_ctx, pkcs7, pkcs7_len);
+        est_stats_stage(ctx, EST_STATS_STAGE_RESPONSE, start);
     }
     free(pkcs7);
 
@@ -983,6 +972,8 @@ EST_CTX * est_proxy_init (unsigned char *ca_chain, int ca_chain_len,
     memset(ctx, 0, sizeof(EST_CTX));
     ctx->est_mode = EST_PROXY;
     ctx->retry_period = EST_RETRY_PERIOD_DEF;
+    ctx->conn_pool_size = EST_CONN_POOL_DEF;
+    ctx->max_content_len = EST_MAX_CONTENT_LEN_DEF;
     ctx->server_enable_pop = 1;
     ctx->require_http_auth = HTTP_AUTH_REQUIRED;
 
@@ -1031,12 +1022,18 @@ EST_CTX * est_proxy_init (unsigned char *ca_chain, int ca_chain_len,
     ctx->server_cert = tls_id_cert;
     ctx->server_priv_key = tls_id_key;
     ctx->auth_mode = AUTH_BASIC;
+    ctx->nonce_lifetime = EST_NONCE_LIFETIME_DEF;
     ctx->read_timeout = EST_SSL_READ_TIMEOUT_DEF;
     ctx->retry_after_delay = 0;
     ctx->retry_after_date = 0;
 
     ctx->client_ctx_array = (CLIENT_CTX_LU_NODE_T *) malloc( sizeof(CLIENT_CTX_LU_NODE_T)*cur_max_ctx_array);
     memset(ctx->client_ctx_array, 0, sizeof(CLIENT_CTX_LU_NODE_T)*cur_max_ctx_array);
+
+    if (est_stats_new(ctx) != EST_ERR_NONE) {
+	est_destroy(ctx);
+        return NULL;
+    }
     
     return (ctx);
 }
@@ -1064,6 +1061,34 @@ EST_ERROR est_proxy_set_auth_mode (EST_CTX *ctx, EST_HTTP_AUTH_MODE amode)
 }
 
 
+/*! @brief est_proxy_get_stats() is used by an application to retrieve
+    the request counters kept by the EST proxy.
+
+    @param ctx Pointer to the EST proxy context
+    @param stats Receives a snapshot of the counters
+
+    The counters are the same ones kept by an EST server, see
+    est_server_get_stats().  For a proxy the EST_STATS_STAGE_CA
+    histogram times the requests forwarded to the upstream EST
+    server.
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_proxy_get_stats (EST_CTX *ctx, EST_STATS *stats)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (ctx->est_mode != EST_PROXY) {
+        return (EST_ERR_BAD_MODE);
+    }
+
+    return (est_stats_get(ctx, stats));
+}
+
+
 /*! @brief est_proxy_set_read_timeout() is used by an application to set
     timeout value of read operations.  After the EST proxy sends a request to
     the EST server it will attempt to read the response from the server.  This
@@ -1144,6 +1169,7 @@ EST_ERROR est_proxy_set_server (EST_CTX *ctx, const char *server, int port)
          */
         ctx->ca_certs = rcvd_cacerts;
         ctx->ca_certs_len = rcvd_cacerts_len;    
+        est_update_cacerts_resp(ctx);
     }
     
     return EST_ERR_NONE;
@@ -22,9 +22,23 @@
 #include "est_ossl_util.h"
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
 
 static ASN1_OBJECT *o_cmcRA = NULL;
 
+/*
+ * Content octets of the challengePassword OID, 1.2.840.113549.1.9.7
+ */
+static const unsigned char est_challenge_pwd_oid[] = {
+    0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x09, 0x07
+};
+
+/*
+ * Deepest nesting of ASN.1 structures followed when looking for OIDs
+ */
+#define EST_ASN1_MAX_DEPTH 32
+
 /*
  * This function sends EST specific HTTP error responses.
  */
@@ -92,39 +106,29 @@ EST_ERROR est_server_send_http_retry_after (EST_CTX *ctx, void *http_ctx, int de
  */
 int est_handle_cacerts (EST_CTX *ctx, void *http_ctx)
 {
-    char http_hdr[EST_HTTP_HDR_MAX];
-    int hdrlen;
+    EST_HTTP_RESP *resp;
+    EST_ERROR rv;
 
-    if (ctx->ca_certs  == NULL) {
-        return (EST_ERR_HTTP_NOT_FOUND);
-    }
-        
     /*
-     * Send HTTP header
+     * Normally the entire response was rendered when
+     * the CA certs were loaded.
      */
-    snprintf(http_hdr, EST_HTTP_HDR_MAX, "%s%s%s%s", EST_HTTP_HDR_200, EST_HTTP_HDR_EOL,
-             EST_HTTP_HDR_STAT_200, EST_HTTP_HDR_EOL);
-    hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-    snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %s%s", EST_HTTP_HDR_CT,
-             EST_HTTP_CT_PKCS7, EST_HTTP_HDR_EOL);
-    hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-    snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %s%s", EST_HTTP_HDR_CE,
-             EST_HTTP_CE_BASE64, EST_HTTP_HDR_EOL);
-    hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-    snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %d%s%s", EST_HTTP_HDR_CL,
-             ctx->ca_certs_len, EST_HTTP_HDR_EOL, EST_HTTP_HDR_EOL);
-    if (!mg_write(http_ctx, http_hdr, strnlen(http_hdr, EST_HTTP_HDR_MAX))) {
-        return (EST_ERR_HTTP_WRITE);
+    resp = est_get_cacerts_resp(ctx);
+    if (resp) {
+        rv = est_send_http_resp(http_ctx, resp);
+        est_http_resp_release(resp);
+        return (rv);
     }
 
+    if (ctx->ca_certs  == NULL) {
+        return (EST_ERR_HTTP_NOT_FOUND);
+    }
+        
     /*
-     * Send the CA certs in the body
+     * Send HTTP header and the CA certs in the body
      */
-    if (!mg_write(http_ctx, ctx->ca_certs, ctx->ca_certs_len)) {
-        return (EST_ERR_HTTP_WRITE);
-    }
-    
-    return (EST_ERR_NONE);
+    return (est_send_http_200(http_ctx, EST_HTTP_CT_PKCS7, ctx->ca_certs,
+                              ctx->ca_certs_len));
 }
 
 /*! @brief est_server_generate_auth_digest() is used by an application 
@@ -239,6 +243,215 @@ static void est_destroy_ah(EST_HTTP_AUTH_HDR *ah)
     free(ah);
 }
 
+/*
+ * This function is used to determine if the EST client, which could be
+ * an RA, is using a certificate that contains the id-kp-cmcRA usage
+ * extension.  When this usage bit is present, the PoP check is disabled
+ * to allow the RA use case. 
+ *
+ * This logic was taken from x509v3_cache_extensions() in v3_purp.c (OpenSSL).
+ *
+ * Returns 1 if the cert contains id-kp-cmcRA extended key usage extension.
+ * Otherwise it returns 0.
+ */
+static int est_check_cmcRA (X509 *cert) 
+{
+    int cmcRA_found = 0;
+    EXTENDED_KEY_USAGE *extusage;
+    int i;
+    ASN1_OBJECT *obj;
+
+    /*
+     * Get the extended key usage extension.  If found
+     * loop through the values and look for the ik-kp-cmcRA
+     * value in this extension.
+     */
+    if((extusage = X509_get_ext_d2i(cert, NID_ext_key_usage, NULL, NULL))) {
+	/*
+	 * Iterate through the extended key usage values
+	 */
+        for(i = 0; i < sk_ASN1_OBJECT_num(extusage); i++) {
+	    obj =  sk_ASN1_OBJECT_value(extusage,i);
+	    /*
+	     * Compare the current iteration with the global
+	     * id-kp-cmcRA value that was created earlier
+	     */
+            if (!OBJ_cmp(obj, o_cmcRA)) {
+                cmcRA_found = 1; 
+                break;
+            }
+        }
+        sk_ASN1_OBJECT_pop_free(extusage, ASN1_OBJECT_free);
+    }
+
+    return (cmcRA_found);
+}
+
+void est_server_conn_auth_clear (EST_CONN_AUTH *auth)
+{
+    if (auth->peer) {
+        X509_free(auth->peer);
+    }
+    memset(auth, 0, sizeof(EST_CONN_AUTH));
+}
+
+/*
+ * Returns what the TLS session says about the client on this
+ * connection.  It is only worked out again when the handshake
+ * changed, so the requests that follow the first on a keep-alive
+ * connection just compare the finished message.
+ */
+static EST_CONN_AUTH *est_server_conn_auth (struct mg_connection *conn, SSL *ssl)
+{
+    EST_CONN_AUTH *auth = &conn->auth;
+    char finished[EST_TLS_FINISHED_MAX];
+    int len;
+
+    len = est_get_tls_finished(ssl, 0, finished, EST_TLS_FINISHED_MAX);
+    if (auth->valid && auth->finished_len == len &&
+        !memcmp(auth->finished, finished, len)) {
+        return (auth);
+    }
+
+    est_server_conn_auth_clear(auth);
+    memcpy(auth->finished, finished, len);
+    auth->finished_len = len;
+    auth->peer = SSL_get_peer_certificate(ssl);
+    if (auth->peer) {
+        auth->verify_result = (int) SSL_get_verify_result(ssl);
+        auth->client_is_ra = est_check_cmcRA(auth->peer);
+    }
+    auth->tls_uid_valid =
+        (est_encode_tls_uid(finished, len, auth->tls_uid) == EST_ERR_NONE);
+    auth->valid = 1;
+    return (auth);
+}
+
+/*
+ * Server nonces for HTTP digest authentication.  A nonce starts
+ * with the index of its slot in the table, so it is found without
+ * searching.  Slots are reused in turn, which retires the oldest
+ * nonce once the table is full.  The highest nonce count accepted
+ * is kept so a request can not be replayed.
+ */
+#define EST_NONCE_SLOTS    1024
+#define EST_NONCE_RAND_LEN 12
+#define EST_NONCE_LEN      (8 + 2 * EST_NONCE_RAND_LEN)
+
+typedef struct est_nonce {
+    char          nonce[EST_NONCE_LEN + 1];
+    time_t        expires;
+    unsigned long nc;
+} EST_NONCE;
+
+struct est_nonce_table {
+    volatile int lock;
+    unsigned int next;
+    EST_NONCE    slots[EST_NONCE_SLOTS];
+};
+
+void est_server_free_nonces (EST_CTX *ctx)
+{
+    if (ctx->nonces) {
+        OPENSSL_cleanse(ctx->nonces, sizeof(struct est_nonce_table));
+        free(ctx->nonces);
+        ctx->nonces = NULL;
+    }
+}
+
+/*
+ * Issues a nonce for a digest challenge.  nonce must have room
+ * for MAX_NONCE + 1 bytes.
+ */
+EST_ERROR est_server_new_nonce (EST_CTX *ctx, char *nonce)
+{
+    struct est_nonce_table *table = ctx->nonces;
+    unsigned char rnd[EST_NONCE_RAND_LEN];
+    EST_NONCE *e;
+    unsigned int slot;
+
+    if (!table) {
+        return (EST_ERR_BAD_MODE);
+    }
+    if (!RAND_bytes(rnd, EST_NONCE_RAND_LEN)) {
+        EST_LOG_ERR("RNG failure while generating nonce");
+        return (EST_ERR_UNKNOWN);
+    }
+
+    est_spin_lock(&table->lock);
+    slot = table->next++ % EST_NONCE_SLOTS;
+    snprintf(nonce, 9, "%08x", slot);
+    est_hex_to_str(nonce + 8, rnd, EST_NONCE_RAND_LEN);
+    nonce[EST_NONCE_LEN] = '\0';
+    e = &table->slots[slot];
+    memcpy(e->nonce, nonce, EST_NONCE_LEN + 1);
+    e->expires = time(NULL) + ctx->nonce_lifetime;
+    e->nc = 0;
+    est_spin_unlock(&table->lock);
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Finds the slot of the nonce in a digest header and parses its
+ * nonce count.  Returns 0 when either one is malformed.
+ */
+static int est_server_parse_nonce (EST_HTTP_AUTH_HDR *ah, unsigned long *slot,
+                                   unsigned long *nc)
+{
+    char slot_str[9];
+    char *end;
+
+    if (!ah->nonce || !ah->nc ||
+        strnlen(ah->nonce, MAX_NONCE) != EST_NONCE_LEN) {
+        return (0);
+    }
+    memcpy(slot_str, ah->nonce, 8);
+    slot_str[8] = '\0';
+    *slot = strtoul(slot_str, &end, 16);
+    if (*end || *slot >= EST_NONCE_SLOTS) {
+        return (0);
+    }
+    *nc = strtoul(ah->nc, &end, 16);
+    if (*end || !*nc) {
+        return (0);
+    }
+    return (1);
+}
+
+/*
+ * Returns 1 when the nonce in a digest header was issued by this
+ * server, has not expired, and its nonce count was not used before.
+ * When use is set the nonce count is also consumed, which is only
+ * done once the digest response has been checked.  Otherwise a
+ * forged request carrying a high nonce count could burn the nonce
+ * for the client it was issued to.
+ */
+static int est_server_check_nonce (EST_CTX *ctx, EST_HTTP_AUTH_HDR *ah,
+                                   int use)
+{
+    struct est_nonce_table *table = ctx->nonces;
+    unsigned long slot, nc;
+    EST_NONCE *e;
+    int ok;
+
+    if (!table) {
+        return (1);
+    }
+    if (!est_server_parse_nonce(ah, &slot, &nc)) {
+        return (0);
+    }
+
+    e = &table->slots[slot];
+    est_spin_lock(&table->lock);
+    ok = !memcmp(e->nonce, ah->nonce, EST_NONCE_LEN) &&
+         e->expires > time(NULL) && nc > e->nc;
+    if (ok && use) {
+        e->nc = nc;
+    }
+    est_spin_unlock(&table->lock);
+    return (ok);
+}
+
 /*
  * This function verifies that the peer either provided a certificate
  * that was verifed by the TLS stack, or HTTP authentication
@@ -254,14 +467,17 @@ EST_AUTH_STATE est_enroll_auth (EST_CTX *ctx, void *http_ctx, SSL *ssl,
     struct mg_connection *conn = (struct mg_connection*)http_ctx;
     EST_HTTP_AUTH_HDR *ah;
     EST_HTTP_AUTH_HDR_RESULT pr;
+    EST_CONN_AUTH *cauth;
     int v_result;
 
     /*
-     * Get client certificate from TLS stack.  
+     * Get client certificate from TLS stack.  This is kept
+     * on the connection along with the verify result.
      */
-    if ((peer = SSL_get_peer_certificate(ssl)) != NULL) {
+    cauth = est_server_conn_auth(conn, ssl);
+    if ((peer = cauth->peer) != NULL) {
         // check TLS based client authorization (is client cert authorized)
-        v_result = (int) SSL_get_verify_result(ssl);
+        v_result = cauth->verify_result;
         if (X509_V_OK == v_result) {
             EST_LOG_INFO("TLS: client certificate is valid");
 	    rv = EST_CERT_AUTH;
@@ -274,7 +490,6 @@ EST_AUTH_STATE est_enroll_auth (EST_CTX *ctx, void *http_ctx, SSL *ssl,
 		         v_result);
 	    /* We need to bail since the client is using a bogus cert,
 	     * no need to contiue with HTTP authentication below */
-	    X509_free(peer);
 	    return(EST_UNAUTHORIZED);
         }
     } else {
@@ -308,12 +523,34 @@ EST_AUTH_STATE est_enroll_auth (EST_CTX *ctx, void *http_ctx, SSL *ssl,
         pr = mg_parse_auth_header(conn, ah);
 	switch (pr) {
         case EST_AUTH_HDR_GOOD:
+	    /*
+	     * A digest nonce must be one we issued and still
+	     * remember.  Otherwise the client is challenged again
+	     * and told it only needs a new nonce.
+	     */
+	    if (ah->mode == AUTH_DIGEST && !est_server_check_nonce(ctx, ah, 0)) {
+		EST_LOG_INFO("Stale or unknown digest nonce, sending a new one");
+		mg_send_authorization_request(conn, 1);
+		rv = EST_HTTP_AUTH_PENDING;
+		break;
+	    }
 	    /*
 	     * Invoke the application specific auth check now 
 	     * that we have the user's credentials
 	     */
 	    if (ctx->est_http_auth_cb(ctx, ah, peer, ctx->ex_data)) {
-		rv = EST_HTTP_AUTH;
+		/*
+		 * The nonce count is consumed now that the response
+		 * checked out.  A request that got here with the
+		 * same count first wins, this one is a replay.
+		 */
+		if (ah->mode == AUTH_DIGEST &&
+		    !est_server_check_nonce(ctx, ah, 1)) {
+		    EST_LOG_WARN("Digest nonce count was already used");
+		    rv = EST_UNAUTHORIZED;
+		} else {
+		    rv = EST_HTTP_AUTH;
+		}
 	    } else {
                 EST_LOG_WARN("HTTP authentication failed. Auth type=%d", 
                              ah->mode);
@@ -322,7 +559,7 @@ EST_AUTH_STATE est_enroll_auth (EST_CTX *ctx, void *http_ctx, SSL *ssl,
 	    break;
         case EST_AUTH_HDR_MISSING:
             // ask client to send us authorization headers
-            mg_send_authorization_request(conn);
+            mg_send_authorization_request(conn, 0);
 	    EST_LOG_INFO("HTTP auth headers missing, sending HTTP auth request to client.");
             rv = EST_HTTP_AUTH_PENDING;
 	    break;
@@ -338,66 +575,55 @@ EST_AUTH_STATE est_enroll_auth (EST_CTX *ctx, void *http_ctx, SSL *ssl,
 	}
 	est_destroy_ah(ah);
     } 
-    if (peer) {
-	X509_free(peer);
-    }
     return (rv);
 
 }
 
 /*
- * This function is used to determine if the EST client, which could be
- * an RA, is using a certificate that contains the id-kp-cmcRA usage
- * extension.  When this usage bit is present, the PoP check is disabled
- * to allow the RA use case. 
- *
- * This logic was taken from x509v3_cache_extensions() in v3_purp.c (OpenSSL).
- *
- * Returns 1 if the cert contains id-kp-cmcRA extended key usage extension.
- * Otherwise it returns 0.
+ * Frees a CSR decoded by est_server_csr_decode()
  */
-static int est_check_cmcRA (X509 *cert) 
+void est_server_csr_free (EST_CSR *csr)
 {
-    int cmcRA_found = 0;
-    EXTENDED_KEY_USAGE *extusage;
-    int i;
-    ASN1_OBJECT *obj;
-
-    /*
-     * Get the extended key usage extension.  If found
-     * loop through the values and look for the ik-kp-cmcRA
-     * value in this extension.
-     */
-    if((extusage = X509_get_ext_d2i(cert, NID_ext_key_usage, NULL, NULL))) {
-	/*
-	 * Iterate through the extended key usage values
-	 */
-        for(i = 0; i < sk_ASN1_OBJECT_num(extusage); i++) {
-	    obj =  sk_ASN1_OBJECT_value(extusage,i);
-	    /*
-	     * Compare the current iteration with the global
-	     * id-kp-cmcRA value that was created earlier
-	     */
-            if (!OBJ_cmp(obj, o_cmcRA)) {
-                cmcRA_found = 1; 
-                break;
-            }
-        }
-        sk_ASN1_OBJECT_pop_free(extusage, ASN1_OBJECT_free);
+    if (!csr) {
+	return;
     }
-
-    return (cmcRA_found);
+    if (csr->req) {
+	X509_REQ_free(csr->req);
+    }
+    free(csr->der);
+    free(csr);
 }
 
 /*
- * This is a utility function to convert the base64 DER encoded
- * CSR to an OpenSSL X509_REQ pointer.  Returns NULL if there
- * was a problem.
+ * This is a utility function to decode the base64 DER encoded
+ * CSR sent by the client.  The DER and the parsed X509_REQ are
+ * kept together so later stages of the enrollment don't have to
+ * decode the request again.  Returns NULL if there was a problem.
  */
-X509_REQ * est_server_parse_csr (unsigned char *pkcs10, int pkcs10_len)
+EST_CSR * est_server_csr_decode (unsigned char *pkcs10, int pkcs10_len)
 {
     BIO *in, *b64;
-    X509_REQ *req;
+    EST_CSR *csr;
+    const unsigned char *p;
+    int max, n;
+
+    csr = calloc(1, sizeof(EST_CSR));
+    if (!csr) {
+	EST_LOG_ERR("malloc failed");
+	return (NULL);
+    }
+
+    /*
+     * Base64 shrinks the data by 3/4, whitespace only
+     * makes the decoded result smaller
+     */
+    max = (pkcs10_len / 4) * 3 + 3;
+    csr->der = malloc(max);
+    if (!csr->der) {
+	EST_LOG_ERR("malloc failed");
+	free(csr);
+	return (NULL);
+    }
 
     /*
      * Get the original pkcs10 request from the client
@@ -405,28 +631,38 @@ X509_REQ * est_server_parse_csr (unsigned char *pkcs10, int pkcs10_len)
     b64 = BIO_new(BIO_f_base64());
     if (b64 == NULL) {
 	EST_LOG_ERR("Unable to open PKCS10 b64 buffer");
+	est_server_csr_free(csr);
 	return (NULL);
     }
     in = BIO_new_mem_buf(pkcs10, pkcs10_len);
     if (in == NULL) {
 	EST_LOG_ERR("Unable to open PKCS10 raw buffer");
 	BIO_free(b64);
+	est_server_csr_free(csr);
 	return (NULL);
     }
+    if (!memchr(pkcs10, '\n', pkcs10_len)) {
+	BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
+    }
     in = BIO_push(b64, in);
+    while (csr->der_len < max &&
+	   (n = BIO_read(in, csr->der + csr->der_len, max - csr->der_len)) > 0) {
+	csr->der_len += n;
+    }
+    BIO_free_all(in);
 
     /*
-     * Read the PEM encoded pkcs10 cert request
+     * Read the DER encoded pkcs10 cert request
      */
-    if ((req = d2i_X509_REQ_bio(in, NULL)) == NULL) {
+    p = csr->der;
+    if ((csr->req = d2i_X509_REQ(NULL, &p, csr->der_len)) == NULL) {
         EST_LOG_ERR("Problem reading DER encoded certificate request");
 	ossl_dump_ssl_errors();
-        BIO_free_all(in);
+	est_server_csr_free(csr);
 	return (NULL);
     }
-    BIO_free_all(in);
 
-    return req;
+    return (csr);
 }
 
 /*
@@ -444,14 +680,14 @@ X509_REQ * est_server_parse_csr (unsigned char *pkcs10, int pkcs10_len)
  *
  * Parameters:
  *	ctx:	    Pointer to EST context
+ *	http_ctx:   Connection the request arrived on
  *	ssl:        Pointer to SSL context
- *	pkcs10:	    Pointer to raw PKCS10 data
- *	pkcs10_len: Length of raw PKCS10 data
+ *	req:	    The client's PKCS10 CSR
  *
  * Return value:
  *	EST_ERR_NONE when PoP check passes
  */
-int est_tls_uid_auth (EST_CTX *ctx, SSL *ssl, X509_REQ *req) 
+int est_tls_uid_auth (EST_CTX *ctx, void *http_ctx, SSL *ssl, X509_REQ *req) 
 {
     X509_ATTRIBUTE *attr;
     int i, j;
@@ -460,7 +696,7 @@ int est_tls_uid_auth (EST_CTX *ctx, SSL *ssl, X509_REQ *req)
     ASN1_BIT_STRING *bs = NULL;
     ASN1_TYPE *t;
     int rv = EST_ERR_NONE;
-    char *tls_uid;
+    EST_CONN_AUTH *cauth;
 
     /*
      * Get the index of the challengePassword attribute in the request
@@ -509,16 +745,15 @@ int est_tls_uid_auth (EST_CTX *ctx, SSL *ssl, X509_REQ *req)
          * This implements the PoP check to verify the client holds the private
          * key used to sign the cert request.
          */
-        tls_uid = est_get_tls_uid(ssl, 0);
-        if (tls_uid) {
-	    if (!memcmp(tls_uid, bs->data, EST_TLS_UID_LEN)) {
+        cauth = est_server_conn_auth((struct mg_connection*)http_ctx, ssl);
+        if (cauth->tls_uid_valid) {
+	    if (!memcmp(cauth->tls_uid, bs->data, EST_TLS_UID_LEN)) {
                 EST_LOG_INFO("PoP is valid");
                 rv = EST_ERR_NONE;
             } else {
                 EST_LOG_WARN("PoP is not valid");
                 rv = EST_ERR_AUTH_FAIL_TLSUID;
             }
-            free(tls_uid);
         } else {
             EST_LOG_WARN("Local TLS channel binding info is not available");
             rv = EST_ERR_AUTH_FAIL_TLSUID;
@@ -567,1175 +802,3453 @@ int est_server_check_csr (X509_REQ *req)
 }
 
 
+typedef int (*est_oid_visit_fn)(const unsigned char *oid, int oid_len, void *arg);
+
 /*
- * Frees the linked-list containing the attributes in
- * the client CSR.
+ * Walks a DER blob and hands the content octets of every OBJECT
+ * IDENTIFIER it contains to visit, descending into all constructed
+ * types.  Returns 0 if the encoding is bad or visit gave up.
  */
-static void est_server_free_csr_oid_list (EST_OID_LIST *head)
+static int est_server_walk_oids (const unsigned char *der, long length, int depth,
+                                 est_oid_visit_fn visit, void *arg)
 {
-    EST_OID_LIST *next_entry;
+    const unsigned char *end = der + length;
+    const unsigned char *ptr;
+    long len;
+    int tag, xclass, j;
 
-    if (!head) {
-	return;
+    if (depth > EST_ASN1_MAX_DEPTH) {
+	EST_LOG_ERR("ASN.1 nested too deeply");
+	return (0);
     }
-
-    next_entry = head->next;
-    while (next_entry) {
-	free(head);
-	head = next_entry;
-	next_entry = head->next;
+    while (der < end) {
+	ptr = der;
+	j = ASN1_get_object(&ptr, &len, &tag, &xclass, (long)(end - der));
+	if (j & 0x80) {
+	    EST_LOG_ERR("Error in encoding"); 
+	    return (0);
+	}
+	if (j == 0x21) {
+	    EST_LOG_ERR("Indefinite length encoding is not supported"); 
+	    return (0);
+	}
+	if (j & V_ASN1_CONSTRUCTED) {
+	    if (!est_server_walk_oids(ptr, len, depth + 1, visit, arg)) {
+		return (0);
+	    }
+	} else if (xclass == V_ASN1_UNIVERSAL && tag == V_ASN1_OBJECT) {
+	    if (len <= 0 || !visit(ptr, (int)len, arg)) {
+		return (0);
+	    }
+	}
+	der = ptr + len;
     }
-    free(head);
+    return (1);
 }
 
-/*
- * Adds a new entry to the tail of the list of attributes
- * in the client CSR.
- */
-static void est_server_add_oid_to_list (EST_OID_LIST **list, EST_OID_LIST *new_entry) 
+static int est_oid_cmp (const void *a, const void *b)
 {
-    EST_OID_LIST *head = *list;
+    const EST_OID *x = (const EST_OID *)a;
+    const EST_OID *y = (const EST_OID *)b;
 
-    /*
-     * If the list doesn't have a head yet, the new entry
-     * simply becomes the head
-     */
-    if (head == NULL) { 
-	*list = new_entry;
-    } else {
-	/*
-	 * Walk the list to find the tail, add the new entry to the end
-	 */
-	while (head->next) {
-	    head = head->next;
-	}
-	head->next = new_entry;
+    if (x->len != y->len) {
+	return (x->len - y->len);
     }
+    return (memcmp(x->data, y->data, x->len));
 }
 
 /*
- * This is a recursive routine that walks through an ASN.1 blob
- * looking for ASN.1 object definitions.  For any that are
- * found, the OID for the object is added to the EST_OID_LIST (first argument).
- * The end result of this routine is **list will contain all the OID
- * values for every ASN.1 object in the blob.
- * This code was shamelessly taken from OpenSSL ans1_parse2(), which
- * explains some of the poorly chosen variable names.
+ * Adds each OID in the configured attributes to the set being
+ * compiled.  The challengePassword is left out, it is already
+ * covered when authenticating the client.
  */
-static int est_server_csr_asn1_parse (EST_OID_LIST **list, const unsigned char **blob, long length, int offset)
+static int est_oid_set_add (const unsigned char *oid, int oid_len, void *arg)
 {
-    EST_OID_LIST *new_entry;
-    const unsigned char *ptr, *ep, *tot, *op, *opp;
-    long len;
-    int tag, xclass;
-    int hl, j, r;
-    ASN1_OBJECT *a_object = NULL;
-
-    ptr = *blob;
-    tot = ptr + length;
-    op = ptr - 1;
-    while ((ptr < tot) && (op < ptr)) {
-	op = ptr;
-	j = ASN1_get_object(&ptr, &len, &tag, &xclass, length);
-	if (j & 0x80) {
-	    EST_LOG_ERR("Error in encoding"); 
-	    *blob = ptr;
-	    return (0);
-	}
-	hl = ptr - op;
-	length -= hl;
+    EST_OID_SET *set = (EST_OID_SET *)arg;
 
-	if (j & V_ASN1_CONSTRUCTED) {
-	    ep = ptr + len;
-	    if (len > length) {
-		EST_LOG_ERR("length is greater than %ld",length);
-		*blob = ptr;
-		return (0);
-	    }
-	    if ((j == 0x21) && (len == 0)) {
-		r = est_server_csr_asn1_parse(list, &ptr, (long)(tot-ptr), offset+(ptr - *blob));
-		if (r == 0) { 
-		    *blob = ptr;
-		    return (0);
-		}
-		if ((r == 2) || (ptr >= tot)) break;
-	    } else {
-		while (ptr < ep) {
-		    r = est_server_csr_asn1_parse(list, &ptr, (long)len, offset+(ptr - *blob));
-		    if (r == 0) { 
-			*blob = ptr;
-			return (0);
-		    }
-		}
-	    }
-	} else if (xclass != 0) {
-	    ptr += len;
-	} else {
-	    if (tag == V_ASN1_OBJECT) {
-		opp = op;
-		if (d2i_ASN1_OBJECT(&a_object, &opp, len+hl) != NULL) {
-		    new_entry = malloc(sizeof(EST_OID_LIST));
-		    if (!new_entry) {
-			EST_LOG_ERR("malloc failure");
-			est_server_free_csr_oid_list(*list);
-			if (a_object != NULL) { ASN1_OBJECT_free(a_object); }
-			*blob = ptr;
-			return (0);
-		    }
-		    memset(new_entry, 0x0, sizeof(EST_OID_LIST));
-		    i2t_ASN1_OBJECT(new_entry->oid, EST_MAX_ATTR_LEN, a_object);
-		    EST_LOG_INFO("Build CSR OID list: %s", new_entry->oid);
-		    est_server_add_oid_to_list(list, new_entry);
-		    if (a_object != NULL) {
-			ASN1_OBJECT_free(a_object);
-			a_object = NULL;
-		    }
-		} else {
-		    EST_LOG_ERR("Bad ASN.1 object");
-		    if (a_object != NULL) { ASN1_OBJECT_free(a_object); }
-		    *blob = ptr;
-		    return (0);
-		}
-	    } 
-	    ptr += len;
-	    if ((tag == V_ASN1_EOC) && (xclass == 0)) {
-		*blob = ptr;
-		return (2);
-	    }
-	}
-	length -= len;
+    if (oid_len == sizeof(est_challenge_pwd_oid) &&
+	!memcmp(oid, est_challenge_pwd_oid, oid_len)) {
+	return (1);
     }
-    *blob = ptr;
+    if (set->count == EST_OID_SET_MAX) {
+	EST_LOG_ERR("More than %d CSR attributes", EST_OID_SET_MAX);
+	return (0);
+    }
+    set->oids[set->count].data = oid;
+    set->oids[set->count].len = oid_len;
+    set->count++;
     return (1);
 }
 
 /*
- * Utility function that populates a linked-list containing
- * the OID (or name) of the attributes present in the
- * client CSR.
+ * Compiles base64 encoded CSR attributes into a sorted set of
+ * OIDs.  The returned set holds one reference.
  */
-static EST_ERROR est_server_build_csr_oid_list (EST_OID_LIST **list, char *body, int body_len)
+static EST_OID_SET *est_server_compile_csrattrs (const char *src, int src_len,
+                                                 EST_ERROR *err)
 {
-    unsigned char *der_data, *der_ptr;
-    int der_len;
-    int rv;
+    EST_OID_SET *set;
+    int der_len, max_oids, i, n;
 
-    /*
-     * grab some space to hold the decoded CSR data
+    /* 
+     * Check smallest possible base64 case here for now 
+     * and sanity test will check min/max value for ASN.1 data
      */
-    der_ptr = der_data = malloc(body_len*2);
-    if (!der_data) {
-	EST_LOG_ERR("malloc failed");
-        return (EST_ERR_MALLOC);
+    if (src_len < MIN_CSRATTRS) {
+	*err = EST_ERR_INVALID_PARAMETERS;
+	return (NULL);
     }
 
     /*
-     * Decode the CSR data
+     * The set, its OID table, the decoded DER and a copy of the
+     * base64 text share one allocation.  Each OID takes at least
+     * three bytes of DER, which bounds the size of the table.
      */
-    der_len = est_base64_decode((char *)body, (char *)der_data, body_len*2);
+    max_oids = src_len / 3 + 1;
+    if (max_oids > EST_OID_SET_MAX) {
+	max_oids = EST_OID_SET_MAX;
+    }
+    set = malloc(sizeof(EST_OID_SET) + max_oids * sizeof(EST_OID) + 
+		 2 * (src_len + 1));
+    if (!set) {
+	EST_LOG_ERR("malloc failure");
+	*err = EST_ERR_MALLOC;
+	return (NULL);
+    }
+    set->refs = 1;
+    set->count = 0;
+    set->oids = (EST_OID *)(set + 1);
+    set->der = (unsigned char *)(set->oids + max_oids);
+    set->src = (char *)set->der + src_len + 1;
+    set->src_len = src_len;
+    memcpy(set->src, src, src_len);
+    set->src[src_len] = 0;
+
+    der_len = est_base64_decode(set->src, (char *)set->der, src_len);
     if (der_len <= 0) {
         EST_LOG_ERR("Invalid base64 encoded data");
-	free(der_data);
-        return (EST_ERR_BAD_BASE64);
+	free(set);
+	*err = EST_ERR_BAD_BASE64;
+        return (NULL);
+    }
+    if (der_len > MAX_CSRATTRS || der_len < MIN_ASN1_CSRATTRS) {
+	EST_LOG_ERR("Invalid DER length %d", der_len);
+	free(set);
+	*err = EST_ERR_INVALID_PARAMETERS;
+        return (NULL);
     }
 
-    rv = est_server_csr_asn1_parse(list, (const unsigned char **)&der_data, der_len, 0);
-    if (!rv) {
-	EST_LOG_ERR("Failed to build OID list from client provided CSR");
-	est_server_free_csr_oid_list(*list);
-	free(der_ptr);
-	return (EST_ERR_UNKNOWN);
+    if (!est_server_walk_oids(set->der, der_len, 0, est_oid_set_add, set)) {
+	EST_LOG_ERR("Unable to parse the CSR attributes");
+	free(set);
+	*err = EST_ERR_BAD_ASN1_HEX;
+        return (NULL);
     }
-    free(der_ptr);
-    return (EST_ERR_NONE);
+
+    /*
+     * Sort and drop duplicates, each required OID is counted once
+     */
+    qsort(set->oids, set->count, sizeof(EST_OID), est_oid_cmp);
+    for (i = 0, n = 0; i < set->count; i++) {
+	if (n && !est_oid_cmp(&set->oids[n-1], &set->oids[i])) {
+	    continue;
+	}
+	set->oids[n++] = set->oids[i];
+    }
+    set->count = n;
+    EST_LOG_INFO("Compiled %d required CSR attributes", n);
+    return (set);
 }
 
 /*
- * This function checks the locally configured CSR attributes
- * against the attributes in the CSR.  If any attributes are
- * missing from the CSR, then an error is returned.
+ * Drops a reference to a compiled set.  The sets are swapped under
+ * csrattrs_set_lock, in the same way as the /cacerts response.
  */
-static EST_ERROR est_server_all_csrattrs_present(EST_CTX *ctx, char *body, int body_len) 
+static void est_oid_set_release (EST_CTX *ctx, EST_OID_SET *set)
 {
-    int tag, xclass, j, found_match, nid;
-    long len;
-    unsigned char *der_ptr, *save_ptr;
-    ASN1_OBJECT *a_object;
-    int max_len = MAX_CSRATTRS;
-    char *csr_data;
-    int csr_len;
-    long out_len_save;
-    unsigned char *der_data;
-    int der_len, out_len;
-    int a_len;
-    char tbuf[EST_MAX_ATTR_LEN];
-    EST_OID_LIST *csr_attr_oids = NULL; 
-    EST_OID_LIST *oid_entry;
-    EST_ERROR rv;
-
-    EST_LOG_INFO("CSR attributes enforcement is enabled");
+    int refs;
 
-    if (!ctx->server_csrattrs && !ctx->est_get_csr_cb) {
-	EST_LOG_WARN("CSR attributes enforcement is enabled, but no attributes have been configured");
-	return EST_ERR_NONE;
+    if (!set) {
+	return;
     }
-
-    /*
-     * Build the list of attributes present in the CSR.  This list will be
-     * used later when we confirm the required attributes are present.
-     */
-    rv =  est_server_build_csr_oid_list(&csr_attr_oids, body, body_len);
-    if (rv != EST_ERR_NONE) {
-	return (rv);
+    est_spin_lock(&ctx->csrattrs_set_lock);
+    refs = --set->refs;
+    est_spin_unlock(&ctx->csrattrs_set_lock);
+    if (!refs) {
+	free(set);
     }
+}
 
-    /*
-     * Get the CSR attributes configured on the server.  We'll need to 
-     * look in the CSR to make sure the CSR provided each of these. 
-     * Use the callback if configured, otherwise use the local copy.
-     */
-    if (ctx->est_get_csr_cb) {
-	csr_data = (char *)ctx->est_get_csr_cb(&csr_len, ctx->ex_data);
-	if (!csr_data) {
-	    EST_LOG_ERR("Application layer failed to return CSR attributes");
-	    est_server_free_csr_oid_list(csr_attr_oids);
-	    return (EST_ERR_CB_FAILED);
+/*
+ * Replaces one of the compiled sets on the context.  Requests
+ * in progress keep using the old set until they release it.
+ */
+static void est_oid_set_swap (EST_CTX *ctx, EST_OID_SET **slot, EST_OID_SET *set)
+{
+    EST_OID_SET *old;
+
+    est_spin_lock(&ctx->csrattrs_set_lock);
+    old = *slot;
+    *slot = set;
+    est_spin_unlock(&ctx->csrattrs_set_lock);
+    est_oid_set_release(ctx, old);
+}
+
+void est_server_free_csrattrs_sets (EST_CTX *ctx)
+{
+    est_oid_set_swap(ctx, &ctx->csrattrs_set, NULL);
+    est_oid_set_swap(ctx, &ctx->csrattrs_cb_set, NULL);
+}
+
+/*
+ * Returns the compiled set of attributes every CSR must contain,
+ * holding a reference for the caller.  Attributes from the
+ * application's callback are only compiled again when they
+ * differ from the last ones it returned.
+ */
+static EST_OID_SET *est_server_get_csrattrs_set (EST_CTX *ctx, EST_ERROR *err)
+{
+    EST_OID_SET *set;
+    char *csr_data;
+    int csr_len;
+
+    if (!ctx->est_get_csr_cb) {
+	est_spin_lock(&ctx->csrattrs_set_lock);
+	set = ctx->csrattrs_set;
+	if (set) {
+	    set->refs++;
 	}
-    } else {
-        csr_data = malloc(ctx->server_csrattrs_len + 1);
-	if (!csr_data) {
-	    EST_LOG_ERR("malloc failure");
-	    est_server_free_csr_oid_list(csr_attr_oids);
-            return (EST_ERR_MALLOC);
-        }
-        strncpy(csr_data, (char *)ctx->server_csrattrs, ctx->server_csrattrs_len);
-	csr_data[ctx->server_csrattrs_len] = 0;
-	csr_len = ctx->server_csrattrs_len;
+	est_spin_unlock(&ctx->csrattrs_set_lock);
+	if (!set) {
+	    *err = EST_ERR_INVALID_PARAMETERS;
+	}
+	return (set);
     }
-    EST_LOG_INFO("Checking CSR attrs present in CSR: %s", csr_data);
 
-    /* 
-     * We have the CSR configured on the server and it needs base64 decoding.
-     * Check smallest possible base64 case here for now 
-     * and sanity test will check min/max value for ASN.1 data
-     */
-    if (csr_len < MIN_CSRATTRS) {
-	est_server_free_csr_oid_list(csr_attr_oids);
-	free(csr_data);
-        return (EST_ERR_INVALID_PARAMETERS);
+    csr_data = (char *)ctx->est_get_csr_cb(&csr_len, ctx->ex_data);
+    if (!csr_data) {
+	EST_LOG_ERR("Application layer failed to return CSR attributes");
+	*err = EST_ERR_CB_FAILED;
+	return (NULL);
     }
 
-    /*
-     * grab some space to hold the decoded CSR data
-     */
-    der_data = malloc(csr_len*2);
-    if (!der_data) {
-	EST_LOG_ERR("malloc failed");
-	est_server_free_csr_oid_list(csr_attr_oids);
+    est_spin_lock(&ctx->csrattrs_set_lock);
+    set = ctx->csrattrs_cb_set;
+    if (set && set->src_len == csr_len && !memcmp(set->src, csr_data, csr_len)) {
+	set->refs++;
+    } else {
+	set = NULL;
+    }
+    est_spin_unlock(&ctx->csrattrs_set_lock);
+    if (set) {
 	free(csr_data);
-        return (EST_ERR_MALLOC);
+	return (set);
     }
 
-    /*
-     * Decode the CSR data
-     */
-    der_len = est_base64_decode(csr_data, (char *)der_data, csr_len*2);
+    set = est_server_compile_csrattrs(csr_data, csr_len, err);
     free(csr_data);
-    if (der_len <= 0) {
-        EST_LOG_ERR("Invalid base64 encoded data");
-	est_server_free_csr_oid_list(csr_attr_oids);
-	free(der_data);
-        return (EST_ERR_BAD_BASE64);
+    if (set) {
+	set->refs++;
+	est_oid_set_swap(ctx, &ctx->csrattrs_cb_set, set);
     }
+    return (set);
+}
 
-    /*
-     * pointer fun starts here, joy to OpenSSL
-     */
-    out_len_save = out_len = der_len;
-    der_ptr = save_ptr = der_data;
+/*
+ * Tracks which of the required OIDs a CSR contains
+ */
+typedef struct est_oid_check {
+    EST_OID_SET  *set;
+    int           found;
+    unsigned char seen[EST_OID_SET_MAX / 8];
+} EST_OID_CHECK;
 
-    if (out_len_save > max_len) {
-	EST_LOG_ERR("DER length exceeds max");
-	est_server_free_csr_oid_list(csr_attr_oids);
-	free(der_data);
-        return (EST_ERR_INVALID_PARAMETERS);
+static int est_oid_check_visit (const unsigned char *oid, int oid_len, void *arg)
+{
+    EST_OID_CHECK *check = (EST_OID_CHECK *)arg;
+    EST_OID key, *hit;
+    int i;
+
+    key.data = oid;
+    key.len = oid_len;
+    hit = bsearch(&key, check->set->oids, check->set->count, sizeof(EST_OID),
+	          est_oid_cmp);
+    if (hit) {
+	i = (int)(hit - check->set->oids);
+	if (!(check->seen[i / 8] & (1 << (i % 8)))) {
+	    check->seen[i / 8] |= 1 << (i % 8);
+	    check->found++;
+	}
     }
+    return (1);
+}
 
-    /* make sure its long enough to be ASN.1 */
-    if (der_len < MIN_ASN1_CSRATTRS) {
-	EST_LOG_ERR("DER too short");
-	est_server_free_csr_oid_list(csr_attr_oids);
-	free(der_data);
-        return (EST_ERR_INVALID_PARAMETERS);
+/*
+ * This function checks the locally configured CSR attributes
+ * against the attributes in the CSR.  If any attributes are
+ * missing from the CSR, then an error is returned.
+ */
+static EST_ERROR est_server_all_csrattrs_present (EST_CTX *ctx, EST_CSR *csr) 
+{
+    EST_OID_SET *set;
+    EST_OID_CHECK check;
+    EST_ERROR rv = EST_ERR_NONE;
+    const unsigned char *p;
+    ASN1_OBJECT *a_object;
+    char tbuf[EST_MAX_ATTR_LEN];
+    int i;
+
+    EST_LOG_INFO("CSR attributes enforcement is enabled");
+
+    if (!ctx->server_csrattrs && !ctx->est_get_csr_cb) {
+	EST_LOG_WARN("CSR attributes enforcement is enabled, but no attributes have been configured");
+	return EST_ERR_NONE;
     }
 
-    /*
-     * Iterate through the CSR attributes configured on the server
-     */
-    while (out_len > 0) {
+    set = est_server_get_csrattrs_set(ctx, &rv);
+    if (!set) {
+	return (rv);
+    }
+
+    check.set = set;
+    check.found = 0;
+    memset(check.seen, 0, sizeof(check.seen));
+    if (!est_server_walk_oids(csr->der, csr->der_len, 0, est_oid_check_visit, &check)) {
+	EST_LOG_ERR("Failed to parse the OIDs in the client provided CSR");
+	rv = EST_ERR_UNKNOWN;
+    } else if (check.found < set->count) {
 	/*
-	 * Get the next attributes
+	 * Name the first attribute that is missing
 	 */
-	j = ASN1_get_object((const unsigned char**)&der_ptr, &len, &tag, &xclass, out_len);
-
-	EST_LOG_INFO("Sanity: tag=%d, len=%d, j=%d, out_len=%d", tag, len, j, out_len);
-	if (j & 0x80) {
-	    EST_LOG_ERR("Bad ASN1 hex");
-	    est_server_free_csr_oid_list(csr_attr_oids);
-	    free(der_data);
-	    return (EST_ERR_BAD_ASN1_HEX);
-        }
-	switch (tag) {
-	case V_ASN1_OBJECT:
-            a_object = c2i_ASN1_OBJECT(NULL, (const unsigned char**)&der_ptr, len);
-	    if (!a_object) {
-		EST_LOG_ERR("a_object is null");
-	        est_server_free_csr_oid_list(csr_attr_oids);
-		free(der_data);
-		return (EST_ERR_UNKNOWN);
-	    }
-	    /*
-	     * If this is the challengePassword, no need to check it.
-	     * This is already covered when authenticating the client
-	     */
-	    nid = OBJ_obj2nid(a_object);
-	    if (nid == NID_pkcs9_challengePassword) {
-		ASN1_OBJECT_free(a_object);
+	for (i = 0; i < set->count; i++) {
+	    if (!(check.seen[i / 8] & (1 << (i % 8)))) {
 		break;
 	    }
-
-	    a_len = i2t_ASN1_OBJECT(tbuf, EST_MAX_ATTR_LEN, a_object);
-	    EST_LOG_INFO("Looking for attr=%s in the CSR", tbuf);
+	}
+	p = set->oids[i].data;
+	a_object = c2i_ASN1_OBJECT(NULL, &p, set->oids[i].len);
+	if (a_object) {
+	    i2t_ASN1_OBJECT(tbuf, EST_MAX_ATTR_LEN, a_object);
 	    ASN1_OBJECT_free(a_object);
-
-	    /*
-	     * If there were no attrubutes in the CSR, we can
-	     * bail now.
-	     */
-	    if (csr_attr_oids == NULL) {
-		EST_LOG_WARN("CSR did not contain any attributes, CSR will be rejected", tbuf);
-		free(der_data);
-	        return (EST_ERR_CSR_ATTR_MISSING);
-	    }
-
-	    found_match = 0;
-	    oid_entry = csr_attr_oids;
-	    /*
-	     * Iterate through the attributes that are in the CSR
-	     */
-	    while (oid_entry) { 
-		EST_LOG_INFO("Comparing %s to %s", tbuf, oid_entry->oid);
-		if (!strncmp(oid_entry->oid, tbuf, (a_len < EST_MAX_ATTR_LEN ? a_len : EST_MAX_ATTR_LEN))) {
-		    found_match = 1;
-		    break;
-		}
-		oid_entry = oid_entry->next;
-	    } 
-
-	    if (!found_match) {
-		EST_LOG_WARN("CSR did not contain %s attribute, CSR will be rejected", tbuf);
-	        est_server_free_csr_oid_list(csr_attr_oids);
-		free(der_data);
-	        return (EST_ERR_CSR_ATTR_MISSING);
-	    }
-	    break;
-	default:
-	    /* have to adjust string pointer here, move on to the next item */
-	    der_ptr += len;
-	    break;
-	case V_ASN1_SET:
-	case V_ASN1_SEQUENCE:
-	    break;
+	} else {
+	    strncpy(tbuf, "unknown", EST_MAX_ATTR_LEN);
 	}
-	out_len = out_len_save - (der_ptr - save_ptr);
-    }
-    
-    /*
-     * One file check to ensure we didn't missing something when parsing
-     * the locally configured CSR attributes.
-     */
-    if (out_len != 0) {
-	EST_LOG_ERR("DER length not zero (%d)", out_len);
-	est_server_free_csr_oid_list(csr_attr_oids);
-	free(der_data);
-        return (EST_ERR_BAD_ASN1_HEX);
+	EST_LOG_WARN("CSR did not contain %s attribute, CSR will be rejected", tbuf);
+	rv = EST_ERR_CSR_ATTR_MISSING;
     }
 
-    /*
-     * If we're lucky enough to make it this far, then in means all the
-     * locally configured CSR attributes were found in the client's CSR.
-     */
-    est_server_free_csr_oid_list(csr_attr_oids);
-    free(der_data);
-    return (EST_ERR_NONE);
+    est_oid_set_release(ctx, set);
+    return (rv);
 }
 
 /*
- * This function is used by the server to process and incoming
- * Simple Enroll request from the client.
+ * Enrollments the CA asked the client to retry, see
+ * est_server_enable_pending_table().  Entries are found by the
+ * SHA-256 of the SubjectPublicKeyInfo in the CSR, which stays the
+ * same across polls even when the rest of the CSR changes, e.g.
+ * the challengePassword carrying the PoP.  The first bytes of the
+ * hash select the bucket.  An entry also holds a digest of the
+ * user ID and client certificate of the client that was told to
+ * retry, only that client may collect the CA's answer.
  */
-static EST_ERROR est_handle_simple_enroll (EST_CTX *ctx, void *http_ctx, SSL *ssl,
-                                           const char *ct, char *body, int body_len,
-				     int reenroll)
+typedef enum {
+    EST_PENDING_WAIT,
+    EST_PENDING_APPROVED,
+    EST_PENDING_REJECTED
+} EST_PENDING_STATE;
+
+typedef struct est_pending {
+    unsigned char key[SHA256_DIGEST_LENGTH];
+    unsigned char requester[SHA256_DIGEST_LENGTH];
+    int requester_set;
+    EST_PENDING_STATE state;
+    time_t expires;
+    unsigned char *pkcs7;
+    int pkcs7_len;
+    struct est_pending *next;
+} EST_PENDING;
+
+struct est_pending_table {
+    volatile int lock;
+    int lifetime;
+    int max_entries;
+    int count;
+    unsigned int mask;
+    EST_PENDING **buckets;
+};
+
+static void est_pending_free (EST_PENDING *e)
 {
-    int rv, cert_len;
-    struct mg_connection *conn = (struct mg_connection*)http_ctx;
-    unsigned char *cert;
-    char http_hdr[EST_HTTP_HDR_MAX];
-    int hdrlen;
-    X509 *peer_cert;
-    X509_REQ *csr = NULL;
-    int client_is_ra = 0;
-
-    if (!reenroll && !ctx->est_enroll_pkcs10_cb) {
-	EST_LOG_ERR("Null enrollment callback");
-        return (EST_ERR_NULL_CALLBACK);
+    if (e->pkcs7) {
+        free(e->pkcs7);
     }
+    free(e);
+}
 
-    if (reenroll && !ctx->est_reenroll_pkcs10_cb) {
-	EST_LOG_ERR("Null reenroll callback");
-        return (EST_ERR_NULL_CALLBACK);
-    }
+void est_server_free_pending (EST_CTX *ctx)
+{
+    struct est_pending_table *table = ctx->pending;
+    EST_PENDING *e;
+    unsigned int i;
 
-    /*
-     * Make sure the client has sent us a PKCS10 CSR request
-     */
-    if (strncmp(ct, "application/pkcs10", 18)) {
-        return (EST_ERR_BAD_CONTENT_TYPE);
+    if (!table) {
+        return;
     }
+    for (i = 0; i <= table->mask; i++) {
+        while ((e = table->buckets[i])) {
+            table->buckets[i] = e->next;
+            est_pending_free(e);
+        }
+    }
+    free(table->buckets);
+    free(table);
+    ctx->pending = NULL;
+}
 
+/*
+ * Hashes the DER encoded SubjectPublicKeyInfo of pub_key.
+ * Returns 0 on success.
+ */
+static int est_pending_key (EVP_PKEY *pub_key, unsigned char *key)
+{
+    unsigned char *der = NULL;
+    int der_len;
 
-    /*
-     * Authenticate the client
-     */
-    switch (est_enroll_auth(ctx, http_ctx, ssl, reenroll)) {
-    case EST_HTTP_AUTH:
-    case EST_SRP_AUTH:
-    case EST_CERT_AUTH:
-	/*
-	 * this means the user was authorized, either through
-	 * HTTP authoriztion or certificate authorization
-	 */
-        break;
-    case EST_HTTP_AUTH_PENDING:
-        return (EST_ERR_AUTH_PENDING);
-        break;
-    case EST_UNAUTHORIZED:
-    default:
-        return (EST_ERR_AUTH_FAIL);
-        break;
+    der_len = i2d_PUBKEY(pub_key, &der);
+    if (der_len <= 0) {
+        EST_LOG_ERR("Unable to encode public key");
+        ossl_dump_ssl_errors();
+        return (1);
     }
+    SHA256(der, der_len, key);
+    OPENSSL_free(der);
+    return (0);
+}
 
-    /*
-     * Parse the PKCS10 CSR from the client
-     */
-    csr = est_server_parse_csr((unsigned char*)body, body_len);
-    if (!csr) {
-	EST_LOG_ERR("Unable to parse the PKCS10 CSR sent by the client");
-	return (EST_ERR_BAD_PKCS10);
-    }
-    
-    /*
-     * Perform a sanity check on the CSR
-     */
-    if (est_server_check_csr(csr)) {
-	EST_LOG_ERR("PKCS10 CSR sent by the client failed sanity check");
-	X509_REQ_free(csr);
-	return (EST_ERR_BAD_PKCS10);
+static int est_pending_csr_key (X509_REQ *req, unsigned char *key)
+{
+    EVP_PKEY *pub_key;
+    int rv;
+
+    pub_key = X509_REQ_get_pubkey(req);
+    if (!pub_key) {
+        EST_LOG_ERR("Unable to extract public key from CSR");
+        return (1);
     }
+    rv = est_pending_key(pub_key, key);
+    EVP_PKEY_free(pub_key);
+    return (rv);
+}
 
-    /*
-     * Get the peer certificate if available.  This
-     * identifies the client. The CA may desire
-     * this information.
-     */
-    peer_cert = SSL_get_peer_certificate(ssl);
+/*
+ * Works out the digest identifying the client that sent csr
+ */
+static void est_pending_requester (struct mg_connection *conn,
+                                   X509 *peer_cert, EST_CSR *csr)
+{
+    SHA256_CTX sha;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
 
-    if (peer_cert) {
-	client_is_ra = est_check_cmcRA (peer_cert);
+    if (peer_cert && !X509_digest(peer_cert, EVP_sha256(), md, &md_len)) {
+        EST_LOG_WARN("Unable to hash the client certificate");
+        return;
     }
-    EST_LOG_INFO("id-kp-cmcRA present: %d", client_is_ra);
+    SHA256_Init(&sha);
+    SHA256_Update(&sha, conn->user_id, strnlen(conn->user_id, MG_UID_MAX) + 1);
+    SHA256_Update(&sha, md, md_len);
+    SHA256_Final(csr->requester, &sha);
+    csr->requester_set = 1;
+}
 
-    /*
-     * Do the PoP check (Proof of Possession).  The challenge password
-     * in the pkcs10 request should match the TLS uniqe ID.
-     * The PoP check is not performend when the client is an RA.
-     */
-    if (!client_is_ra) {
-	rv = est_tls_uid_auth(ctx, ssl, csr);
-	if (rv != EST_ERR_NONE) {
-	    X509_REQ_free(csr);
-	    X509_free(peer_cert);
-	    return (EST_ERR_AUTH_FAIL_TLSUID);
-	} 
+/*
+ * Returns the link pointing at the entry for key, or at the NULL
+ * ending its bucket.  The table must be locked.
+ */
+static EST_PENDING **est_pending_find (struct est_pending_table *table,
+                                       const unsigned char *key)
+{
+    EST_PENDING **link;
+    unsigned int b;
+
+    b = ((unsigned int)key[0] << 24 | (unsigned int)key[1] << 16 |
+         (unsigned int)key[2] << 8 | key[3]) & table->mask;
+    for (link = &table->buckets[b]; *link; link = &(*link)->next) {
+        if (!memcmp((*link)->key, key, SHA256_DIGEST_LENGTH)) {
+            break;
+        }
     }
+    return (link);
+}
 
-    /*
-     * Check if we need to ensure the client included all the
-     * CSR attributes required by the CA.
-     */
-    if (ctx->enforce_csrattrs) {
-	if (EST_ERR_NONE != est_server_all_csrattrs_present(ctx, body, body_len)) {
-	    X509_REQ_free(csr);
-	    X509_free(peer_cert);
-	    return (EST_ERR_CSR_ATTR_MISSING);
-	}
+/*
+ * Drops every expired entry onto the list returned, which the
+ * caller frees once the table is unlocked.
+ */
+static EST_PENDING *est_pending_expire (struct est_pending_table *table,
+                                        time_t now)
+{
+    EST_PENDING **link, *e, *expired = NULL;
+    unsigned int i;
+
+    for (i = 0; i <= table->mask; i++) {
+        link = &table->buckets[i];
+        while ((e = *link)) {
+            if (e->expires <= now) {
+                *link = e->next;
+                e->next = expired;
+                expired = e;
+                table->count--;
+            } else {
+                link = &e->next;
+            }
+        }
     }
+    return (expired);
+}
 
-    /* body now points to the pkcs10 data, pass
-     * this to the enrollment routine */
-    if (reenroll) {
-        rv = ctx->est_reenroll_pkcs10_cb((unsigned char*)body, body_len, 
-                                         &cert, (int*)&cert_len,
-                                         conn->user_id, peer_cert, ctx->ex_data);
-    } else {
-        rv = ctx->est_enroll_pkcs10_cb((unsigned char*)body, body_len, 
-                                       &cert, (int*)&cert_len,
-                                       conn->user_id, peer_cert, ctx->ex_data);
+/*
+ * Unlinks the waiting entry closest to expiring, so an answer
+ * from the CA can take its place.  Returns NULL if every entry
+ * holds an answer.
+ */
+static EST_PENDING *est_pending_evict_wait (struct est_pending_table *table)
+{
+    EST_PENDING **link, **victim = NULL;
+    EST_PENDING *e;
+    unsigned int i;
+
+    for (i = 0; i <= table->mask; i++) {
+        for (link = &table->buckets[i]; *link; link = &(*link)->next) {
+            if ((*link)->state == EST_PENDING_WAIT &&
+                (!victim || (*link)->expires < (*victim)->expires)) {
+                victim = link;
+            }
+        }
     }
-
-    /*
-     * Peer cert is no longer needed, delete it if we have one
-     */
-    if (peer_cert) {
-	X509_free(peer_cert);
+    if (!victim) {
+        return (NULL);
     }
+    e = *victim;
+    *victim = e->next;
+    e->next = NULL;
+    table->count--;
+    return (e);
+}
 
-    if (rv == EST_ERR_NONE && cert_len > 0) {
-        /*
-         * Send HTTP header
-         */
-        snprintf(http_hdr, EST_HTTP_HDR_MAX, "%s%s%s%s", EST_HTTP_HDR_200, EST_HTTP_HDR_EOL,
-                 EST_HTTP_HDR_STAT_200, EST_HTTP_HDR_EOL);
-        hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-        snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %s%s", EST_HTTP_HDR_CT,
-                 EST_HTTP_CT_PKCS7_CO, EST_HTTP_HDR_EOL);
-        hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-        snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %s%s", EST_HTTP_HDR_CE,
-                 EST_HTTP_CE_BASE64, EST_HTTP_HDR_EOL);
-        hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-        snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %d%s%s", EST_HTTP_HDR_CL,
-                 cert_len, EST_HTTP_HDR_EOL, EST_HTTP_HDR_EOL);
-        if (!mg_write(http_ctx, http_hdr, strnlen(http_hdr, EST_HTTP_HDR_MAX))) {
-            free(cert);
-	    X509_REQ_free(csr);
-            return (EST_ERR_HTTP_WRITE);
+/*
+ * Records the state of an enrollment.  An entry that already
+ * exists is only changed when replace is set, so a client that
+ * was told to wait does not undo an approval the CA posted in
+ * the meantime.  It is however bound to that client when the
+ * CA answered before anyone was told to wait.  The CA's answers
+ * take the place of waiting entries when the table is full.
+ * Takes ownership of pkcs7.
+ */
+static EST_ERROR est_pending_post (EST_CTX *ctx, const unsigned char *key,
+                                   const unsigned char *requester,
+                                   EST_PENDING_STATE state,
+                                   unsigned char *pkcs7, int pkcs7_len,
+                                   int replace)
+{
+    struct est_pending_table *table = ctx->pending;
+    EST_PENDING **link, *e, *old = NULL, *expired = NULL, *next;
+    EST_ERROR rv = EST_ERR_NONE;
+    time_t now = time(NULL);
+
+    e = calloc(1, sizeof(EST_PENDING));
+    if (!e) {
+        EST_LOG_ERR("malloc failure");
+        if (pkcs7) {
+            free(pkcs7);
         }
-
-        /*
-         * Send the signed PKCS7 certificate in the body
-         */
-        if (!mg_write(http_ctx, cert, cert_len)) {
-            free(cert);
-	    X509_REQ_free(csr);
-            return (EST_ERR_HTTP_WRITE);
-        }
-        free(cert);
-    } else if (rv == EST_ERR_CA_ENROLL_RETRY) {
-        /*
-         * The CA did not sign the request and has asked the
-         * client to retry in the future.  This may occur if
-         * the CA is not configured for automatic enrollment.
-         * Send the HTTP retry response to the client.
-         */
-        EST_LOG_INFO("CA server requests retry, possibly it's not setup for auto-enroll");
-        if (EST_ERR_NONE != est_server_send_http_retry_after(ctx, http_ctx, ctx->retry_period)) { 
-	    X509_REQ_free(csr);
-            return (EST_ERR_HTTP_WRITE);
+        return (EST_ERR_MALLOC);
+    }
+    memcpy(e->key, key, SHA256_DIGEST_LENGTH);
+    if (requester) {
+        memcpy(e->requester, requester, SHA256_DIGEST_LENGTH);
+        e->requester_set = 1;
+    }
+    e->state = state;
+    e->expires = now + table->lifetime;
+    e->pkcs7 = pkcs7;
+    e->pkcs7_len = pkcs7_len;
+
+    est_spin_lock(&table->lock);
+    link = est_pending_find(table, key);
+    if (*link && (*link)->expires > now && !replace) {
+        /* Leave the CA's answer in place */
+        if (!(*link)->requester_set && e->requester_set) {
+            memcpy((*link)->requester, e->requester, SHA256_DIGEST_LENGTH);
+            (*link)->requester_set = 1;
         }
+        old = e;
     } else {
-	X509_REQ_free(csr);
-        return (EST_ERR_CA_ENROLL_FAIL);
+        if (*link) {
+            old = *link;
+            *link = old->next;
+            table->count--;
+            if (!e->requester_set && old->requester_set &&
+                old->expires > now) {
+                memcpy(e->requester, old->requester, SHA256_DIGEST_LENGTH);
+                e->requester_set = 1;
+            }
+        }
+        if (table->count >= table->max_entries) {
+            expired = est_pending_expire(table, now);
+        }
+        if (table->count >= table->max_entries &&
+            state != EST_PENDING_WAIT) {
+            next = est_pending_evict_wait(table);
+            if (next) {
+                next->next = expired;
+                expired = next;
+            }
+        }
+        if (table->count < table->max_entries) {
+            link = est_pending_find(table, key);
+            e->next = *link;
+            *link = e;
+            table->count++;
+        } else {
+            EST_LOG_WARN("Pending enrollment table is full");
+            e->next = expired;
+            expired = e;
+            rv = EST_ERR_PENDING_FULL;
+        }
     }
+    est_spin_unlock(&table->lock);
 
-    X509_REQ_free(csr);
-    return (EST_ERR_NONE);
+    if (old) {
+        est_pending_free(old);
+    }
+    for (; expired; expired = next) {
+        next = expired->next;
+        est_pending_free(expired);
+    }
+    return (rv);
 }
 
 /*
- * This function is used by the server to process and incoming
- * csr attributes request from the client.
+ * Remembers that the CA asked the client to retry csr.  Failing
+ * to do so only means the next poll goes to the CA again.
  */
-static int est_handle_csr_attrs (EST_CTX *ctx, void *http_ctx)
+static void est_pending_wait (EST_CTX *ctx, EST_CSR *csr)
 {
-    int rv = EST_ERR_NONE;
-    int pop_present;
-    char *csr_data, *csr_data_pop;
-    int csr_len, csr_pop_len;
+    unsigned char key[SHA256_DIGEST_LENGTH];
 
-    if (!ctx->server_csrattrs && !ctx->est_get_csr_cb) {
-        if (!ctx->server_enable_pop) {
-  	        EST_LOG_ERR("Null csr callback");
-		/* Send a 204 response indicating the server doesn't have a CSR */
-		est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NO_CONTENT);
-		return (EST_ERR_NONE);
-        } else {
-	  csr_data = malloc(EST_CSRATTRS_POP_LEN + 1);
-	    if (!csr_data) {
-                return (EST_ERR_MALLOC);
-	    }
-	    strncpy(csr_data, EST_CSRATTRS_POP, EST_CSRATTRS_POP_LEN);
-	    csr_data[EST_CSRATTRS_POP_LEN] = 0;
-	    csr_len = EST_CSRATTRS_POP_LEN;
-	    return (est_send_csrattr_data(ctx, csr_data, csr_len, http_ctx));
+    if (!ctx->pending || !csr || !csr->requester_set ||
+        est_pending_csr_key(csr->req, key)) {
+        return;
+    }
+    est_pending_post(ctx, key, csr->requester, EST_PENDING_WAIT, NULL, 0, 0);
+}
+
+/*
+ * Certificates recently issued to a client, see
+ * est_server_set_enroll_cache().  An entry is keyed by the SHA-256
+ * of the CSR DER and the identity the client authenticated with.
+ * Entries are kept on a list ordered by use, the least recently
+ * used one is dropped when the cache is full.
+ */
+typedef struct est_enroll_cache_entry {
+    unsigned char key[SHA256_DIGEST_LENGTH];
+    time_t expires;
+    EST_HTTP_RESP *resp;
+    struct est_enroll_cache_entry *hnext;  /* Bucket chain */
+    struct est_enroll_cache_entry *prev;   /* Use order, newest first */
+    struct est_enroll_cache_entry *next;
+} EST_ENROLL_CACHE_ENTRY;
+
+struct est_enroll_cache {
+    volatile int lock;
+    int window;
+    int max_entries;
+    int count;
+    unsigned int mask;
+    EST_ENROLL_CACHE_ENTRY **buckets;
+    EST_ENROLL_CACHE_ENTRY *head;
+    EST_ENROLL_CACHE_ENTRY *tail;
+};
+
+void est_server_free_enroll_cache (EST_CTX *ctx)
+{
+    struct est_enroll_cache *cache = ctx->enroll_cache;
+    EST_ENROLL_CACHE_ENTRY *e;
+
+    if (!cache) {
+        return;
+    }
+    while ((e = cache->head)) {
+        cache->head = e->next;
+        est_http_resp_release(e->resp);
+        free(e);
+    }
+    free(cache->buckets);
+    free(cache);
+    ctx->enroll_cache = NULL;
+}
+
+static EST_ENROLL_CACHE_ENTRY **est_enroll_cache_find (struct est_enroll_cache *cache,
+                                                        const unsigned char *key)
+{
+    EST_ENROLL_CACHE_ENTRY **link;
+    unsigned int b;
+
+    b = ((unsigned int)key[0] << 24 | (unsigned int)key[1] << 16 |
+         (unsigned int)key[2] << 8 | key[3]) & cache->mask;
+    for (link = &cache->buckets[b]; *link; link = &(*link)->hnext) {
+        if (!memcmp((*link)->key, key, SHA256_DIGEST_LENGTH)) {
+            break;
         }
     }
+    return (link);
+}
 
-    /*
-     * Invoke CA server callback to retrieve the CSR.  Callback takes priority
-     * over saved values in the context.
-     * Note: there is no need to authenticate the client (see sec 4.5)
-     */
-    if (ctx->est_get_csr_cb) {
-	csr_data = (char *)ctx->est_get_csr_cb(&csr_len, ctx->ex_data);
-	rv = est_asn1_parse_attributes(csr_data, csr_len, &pop_present);
-	if (csr_len && (rv != EST_ERR_NONE)) {
-            if (csr_data) {
-                free(csr_data);
+/*
+ * Takes an entry off both lists.  The cache must be locked.
+ */
+static void est_enroll_cache_unlink (struct est_enroll_cache *cache,
+                                     EST_ENROLL_CACHE_ENTRY *e)
+{
+    EST_ENROLL_CACHE_ENTRY **link;
+
+    link = est_enroll_cache_find(cache, e->key);
+    *link = e->hnext;
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        cache->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        cache->tail = e->prev;
+    }
+    cache->count--;
+}
+
+/*
+ * Works out the cache key for an enrollment from the CSR and
+ * whatever identifies the client.  The key is kept with the CSR
+ * so the certificate can be added once the CA has signed it.
+ */
+static void est_enroll_cache_key (struct mg_connection *conn, X509 *peer_cert,
+                                  EST_CSR *csr, int reenroll)
+{
+    SHA256_CTX sha;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    unsigned char type = reenroll ? 'R' : 'E';
+
+    if (peer_cert && !X509_digest(peer_cert, EVP_sha256(), md, &md_len)) {
+        EST_LOG_WARN("Unable to hash the client certificate");
+        return;
+    }
+    SHA256_Init(&sha);
+    SHA256_Update(&sha, &type, 1);
+    SHA256_Update(&sha, conn->user_id, strnlen(conn->user_id, MG_UID_MAX) + 1);
+    SHA256_Update(&sha, md, md_len);
+    SHA256_Update(&sha, csr->der, csr->der_len);
+    SHA256_Final(csr->cache_key, &sha);
+    csr->cache_key_set = 1;
+}
+
+/*
+ * Sends the certificate issued for an identical request, if it is
+ * still cached.  Returns 1 when the request was handled, rc then
+ * holds the result.
+ */
+static int est_enroll_cache_lookup (EST_CTX *ctx, void *http_ctx,
+                                    EST_CSR *csr, int *rc)
+{
+    struct est_enroll_cache *cache = ctx->enroll_cache;
+    EST_ENROLL_CACHE_ENTRY **link, *e, *expired = NULL;
+    EST_HTTP_RESP *resp = NULL;
+
+    est_spin_lock(&cache->lock);
+    link = est_enroll_cache_find(cache, csr->cache_key);
+    if ((e = *link)) {
+        if (e->expires <= time(NULL)) {
+            est_enroll_cache_unlink(cache, e);
+            expired = e;
+        } else {
+            resp = e->resp;
+            est_http_resp_hold(resp);
+            if (e->prev) {
+                /* Move to the front */
+                e->prev->next = e->next;
+                if (e->next) {
+                    e->next->prev = e->prev;
+                } else {
+                    cache->tail = e->prev;
+                }
+                e->prev = NULL;
+                e->next = cache->head;
+                cache->head->prev = e;
+                cache->head = e;
             }
-	    est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NO_CONTENT);
-	    return (EST_ERR_NONE);
-	}
+        }
+    }
+    est_spin_unlock(&cache->lock);
 
-	ctx->csr_pop_present = 0;
-	if (ctx->server_enable_pop) {
-	    rv = est_is_challengePassword_present(csr_data, csr_len, &pop_present);
-	    if (rv != EST_ERR_NONE) {
-		EST_LOG_ERR("Error during PoP/sanity check");
-		if (csr_data) {
-		    free(csr_data);
-		}
-		est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NO_CONTENT);
-		return (EST_ERR_NONE);
-	    }
-	    ctx->csr_pop_present = pop_present;
+    if (expired) {
+        est_http_resp_release(expired->resp);
+        free(expired);
+    }
+    if (!resp) {
+        return (0);
+    }
+    EST_LOG_INFO("Sending the certificate issued earlier for this CSR");
+    *rc = est_send_http_resp(http_ctx, resp);
+    est_http_resp_release(resp);
+    return (1);
+}
 
-	    if (!ctx->csr_pop_present) {
-		if (csr_len == 0) {
-                    csr_data = malloc(EST_CSRATTRS_POP_LEN + 1);
-		    if (!csr_data) {
-			return (EST_ERR_MALLOC);
-		    }
-		    strncpy(csr_data, EST_CSRATTRS_POP, EST_CSRATTRS_POP_LEN);
-		    csr_data[EST_CSRATTRS_POP_LEN] = 0;
-		    csr_len = EST_CSRATTRS_POP_LEN;
-		    return (est_send_csrattr_data(ctx, csr_data, csr_len, http_ctx));
-		}
-		rv = est_add_challengePassword(csr_data, csr_len, &csr_data_pop, &csr_pop_len);
-		if (rv != EST_ERR_NONE) {
-		    if (csr_data) {
-		        free(csr_data);
-		    }
-		    EST_LOG_ERR("Error during add PoP");
-		    est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NO_CONTENT);
-		    return (EST_ERR_NONE);
-		}
-		free(csr_data);
-		csr_data = csr_data_pop;
-		csr_len = csr_pop_len;
-	    }
-	}
+/*
+ * Remembers the response sent for an enrollment.  The caller keeps
+ * its reference to resp.
+ */
+static void est_enroll_cache_add (EST_CTX *ctx, EST_CSR *csr,
+                                  EST_HTTP_RESP *resp)
+{
+    struct est_enroll_cache *cache = ctx->enroll_cache;
+    EST_ENROLL_CACHE_ENTRY **link, *e, *old = NULL;
+
+    e = calloc(1, sizeof(EST_ENROLL_CACHE_ENTRY));
+    if (!e) {
+        EST_LOG_ERR("malloc failure");
+        return;
+    }
+    memcpy(e->key, csr->cache_key, SHA256_DIGEST_LENGTH);
+    e->expires = time(NULL) + cache->window;
+    est_http_resp_hold(resp);
+    e->resp = resp;
+
+    est_spin_lock(&cache->lock);
+    link = est_enroll_cache_find(cache, e->key);
+    if (*link) {
+        old = *link;
+        est_enroll_cache_unlink(cache, old);
+    } else if (cache->count >= cache->max_entries) {
+        old = cache->tail;
+        est_enroll_cache_unlink(cache, old);
+    }
+    link = est_enroll_cache_find(cache, e->key);
+    *link = e;
+    e->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = e;
     } else {
-        csr_data = malloc(ctx->server_csrattrs_len + 1);
-	if (!csr_data) {
-            return (EST_ERR_MALLOC);
-        }
-        strncpy(csr_data, (char *)ctx->server_csrattrs, ctx->server_csrattrs_len);
-	csr_data[ctx->server_csrattrs_len] = 0;
-	csr_len = ctx->server_csrattrs_len;
+        cache->tail = e;
+    }
+    cache->head = e;
+    cache->count++;
+    est_spin_unlock(&cache->lock);
+
+    if (old) {
+        est_http_resp_release(old->resp);
+        free(old);
     }
-    return (est_send_csrattr_data(ctx, csr_data, csr_len, http_ctx));
 }
 
 /*
- * This function should be called by the web server layer when
- * a HTTP request arrives on the listening port of the EST server.
- * It will determine the EST request type and dispatch the request
- * to the appropriate handler.
- *
- * Paramters:
- *      ctx:	    Pointer to EST_CTX
- *      http_ctx:   Context pointer from web server
- *      method:     The HTML method in the request, should be either "GET" or "POST"
- *	uri:	    pointer to HTTP URI
- *	body:	    pointer to full HTML body contents
- *	body_len:   length of HTML body
- *	ct:         HTML content type header
+ * Sends a rendered certificate response, remembering it in the
+ * enrollment cache once it went out.
  */
-int est_http_request (EST_CTX *ctx, void *http_ctx,
-                      char *method, char *uri,
-                      char *body, int body_len, const char *ct)
+static EST_ERROR est_server_enroll_send (EST_CTX *ctx, void *http_ctx,
+                                         EST_CSR *csr, EST_HTTP_RESP *resp)
 {
-    SSL *ssl;
-    int rc;
+    EST_ERROR rv;
 
-    if (!ctx) {
-	EST_LOG_ERR("Null context");
-        return (EST_ERR_NO_CTX);
+    rv = est_send_http_resp(http_ctx, resp);
+    if (rv == EST_ERR_NONE && csr && csr->cache_key_set) {
+        est_enroll_cache_add(ctx, csr, resp);
+    }
+    return (rv);
+}
+
+/*
+ * The fixed parts of a certs-only PKCS7, RFC 5652 section 5.1 with
+ * the SignedData left degenerate: the contentType of the ContentInfo
+ * and the SignedData fields ahead of the certificates.
+ */
+static const unsigned char est_p7_signed_oid[] = {
+    0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x02
+};
+static const unsigned char est_p7_signed_head[] = {
+    0x02, 0x01, 0x01,                   /* version 1 */
+    0x31, 0x00,                         /* no digestAlgorithms */
+    0x30, 0x0B, 0x06, 0x09, 0x2A, 0x86, /* encapContentInfo: data */
+    0x48, 0x86, 0xF7, 0x0D, 0x01, 0x07, 0x01
+};
+static const unsigned char est_p7_signed_tail[] = {
+    0x31, 0x00                          /* no signerInfos */
+};
+
+/*
+ * Size of a DER tag and length header for len bytes of content
+ */
+static int est_der_hdr_len (int len)
+{
+    if (len < 0x80) {
+        return (2);
+    } else if (len < 0x100) {
+        return (3);
+    } else if (len < 0x10000) {
+        return (4);
+    } else if (len < 0x1000000) {
+        return (5);
     }
+    return (6);
+}
+
+static unsigned char *est_der_put_hdr (unsigned char *p, unsigned char tag,
+                                       int len)
+{
+    int n;
+
+    *p++ = tag;
+    if (len < 0x80) {
+        *p++ = (unsigned char)len;
+        return (p);
+    }
+    n = est_der_hdr_len(len) - 2;
+    *p++ = 0x80 | n;
+    while (n--) {
+        *p++ = (unsigned char)(len >> (8 * n));
+    }
+    return (p);
+}
+
+/*
+ * Renders the response for a certificate issued through
+ * est_enroll_x509_cb.  The certs-only PKCS7 is assembled here,
+ * followed by the chain encoded by est_server_set_enroll_chain(),
+ * and base64 encoded straight into the response.  The lines are
+ * broken the way the OpenSSL base64 BIO does, so the response is
+ * the same as when the CA encodes the PKCS7 itself.
+ */
+static EST_HTTP_RESP *est_server_x509_resp (EST_CTX *ctx, X509 *cert)
+{
+    EST_HTTP_RESP *resp;
+    unsigned char *der, *p;
+    char *body;
+    int cert_len, certs_len, sd_len, exp_len, ci_len;
+    size_t der_len, body_len, i, n;
 
     /*
-     * Verify the context is for a server, not a client
+     * Both the certificate and the chain are limited to
+     * EST_CA_MAX, so none of the sums below can overflow
      */
-    if (ctx->est_mode != EST_SERVER) {
-        return (EST_ERR_BAD_MODE);
+    cert_len = i2d_X509(cert, NULL);
+    if (cert_len <= 0 || cert_len > EST_CA_MAX) {
+        EST_LOG_ERR("Unable to encode the certificate");
+        ossl_dump_ssl_errors();
+        return (NULL);
+    }
+    if (ctx->enroll_chain_len < 0 || ctx->enroll_chain_len > EST_CA_MAX) {
+        EST_LOG_ERR("Invalid enrollment chain length (%d)",
+                    ctx->enroll_chain_len);
+        return (NULL);
+    }
+    certs_len = cert_len + ctx->enroll_chain_len;
+    sd_len = sizeof(est_p7_signed_head) + est_der_hdr_len(certs_len) +
+             certs_len + sizeof(est_p7_signed_tail);
+    exp_len = est_der_hdr_len(sd_len) + sd_len;
+    ci_len = sizeof(est_p7_signed_oid) + est_der_hdr_len(exp_len) + exp_len;
+    der_len = (size_t)est_der_hdr_len(ci_len) + (size_t)ci_len;
+
+    der = malloc(der_len);
+    if (!der) {
+        EST_LOG_ERR("malloc failure");
+        return (NULL);
+    }
+    p = est_der_put_hdr(der, 0x30, ci_len);
+    memcpy(p, est_p7_signed_oid, sizeof(est_p7_signed_oid));
+    p += sizeof(est_p7_signed_oid);
+    p = est_der_put_hdr(p, 0xA0, exp_len);
+    p = est_der_put_hdr(p, 0x30, sd_len);
+    memcpy(p, est_p7_signed_head, sizeof(est_p7_signed_head));
+    p += sizeof(est_p7_signed_head);
+    p = est_der_put_hdr(p, 0xA0, certs_len);
+    i2d_X509(cert, &p);
+    if (ctx->enroll_chain_len) {
+        memcpy(p, ctx->enroll_chain, ctx->enroll_chain_len);
+        p += ctx->enroll_chain_len;
     }
+    memcpy(p, est_p7_signed_tail, sizeof(est_p7_signed_tail));
 
     /*
-     * See if this is a cacerts request
+     * 64 characters per line, each ending with a newline
      */
-    if (strncmp(uri, EST_CACERTS_URI, EST_URI_MAX_LEN) == 0) {
-        /* Only GET is allowed */
-        if (strncmp(method, "GET", 3)) {
-            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
-            return (EST_ERR_WRONG_METHOD);
-        }
-
-        rc = est_handle_cacerts(ctx, http_ctx);
-        if (rc != EST_ERR_NONE) {
-            est_send_http_error(ctx, http_ctx, rc);
-            return (rc);
+    body_len = 4 * ((der_len + 2) / 3) + (der_len + 47) / 48;
+    resp = est_http_resp_alloc_200(EST_HTTP_CT_PKCS7_CO, (int)body_len, &body);
+    if (resp) {
+        for (i = 0; i < der_len; i += 48) {
+            n = der_len - i < 48 ? der_len - i : 48;
+            est_base64_encode(der + i, (int)n, body);
+            body += 4 * ((n + 2) / 3);
+            *body++ = '\n';
         }
     }
+    free(der);
+    return (resp);
+}
 
-    /*
-     * See if this is a simple enrollment request
-     */
-    else if (strncmp(uri, EST_SIMPLE_ENROLL_URI, EST_URI_MAX_LEN) == 0) {
-        /* Only POST is allowed */
-        if (strncmp(method, "POST", 4)) {
-            EST_LOG_WARN("Incoming HTTP request used wrong method\n");
-            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
-            return (EST_ERR_WRONG_METHOD);
+/*
+ * Sends the outcome of an enrollment back to the client.  This is
+ * shared by the synchronous CA handlers and the asynchronous ones,
+ * which may finish long after the request arrived.  A failure is
+ * returned to the caller, which is expected to send the error
+ * response.  The certificate remains owned by the caller.  A retry
+ * for csr is remembered when the pending table is enabled, and the
+ * certificate when the enrollment cache is.
+ */
+static EST_ERROR est_server_enroll_respond (EST_CTX *ctx, void *http_ctx,
+                                            EST_CSR *csr, int rv,
+                                            unsigned char *cert, int cert_len)
+{
+    uint64_t start;
+    EST_HTTP_RESP *resp;
+
+    start = est_stats_now();
+    if (rv == EST_ERR_NONE && cert_len > 0 && csr && csr->cache_key_set) {
+        /*
+         * Render the response once, it is sent again if the
+         * client repeats the request
+         */
+        resp = est_http_resp_new_200(EST_HTTP_CT_PKCS7_CO, cert, cert_len);
+        if (!resp) {
+            return (EST_ERR_MALLOC);
         }
-	if (!ct) {
-            EST_LOG_WARN("Incoming HTTP header has no Content-Type header\n");
-            est_send_http_error(ctx, http_ctx, EST_ERR_BAD_PKCS10);
-	    return (EST_ERR_BAD_CONTENT_TYPE); 
-	}
+        rv = est_server_enroll_send(ctx, http_ctx, csr, resp);
+        est_http_resp_release(resp);
+        if (rv != EST_ERR_NONE) {
+            return (rv);
+        }
+    } else if (rv == EST_ERR_NONE && cert_len > 0) {
         /*
-         * Get the SSL context, which is required for authenticating
-         * the client.
+         * Send HTTP header and the signed PKCS7 certificate in the body
          */
-        ssl = (SSL*)mg_get_conn_ssl(http_ctx);
-        if (!ssl) {
-            est_send_http_error(ctx, http_ctx, EST_ERR_NO_SSL_CTX);
-            return (EST_ERR_NO_SSL_CTX);
+        rv = est_send_http_200(http_ctx, EST_HTTP_CT_PKCS7_CO, cert, cert_len);
+        if (rv != EST_ERR_NONE) {
+            return (rv);
+        }
+    } else if (rv == EST_ERR_CA_ENROLL_RETRY) {
+        /*
+         * The CA did not sign the request and has asked the
+         * client to retry in the future.  This may occur if
+         * the CA is not configured for automatic enrollment.
+         * Send the HTTP retry response to the client.
+         */
+        EST_LOG_INFO("CA server requests retry, possibly it's not setup for auto-enroll");
+        est_pending_wait(ctx, csr);
+        if (EST_ERR_NONE != est_server_send_http_retry_after(ctx, http_ctx, ctx->retry_period)) { 
+            return (EST_ERR_HTTP_WRITE);
         }
+    } else {
+        return (EST_ERR_CA_ENROLL_FAIL);
+    }
+    est_stats_stage(ctx, EST_STATS_STAGE_RESPONSE, start);
+    return (EST_ERR_NONE);
+}
 
-        rc = est_handle_simple_enroll(ctx, http_ctx, ssl, ct, body, body_len, 0);
-        if (rc != EST_ERR_NONE && rc != EST_ERR_AUTH_PENDING) {
-            EST_LOG_WARN("Enrollment failed with rc=%d (%s)\n", 
-		         rc, EST_ERR_NUM_TO_STR(rc));
-	    if (rc == EST_ERR_AUTH_FAIL) {
-		est_send_http_error(ctx, http_ctx, EST_ERR_AUTH_FAIL);
-	    } else {
-		est_send_http_error(ctx, http_ctx, EST_ERR_BAD_PKCS10);
-	    }
-            return rc;
+/*
+ * Answers a poll for an enrollment the CA asked to be retried,
+ * without going back to the CA.  The client has been authenticated
+ * and the CSR signature and PoP have been checked.  Only the client
+ * that was told to retry is answered, anyone else's request goes
+ * to the CA as usual.  Returns 1 when the request was handled, rc
+ * then holds the result.
+ */
+static int est_pending_poll (EST_CTX *ctx, void *http_ctx, EST_CSR *csr,
+                             int *rc)
+{
+    struct est_pending_table *table = ctx->pending;
+    unsigned char key[SHA256_DIGEST_LENGTH];
+    EST_PENDING **link, *e = NULL;
+    EST_PENDING_STATE state = EST_PENDING_WAIT;
+    int found = 0;
+    time_t now;
+
+    if (!csr->requester_set || est_pending_csr_key(csr->req, key)) {
+        return (0);
+    }
+
+    now = time(NULL);
+    est_spin_lock(&table->lock);
+    link = est_pending_find(table, key);
+    if (*link && (*link)->expires > now &&
+        (!(*link)->requester_set ||
+         memcmp((*link)->requester, csr->requester, SHA256_DIGEST_LENGTH))) {
+        /* Not this client's enrollment */
+    } else if (*link && ((*link)->expires <= now ||
+                         (*link)->state != EST_PENDING_WAIT)) {
+        /*
+         * The CA's answer is delivered once.  If the client never
+         * receives it the next poll goes to the CA again.
+         */
+        e = *link;
+        *link = e->next;
+        table->count--;
+        found = e->expires > now;
+        state = e->state;
+    } else if (*link) {
+        found = 1;
+    }
+    est_spin_unlock(&table->lock);
+
+    if (!found) {
+        if (e) {
+            est_pending_free(e);
         }
+        return (0);
     }
 
+    switch (state) {
+    case EST_PENDING_APPROVED:
+        EST_LOG_INFO("Sending certificate approved by the CA");
+        *rc = est_server_enroll_respond(ctx, http_ctx, csr, EST_ERR_NONE,
+                                        e->pkcs7, e->pkcs7_len);
+        break;
+    case EST_PENDING_REJECTED:
+        EST_LOG_INFO("Enrollment was rejected by the CA");
+        *rc = EST_ERR_CA_ENROLL_FAIL;
+        break;
+    case EST_PENDING_WAIT:
+    default:
+        *rc = est_server_enroll_respond(ctx, http_ctx, NULL,
+                                        EST_ERR_CA_ENROLL_RETRY, NULL, 0);
+        break;
+    }
+    if (e) {
+        est_pending_free(e);
+    }
+    return (1);
+}
+
+#ifndef DISABLE_PTHREADS
+/*
+ * An enrollment handed to one of the asynchronous CA handlers.
+ * The application holds one reference until it completes or fails
+ * the request, libest holds the other until the response has been
+ * sent or the client connection has gone away.  The CSR belongs
+ * to the request so the CA can use it until it is done.
+ */
+struct est_enroll_req {
+    EST_CTX *ctx;
+    struct mg_connection *conn;  /* Parked connection, NULL when blocking */
+    EST_CSR *csr;
+    uint64_t start;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    int refs;
+    int done;
+    EST_ERROR rv;
+    unsigned char *pkcs7;
+    int pkcs7_len;
+    /* Only used while queued for the batch dispatcher */
+    struct est_enroll_req *next;
+    char *user_id;
+    X509 *peer_cert;
+    int reenroll;
+    struct timespec queued;
+};
+
+/*
+ * Requests waiting for the batch handler.  The dispatcher thread
+ * hands them over once max_batch are queued or the oldest one has
+ * waited max_wait_ms.
+ */
+struct est_enroll_batch {
+    int (*cb)(EST_ENROLL_ITEM *items, int count, void *ex_data);
+    int max_batch;
+    int max_wait_ms;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int running;
+    int stop;
+    EST_ENROLL_REQ *head;
+    EST_ENROLL_REQ *tail;
+    int count;
+    EST_ENROLL_REQ **reqs;   /* Dispatcher's scratch space */
+    EST_ENROLL_ITEM *items;
+};
+
+static void est_enroll_req_release (EST_ENROLL_REQ *req)
+{
+    int refs;
+
+    pthread_mutex_lock(&req->lock);
+    refs = --req->refs;
+    pthread_mutex_unlock(&req->lock);
+    if (refs) {
+        return;
+    }
+    pthread_cond_destroy(&req->done_cond);
+    pthread_mutex_destroy(&req->lock);
+    if (req->pkcs7) {
+        free(req->pkcs7);
+    }
+    if (req->user_id) {
+        free(req->user_id);
+    }
+    if (req->peer_cert) {
+        X509_free(req->peer_cert);
+    }
+    est_server_csr_free(req->csr);
+    free(req);
+}
+
+/*
+ * Records the CA's answer and lets the connection know about it.
+ * This runs on whichever thread the application finishes the
+ * request from.
+ */
+static EST_ERROR est_enroll_req_finish (EST_ENROLL_REQ *req, EST_ERROR rv,
+                                        unsigned char *pkcs7, int pkcs7_len)
+{
+    EST_CTX *ctx;
+
+    if (!req) {
+        EST_LOG_ERR("Null enrollment request");
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    ctx = req->ctx;
+
+    pthread_mutex_lock(&req->lock);
+    if (req->done) {
+        pthread_mutex_unlock(&req->lock);
+        EST_LOG_ERR("Enrollment request was already finished");
+        return (EST_ERR_BAD_MODE);
+    }
+    req->done = 1;
+    req->rv = rv;
+    req->pkcs7 = pkcs7;
+    req->pkcs7_len = pkcs7_len;
+    pthread_cond_signal(&req->done_cond);
     /*
-     * See if this is a re-enrollment request
+     * The lock keeps the connection from being released while
+     * the application is told it can be resumed.
      */
-    else if (strncmp(uri, EST_RE_ENROLL_URI, EST_URI_MAX_LEN) == 0) {
-        /* Only POST is allowed */
-        if (strncmp(method, "POST", 4)) {
-            EST_LOG_WARN("Incoming HTTP request used wrong method\n");
-            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
-            return (EST_ERR_WRONG_METHOD);
+    if (req->conn && ctx->est_enroll_wakeup_cb) {
+        ctx->est_enroll_wakeup_cb(req->conn, ctx->ex_data);
+    }
+    pthread_mutex_unlock(&req->lock);
+
+    est_enroll_req_release(req);
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Hands one batch to the application and routes each result back
+ * to the request it belongs to.
+ */
+static void est_enroll_batch_dispatch (EST_CTX *ctx, struct est_enroll_batch *batch,
+                                       int count)
+{
+    EST_ENROLL_ITEM *item;
+    EST_ENROLL_REQ *req;
+    int i, rv;
+
+    for (i = 0; i < count; i++) {
+        req = batch->reqs[i];
+        item = &batch->items[i];
+        item->csr = req->csr->req;
+        item->der = req->csr->der;
+        item->der_len = req->csr->der_len;
+        item->user_id = req->user_id;
+        item->peer_cert = req->peer_cert;
+        item->reenroll = req->reenroll;
+        item->pkcs7 = NULL;
+        item->pkcs7_len = 0;
+        item->rv = EST_ERR_CA_ENROLL_FAIL;
+    }
+
+    EST_LOG_INFO("Dispatching %d enrollment requests to the CA", count);
+    rv = batch->cb(batch->items, count, ctx->ex_data);
+    if (rv != EST_ERR_NONE) {
+        EST_LOG_WARN("Batch enrollment handler failed rv=%d (%s)", 
+                     rv, EST_ERR_NUM_TO_STR(rv));
+    }
+
+    for (i = 0; i < count; i++) {
+        item = &batch->items[i];
+        if (rv == EST_ERR_NONE && item->rv == EST_ERR_NONE) {
+            est_server_enroll_complete(batch->reqs[i], item->pkcs7, item->pkcs7_len);
+            continue;
         }
-	if (!ct) {
-            EST_LOG_WARN("Incoming HTTP header has no Content-Type header\n");
-            est_send_http_error(ctx, http_ctx, EST_ERR_BAD_PKCS10);
-	    return (EST_ERR_BAD_CONTENT_TYPE); 
-	}
+        if (item->pkcs7) {
+            free(item->pkcs7);
+        }
+        est_server_enroll_fail(batch->reqs[i], 
+                               rv == EST_ERR_NONE ? item->rv : EST_ERR_CA_ENROLL_FAIL);
+    }
+}
+
+static void *est_enroll_batch_main (void *arg)
+{
+    EST_CTX *ctx = (EST_CTX *)arg;
+    struct est_enroll_batch *batch = ctx->enroll_batch;
+    struct timespec deadline;
+    int n;
+
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        while (!batch->count && !batch->stop) {
+            pthread_cond_wait(&batch->cond, &batch->lock);
+        }
+        if (!batch->count) {
+            break;
+        }
+
         /*
-         * Get the SSL context, which is required for authenticating
-         * the client.
+         * Give the batch until the oldest request queued has
+         * waited max_wait_ms to fill up.  Requests left over
+         * from a full batch keep the time they arrived.
+         * Whatever is still queued when stopping is dispatched
+         * straight away.
          */
-        ssl = (SSL*)mg_get_conn_ssl(http_ctx);
-        if (!ssl) {
-            est_send_http_error(ctx, http_ctx, EST_ERR_NO_SSL_CTX);
-            return (EST_ERR_NO_SSL_CTX);
+        deadline = batch->head->queued;
+        deadline.tv_sec += batch->max_wait_ms / 1000;
+        deadline.tv_nsec += (batch->max_wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (batch->count < batch->max_batch && !batch->stop) {
+            if (pthread_cond_timedwait(&batch->cond, &batch->lock, &deadline)) {
+                break;
+            }
         }
 
-        rc = est_handle_simple_enroll(ctx, http_ctx, ssl, ct, body, body_len, 1);
-        if (rc != EST_ERR_NONE && rc != EST_ERR_AUTH_PENDING) {
-            EST_LOG_WARN("Reenroll failed with rc=%d (%s)\n", 
-		         rc, EST_ERR_NUM_TO_STR(rc));
-	    if (rc == EST_ERR_AUTH_FAIL) {
-		est_send_http_error(ctx, http_ctx, EST_ERR_AUTH_FAIL);
-	    } else {
-		est_send_http_error(ctx, http_ctx, EST_ERR_BAD_PKCS10);
-	    }
-            return rc;
+        for (n = 0; n < batch->max_batch && batch->head; n++) {
+            batch->reqs[n] = batch->head;
+            batch->head = batch->head->next;
+        }
+        if (!batch->head) {
+            batch->tail = NULL;
         }
+        batch->count -= n;
+        pthread_mutex_unlock(&batch->lock);
+
+        est_enroll_batch_dispatch(ctx, batch, n);
+
+        pthread_mutex_lock(&batch->lock);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return (NULL);
+}
+
+/*
+ * Queues a request for the batch dispatcher, which takes over the
+ * reference the application would hold.  The user ID and peer
+ * certificate are copied since the batch is handed over later.
+ */
+static EST_ERROR est_enroll_batch_add (EST_CTX *ctx, EST_ENROLL_REQ *req,
+                                       struct mg_connection *conn,
+                                       X509 *peer_cert, int reenroll)
+{
+    struct est_enroll_batch *batch = ctx->enroll_batch;
+
+    req->reenroll = reenroll;
+    req->user_id = strdup(conn->user_id);
+    if (!req->user_id) {
+        EST_LOG_ERR("malloc failure");
+        return (EST_ERR_MALLOC);
+    }
+    if (peer_cert) {
+        req->peer_cert = X509_dup(peer_cert);
+        if (!req->peer_cert) {
+            EST_LOG_ERR("Unable to copy peer certificate");
+            return (EST_ERR_MALLOC);
+        }
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    if (!batch->running) {
+        pthread_mutex_unlock(&batch->lock);
+        EST_LOG_ERR("Batch enrollment dispatcher is not running");
+        return (EST_ERR_CA_ENROLL_FAIL);
+    }
+    clock_gettime(CLOCK_REALTIME, &req->queued);
+    if (batch->tail) {
+        batch->tail->next = req;
+    } else {
+        batch->head = req;
+    }
+    batch->tail = req;
+    batch->count++;
+    if (batch->count == 1 || batch->count >= batch->max_batch) {
+        pthread_cond_signal(&batch->cond);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Starts the batch dispatcher, if batching is configured.
+ */
+static EST_ERROR est_enroll_batch_start (EST_CTX *ctx)
+{
+    struct est_enroll_batch *batch = ctx->enroll_batch;
+
+    if (!batch || batch->running) {
+        return (EST_ERR_NONE);
+    }
+    batch->stop = 0;
+    if (pthread_create(&batch->thread, NULL, est_enroll_batch_main, ctx)) {
+        EST_LOG_ERR("Unable to start the batch enrollment dispatcher");
+        return (EST_ERR_UNKNOWN);
+    }
+    batch->running = 1;
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Stops the batch dispatcher once every queued request has been
+ * handed to the CA.
+ */
+static void est_enroll_batch_stop (EST_CTX *ctx)
+{
+    struct est_enroll_batch *batch = ctx->enroll_batch;
+
+    if (!batch || !batch->running) {
+        return;
+    }
+    pthread_mutex_lock(&batch->lock);
+    batch->stop = 1;
+    batch->running = 0;
+    pthread_cond_signal(&batch->cond);
+    pthread_mutex_unlock(&batch->lock);
+    pthread_join(batch->thread, NULL);
+}
+
+void est_server_free_enroll_batch (EST_CTX *ctx)
+{
+    struct est_enroll_batch *batch = ctx->enroll_batch;
+
+    if (!batch) {
+        return;
+    }
+    est_enroll_batch_stop(ctx);
+    pthread_cond_destroy(&batch->cond);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch->reqs);
+    free(batch->items);
+    free(batch);
+    ctx->enroll_batch = NULL;
+}
+
+/*
+ * Hands a decoded CSR to the asynchronous CA handler.  A connection
+ * driven by est_server_conn_on_event() is parked until the CA
+ * finishes, as long as the application can be woken up for it.
+ * Otherwise this thread waits for the answer, just as it would
+ * have waited in a synchronous handler.  Takes ownership of csr.
+ */
+static EST_ERROR est_server_enroll_async (EST_CTX *ctx, struct mg_connection *conn,
+                                          EST_CSR *csr, X509 *peer_cert,
+                                          int reenroll)
+{
+    EST_ENROLL_REQ *req;
+    int rv;
+
+    req = calloc(1, sizeof(EST_ENROLL_REQ));
+    if (!req) {
+        EST_LOG_ERR("malloc failure");
+        est_server_csr_free(csr);
+        return (EST_ERR_MALLOC);
+    }
+    pthread_mutex_init(&req->lock, NULL);
+    pthread_cond_init(&req->done_cond, NULL);
+    req->ctx = ctx;
+    req->csr = csr;
+    req->refs = 2;
+    if (conn->nonblocking && ctx->est_enroll_wakeup_cb) {
+        req->conn = conn;
+    }
+
+    req->start = est_stats_now();
+    if (ctx->enroll_batch) {
+        rv = est_enroll_batch_add(ctx, req, conn, peer_cert, reenroll);
+    } else if (reenroll) {
+        rv = ctx->est_reenroll_async_cb(req, csr->req, csr->der, csr->der_len,
+                                        conn->user_id, peer_cert, ctx->ex_data);
+    } else {
+        rv = ctx->est_enroll_async_cb(req, csr->req, csr->der, csr->der_len,
+                                      conn->user_id, peer_cert, ctx->ex_data);
+    }
+    if (rv != EST_ERR_NONE) {
+        /*
+         * The CA turned the request down without taking it,
+         * neither reference will be used.
+         */
+        est_stats_stage(ctx, EST_STATS_STAGE_CA, req->start);
+        req->refs = 1;
+        req->conn = NULL;
+        rv = est_server_enroll_respond(ctx, conn, csr, rv, NULL, 0);
+        est_enroll_req_release(req);
+        return (rv);
+    }
+
+    if (req->conn) {
+        /*
+         * The HTTP layer parks the connection, see
+         * est_server_enroll_resume()
+         */
+        conn->enroll_req = req;
+        return (EST_ERR_NONE);
+    }
+
+    pthread_mutex_lock(&req->lock);
+    while (!req->done) {
+        pthread_cond_wait(&req->done_cond, &req->lock);
+    }
+    pthread_mutex_unlock(&req->lock);
+    est_stats_stage(ctx, EST_STATS_STAGE_CA, req->start);
+
+    rv = est_server_enroll_respond(ctx, conn, req->csr, req->rv,
+                                   req->pkcs7, req->pkcs7_len);
+    est_enroll_req_release(req);
+    return (rv);
+}
+
+/*
+ * Returns non-zero while the CA has yet to finish a parked
+ * enrollment.
+ */
+int est_server_enroll_pending (EST_ENROLL_REQ *req)
+{
+    int done;
+
+    pthread_mutex_lock(&req->lock);
+    done = req->done;
+    pthread_mutex_unlock(&req->lock);
+    return (!done);
+}
+
+/*
+ * Sends the response for a parked enrollment once the CA has
+ * finished with it, and unparks the connection.
+ */
+void est_server_enroll_resume (void *http_ctx)
+{
+    struct mg_connection *conn = (struct mg_connection*)http_ctx;
+    EST_ENROLL_REQ *req = conn->enroll_req;
+    EST_CTX *ctx = req->ctx;
+    EST_ERROR rv;
+
+    conn->enroll_req = NULL;
+    pthread_mutex_lock(&req->lock);
+    req->conn = NULL;
+    pthread_mutex_unlock(&req->lock);
+    est_stats_stage(ctx, EST_STATS_STAGE_CA, req->start);
+
+    rv = est_server_enroll_respond(ctx, conn, req->csr, req->rv,
+                                   req->pkcs7, req->pkcs7_len);
+    if (rv != EST_ERR_NONE) {
+        EST_LOG_WARN("Enrollment failed with rc=%d (%s)\n", 
+                     rv, EST_ERR_NUM_TO_STR(rv));
+        est_send_http_error(ctx, conn, EST_ERR_BAD_PKCS10);
+    }
+    est_enroll_req_release(req);
+}
+
+/*
+ * Called when a connection is released while its enrollment is
+ * still parked.  The CA may still finish the request later on.
+ */
+void est_server_enroll_detach (EST_ENROLL_REQ *req)
+{
+    pthread_mutex_lock(&req->lock);
+    req->conn = NULL;
+    pthread_mutex_unlock(&req->lock);
+    est_enroll_req_release(req);
+}
+#else
+void est_server_free_enroll_batch (EST_CTX *ctx)
+{
+}
+
+int est_server_enroll_pending (EST_ENROLL_REQ *req)
+{
+    return (0);
+}
+
+void est_server_enroll_resume (void *http_ctx)
+{
+}
+
+void est_server_enroll_detach (EST_ENROLL_REQ *req)
+{
+}
+#endif
+
+/*
+ * Hands a decoded CSR to the CA handler that returns the issued
+ * certificate itself, and sends it to the client as a certs-only
+ * PKCS7.  Takes ownership of csr.
+ */
+static EST_ERROR est_server_enroll_x509 (EST_CTX *ctx, struct mg_connection *conn,
+                                         EST_CSR *csr, X509 *peer_cert,
+                                         int reenroll)
+{
+    EST_HTTP_RESP *resp;
+    X509 *cert = NULL;
+    uint64_t start;
+    int rv;
+
+    start = est_stats_now();
+    if (reenroll) {
+        rv = ctx->est_reenroll_x509_cb(csr->req, csr->der, csr->der_len,
+                                       &cert, conn->user_id, peer_cert,
+                                       ctx->ex_data);
+    } else {
+        rv = ctx->est_enroll_x509_cb(csr->req, csr->der, csr->der_len,
+                                     &cert, conn->user_id, peer_cert,
+                                     ctx->ex_data);
+    }
+    est_stats_stage(ctx, EST_STATS_STAGE_CA, start);
+
+    if (rv != EST_ERR_NONE || !cert) {
+        if (cert) {
+            X509_free(cert);
+        }
+        rv = est_server_enroll_respond(ctx, conn, csr, rv, NULL, 0);
+        est_server_csr_free(csr);
+        return (rv);
+    }
+
+    start = est_stats_now();
+    resp = est_server_x509_resp(ctx, cert);
+    X509_free(cert);
+    if (!resp) {
+        est_server_csr_free(csr);
+        return (EST_ERR_MALLOC);
+    }
+    rv = est_server_enroll_send(ctx, conn, csr, resp);
+    est_http_resp_release(resp);
+    est_server_csr_free(csr);
+    if (rv == EST_ERR_NONE) {
+        est_stats_stage(ctx, EST_STATS_STAGE_RESPONSE, start);
+    }
+    return (rv);
+}
+
+/*
+ * This function is used by the server to process and incoming
+ * Simple Enroll request from the client.
+ */
+static EST_ERROR est_handle_simple_enroll (EST_CTX *ctx, void *http_ctx, SSL *ssl,
+                                           const char *ct, char *body, int body_len,
+				     int reenroll)
+{
+    int rv, rc, cert_len = 0;
+    struct mg_connection *conn = (struct mg_connection*)http_ctx;
+    unsigned char *cert = NULL;
+    X509 *peer_cert;
+    EST_CONN_AUTH *cauth;
+    EST_CSR *csr = NULL;
+    int client_is_ra = 0;
+    EST_AUTH_STATE auth;
+    uint64_t start;
+
+    if (!reenroll && !ctx->est_enroll_pkcs10_cb && !ctx->est_enroll_csr_cb &&
+        !ctx->est_enroll_x509_cb && !ctx->est_enroll_async_cb &&
+        !ctx->enroll_batch) {
+	EST_LOG_ERR("Null enrollment callback");
+        return (EST_ERR_NULL_CALLBACK);
+    }
+
+    if (reenroll && !ctx->est_reenroll_pkcs10_cb && !ctx->est_reenroll_csr_cb &&
+        !ctx->est_reenroll_x509_cb && !ctx->est_reenroll_async_cb &&
+        !ctx->enroll_batch) {
+	EST_LOG_ERR("Null reenroll callback");
+        return (EST_ERR_NULL_CALLBACK);
     }
 
-#if 0
     /*
-     * See if this is a keygen request
-     * FIXME: this is currently not implemented
+     * Make sure the client has sent us a PKCS10 CSR request
      */
-    else if (strncmp(uri, EST_KEYGEN_URI, EST_URI_MAX_LEN) == 0) {
-        /* Only POST is allowed */
-        if (strncmp(method, "POST", 4)) {
-            EST_LOG_WARN("Incoming HTTP request used wrong method\n");
-            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
-            return (EST_ERR_WRONG_METHOD);
+    if (strncmp(ct, "application/pkcs10", 18)) {
+        return (EST_ERR_BAD_CONTENT_TYPE);
+    }
+
+
+    /*
+     * Authenticate the client
+     */
+    start = est_stats_now();
+    auth = est_enroll_auth(ctx, http_ctx, ssl, reenroll);
+    est_stats_stage(ctx, EST_STATS_STAGE_AUTH, start);
+    est_stats_auth(ctx, auth);
+    switch (auth) {
+    case EST_HTTP_AUTH:
+    case EST_SRP_AUTH:
+    case EST_CERT_AUTH:
+	/*
+	 * this means the user was authorized, either through
+	 * HTTP authoriztion or certificate authorization
+	 */
+        break;
+    case EST_HTTP_AUTH_PENDING:
+        return (EST_ERR_AUTH_PENDING);
+        break;
+    case EST_UNAUTHORIZED:
+    default:
+        return (EST_ERR_AUTH_FAIL);
+        break;
+    }
+
+    /*
+     * Decode the PKCS10 CSR from the client.  Every check
+     * below and the CA callback share the decoded request.
+     */
+    start = est_stats_now();
+    csr = est_server_csr_decode((unsigned char*)body, body_len);
+    if (!csr) {
+	EST_LOG_ERR("Unable to parse the PKCS10 CSR sent by the client");
+	return (EST_ERR_BAD_PKCS10);
+    }
+
+    /*
+     * Get the peer certificate if available.  This
+     * identifies the client. The CA may desire
+     * this information.  It belongs to the connection.
+     */
+    cauth = est_server_conn_auth(conn, ssl);
+    peer_cert = cauth->peer;
+    client_is_ra = cauth->client_is_ra;
+    EST_LOG_INFO("id-kp-cmcRA present: %d", client_is_ra);
+
+    /*
+     * A client repeating a request it already got a certificate
+     * for is sent the same certificate again
+     */
+    if (ctx->enroll_cache) {
+	est_enroll_cache_key(conn, peer_cert, csr, reenroll);
+	if (csr->cache_key_set &&
+	    est_enroll_cache_lookup(ctx, http_ctx, csr, &rc)) {
+	    est_stats_stage(ctx, EST_STATS_STAGE_CSR, start);
+	    est_server_csr_free(csr);
+	    return (rc);
+	}
+    }
+
+    /*
+     * Perform a sanity check on the CSR
+     */
+    if (est_server_check_csr(csr->req)) {
+	EST_LOG_ERR("PKCS10 CSR sent by the client failed sanity check");
+	est_server_csr_free(csr);
+	return (EST_ERR_BAD_PKCS10);
+    }
+
+    /*
+     * Do the PoP check (Proof of Possession).  The challenge password
+     * in the pkcs10 request should match the TLS uniqe ID.
+     * The PoP check is not performend when the client is an RA.
+     */
+    if (!client_is_ra) {
+	rv = est_tls_uid_auth(ctx, http_ctx, ssl, csr->req);
+	if (rv != EST_ERR_NONE) {
+	    est_server_csr_free(csr);
+	    return (EST_ERR_AUTH_FAIL_TLSUID);
+	} 
+    }
+
+    /*
+     * A client polling for an enrollment the CA asked it to
+     * retry is answered from the pending table
+     */
+    if (ctx->pending) {
+	est_pending_requester(conn, peer_cert, csr);
+	if (est_pending_poll(ctx, http_ctx, csr, &rc)) {
+	    est_stats_stage(ctx, EST_STATS_STAGE_CSR, start);
+	    est_server_csr_free(csr);
+	    return (rc);
+	}
+    }
+
+    /*
+     * Check if we need to ensure the client included all the
+     * CSR attributes required by the CA.
+     */
+    if (ctx->enforce_csrattrs) {
+	if (EST_ERR_NONE != est_server_all_csrattrs_present(ctx, csr)) {
+	    est_server_csr_free(csr);
+	    return (EST_ERR_CSR_ATTR_MISSING);
+	}
+    }
+
+    est_stats_stage(ctx, EST_STATS_STAGE_CSR, start);
+
+#ifndef DISABLE_PTHREADS
+    if (ctx->enroll_batch ||
+        (reenroll ? ctx->est_reenroll_async_cb != NULL :
+                    ctx->est_enroll_async_cb != NULL)) {
+        return (est_server_enroll_async(ctx, conn, csr, peer_cert, reenroll));
+    }
+#endif
+
+    if (reenroll ? ctx->est_reenroll_x509_cb != NULL :
+                   ctx->est_enroll_x509_cb != NULL) {
+        return (est_server_enroll_x509(ctx, conn, csr, peer_cert, reenroll));
+    }
+
+    /*
+     * Hand the request to the CA.  The decoded CSR is passed when
+     * the application installed a handler for it, otherwise body
+     * still points to the base64 pkcs10 data.
+     */
+    start = est_stats_now();
+    if (reenroll && ctx->est_reenroll_csr_cb) {
+        rv = ctx->est_reenroll_csr_cb(csr->req, csr->der, csr->der_len,
+                                      &cert, (int*)&cert_len,
+                                      conn->user_id, peer_cert, ctx->ex_data);
+    } else if (reenroll) {
+        rv = ctx->est_reenroll_pkcs10_cb((unsigned char*)body, body_len, 
+                                         &cert, (int*)&cert_len,
+                                         conn->user_id, peer_cert, ctx->ex_data);
+    } else if (ctx->est_enroll_csr_cb) {
+        rv = ctx->est_enroll_csr_cb(csr->req, csr->der, csr->der_len,
+                                    &cert, (int*)&cert_len,
+                                    conn->user_id, peer_cert, ctx->ex_data);
+    } else {
+        rv = ctx->est_enroll_pkcs10_cb((unsigned char*)body, body_len, 
+                                       &cert, (int*)&cert_len,
+                                       conn->user_id, peer_cert, ctx->ex_data);
+    }
+
+    est_stats_stage(ctx, EST_STATS_STAGE_CA, start);
+
+    rc = est_server_enroll_respond(ctx, http_ctx, csr, rv, cert, cert_len);
+    if (rv == EST_ERR_NONE && cert_len > 0) {
+        free(cert);
+    }
+    est_server_csr_free(csr);
+    return (rc);
+}
+
+/*
+ * Retrieves the CSR attributes from the application's callback and
+ * checks them, adding the challengePassword when PoP is enabled.
+ * On success csr_data holds the response body, which is NULL when
+ * there are no attributes to send.  Any other return value means
+ * the client should get a 204.
+ */
+static EST_ERROR est_server_get_app_csrattrs (EST_CTX *ctx, char **csr_data_out,
+                                              int *csr_len_out, int *pop_out)
+{
+    int rv;
+    int pop_present = 0;
+    char *csr_data, *csr_data_pop;
+    int csr_len = 0, csr_pop_len;
+
+    *csr_data_out = NULL;
+    *csr_len_out = 0;
+    *pop_out = 0;
+
+    csr_data = (char *)ctx->est_get_csr_cb(&csr_len, ctx->ex_data);
+    rv = est_asn1_parse_attributes(csr_data, csr_len, &pop_present);
+    if (csr_len && (rv != EST_ERR_NONE)) {
+	if (csr_data) {
+	    free(csr_data);
+	}
+	return (EST_ERR_HTTP_NO_CONTENT);
+    }
+
+    if (ctx->server_enable_pop) {
+	rv = est_is_challengePassword_present(csr_data, csr_len, &pop_present);
+	if (rv != EST_ERR_NONE) {
+	    EST_LOG_ERR("Error during PoP/sanity check");
+	    if (csr_data) {
+		free(csr_data);
+	    }
+	    return (EST_ERR_HTTP_NO_CONTENT);
+	}
+	*pop_out = pop_present;
+
+	if (!pop_present) {
+	    if (csr_len == 0) {
+		if (csr_data) {
+		    free(csr_data);
+		}
+		csr_data = malloc(EST_CSRATTRS_POP_LEN + 1);
+		if (!csr_data) {
+		    return (EST_ERR_MALLOC);
+		}
+		strncpy(csr_data, EST_CSRATTRS_POP, EST_CSRATTRS_POP_LEN);
+		csr_data[EST_CSRATTRS_POP_LEN] = 0;
+		csr_len = EST_CSRATTRS_POP_LEN;
+	    } else {
+		rv = est_add_challengePassword(csr_data, csr_len, &csr_data_pop, &csr_pop_len);
+		free(csr_data);
+		if (rv != EST_ERR_NONE) {
+		    EST_LOG_ERR("Error during add PoP");
+		    return (EST_ERR_HTTP_NO_CONTENT);
+		}
+		csr_data = csr_data_pop;
+		csr_len = csr_pop_len;
+	    }
+	}
+    }
+    if (!csr_len && csr_data) {
+	free(csr_data);
+	csr_data = NULL;
+    }
+    *csr_data_out = csr_data;
+    *csr_len_out = csr_len;
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Attributes from the application's callback may be kept for a
+ * while, see est_server_set_csrattrs_cache_ttl().  The response
+ * is rendered once, so a cache hit is a single write.  A NULL
+ * resp on a valid entry means the answer is a 204.
+ */
+struct est_csrattrs_cache {
+    volatile int lock;
+    int valid;
+    EST_HTTP_RESP *resp;
+    int pop_present;
+    time_t expires;
+    volatile int refreshing;    /* Only one refresh at a time */
+#ifndef DISABLE_PTHREADS
+    pthread_t refresh_thread;
+    int refresh_joinable;
+#endif
+};
+
+/*
+ * Asks the application for its attributes and replaces the cached
+ * response.  On failure the previous response is kept, and is used
+ * for a little longer before the application is asked again.
+ */
+static EST_ERROR est_csrattrs_cache_fill (EST_CTX *ctx)
+{
+    struct est_csrattrs_cache *cache = ctx->csrattrs_cache;
+    EST_HTTP_RESP *resp = NULL, *old;
+    char *csr_data;
+    int csr_len, pop_present;
+    int retry;
+    EST_ERROR rv;
+
+    rv = est_server_get_app_csrattrs(ctx, &csr_data, &csr_len, &pop_present);
+    if (rv == EST_ERR_NONE && csr_data) {
+	resp = est_http_resp_new_200(EST_HTTP_CT_CSRATTRS, csr_data, csr_len);
+	free(csr_data);
+	if (!resp) {
+	    rv = EST_ERR_MALLOC;
+	}
+    }
+    if (rv != EST_ERR_NONE) {
+	EST_LOG_WARN("Unable to refresh the cached CSR attributes");
+	retry = ctx->csrattrs_cache_ttl;
+	if (retry > EST_CSRATTRS_CACHE_RETRY) {
+	    retry = EST_CSRATTRS_CACHE_RETRY;
+	}
+	est_spin_lock(&cache->lock);
+	if (cache->valid) {
+	    cache->expires = time(NULL) + retry;
+	}
+	est_spin_unlock(&cache->lock);
+	return (rv);
+    }
+
+    est_spin_lock(&cache->lock);
+    old = cache->resp;
+    cache->resp = resp;
+    cache->pop_present = pop_present;
+    cache->expires = time(NULL) + ctx->csrattrs_cache_ttl;
+    cache->valid = 1;
+    est_spin_unlock(&cache->lock);
+    est_http_resp_release(old);
+    return (EST_ERR_NONE);
+}
+
+#ifndef DISABLE_PTHREADS
+static void *est_csrattrs_refresh_main (void *data)
+{
+    EST_CTX *ctx = (EST_CTX *)data;
+
+    est_csrattrs_cache_fill(ctx);
+    __sync_lock_release(&ctx->csrattrs_cache->refreshing);
+    return (NULL);
+}
+#endif
+
+/*
+ * Refreshes an expired entry.  Requests keep getting the old
+ * response meanwhile, so only the thread doing the refresh waits
+ * on the application.
+ */
+static void est_csrattrs_cache_refresh (EST_CTX *ctx)
+{
+    struct est_csrattrs_cache *cache = ctx->csrattrs_cache;
+
+    if (__sync_lock_test_and_set(&cache->refreshing, 1)) {
+	return;
+    }
+#ifndef DISABLE_PTHREADS
+    /*
+     * The previous refresh thread cleared the flag on its way out,
+     * so it has finished or is about to.
+     */
+    if (cache->refresh_joinable) {
+	pthread_join(cache->refresh_thread, NULL);
+	cache->refresh_joinable = 0;
+    }
+    if (!pthread_create(&cache->refresh_thread, NULL, est_csrattrs_refresh_main, ctx)) {
+	cache->refresh_joinable = 1;
+	return;
+    }
+    EST_LOG_WARN("Unable to start a thread, refreshing CSR attributes inline");
+#endif
+    est_csrattrs_cache_fill(ctx);
+    __sync_lock_release(&cache->refreshing);
+}
+
+/*
+ * Waits for a refresh in progress to finish.
+ */
+static void est_csrattrs_cache_quiesce (struct est_csrattrs_cache *cache)
+{
+    while (__sync_lock_test_and_set(&cache->refreshing, 1)) {
+	usleep(1000);
+    }
+#ifndef DISABLE_PTHREADS
+    if (cache->refresh_joinable) {
+	pthread_join(cache->refresh_thread, NULL);
+	cache->refresh_joinable = 0;
+    }
+#endif
+    __sync_lock_release(&cache->refreshing);
+}
+
+void est_server_free_csrattrs_cache (EST_CTX *ctx)
+{
+    struct est_csrattrs_cache *cache = ctx->csrattrs_cache;
+
+    if (!cache) {
+	return;
+    }
+    est_csrattrs_cache_quiesce(cache);
+    est_http_resp_release(cache->resp);
+    free(cache);
+    ctx->csrattrs_cache = NULL;
+}
+
+/*
+ * Answers a /csrattrs request from the cache.  The first request
+ * fills it, after that the application is only asked again once
+ * the entry has expired.
+ */
+static EST_ERROR est_send_cached_csrattrs (EST_CTX *ctx, void *http_ctx)
+{
+    struct est_csrattrs_cache *cache = ctx->csrattrs_cache;
+    EST_HTTP_RESP *resp;
+    char *csr_data;
+    int csr_len;
+    int valid, stale, pop_present;
+    EST_ERROR rv;
+
+    est_spin_lock(&cache->lock);
+    valid = cache->valid;
+    stale = valid && time(NULL) >= cache->expires;
+    est_spin_unlock(&cache->lock);
+
+    if (!valid) {
+	/*
+	 * A request arriving while another one fills the empty cache
+	 * asks the application itself rather than waiting.
+	 */
+	if (__sync_lock_test_and_set(&cache->refreshing, 1)) {
+	    rv = est_server_get_app_csrattrs(ctx, &csr_data, &csr_len, &pop_present);
+	    ctx->csr_pop_present = pop_present;
+	    if (rv == EST_ERR_MALLOC) {
+		return (rv);
+	    }
+	    if (rv != EST_ERR_NONE) {
+		est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NO_CONTENT);
+		return (EST_ERR_NONE);
+	    }
+	    return (est_send_csrattr_data(ctx, csr_data, csr_len, http_ctx));
+	}
+	est_spin_lock(&cache->lock);
+	valid = cache->valid;
+	est_spin_unlock(&cache->lock);
+	rv = valid ? EST_ERR_NONE : est_csrattrs_cache_fill(ctx);
+	__sync_lock_release(&cache->refreshing);
+	if (rv == EST_ERR_MALLOC) {
+	    return (rv);
+	}
+	if (rv != EST_ERR_NONE) {
+	    ctx->csr_pop_present = 0;
+	    est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NO_CONTENT);
+	    return (EST_ERR_NONE);
+	}
+    }
+    if (stale) {
+	est_csrattrs_cache_refresh(ctx);
+    }
+
+    est_spin_lock(&cache->lock);
+    resp = cache->resp;
+    if (resp) {
+	est_http_resp_hold(resp);
+    }
+    pop_present = cache->pop_present;
+    est_spin_unlock(&cache->lock);
+
+    ctx->csr_pop_present = pop_present;
+    if (!resp) {
+	est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NO_CONTENT);
+	return (EST_ERR_NONE);
+    }
+    rv = est_send_http_resp(http_ctx, resp);
+    est_http_resp_release(resp);
+    return (rv);
+}
+
+/*
+ * This function is used by the server to process and incoming
+ * csr attributes request from the client.
+ */
+static int est_handle_csr_attrs (EST_CTX *ctx, void *http_ctx)
+{
+    int rv = EST_ERR_NONE;
+    int pop_present = 0;
+    char *csr_data;
+    int csr_len;
+
+    if (!ctx->server_csrattrs && !ctx->est_get_csr_cb) {
+        if (!ctx->server_enable_pop) {
+  	        EST_LOG_ERR("Null csr callback");
+		/* Send a 204 response indicating the server doesn't have a CSR */
+		est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NO_CONTENT);
+		return (EST_ERR_NONE);
+        } else {
+	  csr_data = malloc(EST_CSRATTRS_POP_LEN + 1);
+	    if (!csr_data) {
+                return (EST_ERR_MALLOC);
+	    }
+	    strncpy(csr_data, EST_CSRATTRS_POP, EST_CSRATTRS_POP_LEN);
+	    csr_data[EST_CSRATTRS_POP_LEN] = 0;
+	    csr_len = EST_CSRATTRS_POP_LEN;
+	    return (est_send_csrattr_data(ctx, csr_data, csr_len, http_ctx));
+        }
+    }
+
+    /*
+     * Invoke CA server callback to retrieve the CSR.  Callback takes priority
+     * over saved values in the context.
+     * Note: there is no need to authenticate the client (see sec 4.5)
+     */
+    if (ctx->est_get_csr_cb) {
+	if (ctx->csrattrs_cache) {
+	    return (est_send_cached_csrattrs(ctx, http_ctx));
+	}
+	rv = est_server_get_app_csrattrs(ctx, &csr_data, &csr_len, &pop_present);
+	ctx->csr_pop_present = pop_present;
+	if (rv == EST_ERR_MALLOC) {
+	    return (rv);
+	}
+	if (rv != EST_ERR_NONE) {
+	    est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NO_CONTENT);
+	    return (EST_ERR_NONE);
+	}
+    } else {
+        csr_data = malloc(ctx->server_csrattrs_len + 1);
+	if (!csr_data) {
+            return (EST_ERR_MALLOC);
+        }
+        strncpy(csr_data, (char *)ctx->server_csrattrs, ctx->server_csrattrs_len);
+	csr_data[ctx->server_csrattrs_len] = 0;
+	csr_len = ctx->server_csrattrs_len;
+    }
+    return (est_send_csrattr_data(ctx, csr_data, csr_len, http_ctx));
+}
+
+/*
+ * This function should be called by the web server layer when
+ * a HTTP request arrives on the listening port of the EST server.
+ * It will determine the EST request type and dispatch the request
+ * to the appropriate handler.
+ *
+ * Paramters:
+ *      ctx:	    Pointer to EST_CTX
+ *      http_ctx:   Context pointer from web server
+ *      method:     The HTML method in the request, should be either "GET" or "POST"
+ *	uri:	    pointer to HTTP URI
+ *	body:	    pointer to full HTML body contents
+ *	body_len:   length of HTML body
+ *	ct:         HTML content type header
+ */
+int est_http_request (EST_CTX *ctx, void *http_ctx,
+                      char *method, char *uri,
+                      char *body, int body_len, const char *ct)
+{
+    SSL *ssl;
+    int rc;
+
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    /*
+     * Verify the context is for a server, not a client
+     */
+    if (ctx->est_mode != EST_SERVER) {
+        return (EST_ERR_BAD_MODE);
+    }
+
+    /*
+     * See if this is a cacerts request
+     */
+    if (strncmp(uri, EST_CACERTS_URI, EST_URI_MAX_LEN) == 0) {
+        /* Only GET is allowed */
+        if (strncmp(method, "GET", 3)) {
+            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
+            return (EST_ERR_WRONG_METHOD);
+        }
+
+        rc = est_handle_cacerts(ctx, http_ctx);
+        if (rc != EST_ERR_NONE) {
+            est_send_http_error(ctx, http_ctx, rc);
+            return (rc);
+        }
+    }
+
+    /*
+     * See if this is a simple enrollment request
+     */
+    else if (strncmp(uri, EST_SIMPLE_ENROLL_URI, EST_URI_MAX_LEN) == 0) {
+        /* Only POST is allowed */
+        if (strncmp(method, "POST", 4)) {
+            EST_LOG_WARN("Incoming HTTP request used wrong method\n");
+            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
+            return (EST_ERR_WRONG_METHOD);
+        }
+	if (!ct) {
+            EST_LOG_WARN("Incoming HTTP header has no Content-Type header\n");
+            est_send_http_error(ctx, http_ctx, EST_ERR_BAD_PKCS10);
+	    return (EST_ERR_BAD_CONTENT_TYPE); 
+	}
+        /*
+         * Get the SSL context, which is required for authenticating
+         * the client.
+         */
+        ssl = (SSL*)mg_get_conn_ssl(http_ctx);
+        if (!ssl) {
+            est_send_http_error(ctx, http_ctx, EST_ERR_NO_SSL_CTX);
+            return (EST_ERR_NO_SSL_CTX);
+        }
+
+        rc = est_handle_simple_enroll(ctx, http_ctx, ssl, ct, body, body_len, 0);
+        if (rc != EST_ERR_NONE && rc != EST_ERR_AUTH_PENDING) {
+            EST_LOG_WARN("Enrollment failed with rc=%d (%s)\n", 
+		         rc, EST_ERR_NUM_TO_STR(rc));
+	    if (rc == EST_ERR_AUTH_FAIL) {
+		est_send_http_error(ctx, http_ctx, EST_ERR_AUTH_FAIL);
+	    } else {
+		est_send_http_error(ctx, http_ctx, EST_ERR_BAD_PKCS10);
+	    }
+            return rc;
+        }
+    }
+
+    /*
+     * See if this is a re-enrollment request
+     */
+    else if (strncmp(uri, EST_RE_ENROLL_URI, EST_URI_MAX_LEN) == 0) {
+        /* Only POST is allowed */
+        if (strncmp(method, "POST", 4)) {
+            EST_LOG_WARN("Incoming HTTP request used wrong method\n");
+            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
+            return (EST_ERR_WRONG_METHOD);
+        }
+	if (!ct) {
+            EST_LOG_WARN("Incoming HTTP header has no Content-Type header\n");
+            est_send_http_error(ctx, http_ctx, EST_ERR_BAD_PKCS10);
+	    return (EST_ERR_BAD_CONTENT_TYPE); 
+	}
+        /*
+         * Get the SSL context, which is required for authenticating
+         * the client.
+         */
+        ssl = (SSL*)mg_get_conn_ssl(http_ctx);
+        if (!ssl) {
+            est_send_http_error(ctx, http_ctx, EST_ERR_NO_SSL_CTX);
+            return (EST_ERR_NO_SSL_CTX);
+        }
+
+        rc = est_handle_simple_enroll(ctx, http_ctx, ssl, ct, body, body_len, 1);
+        if (rc != EST_ERR_NONE && rc != EST_ERR_AUTH_PENDING) {
+            EST_LOG_WARN("Reenroll failed with rc=%d (%s)\n", 
+		         rc, EST_ERR_NUM_TO_STR(rc));
+	    if (rc == EST_ERR_AUTH_FAIL) {
+		est_send_http_error(ctx, http_ctx, EST_ERR_AUTH_FAIL);
+	    } else {
+		est_send_http_error(ctx, http_ctx, EST_ERR_BAD_PKCS10);
+	    }
+            return rc;
+        }
+    }
+
+#if 0
+    /*
+     * See if this is a keygen request
+     * FIXME: this is currently not implemented
+     */
+    else if (strncmp(uri, EST_KEYGEN_URI, EST_URI_MAX_LEN) == 0) {
+        /* Only POST is allowed */
+        if (strncmp(method, "POST", 4)) {
+            EST_LOG_WARN("Incoming HTTP request used wrong method\n");
+            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
+            return (EST_ERR_WRONG_METHOD);
+        }
+	if (!ct) {
+            EST_LOG_WARN("Incoming HTTP header has no Content-Type header\n");
+	    return (EST_ERR_BAD_CONTENT_TYPE); 
+	}
+        if (est_handle_keygen(ctx)) {
+            est_send_http_error(ctx, http_ctx, 0); //FIXME: last param should not be zero
+            return (EST_ERR_HTTP_WRITE);           //FIXME: need the appropriate return code
+        }
+    }
+#endif
+
+    /*
+     * See if this is a CSR attributes request
+     */
+    else if (strncmp(uri, EST_CSR_ATTRS_URI, EST_URI_MAX_LEN) == 0) {
+        /* Only GET is allowed */
+        if (strncmp(method, "GET", 4)) {
+            EST_LOG_WARN("Incoming HTTP request used wrong method\n");
+            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
+            return (EST_ERR_WRONG_METHOD);
+        }
+
+        rc = est_handle_csr_attrs(ctx, http_ctx);
+	if (rc != EST_ERR_NONE) {
+            est_send_http_error(ctx, http_ctx, rc); 
+            return (rc);
+        }
+    }
+
+    /*
+     * Send a 404 error if the URI didn't match 
+     */
+    else {
+        est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NOT_FOUND);
+    }
+
+    return (EST_ERR_NONE);
+}
+
+
+/*! @brief est_server_start() is used by an application to start
+    the EST server after est_server_init() has been called and
+    all the required callback functions have been provided by
+    the application.   
+ 
+    @param ctx Pointer to the EST context
+
+    libest uses HTTP code from the Mongoose HTTP server.
+    This function allows the application to start the HTTP
+    services layer, which is required by EST.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_start (EST_CTX *ctx)
+{
+    EST_MG_CONTEXT *mgctx;
+#ifndef DISABLE_PTHREADS
+    EST_ERROR rv;
+#endif
+
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+	return (EST_ERR_NO_CTX);
+    }
+
+#ifndef DISABLE_PTHREADS
+    /*
+     * Start the batch dispatcher first, there's nothing to
+     * undo when it fails.
+     */
+    rv = est_enroll_batch_start(ctx);
+    if (rv != EST_ERR_NONE) {
+        return (rv);
+    }
+#endif
+    mgctx = mg_start(ctx);
+    if (mgctx) {
+        ctx->mg_ctx = mgctx;
+        return (EST_ERR_NONE);
+    } else {
+#ifndef DISABLE_PTHREADS
+        est_enroll_batch_stop(ctx);
+#endif
+        return (EST_ERR_NO_SSL_CTX);
+    }
+}
+
+/*! @brief est_server_stop() is used by an application to stop
+    the EST server.  This should be called prior to est_destroy().
+ 
+    @param ctx Pointer to the EST context
+
+    libest uses HTTP code from the Mongoose HTTP server.
+    This function allows the application to stop the HTTP
+    services layer.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_stop (EST_CTX *ctx)
+{
+    EST_MG_CONTEXT *mgctx;
+
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+	return (EST_ERR_NO_CTX);
+    }
+
+    mgctx = (EST_MG_CONTEXT*)ctx->mg_ctx;
+    if (mgctx) {
+        mg_stop(mgctx);
+    }
+#ifndef DISABLE_PTHREADS
+    /*
+     * Worker threads may have been waiting on a batch, so the
+     * dispatcher is only stopped once they are gone.
+     */
+    est_enroll_batch_stop(ctx);
+#endif
+    if (ctx->csrattrs_cache) {
+	est_csrattrs_cache_quiesce(ctx->csrattrs_cache);
+    }
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_server_init() is used by an application to create
+    a context in the EST library when operating as an EST server that
+    fronts a CA.  This context is used when invoking other functions in the API.
+ 
+    @param ca_chain     Char array containing PEM encoded CA certs & CRL entries 
+    @param ca_chain_len Length of ca_chain char array 
+    @param cacerts_resp_chain Char array containing PEM encoded CA certs to include
+                              in the /cacerts response
+    @param cacerts_resp_chain_len Length of cacerts_resp_chain char array
+    @param cert_format Specifies the encoding of the local and external
+                       certificate chains (PEM/DER).  
+    @param http_realm Char array containing HTTP realm name for HTTP auth
+    @param tls_id_cert Pointer to X509 that contains the server's certificate
+                    for the TLS layer.
+    @param tls_id_key Pointer to EVP_PKEY that contains the private key
+                   associated with the server's certificate.
+
+    This function allows an application to initialize an EST server context
+    that is used with a CA (not an RA).
+    The application must provide the trusted CA certificates to use
+    for server operation using the ca_chain parameter.  This certificate
+    set should include the explicit trust anchor certificate, any number
+    of implicit trust anchor certificates, and any intermediate sub-CA
+    certificates required to complete the chain of trust between the
+    identity certificate passed into the tls_id_cert parameter and the
+    root certificate for that identity certificate.  
+    The CA certificates should be encoded using
+    the format specified in the cert_format parameter (e.g. PEM) and
+    may contain CRL entries that will be used when authenticating
+    EST clients connecting to the server.  
+    The applications must also provide the HTTP realm to use for 
+    HTTP authentication and the server cerificate/private key to use
+    for the TLS stack to identify the server.
+    
+    Warning: Including additional intermediate sub-CA certificates that are
+             not needed to complete the chain of trust may result in a
+	     potential MITM attack.  
+ 
+    @return EST_CTX.
+ */
+EST_CTX * est_server_init (unsigned char *ca_chain, int ca_chain_len,
+                           unsigned char *cacerts_resp_chain, int cacerts_resp_chain_len,
+			   EST_CERT_FORMAT cert_format,
+                           char *http_realm, 
+			   X509 *tls_id_cert, EVP_PKEY *tls_id_key)
+{
+    EST_CTX *ctx;
+    int len;
+
+    est_log_version();
+
+    /*
+     * Sanity check the input
+     */
+    if (ca_chain == NULL) {
+        EST_LOG_ERR("Trusted CA certificate set is empty");
+        return NULL;
+    }
+    if (cacerts_resp_chain == NULL) {
+        EST_LOG_ERR("CA certificates response set is empty");
+        return NULL;
+    }
+
+    if (cert_format != EST_CERT_FORMAT_PEM) {
+        EST_LOG_ERR("Only PEM encoding of certificate changes is supported.");
+        return NULL;
+    }
+
+    /* 
+     * Check the length value, it should match.
+     * We are not using safelib here because the max
+     * string length in safelib is 4096, which isn't
+     * enough to hold all the CA certs 
+     */
+    len = (int) strnlen((char *)ca_chain, EST_CA_MAX);
+    if (len != ca_chain_len) {
+	EST_LOG_ERR("Length of ca_chain doesn't match ca_chain_len");
+        return NULL;
+    }
+    len = (int) strnlen((char *)cacerts_resp_chain, EST_CA_MAX);
+    if (len != cacerts_resp_chain_len) {
+	EST_LOG_ERR("Length of cacerts_resp_chain doesn't match cacerts_resp_chain_len");
+        return NULL;
+    }
+
+    if (tls_id_cert == NULL) {
+        EST_LOG_ERR("TLS identity cert is empty");
+        return NULL;
+    }
+
+    if (tls_id_key == NULL) {
+        EST_LOG_ERR("Private key associated with TLS identity cert is empty");
+        return NULL;
+    }
+    if (http_realm == NULL) {
+        EST_LOG_ERR("EST HTTP realm is NULL");
+        return NULL;
+    }
+
+    ctx = malloc(sizeof(EST_CTX));
+    if (!ctx) {
+        EST_LOG_ERR("malloc failed");
+        return NULL;
+    }
+    memset(ctx, 0, sizeof(EST_CTX));
+    ctx->est_mode = EST_SERVER;
+    ctx->retry_period = EST_RETRY_PERIOD_DEF;
+    ctx->conn_pool_size = EST_CONN_POOL_DEF;
+    ctx->max_content_len = EST_MAX_CONTENT_LEN_DEF;
+    ctx->require_http_auth = HTTP_AUTH_REQUIRED;
+
+    /*
+     * Load the CA certificates into local memory and retain
+     * for future use.  This will be used for /cacerts requests.
+     */
+    if (est_load_ca_certs(ctx, cacerts_resp_chain, cacerts_resp_chain_len)) {
+        EST_LOG_ERR("Failed to load CA certificates response buffer");
+	free(ctx);
+        return NULL;
+    }
+    if (est_load_trusted_certs(ctx, ca_chain, ca_chain_len)) {
+        EST_LOG_ERR("Failed to load trusted certficate store");
+	free(ctx);
+        return NULL;
+    }
+
+    strncpy(ctx->realm, http_realm, MAX_REALM);
+    ctx->server_cert = tls_id_cert;
+    ctx->server_priv_key = tls_id_key;
+    ctx->auth_mode = AUTH_BASIC;
+    ctx->nonce_lifetime = EST_NONCE_LIFETIME_DEF;
+    ctx->server_enable_pop = 1;
+
+    /* 
+     * Create a new ASN object for the id-kp-cmcRA OID.  
+     * OpenSSL doesn't define this, so we need to create it
+     * ourselves.
+     * http://www.openssl.org/docs/crypto/OBJ_nid2obj.html
+     */
+    if (!o_cmcRA) {
+	o_cmcRA = OBJ_txt2obj("1.3.6.1.5.5.7.3.28", 1);
+	if (!o_cmcRA) {
+	    EST_LOG_WARN("Failed to create OID for id-kp-cmcRA key usage checks");
+	}
+    }
+
+    if (est_stats_new(ctx) != EST_ERR_NONE) {
+	est_destroy(ctx);
+	return NULL;
+    }
+
+    return (ctx);
+}
+
+/*! @brief est_server_set_auth_mode() is used by an application to configure
+    the HTTP authentication method to use for validating the identity of
+    and EST client.
+ 
+    @param ctx Pointer to the EST context
+    @param amode Should be either AUTH_BASIC or AUTH_DIGEST
+
+    This function can optionally be invoked by the application to change
+    the default HTTP authentication mode.  The default mode is HTTP Basic
+    authentication.  An application may desire to use Digest authentication
+    instead, in which case this function can be used to set that mode.  
+    This function should be invoked prior to starting the EST server.  
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_auth_mode (EST_CTX *ctx, EST_HTTP_AUTH_MODE amode)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    switch (amode) {
+    case AUTH_BASIC:
+    case AUTH_DIGEST:
+	if (FIPS_mode()) {
+	    /*
+	     * Since HTTP digest auth uses MD5, make sure we're
+	     * not in FIPS mode.
+	     */
+	    EST_LOG_ERR("HTTP digest auth not allowed while in FIPS mode");
+	    return (EST_ERR_BAD_MODE);
+	}
+	if (amode == AUTH_DIGEST && !ctx->nonces) {
+	    ctx->nonces = calloc(1, sizeof(struct est_nonce_table));
+	    if (!ctx->nonces) {
+		return (EST_ERR_MALLOC);
+	    }
+	}
+	ctx->auth_mode = amode;
+	return (EST_ERR_NONE);
+	break;
+    default:
+        EST_LOG_ERR("Unsupported HTTP authentication mode, only Basic and Digest allowed");
+	return (EST_ERR_BAD_MODE);
+	break;
+    }
+}
+
+/*! @brief est_server_set_auth_nonce_lifetime() is used by an application
+    to set how long a nonce issued for HTTP digest authentication is
+    accepted.
+ 
+    @param ctx Pointer to the EST context
+    @param seconds Lifetime of a nonce, from EST_NONCE_LIFETIME_MIN to
+                   EST_NONCE_LIFETIME_MAX
+
+    The server remembers every nonce it issues along with the highest
+    nonce count used with it.  A client may keep using a nonce for
+    later requests by increasing the nonce count, which saves the
+    round trip needed to obtain a new one.  A request with a nonce
+    that has expired, was not issued by this server, or repeats a
+    nonce count is challenged again with a new nonce and stale=true.
+    The default lifetime is EST_NONCE_LIFETIME_DEF seconds.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_auth_nonce_lifetime (EST_CTX *ctx, int seconds)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (seconds < EST_NONCE_LIFETIME_MIN || seconds > EST_NONCE_LIFETIME_MAX) {
+        EST_LOG_ERR("Invalid nonce lifetime: %d", seconds);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    ctx->nonce_lifetime = seconds;
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_set_ca_enroll_cb() is used by an application to install
+    a handler for signing incoming PKCS10 requests.  
+ 
+    @param ctx Pointer to the EST context
+    @param cb Function address of the handler
+
+    This function must be called prior to starting the EST server.  The
+    callback function must match the following prototype:
+
+        int func(unsigned char*, int, unsigned char**, int*, char*, X509*)
+
+    This function is called by libest when a certificate request
+    needs to be signed by the CA server.  The application will need
+    to forward the request to the signing authority and return
+    the response.  The response should be a PKCS7 signed certificate.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_set_ca_enroll_cb (EST_CTX *ctx, int (*cb)(unsigned char *pkcs10, int p10_len,
+                                                  unsigned char **pkcs7, int *pkcs7_len,
+						  char *user_id, X509 *peer_cert,
+						  void *ex_data))
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    ctx->est_enroll_pkcs10_cb = cb;
+
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_set_ca_reenroll_cb() is used by an application to install
+    a handler for re-enrolling certificates.  
+ 
+    @param ctx Pointer to the EST context
+    @param cb Function address of the handler
+
+    This function must be called prior to starting the EST server.  The
+    callback function must match the following prototype:
+
+        int func(unsigned char*, int, unsigned char**, int*, char*, X509*)
+
+    This function is called by libest when a certificate 
+    needs to be renewed by the CA server.  The application will need
+    to forward the request to the signing authority and return
+    the response.  The response should be a PKCS7 signed certificate.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_set_ca_reenroll_cb (EST_CTX *ctx, int (*cb)(unsigned char *pkcs10, int p10_len,
+                                                  unsigned char **pkcs7, int *pkcs7_len,
+						  char *user_id, X509 *peer_cert,
+						  void *ex_data))
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    ctx->est_reenroll_pkcs10_cb = cb;
+
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_set_ca_enroll_csr_cb() is used by an application to
+    install a handler for signing certificate requests that receives
+    the request already decoded.
+ 
+    @param ctx Pointer to the EST context
+    @param cb Function address of the handler
+
+    This function must be called prior to starting the EST server.  The
+    callback function must match the following prototype:
+
+        int func(X509_REQ*, unsigned char*, int, unsigned char**, int*, char*, X509*, void*)
+
+    This is an alternative to est_set_ca_enroll_cb().  libest decodes
+    each CSR once and uses the result for its own checks; this handler
+    is given the parsed X509_REQ along with its DER encoding so the CA
+    doesn't need to decode the request again.  Both are owned by libest
+    and are only valid for the duration of the call.  When both
+    handlers are installed this one is used.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_set_ca_enroll_csr_cb (EST_CTX *ctx, int (*cb)(X509_REQ *csr,
+                                                      unsigned char *der, int der_len,
+                                                      unsigned char **pkcs7, int *pkcs7_len,
+                                                      char *user_id, X509 *peer_cert,
+                                                      void *ex_data))
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    ctx->est_enroll_csr_cb = cb;
+
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_set_ca_reenroll_csr_cb() is used by an application to
+    install a handler for re-enrolling certificates that receives
+    the request already decoded.
+ 
+    @param ctx Pointer to the EST context
+    @param cb Function address of the handler
+
+    This function must be called prior to starting the EST server.  The
+    callback function must match the following prototype:
+
+        int func(X509_REQ*, unsigned char*, int, unsigned char**, int*, char*, X509*, void*)
+
+    This is the re-enroll counterpart of est_set_ca_enroll_csr_cb(),
+    and is used in preference to the handler installed with
+    est_set_ca_reenroll_cb().
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_set_ca_reenroll_csr_cb (EST_CTX *ctx, int (*cb)(X509_REQ *csr,
+                                                        unsigned char *der, int der_len,
+                                                        unsigned char **pkcs7, int *pkcs7_len,
+                                                        char *user_id, X509 *peer_cert,
+                                                        void *ex_data))
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    ctx->est_reenroll_csr_cb = cb;
+
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_set_ca_enroll_x509_cb() is used by an application to
+    install a handler for signing certificate requests that returns
+    the issued certificate as an X509.
+ 
+    @param ctx Pointer to the EST context
+    @param cb Function address of the handler
+
+    This function must be called prior to starting the EST server.  The
+    callback function must match the following prototype:
+
+        int func(X509_REQ*, unsigned char*, int, X509**, char*, X509*, void*)
+
+    The CSR is passed in the same way as with est_set_ca_enroll_csr_cb().
+    Instead of a base64 encoded PKCS7 the handler sets the X509 pointer
+    to the certificate it issued, ownership of which passes to libest.
+    libest wraps the certificate in a certs-only PKCS7 for the client,
+    followed by the chain set with est_server_set_enroll_chain().  Any
+    other return value than EST_ERR_NONE is handled as it is for the
+    other enrollment handlers.  When installed, this handler is used in
+    preference to the ones set with est_set_ca_enroll_csr_cb() and
+    est_set_ca_enroll_cb().
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_set_ca_enroll_x509_cb (EST_CTX *ctx, int (*cb)(X509_REQ *csr,
+                                                       unsigned char *der, int der_len,
+                                                       X509 **cert,
+                                                       char *user_id, X509 *peer_cert,
+                                                       void *ex_data))
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    ctx->est_enroll_x509_cb = cb;
+
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_set_ca_reenroll_x509_cb() is used by an application to
+    install a handler for re-enrolling certificates that returns the
+    issued certificate as an X509.
+ 
+    @param ctx Pointer to the EST context
+    @param cb Function address of the handler
+
+    This function must be called prior to starting the EST server.  The
+    callback function must match the following prototype:
+
+        int func(X509_REQ*, unsigned char*, int, X509**, char*, X509*, void*)
+
+    This is the re-enroll counterpart of est_set_ca_enroll_x509_cb(),
+    and is used in preference to the handlers installed with
+    est_set_ca_reenroll_csr_cb() and est_set_ca_reenroll_cb().
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_set_ca_reenroll_x509_cb (EST_CTX *ctx, int (*cb)(X509_REQ *csr,
+                                                         unsigned char *der, int der_len,
+                                                         X509 **cert,
+                                                         char *user_id, X509 *peer_cert,
+                                                         void *ex_data))
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    ctx->est_reenroll_x509_cb = cb;
+
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_server_set_enroll_chain() is used by an application to
+    set the certificates sent along with each certificate issued
+    through est_set_ca_enroll_x509_cb() or est_set_ca_reenroll_x509_cb().
+ 
+    @param ctx Pointer to the EST context
+    @param chain Certificates to send after the issued one, usually
+                 the chain of the issuing CA.  NULL sends the issued
+                 certificate alone, which is the default.
+
+    The chain is encoded once here, libest keeps no reference to it.
+    The certificates are sent in the order of the stack.
+
+    This function must be called prior to starting the EST server.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_enroll_chain (EST_CTX *ctx, STACK_OF(X509) *chain)
+{
+    unsigned char *der = NULL, *p;
+    int der_len = 0, len, i;
+
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (ctx->est_mode != EST_SERVER) {
+        return (EST_ERR_BAD_MODE);
+    }
+
+    for (i = 0; chain && i < sk_X509_num(chain); i++) {
+        len = i2d_X509(sk_X509_value(chain, i), NULL);
+        if (len <= 0) {
+            EST_LOG_ERR("Unable to encode certificate %d of the chain", i);
+            ossl_dump_ssl_errors();
+            return (EST_ERR_INVALID_PARAMETERS);
         }
-	if (!ct) {
-            EST_LOG_WARN("Incoming HTTP header has no Content-Type header\n");
-	    return (EST_ERR_BAD_CONTENT_TYPE); 
-	}
-        if (est_handle_keygen(ctx)) {
-            est_send_http_error(ctx, http_ctx, 0); //FIXME: last param should not be zero
-            return (EST_ERR_HTTP_WRITE);           //FIXME: need the appropriate return code
+        if (len > EST_CA_MAX - der_len) {
+            EST_LOG_ERR("Enrollment chain is too large");
+            return (EST_ERR_INVALID_PARAMETERS);
         }
+        der_len += len;
     }
-#endif
-
-    /*
-     * See if this is a CSR attributes request
-     */
-    else if (strncmp(uri, EST_CSR_ATTRS_URI, EST_URI_MAX_LEN) == 0) {
-        /* Only GET is allowed */
-        if (strncmp(method, "GET", 4)) {
-            EST_LOG_WARN("Incoming HTTP request used wrong method\n");
-            est_send_http_error(ctx, http_ctx, EST_ERR_WRONG_METHOD);
-            return (EST_ERR_WRONG_METHOD);
+    if (der_len) {
+        der = malloc(der_len);
+        if (!der) {
+            EST_LOG_ERR("malloc failure");
+            return (EST_ERR_MALLOC);
         }
-
-        rc = est_handle_csr_attrs(ctx, http_ctx);
-	if (rc != EST_ERR_NONE) {
-            est_send_http_error(ctx, http_ctx, rc); 
-            return (rc);
+        p = der;
+        for (i = 0; i < sk_X509_num(chain); i++) {
+            i2d_X509(sk_X509_value(chain, i), &p);
         }
     }
 
-    /*
-     * Send a 404 error if the URI didn't match 
-     */
-    else {
-        est_send_http_error(ctx, http_ctx, EST_ERR_HTTP_NOT_FOUND);
+    if (ctx->enroll_chain) {
+        free(ctx->enroll_chain);
     }
-
+    ctx->enroll_chain = der;
+    ctx->enroll_chain_len = der_len;
     return (EST_ERR_NONE);
 }
 
-
-/*! @brief est_server_start() is used by an application to start
-    the EST server after est_server_init() has been called and
-    all the required callback functions have been provided by
-    the application.   
+/*! @brief est_set_ca_enroll_async_cb() is used by an application to
+    install a handler for signing certificate requests that answers
+    at a later time, from any thread.
  
     @param ctx Pointer to the EST context
+    @param cb Function address of the handler
 
-    libest uses HTTP code from the Mongoose HTTP server.
-    This function allows the application to start the HTTP
-    services layer, which is required by EST.
+    This function must be called prior to starting the EST server.  The
+    callback function must match the following prototype:
+
+        int func(EST_ENROLL_REQ*, X509_REQ*, unsigned char*, int, char*, X509*, void*)
+
+    The handler is given the same decoded request as the handler
+    installed with est_set_ca_enroll_csr_cb(), along with a handle for
+    the request.  It should queue the request and return EST_ERR_NONE
+    without waiting for the CA, the application later finishes the
+    request with est_server_enroll_complete() or est_server_enroll_fail().
+    Any other return value fails the request straight away, in the
+    same way as for the synchronous handlers.  The X509_REQ and DER
+    encoding remain valid until the request is finished, the user ID
+    and peer certificate only for the duration of the call.
+
+    Connections driven through est_server_conn_on_event() are parked
+    while the CA works on the request when a handler has been installed
+    with est_server_set_enroll_wakeup_cb().  In all other cases the
+    thread that received the request waits for it to be finished.
+    When both handlers are installed this one is used.  This handler
+    requires pthreads.
  
     @return EST_ERROR.
  */
-EST_ERROR est_server_start (EST_CTX *ctx)
+EST_ERROR est_set_ca_enroll_async_cb (EST_CTX *ctx, int (*cb)(EST_ENROLL_REQ *req,
+                                                        X509_REQ *csr,
+                                                        unsigned char *der, int der_len,
+                                                        char *user_id, X509 *peer_cert,
+                                                        void *ex_data))
 {
-    EST_MG_CONTEXT *mgctx;
-
     if (!ctx) {
 	EST_LOG_ERR("Null context");
-	return (EST_ERR_NO_CTX);
+        return (EST_ERR_NO_CTX);
     }
 
-    mgctx = mg_start(ctx);
-    if (mgctx) {
-        ctx->mg_ctx = mgctx;
-        return (EST_ERR_NONE);
-    } else {
-        return (EST_ERR_NO_SSL_CTX);
-    }
+#ifndef DISABLE_PTHREADS
+    ctx->est_enroll_async_cb = cb;
+
+    return (EST_ERR_NONE);
+#else
+    EST_LOG_ERR("Asynchronous enrollment requires pthreads");
+    return (EST_ERR_BAD_MODE);
+#endif
 }
 
-/*! @brief est_server_stop() is used by an application to stop
-    the EST server.  This should be called prior to est_destroy().
+/*! @brief est_set_ca_reenroll_async_cb() is used by an application to
+    install a handler for re-enrolling certificates that answers at
+    a later time, from any thread.
  
     @param ctx Pointer to the EST context
+    @param cb Function address of the handler
 
-    libest uses HTTP code from the Mongoose HTTP server.
-    This function allows the application to stop the HTTP
-    services layer.
+    This function must be called prior to starting the EST server.  The
+    callback function must match the following prototype:
+
+        int func(EST_ENROLL_REQ*, X509_REQ*, unsigned char*, int, char*, X509*, void*)
+
+    This is the re-enroll counterpart of est_set_ca_enroll_async_cb(),
+    and is used in preference to the other re-enroll handlers.
  
     @return EST_ERROR.
  */
-EST_ERROR est_server_stop (EST_CTX *ctx)
+EST_ERROR est_set_ca_reenroll_async_cb (EST_CTX *ctx, int (*cb)(EST_ENROLL_REQ *req,
+                                                          X509_REQ *csr,
+                                                          unsigned char *der, int der_len,
+                                                          char *user_id, X509 *peer_cert,
+                                                          void *ex_data))
 {
-    EST_MG_CONTEXT *mgctx;
-
     if (!ctx) {
 	EST_LOG_ERR("Null context");
-	return (EST_ERR_NO_CTX);
+        return (EST_ERR_NO_CTX);
     }
 
-    mgctx = (EST_MG_CONTEXT*)ctx->mg_ctx;
-    if (mgctx) {
-        mg_stop(mgctx);
-    }
+#ifndef DISABLE_PTHREADS
+    ctx->est_reenroll_async_cb = cb;
+
     return (EST_ERR_NONE);
+#else
+    EST_LOG_ERR("Asynchronous enrollment requires pthreads");
+    return (EST_ERR_BAD_MODE);
+#endif
 }
 
-/*! @brief est_server_init() is used by an application to create
-    a context in the EST library when operating as an EST server that
-    fronts a CA.  This context is used when invoking other functions in the API.
+/*! @brief est_set_ca_enroll_batch_cb() is used by an application to
+    install a handler that signs certificate requests in batches.
  
-    @param ca_chain     Char array containing PEM encoded CA certs & CRL entries 
-    @param ca_chain_len Length of ca_chain char array 
-    @param cacerts_resp_chain Char array containing PEM encoded CA certs to include
-                              in the /cacerts response
-    @param cacerts_resp_chain_len Length of cacerts_resp_chain char array
-    @param cert_format Specifies the encoding of the local and external
-                       certificate chains (PEM/DER).  
-    @param http_realm Char array containing HTTP realm name for HTTP auth
-    @param tls_id_cert Pointer to X509 that contains the server's certificate
-                    for the TLS layer.
-    @param tls_id_key Pointer to EVP_PKEY that contains the private key
-                   associated with the server's certificate.
+    @param ctx Pointer to the EST context
+    @param cb Function address of the handler, or NULL to stop batching
+    @param max_batch Largest number of requests handed over at once,
+                     from 1 to EST_ENROLL_BATCH_MAX
+    @param max_wait_ms Longest time in milliseconds a request waits for
+                       others to join its batch, from 0 to
+                       EST_ENROLL_BATCH_WAIT_MAX
 
-    This function allows an application to initialize an EST server context
-    that is used with a CA (not an RA).
-    The application must provide the trusted CA certificates to use
-    for server operation using the ca_chain parameter.  This certificate
-    set should include the explicit trust anchor certificate, any number
-    of implicit trust anchor certificates, and any intermediate sub-CA
-    certificates required to complete the chain of trust between the
-    identity certificate passed into the tls_id_cert parameter and the
-    root certificate for that identity certificate.  
-    The CA certificates should be encoded using
-    the format specified in the cert_format parameter (e.g. PEM) and
-    may contain CRL entries that will be used when authenticating
-    EST clients connecting to the server.  
-    The applications must also provide the HTTP realm to use for 
-    HTTP authentication and the server cerificate/private key to use
-    for the TLS stack to identify the server.
-    
-    Warning: Including additional intermediate sub-CA certificates that are
-             not needed to complete the chain of trust may result in a
-	     potential MITM attack.  
+    This function must be called prior to starting the EST server.  The
+    callback function must match the following prototype:
+
+        int func(EST_ENROLL_ITEM*, int, void*)
+
+    Requests are gathered by a thread that libest starts along with
+    the server.  Once max_batch requests are waiting, or the first of
+    them has waited max_wait_ms, the handler is invoked from that
+    thread with the whole batch.  It fills in the result of each item
+    before returning, and a return value other than EST_ERR_NONE fails
+    every request in the batch.  The items are only valid for the
+    duration of the call.  This handler is used for both enroll and
+    re-enroll requests, in preference to all of the other handlers.
+
+    Connections are parked or wait for their batch in the same way as
+    for est_set_ca_enroll_async_cb(), so a server that should scale
+    to many concurrent requests is best driven through
+    est_server_conn_on_event().  This handler requires pthreads.
  
-    @return EST_CTX.
+    @return EST_ERROR.
  */
-EST_CTX * est_server_init (unsigned char *ca_chain, int ca_chain_len,
-                           unsigned char *cacerts_resp_chain, int cacerts_resp_chain_len,
-			   EST_CERT_FORMAT cert_format,
-                           char *http_realm, 
-			   X509 *tls_id_cert, EVP_PKEY *tls_id_key)
+EST_ERROR est_set_ca_enroll_batch_cb (EST_CTX *ctx,
+                                      int (*cb)(EST_ENROLL_ITEM *items, int count,
+                                                void *ex_data),
+                                      int max_batch, int max_wait_ms)
 {
-    EST_CTX *ctx;
-    int len;
+#ifndef DISABLE_PTHREADS
+    struct est_enroll_batch *batch;
+#endif
 
-    est_log_version();
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
 
-    /*
-     * Sanity check the input
-     */
-    if (ca_chain == NULL) {
-        EST_LOG_ERR("Trusted CA certificate set is empty");
-        return NULL;
+#ifndef DISABLE_PTHREADS
+    if (ctx->enroll_batch && ctx->enroll_batch->running) {
+        EST_LOG_ERR("Batch handler must be set before the server is started");
+        return (EST_ERR_BAD_MODE);
     }
-    if (cacerts_resp_chain == NULL) {
-        EST_LOG_ERR("CA certificates response set is empty");
-        return NULL;
+    if (cb && (max_batch < 1 || max_batch > EST_ENROLL_BATCH_MAX ||
+               max_wait_ms < 0 || max_wait_ms > EST_ENROLL_BATCH_WAIT_MAX)) {
+        EST_LOG_ERR("Invalid batch size %d or wait %d ms", max_batch, max_wait_ms);
+        return (EST_ERR_INVALID_PARAMETERS);
     }
 
-    if (cert_format != EST_CERT_FORMAT_PEM) {
-        EST_LOG_ERR("Only PEM encoding of certificate changes is supported.");
-        return NULL;
+    est_server_free_enroll_batch(ctx);
+    if (!cb) {
+        return (EST_ERR_NONE);
     }
 
-    /* 
-     * Check the length value, it should match.
-     * We are not using safelib here because the max
-     * string length in safelib is 4096, which isn't
-     * enough to hold all the CA certs 
-     */
-    len = (int) strnlen((char *)ca_chain, EST_CA_MAX);
-    if (len != ca_chain_len) {
-	EST_LOG_ERR("Length of ca_chain doesn't match ca_chain_len");
-        return NULL;
+    batch = calloc(1, sizeof(struct est_enroll_batch));
+    if (!batch) {
+        EST_LOG_ERR("malloc failure");
+        return (EST_ERR_MALLOC);
     }
-    len = (int) strnlen((char *)cacerts_resp_chain, EST_CA_MAX);
-    if (len != cacerts_resp_chain_len) {
-	EST_LOG_ERR("Length of cacerts_resp_chain doesn't match cacerts_resp_chain_len");
-        return NULL;
+    batch->reqs = calloc(max_batch, sizeof(EST_ENROLL_REQ *));
+    batch->items = calloc(max_batch, sizeof(EST_ENROLL_ITEM));
+    if (!batch->reqs || !batch->items) {
+        EST_LOG_ERR("malloc failure");
+        free(batch->reqs);
+        free(batch->items);
+        free(batch);
+        return (EST_ERR_MALLOC);
     }
+    batch->cb = cb;
+    batch->max_batch = max_batch;
+    batch->max_wait_ms = max_wait_ms;
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+    ctx->enroll_batch = batch;
 
-    if (tls_id_cert == NULL) {
-        EST_LOG_ERR("TLS identity cert is empty");
-        return NULL;
-    }
+    return (EST_ERR_NONE);
+#else
+    EST_LOG_ERR("Batch enrollment requires pthreads");
+    return (EST_ERR_BAD_MODE);
+#endif
+}
 
-    if (tls_id_key == NULL) {
-        EST_LOG_ERR("Private key associated with TLS identity cert is empty");
-        return NULL;
-    }
-    if (http_realm == NULL) {
-        EST_LOG_ERR("EST HTTP realm is NULL");
-        return NULL;
-    }
+/*! @brief est_server_set_enroll_wakeup_cb() is used by an application
+    with its own event loop to learn when a parked enrollment can
+    be resumed.
+ 
+    @param ctx Pointer to the EST context
+    @param cb Function address of the handler
 
-    ctx = malloc(sizeof(EST_CTX));
+    When est_server_conn_on_event() returns EST_CONN_EV_ENROLL the
+    connection is waiting on the CA, and the application should stop
+    polling its socket.  Once the request is finished this handler is
+    invoked with the connection, on the thread that invoked
+    est_server_enroll_complete() or est_server_enroll_fail().  It
+    should only arrange for the event loop to invoke
+    est_server_conn_on_event() for the connection again, it must not
+    invoke any libest function itself.  The callback function must
+    match the following prototype:
+
+        void func(EST_SERVER_CONN*, void*)
+
+    An application that keeps watching the socket of a parked
+    connection may finish the connection first, so the handler can
+    be invoked for a connection that has since been released.
+    Without this handler connections are not parked, the thread
+    driving the connection waits for the CA instead.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_enroll_wakeup_cb (EST_CTX *ctx,
+                                           void (*cb)(EST_SERVER_CONN *conn,
+                                                      void *ex_data))
+{
     if (!ctx) {
-        EST_LOG_ERR("malloc failed");
-        return NULL;
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
     }
-    memset(ctx, 0, sizeof(EST_CTX));
-    ctx->est_mode = EST_SERVER;
-    ctx->retry_period = EST_RETRY_PERIOD_DEF;
-    ctx->require_http_auth = HTTP_AUTH_REQUIRED;
 
-    /*
-     * Load the CA certificates into local memory and retain
-     * for future use.  This will be used for /cacerts requests.
-     */
-    if (est_load_ca_certs(ctx, cacerts_resp_chain, cacerts_resp_chain_len)) {
-        EST_LOG_ERR("Failed to load CA certificates response buffer");
-	free(ctx);
-        return NULL;
-    }
-    if (est_load_trusted_certs(ctx, ca_chain, ca_chain_len)) {
-        EST_LOG_ERR("Failed to load trusted certficate store");
-	free(ctx);
-        return NULL;
-    }
+    ctx->est_enroll_wakeup_cb = cb;
 
-    strncpy(ctx->realm, http_realm, MAX_REALM);
-    ctx->server_cert = tls_id_cert;
-    ctx->server_priv_key = tls_id_key;
-    ctx->auth_mode = AUTH_BASIC;
-    ctx->server_enable_pop = 1;
+    return (EST_ERR_NONE);
+}
 
-    /* 
-     * Create a new ASN object for the id-kp-cmcRA OID.  
-     * OpenSSL doesn't define this, so we need to create it
-     * ourselves.
-     * http://www.openssl.org/docs/crypto/OBJ_nid2obj.html
-     */
-    if (!o_cmcRA) {
-	o_cmcRA = OBJ_txt2obj("1.3.6.1.5.5.7.3.28", 1);
-	if (!o_cmcRA) {
-	    EST_LOG_WARN("Failed to create OID for id-kp-cmcRA key usage checks");
-	}
-    }
+/*! @brief est_server_enroll_complete() is used by an application to
+    finish a request it accepted through an asynchronous enrollment
+    handler with a signed certificate.
+ 
+    @param req Handle that was given to the enrollment handler
+    @param pkcs7 The base64 encoded PKCS7 response, allocated with malloc()
+    @param pkcs7_len Length of the response
 
-    return (ctx);
+    This may be invoked from any thread.  When EST_ERR_NONE is returned
+    libest takes ownership of the pkcs7 buffer, and the handle must not
+    be used again.  A missing response fails the request.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_enroll_complete (EST_ENROLL_REQ *req, unsigned char *pkcs7,
+                                      int pkcs7_len)
+{
+#ifndef DISABLE_PTHREADS
+    if (!pkcs7 || pkcs7_len <= 0) {
+        return (est_enroll_req_finish(req, EST_ERR_CA_ENROLL_FAIL, pkcs7, 0));
+    }
+    return (est_enroll_req_finish(req, EST_ERR_NONE, pkcs7, pkcs7_len));
+#else
+    return (EST_ERR_BAD_MODE);
+#endif
 }
 
-/*! @brief est_server_set_auth_mode() is used by an application to configure
-    the HTTP authentication method to use for validating the identity of
-    and EST client.
+/*! @brief est_server_enroll_fail() is used by an application to
+    finish a request it accepted through an asynchronous enrollment
+    handler without a certificate.
  
-    @param ctx Pointer to the EST context
-    @param amode Should be either AUTH_BASIC or AUTH_DIGEST
+    @param req Handle that was given to the enrollment handler
+    @param code EST_ERR_CA_ENROLL_RETRY to ask the client to try again
+                later, any other value rejects the request.
 
-    This function can optionally be invoked by the application to change
-    the default HTTP authentication mode.  The default mode is HTTP Basic
-    authentication.  An application may desire to use Digest authentication
-    instead, in which case this function can be used to set that mode.  
-    This function should be invoked prior to starting the EST server.  
+    This may be invoked from any thread.  When EST_ERR_NONE is returned
+    the handle must not be used again.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_enroll_fail (EST_ENROLL_REQ *req, EST_ERROR code)
+{
+#ifndef DISABLE_PTHREADS
+    if (code != EST_ERR_CA_ENROLL_RETRY) {
+        code = EST_ERR_CA_ENROLL_FAIL;
+    }
+    return (est_enroll_req_finish(req, code, NULL, 0));
+#else
+    return (EST_ERR_BAD_MODE);
+#endif
+}
 
+/*! @brief est_server_enable_pending_table() is used by an application
+    to have libest remember the enrollments the CA asked to be retried.
+ 
+    @param ctx Pointer to the EST context
+    @param max_entries Most enrollments remembered at once, from 1 to
+                       EST_PENDING_ENTRIES_MAX
+    @param lifetime Seconds an enrollment is remembered, from 1 to
+                    EST_PENDING_LIFETIME_MAX
+
+    When a CA handler answers EST_ERR_CA_ENROLL_RETRY the public key
+    of the CSR is recorded, along with the user ID and certificate
+    the client authenticated with.  Until the CA posts an answer with
+    est_server_approve_pending() or est_server_reject_pending(),
+    the same client polling with a CSR for the same public key is
+    told to retry again without the CA handler being invoked.  The
+    poll must still pass authentication and the CSR signature and
+    PoP checks.  Once posted the answer is sent on the next poll by
+    that client and forgotten.  Enrollments not polled for within
+    lifetime are dropped and the next poll goes to the CA handler
+    again.
+
+    This function must be called prior to starting the EST server.
+    Calling it again discards the enrollments remembered so far.
+ 
     @return EST_ERROR.
  */
-EST_ERROR est_server_set_auth_mode (EST_CTX *ctx, EST_HTTP_AUTH_MODE amode)
+EST_ERROR est_server_enable_pending_table (EST_CTX *ctx, int max_entries,
+                                           int lifetime)
 {
+    struct est_pending_table *table;
+    unsigned int nbuckets = 1;
+
     if (!ctx) {
 	EST_LOG_ERR("Null context");
         return (EST_ERR_NO_CTX);
     }
 
-    switch (amode) {
-    case AUTH_BASIC:
-    case AUTH_DIGEST:
-	if (FIPS_mode()) {
-	    /*
-	     * Since HTTP digest auth uses MD5, make sure we're
-	     * not in FIPS mode.
-	     */
-	    EST_LOG_ERR("HTTP digest auth not allowed while in FIPS mode");
-	    return (EST_ERR_BAD_MODE);
-	}
-	ctx->auth_mode = amode;
-	return (EST_ERR_NONE);
-	break;
-    default:
-        EST_LOG_ERR("Unsupported HTTP authentication mode, only Basic and Digest allowed");
-	return (EST_ERR_BAD_MODE);
-	break;
+    if (ctx->est_mode != EST_SERVER) {
+        return (EST_ERR_BAD_MODE);
     }
-}
 
-/*! @brief est_set_ca_enroll_cb() is used by an application to install
-    a handler for signing incoming PKCS10 requests.  
- 
-    @param ctx Pointer to the EST context
-    @param cb Function address of the handler
+    if (max_entries < 1 || max_entries > EST_PENDING_ENTRIES_MAX ||
+        lifetime < 1 || lifetime > EST_PENDING_LIFETIME_MAX) {
+        EST_LOG_ERR("Invalid pending table size %d or lifetime %d",
+                    max_entries, lifetime);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
 
-    This function must be called prior to starting the EST server.  The
-    callback function must match the following prototype:
+    table = calloc(1, sizeof(struct est_pending_table));
+    if (!table) {
+        EST_LOG_ERR("malloc failure");
+        return (EST_ERR_MALLOC);
+    }
+    while (nbuckets < (unsigned int)max_entries) {
+        nbuckets <<= 1;
+    }
+    table->buckets = calloc(nbuckets, sizeof(EST_PENDING *));
+    if (!table->buckets) {
+        EST_LOG_ERR("malloc failure");
+        free(table);
+        return (EST_ERR_MALLOC);
+    }
+    table->mask = nbuckets - 1;
+    table->max_entries = max_entries;
+    table->lifetime = lifetime;
 
-        int func(unsigned char*, int, unsigned char**, int*, char*, X509*)
+    est_server_free_pending(ctx);
+    ctx->pending = table;
+    return (EST_ERR_NONE);
+}
 
-    This function is called by libest when a certificate request
-    needs to be signed by the CA server.  The application will need
-    to forward the request to the signing authority and return
-    the response.  The response should be a PKCS7 signed certificate.
- 
-    @return EST_ERROR.
+/*
+ * Common code for posting the CA's answer to a pending enrollment
  */
-EST_ERROR est_set_ca_enroll_cb (EST_CTX *ctx, int (*cb)(unsigned char *pkcs10, int p10_len,
-                                                  unsigned char **pkcs7, int *pkcs7_len,
-						  char *user_id, X509 *peer_cert,
-						  void *ex_data))
+static EST_ERROR est_server_post_pending (EST_CTX *ctx, EVP_PKEY *pub_key,
+                                          EST_PENDING_STATE state,
+                                          unsigned char *pkcs7, int pkcs7_len)
 {
+    unsigned char key[SHA256_DIGEST_LENGTH];
+    unsigned char *copy = NULL;
+
     if (!ctx) {
 	EST_LOG_ERR("Null context");
         return (EST_ERR_NO_CTX);
     }
 
-    ctx->est_enroll_pkcs10_cb = cb;
+    if (!ctx->pending) {
+        EST_LOG_ERR("Pending table is not enabled");
+        return (EST_ERR_BAD_MODE);
+    }
 
-    return (EST_ERR_NONE);
+    if (!pub_key) {
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    if (est_pending_key(pub_key, key)) {
+        return (EST_ERR_X509_PUBKEY);
+    }
+
+    if (pkcs7) {
+        copy = malloc(pkcs7_len);
+        if (!copy) {
+            EST_LOG_ERR("malloc failure");
+            return (EST_ERR_MALLOC);
+        }
+        memcpy(copy, pkcs7, pkcs7_len);
+    }
+    return (est_pending_post(ctx, key, NULL, state, copy, pkcs7_len, 1));
 }
 
-/*! @brief est_set_ca_reenroll_cb() is used by an application to install
-    a handler for re-enrolling certificates.  
+/*! @brief est_server_approve_pending() is used by an application to
+    post the certificate for an enrollment the CA asked to be retried.
  
     @param ctx Pointer to the EST context
-    @param cb Function address of the handler
+    @param pub_key Public key from the client's CSR
+    @param pkcs7 The base64 encoded PKCS7 response
+    @param pkcs7_len Length of the response
+
+    The certificate is sent to the client on its next poll, see
+    est_server_enable_pending_table().  The answer may be posted
+    before the client was told to retry, including from within the
+    CA handler.  This may be invoked from any thread.  The pkcs7
+    buffer remains owned by the caller.
+
+    When the table is full, the enrollment closest to expiring
+    that has no answer yet is dropped to make room.  If every
+    entry holds an answer EST_ERR_PENDING_FULL is returned and
+    the approval is not recorded.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_approve_pending (EST_CTX *ctx, EVP_PKEY *pub_key,
+                                      unsigned char *pkcs7, int pkcs7_len)
+{
+    if (!pkcs7 || pkcs7_len <= 0) {
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    return (est_server_post_pending(ctx, pub_key, EST_PENDING_APPROVED,
+                                    pkcs7, pkcs7_len));
+}
 
-    This function must be called prior to starting the EST server.  The
-    callback function must match the following prototype:
+/*! @brief est_server_reject_pending() is used by an application to
+    turn down an enrollment the CA asked to be retried.
+ 
+    @param ctx Pointer to the EST context
+    @param pub_key Public key from the client's CSR
 
-        int func(unsigned char*, int, unsigned char**, int*, char*, X509*)
+    The client's next poll fails, see est_server_enable_pending_table().
+    This may be invoked from any thread.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_reject_pending (EST_CTX *ctx, EVP_PKEY *pub_key)
+{
+    return (est_server_post_pending(ctx, pub_key, EST_PENDING_REJECTED,
+                                    NULL, 0));
+}
 
-    This function is called by libest when a certificate 
-    needs to be renewed by the CA server.  The application will need
-    to forward the request to the signing authority and return
-    the response.  The response should be a PKCS7 signed certificate.
+/*! @brief est_server_set_enroll_cache() is used by an application
+    to have libest remember the certificates it recently sent to
+    clients.
+ 
+    @param ctx Pointer to the EST context
+    @param max_entries Most certificates remembered at once, up to
+                       EST_ENROLL_CACHE_ENTRIES_MAX.  Zero disables
+                       the cache, which is the default.
+    @param window Seconds a certificate is remembered, from 1 to
+                  EST_ENROLL_CACHE_WINDOW_MAX
+
+    A client that loses the response to an enrollment often sends
+    the same CSR again.  With the cache enabled such a request is
+    answered with the certificate issued the first time, without
+    the CSR being verified again or the CA being asked to sign it
+    a second time.  A request only matches when the CSR is
+    identical, it arrived on the same enroll or re-enroll URI, and
+    the client authenticated with the same HTTP user ID and TLS
+    certificate.  The least recently used certificate is dropped
+    when the cache is full.
+
+    This function must be called prior to starting the EST server.
+    Calling it again discards the certificates remembered so far.
  
     @return EST_ERROR.
  */
-EST_ERROR est_set_ca_reenroll_cb (EST_CTX *ctx, int (*cb)(unsigned char *pkcs10, int p10_len,
-                                                  unsigned char **pkcs7, int *pkcs7_len,
-						  char *user_id, X509 *peer_cert,
-						  void *ex_data))
+EST_ERROR est_server_set_enroll_cache (EST_CTX *ctx, int max_entries,
+                                       int window)
 {
+    struct est_enroll_cache *cache;
+    unsigned int nbuckets = 1;
+
     if (!ctx) {
 	EST_LOG_ERR("Null context");
         return (EST_ERR_NO_CTX);
     }
 
-    ctx->est_reenroll_pkcs10_cb = cb;
+    if (ctx->est_mode != EST_SERVER) {
+        return (EST_ERR_BAD_MODE);
+    }
+
+    if (max_entries < 0 || max_entries > EST_ENROLL_CACHE_ENTRIES_MAX ||
+        (max_entries && (window < 1 || window > EST_ENROLL_CACHE_WINDOW_MAX))) {
+        EST_LOG_ERR("Invalid enroll cache size %d or window %d",
+                    max_entries, window);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
 
+    est_server_free_enroll_cache(ctx);
+    if (!max_entries) {
+        return (EST_ERR_NONE);
+    }
+
+    cache = calloc(1, sizeof(struct est_enroll_cache));
+    if (!cache) {
+        EST_LOG_ERR("malloc failure");
+        return (EST_ERR_MALLOC);
+    }
+    while (nbuckets < (unsigned int)max_entries) {
+        nbuckets <<= 1;
+    }
+    cache->buckets = calloc(nbuckets, sizeof(EST_ENROLL_CACHE_ENTRY *));
+    if (!cache->buckets) {
+        EST_LOG_ERR("malloc failure");
+        free(cache);
+        return (EST_ERR_MALLOC);
+    }
+    cache->mask = nbuckets - 1;
+    cache->max_entries = max_entries;
+    cache->window = window;
+    ctx->enroll_cache = cache;
     return (EST_ERR_NONE);
 }
 
@@ -1776,6 +4289,57 @@ EST_ERROR est_set_csr_cb (EST_CTX *ctx, unsigned char *(*cb)(int*csr_len, void *
     return (EST_ERR_NONE);
 }
 
+/*! @brief est_server_set_csrattrs_cache_ttl() is used by an application
+    to keep the CSR attributes returned by the est_get_csr_cb handler
+    for a while, rather than asking for them on every request.
+ 
+    @param ctx Pointer to the EST context
+    @param seconds How long the attributes are used before the handler
+                   is asked again, from 1 to EST_CSRATTRS_CACHE_TTL_MAX,
+                   or 0 to disable caching
+
+    This function must be called prior to starting the EST server.
+    Caching is disabled by default.  The response to the first CSR
+    attributes request is kept once it has been checked.  When it
+    expires, it is refreshed in the background by a thread libest
+    starts, and clients keep receiving the previous response until
+    the refresh completes.  Should the handler fail or return invalid
+    attributes, the previous response stays in use and the handler
+    is asked again 30 seconds later, or after the TTL if it is
+    shorter.  Calling this
+    function again discards anything cached, which an application
+    may do when its attributes change.
+ 
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_csrattrs_cache_ttl (EST_CTX *ctx, int seconds)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (ctx->est_mode != EST_SERVER) {
+        return (EST_ERR_BAD_MODE);
+    }
+
+    if (seconds < 0 || seconds > EST_CSRATTRS_CACHE_TTL_MAX) {
+        EST_LOG_ERR("Invalid CSR attributes cache TTL: %d", seconds);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    est_server_free_csrattrs_cache(ctx);
+    ctx->csrattrs_cache_ttl = seconds;
+    if (!seconds) {
+        return (EST_ERR_NONE);
+    }
+    ctx->csrattrs_cache = calloc(1, sizeof(struct est_csrattrs_cache));
+    if (!ctx->csrattrs_cache) {
+        return (EST_ERR_MALLOC);
+    }
+    return (EST_ERR_NONE);
+}
+
 /*! @brief est_set_http_auth_cb() is used by an application to install
     a handler for authenticating EST clients.
  
@@ -2085,6 +4649,8 @@ EST_ERROR est_server_init_csrattrs (EST_CTX *ctx, char *csrattrs, int csrattrs_l
 {
     int csrattrs_pop_len, pop_present, rv;
     char *csrattrs_data_pop = NULL;
+    EST_OID_SET *set;
+    EST_ERROR err;
 
     if (ctx == NULL) {
         return (EST_ERR_NO_CTX);
@@ -2106,6 +4672,7 @@ EST_ERROR est_server_init_csrattrs (EST_CTX *ctx, char *csrattrs, int csrattrs_l
         ctx->server_csrattrs = NULL;
         ctx->server_csrattrs_len = 0;
     }
+    est_oid_set_swap(ctx, &ctx->csrattrs_set, NULL);
 
     /* caller just wanted to clear it, so return */
     if (csrattrs == NULL) {
@@ -2168,6 +4735,21 @@ EST_ERROR est_server_init_csrattrs (EST_CTX *ctx, char *csrattrs, int csrattrs_l
     if (csrattrs_data_pop) {
       free(csrattrs_data_pop);
     }
+
+    /*
+     * Compile the attributes now so enforcement doesn't have to
+     * decode them for every request.  Attributes larger than
+     * enforcement allows are still served by /csrattrs, but every
+     * enroll is refused while enforcement is enabled.
+     */
+    set = est_server_compile_csrattrs((char *)ctx->server_csrattrs,
+                                      ctx->server_csrattrs_len, &err);
+    if (set) {
+        est_oid_set_swap(ctx, &ctx->csrattrs_set, set);
+    } else {
+        EST_LOG_WARN("CSR attributes can't be enforced, error %s",
+                     EST_ERR_NUM_TO_STR(err));
+    }
     EST_LOG_INFO("Attributes pointer is %d, len=%d", ctx->server_csrattrs, 
 		 ctx->server_csrattrs_len);
     return (EST_ERR_NONE);
@@ -2197,3 +4779,189 @@ EST_ERROR est_server_enforce_csrattr (EST_CTX *ctx)
     ctx->enforce_csrattrs = 1;
     return (EST_ERR_NONE);
 }
+
+/*! @brief est_server_set_listen_backlog() is used by an application to
+    set the backlog passed to listen() by est_server_run().
+
+    @param ctx Pointer to the EST context
+    @param backlog Maximum number of pending connections queued by
+           the kernel.  Pass in zero to use SOMAXCONN, which is
+           the default.
+
+    This function must be called prior to est_server_run().
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_listen_backlog (EST_CTX *ctx, int backlog)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (backlog < 0) {
+	EST_LOG_ERR("Invalid listen backlog %d", backlog);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    ctx->listen_backlog = backlog;
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_server_set_listen_family() is used by an application to
+    select the address family of the socket opened by est_server_run().
+
+    @param ctx Pointer to the EST context
+    @param family Either AF_INET or AF_INET6.  The default is AF_INET.
+
+    This function must be called prior to est_server_run().
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_listen_family (EST_CTX *ctx, int family)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (family != AF_INET && family != AF_INET6) {
+	EST_LOG_ERR("Address family must be AF_INET or AF_INET6");
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    ctx->listen_family = family;
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_server_set_worker_queue_len() is used by an application
+    to set how many accepted connections may wait for each worker
+    thread started by est_server_run().
+
+    @param ctx Pointer to the EST context
+    @param len Number of connections queued per worker.  When every
+           queue is full, the listener stops accepting and new
+           connections wait in the listen backlog.
+
+    This function must be called prior to est_server_run().
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_worker_queue_len (EST_CTX *ctx, int len)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (len < 1 || len > EST_WORKER_QUEUE_LEN_MAX) {
+	EST_LOG_ERR("Worker queue length must be between 1 and %d",
+		EST_WORKER_QUEUE_LEN_MAX);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    ctx->worker_queue_len = len;
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_server_set_conn_pool_size() is used by an application
+    to set how many released connection objects are kept for reuse.
+
+    @param ctx Pointer to the EST context
+    @param size Maximum number of idle connection objects to keep.
+           Pass in zero to disable pooling.
+
+    Each connection object holds the request buffer and the OpenSSL
+    SSL object used for a client connection.  Keeping them on a pool
+    avoids allocating and initializing these for every incoming
+    connection.  The default pool size is 32.
+
+    This function may be called at any time after a context has
+    been created.
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_conn_pool_size (EST_CTX *ctx, int size)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (size < 0 || size > EST_CONN_POOL_MAX) {
+	EST_LOG_ERR("Connection pool size must be between 0 and %d",
+		EST_CONN_POOL_MAX);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    ctx->conn_pool_size = size;
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_server_set_max_content_len() is used by an application
+    to set the largest HTTP request body the server will accept.
+
+    @param ctx Pointer to the EST context
+    @param len Maximum Content-Length in bytes
+
+    Requests announcing a larger body are answered with a
+    413 Request Too Large and the connection is closed.  The
+    default of 65536 bytes leaves room for CSRs carrying large
+    RSA or composite keys.  Bodies that fit in the connection's
+    receive buffer are handed to the EST layer in place, larger
+    bodies are read into a separate buffer.
+
+    This function may be called at any time after a context has
+    been created.
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_max_content_len (EST_CTX *ctx, int len)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (len < 1 || len > EST_MAX_CONTENT_LEN_MAX) {
+	EST_LOG_ERR("Max content length must be between 1 and %d",
+		EST_MAX_CONTENT_LEN_MAX);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    ctx->max_content_len = len;
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_server_get_stats() is used by an application to retrieve
+    the request counters kept by the EST server.
+
+    @param ctx Pointer to the EST context
+    @param stats Receives a snapshot of the counters
+
+    The server counts requests and responses, client authentication
+    outcomes, failed TLS handshakes and the bytes received and sent.
+    It also keeps histograms of the time spent on each request, and
+    on each stage of enroll requests.  Counting doesn't take any
+    locks, so the snapshot may be slightly out of date for requests
+    being processed while it is taken.  Use est_stats_to_prometheus()
+    to format the snapshot for a Prometheus server.
+
+    This function may be called at any time after a context has
+    been created.
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_get_stats (EST_CTX *ctx, EST_STATS *stats)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (ctx->est_mode != EST_SERVER) {
+        return (EST_ERR_BAD_MODE);
+    }
+
+    return (est_stats_get(ctx, stats));
+}
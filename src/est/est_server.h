@@ -19,10 +19,16 @@
 void est_send_http_error(EST_CTX *ctx, void *http_ctx, int fail_code);
 int est_enroll_auth(EST_CTX *ctx, void *http_ctx, SSL *ssl, int reenroll); 
 int est_handle_cacerts(EST_CTX *ctx, void *http_ctx); 
-int est_tls_uid_auth(EST_CTX *ctx, SSL *ssl, X509_REQ *req); 
-X509_REQ * est_server_parse_csr(unsigned char *pkcs10, int pkcs10_len);
+int est_tls_uid_auth(EST_CTX *ctx, void *http_ctx, SSL *ssl, X509_REQ *req); 
+EST_CSR * est_server_csr_decode(unsigned char *pkcs10, int pkcs10_len);
+void est_server_csr_free(EST_CSR *csr);
 int est_server_check_csr(X509_REQ *req); 
 EST_ERROR est_server_send_http_retry_after(EST_CTX *ctx, void *http_ctx, int delay);
+int est_server_enroll_pending(EST_ENROLL_REQ *req);
+void est_server_enroll_resume(void *http_ctx);
+void est_server_enroll_detach(EST_ENROLL_REQ *req);
+void est_server_conn_auth_clear(EST_CONN_AUTH *auth);
+EST_ERROR est_server_new_nonce(EST_CTX *ctx, char *nonce);
 
 #endif
 
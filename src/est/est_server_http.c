@@ -39,6 +39,8 @@
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 #include <openssl/x509v3.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #if defined(_WIN32)
 #define _CRT_SECURE_NO_WARNINGS // Disable deprecation warning in VS2005
 #else
@@ -69,6 +71,12 @@
 #include <fcntl.h>
 #endif // !_WIN32_WCE
 
+#ifndef _WIN32
+#include <netdb.h>
+#include <poll.h>
+#include <sys/mman.h>
+#endif
+
 #include <time.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -348,12 +356,36 @@ char *skip (char **buf, const char *delimiters)
 }
 
 
+// Map a header name to its slot in known_headers, or -1 if libest
+// doesn't track it.  The length check rejects most names without a
+// string comparison.
+static int known_header_id (const char *name, size_t len)
+{
+    switch (len) {
+    case 10:
+        return mg_strcasecmp(name, "Connection") ? -1 : MG_HDR_CONNECTION;
+    case 12:
+        return mg_strcasecmp(name, "Content-Type") ? -1 : MG_HDR_CONTENT_TYPE;
+    case 13:
+        return mg_strcasecmp(name, "Authorization") ? -1 : MG_HDR_AUTHORIZATION;
+    case 14:
+        return mg_strcasecmp(name, "Content-Length") ? -1 : MG_HDR_CONTENT_LENGTH;
+    default:
+        return -1;
+    }
+}
+
 // Return HTTP header value, or NULL if not found.
 static const char *get_header (const struct mg_request_info *ri,
                                const char *name)
 {
     int i;
 
+    i = known_header_id(name, strlen(name));
+    if (i >= 0) {
+        return ri->known_headers[i];
+    }
+
     for (i = 0; i < ri->num_headers; i++) {
         if (!mg_strcasecmp(name, ri->http_headers[i].name)) {
             return ri->http_headers[i].value;
@@ -404,8 +436,9 @@ void mg_send_http_error (struct mg_connection *conn, int status,
                          const char *reason, const char *fmt, ...)
 {
     char buf[MG_BUF_LEN];
+    char hdr[EST_HTTP_HDR_MAX];
     va_list ap;
-    int len;
+    int len, hdr_len;
 
     conn->status_code = status;
     conn->request_info.ev_data = (void*)(long)status;
@@ -423,11 +456,13 @@ void mg_send_http_error (struct mg_connection *conn, int status,
     }
     EST_LOG_INFO("[%s]", buf);
 
-    mg_printf(conn, "HTTP/1.1 %d %s\r\n"
-              "Content-Length: %d\r\n"
-              "Connection: %s\r\n\r\n", status, reason, len,
-              suggest_connection_header(conn));
-    conn->num_bytes_sent += mg_printf(conn, "%s", buf);
+    hdr_len = mg_snprintf(conn, hdr, sizeof(hdr), "HTTP/1.1 %d %s\r\n"
+                          "Content-Length: %d\r\n"
+                          "Connection: %s\r\n\r\n", status, reason, len,
+                          suggest_connection_header(conn));
+    if (mg_write_response(conn, hdr, hdr_len, buf, len)) {
+        conn->num_bytes_sent += len;
+    }
 }
 
 #if defined(_WIN32) && !defined(__SYMBIAN32__)
@@ -535,7 +570,8 @@ static int64_t push (FILE *fp, SOCKET sock, SSL *ssl, const char *buf,
 // with a timeout, and when returned, check the context for the stop flag.
 // If it is set, we return 0, and this means that we must not continue
 // reading, must give up and close the connection and exit serving thread.
-static int wait_until_socket_is_readable (struct mg_connection *conn)
+static int wait_until_socket_is_ready (struct mg_connection *conn,
+                                       int for_write)
 {
     int result;
     struct timeval tv;
@@ -546,8 +582,9 @@ static int wait_until_socket_is_readable (struct mg_connection *conn)
         tv.tv_usec = 300 * 1000;
         FD_ZERO(&set);
         FD_SET(conn->client.sock, &set);
-        result = select(conn->client.sock + 1, &set, NULL, NULL, &tv);
-        if (result == 0 && conn->ssl != NULL) {
+        result = select(conn->client.sock + 1, for_write ? NULL : &set,
+                        for_write ? &set : NULL, NULL, &tv);
+        if (result == 0 && !for_write && conn->ssl != NULL) {
             result = SSL_pending(conn->ssl);
         }
     } while ((result == 0 || (result < 0 && ERRNO == EINTR)) &&
@@ -556,6 +593,11 @@ static int wait_until_socket_is_readable (struct mg_connection *conn)
     return conn->ctx->stop_flag || result < 0 ? 0 : 1;
 }
 
+static int wait_until_socket_is_readable (struct mg_connection *conn)
+{
+    return wait_until_socket_is_ready(conn, 0);
+}
+
 // Read from IO channel - opened file descriptor, socket, or SSL descriptor.
 // Return negative value on error, or number of bytes read on success.
 static int pull (FILE *fp, struct mg_connection *conn, char *buf, int len)
@@ -634,7 +676,9 @@ int mg_read (struct mg_connection *conn, void *buf, size_t len)
         }
 
         // We have returned all buffered data. Read new data from the remote socket.
-        while (len > 0) {
+        // A non-blocking connection always has the whole body buffered
+        // before the request is handled, so it never reads here.
+        while (len > 0 && !conn->nonblocking) {
             n = pull(NULL, conn, (char*)buf, (int)len);
             if (n < 0) {
                 nread = n; // Propagate the error
@@ -652,15 +696,87 @@ int mg_read (struct mg_connection *conn, void *buf, size_t len)
     return nread;
 }
 
+// Append data to the connection's response queue.  Used instead of
+// writing to the socket when the connection is non-blocking, the
+// queue is flushed by the connection engine once the handler returns.
+// Return number of bytes queued, 0 on allocation failure.
+static int queue_output (struct mg_connection *conn, const char *buf, int len)
+{
+    char *new_buf;
+    int new_size;
+
+    if (conn->wbuf_len + len > conn->wbuf_size) {
+        new_size = conn->wbuf_size ? conn->wbuf_size : MG_BUF_LEN;
+        while (new_size < conn->wbuf_len + len) {
+            new_size *= 2;
+        }
+        new_buf = (char*)realloc(conn->wbuf, (size_t)new_size);
+        if (new_buf == NULL) {
+            cry(conn, "%s: cannot queue %d bytes, OOM", __func__, len);
+            return 0;
+        }
+        conn->wbuf = new_buf;
+        conn->wbuf_size = new_size;
+    }
+    memcpy(conn->wbuf + conn->wbuf_len, buf, (size_t)len);
+    conn->wbuf_len += len;
+    return len;
+}
+
 int mg_write (struct mg_connection *conn, const void *buf, size_t len)
 {
     int64_t total;
 
-    total = push(NULL, conn->client.sock, conn->ssl, (const char*)buf,
-                 (int64_t)len);
+    if (conn->nonblocking) {
+        total = queue_output(conn, (const char*)buf, (int)len);
+    } else {
+        total = push(NULL, conn->client.sock, conn->ssl, (const char*)buf,
+                     (int64_t)len);
+    }
+    est_stats_bytes(conn->ctx->est_ctx, 0, total);
     return (int)total;
 }
 
+// Send a complete response, header and body, as one unit.  A small
+// response is gathered into the connection's write buffer, which is
+// retained across requests and pooled connections, so it is handed to
+// SSL_write() as a single buffer instead of one call per part.  That
+// saves a TLS record and a send() for every response.  A blocking
+// connection writes a larger body straight from the caller's buffer
+// after the header, as one more record costs less than copying it.
+// Return number of bytes written or queued, 0 on failure.
+int mg_write_response (struct mg_connection *conn, const char *hdr, int hdr_len,
+                       const void *body, int body_len)
+{
+    int start = conn->wbuf_len;
+    int64_t total;
+
+    if (!conn->nonblocking && hdr_len + body_len > MG_BUF_LEN) {
+        total = push(NULL, conn->client.sock, conn->ssl, hdr, (int64_t)hdr_len);
+        if (total == hdr_len && body_len > 0) {
+            total += push(NULL, conn->client.sock, conn->ssl,
+                          (const char*)body, (int64_t)body_len);
+        }
+        est_stats_bytes(conn->ctx->est_ctx, 0, total);
+        return (total == hdr_len + body_len ? (int)total : 0);
+    }
+    if (!queue_output(conn, hdr, hdr_len) ||
+        (body_len > 0 && !queue_output(conn, (const char*)body, body_len))) {
+        conn->wbuf_len = start;
+        return 0;
+    }
+    if (conn->nonblocking) {
+        // Flushed by the connection engine
+        est_stats_bytes(conn->ctx->est_ctx, 0, hdr_len + body_len);
+        return (hdr_len + body_len);
+    }
+    total = push(NULL, conn->client.sock, conn->ssl, conn->wbuf + start,
+                 (int64_t)(hdr_len + body_len));
+    conn->wbuf_len = start;
+    est_stats_bytes(conn->ctx->est_ctx, 0, total);
+    return (total == hdr_len + body_len ? (int)total : 0);
+}
+
 int mg_printf (struct mg_connection *conn, const char *fmt, ...)
 {
     char mem[MG_BUF_LEN], *buf = mem;
@@ -731,30 +847,57 @@ static int url_decode (const char *src, int src_len, char *dst,
     return i >= src_len ? j : -1;
 }
 
-// Check whether full request is buffered. Return:
+// Character classes used when framing a request.  Control characters
+// are not allowed in the request headers, but >=128 is.
+#define REQ_CH_OK   0
+#define REQ_CH_BAD  1
+#define REQ_CH_LF   2
+static const unsigned char req_char_class[256] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 1, 1, 0, 1, 1,  // 0x00, \r is ok
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x10
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x20
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,  // 0x7f is DEL
+    // 0x80 - 0xff are all allowed
+};
+
+// Check whether full request is buffered.  The search resumes where
+// the previous call left off, *scanned holds the number of bytes
+// already known not to complete the headers, so a request that
+// arrives in many small reads is only scanned once.  Return:
 //   -1  if request is malformed
 //    0  if request is not yet fully buffered
 //   >0  actual request length, including last \r\n\r\n
-static int get_request_len (const char *buf, int buflen)
-{
-    const char *s, *e;
-    int len = 0;
-
-    for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++) {
-        // Control characters are not allowed but >=128 is.
-        if (!isprint(*(const unsigned char*)s) && *s != '\r' &&
-            *s != '\n' && *(const unsigned char*)s < 128) {
-            len = -1;
-            break; // [i_a] abort scan as soon as one malformed character is found; don't let subsequent \r\n\r\n win us over anyhow
-        } else if (s[0] == '\n' && s[1] == '\n') {
-            len = (int)(s - buf) + 2;
-        } else if (s[0] == '\n' && &s[1] < e &&
-                   s[1] == '\r' && s[2] == '\n') {
-            len = (int)(s - buf) + 3;
+static int scan_request_len (const char *buf, int buflen, int *scanned)
+{
+    const unsigned char *s = (const unsigned char*)buf;
+    int i;
+
+    // A terminator may straddle the previous end of data
+    i = *scanned > 2 ? *scanned - 2 : 0;
+    for (; i < buflen; i++) {
+        switch (req_char_class[s[i]]) {
+        case REQ_CH_OK:
+            continue;
+        case REQ_CH_BAD:
+            // [i_a] abort scan as soon as one malformed character is found
+            return -1;
+        default:
+            // \n\n or \n\r\n ends the headers
+            if (i + 1 < buflen && s[i + 1] == '\n') {
+                return i + 2;
+            }
+            if (i + 2 < buflen && s[i + 1] == '\r' && s[i + 2] == '\n') {
+                return i + 3;
+            }
+            break;
         }
     }
-
-    return len;
+    *scanned = buflen;
+    return 0;
 }
 
 // Protect against directory disclosure attack by removing '..',
@@ -968,8 +1111,10 @@ EST_HTTP_AUTH_HDR_RESULT mg_parse_auth_header (struct mg_connection *conn,
     return EST_AUTH_HDR_GOOD;
 }
 
-void mg_send_authorization_request (struct mg_connection *conn)
+void mg_send_authorization_request (struct mg_connection *conn, int stale)
 {
+    char nonce[MAX_NONCE + 1];
+
     conn->status_code = 401;
     switch (conn->ctx->est_ctx->auth_mode) {
     case AUTH_BASIC:
@@ -983,16 +1128,24 @@ void mg_send_authorization_request (struct mg_connection *conn)
               conn->ctx->est_ctx->realm);
 	break;
     case AUTH_DIGEST:
+	/*
+	 * The nonce is remembered so the client may reuse it,
+	 * see est_server_set_auth_nonce_lifetime().
+	 */
+	if (est_server_new_nonce(conn->ctx->est_ctx, nonce) != EST_ERR_NONE) {
+	    est_send_http_error(conn->ctx->est_ctx, conn, EST_ERR_UNKNOWN);
+	    break;
+	}
 	mg_printf(conn,
               "%s\r\n"
               "%s: 0\r\n"
               "%s: Digest qop=\"auth\", "
-              "realm=\"%s\", nonce=\"%lu\"\r\n\r\n",
+              "realm=\"%s\", nonce=\"%s\"%s\r\n\r\n",
 	      EST_HTTP_HDR_401,
 	      EST_HTTP_HDR_CL,
 	      EST_HTTP_HDR_AUTH,
               conn->ctx->est_ctx->realm,
-              (unsigned long)time(NULL));
+              nonce, stale ? ", stale=true" : "");
 	break;
     case AUTH_FAIL:
     case AUTH_NONE:
@@ -1008,15 +1161,23 @@ void mg_send_authorization_request (struct mg_connection *conn)
 // where parsing stopped.
 static void parse_http_headers (char **buf, struct mg_request_info *ri)
 {
-    int i;
+    int i, id;
+    char *name;
 
     for (i = 0; i < (int)ARRAY_SIZE(ri->http_headers); i++) {
+        name = *buf;
         ri->http_headers[i].name = skip_quoted(buf, ":", " ", 0);
         ri->http_headers[i].value = skip(buf, "\r\n");
         if (ri->http_headers[i].name[0] == '\0') {
             break;
         }
         ri->num_headers = i + 1;
+
+        // The first occurrence of a header wins, as in get_header()
+        id = known_header_id(name, strlen(name));
+        if (id >= 0 && ri->known_headers[id] == NULL) {
+            ri->known_headers[id] = ri->http_headers[i].value;
+        }
     }
 }
 
@@ -1029,14 +1190,16 @@ static int is_valid_http_method (const char *method)
 // Parse HTTP request, fill in mg_request_info structure.
 // This function modifies the buffer by NUL-terminating
 // HTTP request components, header names and header values.
-static int parse_http_message (char *buf, int len, struct mg_request_info *ri)
+// The request has already been framed, request_length is the value
+// returned by scan_request_len().
+static int parse_http_message (char *buf, int request_length,
+                               struct mg_request_info *ri)
 {
-    int request_length = get_request_len(buf, len);
-
     if (request_length > 0) {
         // Reset attributes. DO NOT TOUCH is_ssl, remote_ip, remote_port
         ri->remote_user = ri->request_method = ri->uri = ri->http_version = NULL;
         ri->num_headers = 0;
+        memset(ri->known_headers, 0, sizeof(ri->known_headers));
 
         buf[request_length - 1] = '\0';
 
@@ -1053,9 +1216,10 @@ static int parse_http_message (char *buf, int len, struct mg_request_info *ri)
     return request_length;
 }
 
-static int parse_http_request (char *buf, int len, struct mg_request_info *ri)
+static int parse_http_request (char *buf, int request_length,
+                               struct mg_request_info *ri)
 {
-    int result = parse_http_message(buf, len, ri);
+    int result = parse_http_message(buf, request_length, ri);
 
     if (result > 0 &&
         is_valid_http_method(ri->request_method) &&
@@ -1077,12 +1241,12 @@ static int read_request (FILE *fp, struct mg_connection *conn,
 {
     int request_len, n = 1;
 
-    request_len = get_request_len(buf, *nread);
+    request_len = scan_request_len(buf, *nread, &conn->scan_len);
     while (*nread < bufsiz && request_len == 0 && n >= 0) {
         n = pull(fp, conn, buf + *nread, bufsiz - *nread);
         if (n > 0) {
             *nread += n;
-            request_len = get_request_len(buf, *nread);
+            request_len = scan_request_len(buf, *nread, &conn->scan_len);
         }
     }
 
@@ -1093,37 +1257,60 @@ static int read_request (FILE *fp, struct mg_connection *conn,
     return request_len;
 }
 
-#define EST_MAX_CONTENT_LEN 8192
 /*
  * This function is called by the Mongoose code when an
  * incoming HTTP request is processed.
  * Returns 0 on success, non-zero if the request wasn't
  * handled.
+ *
+ * The Content-Length has already been checked against the
+ * configured maximum by prepare_request().  When the whole body
+ * is sitting in the receive buffer it's handed to the EST layer
+ * in place, the byte following it is saved and restored since
+ * it may belong to a pipelined request.
  */
 static int est_mg_handler (struct mg_connection *conn)
 {
     const struct mg_request_info *request_info = mg_get_request_info(conn);
     EST_CTX *ectx = conn->ctx->est_ctx;
     char *body;
+    char *alloc_body = NULL;
+    char saved = 0;
     int cl;
+    int in_place = 0;
     int est_rv = EST_ERR_NONE;
-    const char *cl_hdr; /* content length html header */
     const char *ct_hdr; /* content type html header */
-
-    cl_hdr = mg_get_header(conn, "Content-Length");
-    if (cl_hdr) {
-        cl = atoi(cl_hdr);
-	/*
-	 * Let's be defensive about the incoming content
-	 * length header from the client.
-	 */
-	if (cl > EST_MAX_CONTENT_LEN) {
-	    EST_LOG_WARN("HTTP request content length greater than %d", 
-		         EST_MAX_CONTENT_LEN);
-	    return (EST_ERR_BAD_CONTENT_LEN);
-	}
-        body = malloc(cl+1);
-        mg_read(conn, body, cl);
+    uint64_t start;
+
+    if (request_info->known_headers[MG_HDR_CONTENT_LENGTH] &&
+        conn->content_len > 0) {
+        cl = (int)conn->content_len;
+        if (conn->body) {
+            /*
+             * The non-blocking engine already read the body
+             * into its own buffer
+             */
+            body = conn->body;
+        } else if (conn->request_len + cl <= conn->data_len &&
+                   conn->request_len + cl < conn->buf_size) {
+            body = conn->buf + conn->request_len;
+            saved = body[cl];
+            in_place = 1;
+        } else {
+            alloc_body = malloc(cl + 1);
+            if (!alloc_body) {
+                EST_LOG_ERR("malloc failed");
+                conn->must_close = 1;
+                return (EST_ERR_MALLOC);
+            }
+            if (mg_read(conn, alloc_body, cl) != cl) {
+                EST_LOG_WARN("Connection closed before the request body was read");
+                free(alloc_body);
+                conn->must_close = 1;
+                return (EST_ERR_BAD_CONTENT_LEN);
+            }
+            body = alloc_body;
+        }
 	/* Make sure the buffer is null terminated */
 	body[cl] = 0x0;
     } else {
@@ -1131,6 +1318,7 @@ static int est_mg_handler (struct mg_connection *conn)
         body = NULL;
     }
     ct_hdr = mg_get_header(conn, "Content-Type");
+    start = est_stats_now();
     if (ectx->est_mode == EST_SERVER) {
         est_rv = est_http_request(ectx, conn,
                                   (char*)request_info->request_method,
@@ -1140,13 +1328,15 @@ static int est_mg_handler (struct mg_connection *conn)
                                         (char*)request_info->request_method,
                                         (char*)request_info->uri, body, cl, ct_hdr);
     }
+    est_stats_request(ectx, est_stats_uri(request_info->uri), start);
     if (est_rv != EST_ERR_NONE) {
         EST_LOG_ERR("EST error response code: %d (%s)\n", 
 		    est_rv, EST_ERR_NUM_TO_STR(est_rv));
     }
-    if (cl_hdr) {
-        free(body);
+    if (in_place) {
+        body[cl] = saved;
     }
+    free(alloc_body);
     return est_rv;
 }
 
@@ -1220,6 +1410,495 @@ static const char *ssl_error (void)
     return err == 0 ? "" : ERR_error_string(err, NULL);
 }
 
+/*
+ * TLS session resumption
+ *
+ * OpenSSL only caches sessions within a single process.  When several
+ * server processes share a listening address a client rarely returns
+ * to the process holding its session, so the application may supply
+ * an external cache through est_server_set_session_cache_cb(), or use
+ * the shared memory cache from est_server_set_shm_session_cache().
+ * Session tickets may be enabled instead, or in addition, by installing
+ * a key with est_server_add_ticket_key().
+ */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EST_SESS_ID_CONST
+#else
+#define EST_SESS_ID_CONST const
+#endif
+
+static int est_sess_new_cb (SSL *ssl, SSL_SESSION *sess)
+{
+    EST_CTX *ectx = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    unsigned char der[EST_SESS_DER_MAX];
+    unsigned char *p = der;
+    const unsigned char *id;
+    unsigned int id_len;
+    int der_len;
+
+    der_len = i2d_SSL_SESSION(sess, NULL);
+    if (der_len <= 0 || der_len > EST_SESS_DER_MAX) {
+        EST_LOG_INFO("TLS session not cached, encoded length %d", der_len);
+        return (0);
+    }
+    i2d_SSL_SESSION(sess, &p);
+    id = SSL_SESSION_get_id(sess, &id_len);
+    ectx->sess_new_cb(id, id_len, der, der_len,
+                      (time_t)(SSL_SESSION_get_time(sess) +
+                               SSL_SESSION_get_timeout(sess)),
+                      ectx->sess_cb_arg);
+    /* The session was copied, OpenSSL keeps its reference */
+    return (0);
+}
+
+static SSL_SESSION *est_sess_get_cb (SSL *ssl, EST_SESS_ID_CONST unsigned char *id,
+                                     int id_len, int *copy)
+{
+    EST_CTX *ectx = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    unsigned char der[EST_SESS_DER_MAX];
+    const unsigned char *p = der;
+    int der_len;
+
+    *copy = 0;
+    der_len = ectx->sess_get_cb(id, id_len, der, EST_SESS_DER_MAX,
+                                ectx->sess_cb_arg);
+    if (der_len <= 0 || der_len > EST_SESS_DER_MAX) {
+        return (NULL);
+    }
+    return (d2i_SSL_SESSION(NULL, &p, der_len));
+}
+
+static void est_sess_remove_cb (SSL_CTX *ssl_ctx, SSL_SESSION *sess)
+{
+    EST_CTX *ectx = SSL_CTX_get_app_data(ssl_ctx);
+    const unsigned char *id;
+    unsigned int id_len;
+
+    if (ectx->sess_remove_cb) {
+        id = SSL_SESSION_get_id(sess, &id_len);
+        ectx->sess_remove_cb(id, id_len, ectx->sess_cb_arg);
+    }
+}
+
+/*
+ * Session ticket callback.  New tickets are protected with the newest
+ * key.  Tickets protected with an older key are still accepted, but
+ * the client is sent a new ticket so it moves to the newest key.
+ */
+static int est_ticket_key_cb (SSL *ssl, unsigned char *key_name,
+                              unsigned char *iv, EVP_CIPHER_CTX *cctx,
+                              HMAC_CTX *hctx, int enc)
+{
+    EST_CTX *ectx = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    EST_TICKET_KEY key;
+    int i;
+    int rv = 0;
+
+    est_spin_lock(&ectx->ticket_keys_lock);
+    if (enc) {
+        if (ectx->num_ticket_keys) {
+            key = ectx->ticket_keys[0];
+            rv = 1;
+        }
+    } else {
+        for (i = 0; i < ectx->num_ticket_keys; i++) {
+            if (!memcmp(key_name, ectx->ticket_keys[i].name,
+                        sizeof(key.name))) {
+                key = ectx->ticket_keys[i];
+                rv = i ? 2 : 1;
+                break;
+            }
+        }
+    }
+    est_spin_unlock(&ectx->ticket_keys_lock);
+    if (!rv) {
+        /* Unknown key, fall back to a full handshake */
+        return (0);
+    }
+
+    if (enc) {
+        if (!RAND_bytes(iv, EVP_MAX_IV_LENGTH)) {
+            OPENSSL_cleanse(&key, sizeof(key));
+            return (-1);
+        }
+        memcpy(key_name, key.name, sizeof(key.name));
+        if (!EVP_EncryptInit_ex(cctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv)) {
+            rv = -1;
+        }
+    } else {
+        if (!EVP_DecryptInit_ex(cctx, EVP_aes_128_cbc(), NULL, key.aes_key, iv)) {
+            rv = -1;
+        }
+    }
+    if (rv > 0 && !HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key),
+                                EVP_sha256(), NULL)) {
+        rv = -1;
+    }
+    OPENSSL_cleanse(&key, sizeof(key));
+    if (rv < 0) {
+        EST_LOG_ERR("Unable to set up the session ticket cipher");
+        ossl_dump_ssl_errors();
+    }
+    return (rv);
+}
+
+/*
+ * Shared memory session cache.  The cache is a file mapped by every
+ * server process, divided into fixed size slots.  A session lives in
+ * the slot selected by a hash of its ID, replacing whatever was there.
+ *
+ * Each slot carries a sequence number that is odd while the slot is
+ * being written.  Writers claim a slot by bumping the sequence and
+ * give up when another writer holds it, readers retry nothing and
+ * treat a changed sequence as a miss.  No process ever waits on
+ * another one, so a process dying mid-update costs at most one slot.
+ */
+#define EST_SHM_SESS_MAGIC  0x45535331  /* "ESS1" */
+
+typedef struct {
+    volatile unsigned int seq;
+    unsigned int id_len;
+    unsigned int der_len;
+    time_t expires;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char der[EST_SESS_DER_MAX];
+} EST_SHM_SESS_SLOT;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int num_slots;
+    unsigned int slot_size;
+    EST_SHM_SESS_SLOT slots[1];
+} EST_SHM_SESS_CACHE;
+
+static EST_SHM_SESS_SLOT *est_shm_sess_slot (EST_SHM_SESS_CACHE *cache,
+                                             const unsigned char *id,
+                                             int id_len)
+{
+    unsigned int h = 2166136261U;
+    int i;
+
+    /* FNV-1a */
+    for (i = 0; i < id_len; i++) {
+        h = (h ^ id[i]) * 16777619U;
+    }
+    return (&cache->slots[h % cache->num_slots]);
+}
+
+static int est_shm_sess_new (const unsigned char *id, int id_len,
+                             const unsigned char *der, int der_len,
+                             time_t expires, void *arg)
+{
+    EST_SHM_SESS_SLOT *slot;
+    unsigned int seq;
+
+    if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH ||
+        der_len > EST_SESS_DER_MAX) {
+        return (0);
+    }
+    slot = est_shm_sess_slot(arg, id, id_len);
+    seq = slot->seq;
+    if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1)) {
+        return (0);
+    }
+    slot->id_len = id_len;
+    memcpy(slot->id, id, id_len);
+    slot->der_len = der_len;
+    memcpy(slot->der, der, der_len);
+    slot->expires = expires;
+    __sync_fetch_and_add(&slot->seq, 1);
+    return (1);
+}
+
+static int est_shm_sess_get (const unsigned char *id, int id_len,
+                             unsigned char *der, int der_max, void *arg)
+{
+    EST_SHM_SESS_SLOT *slot;
+    unsigned int seq;
+    int der_len;
+
+    if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return (0);
+    }
+    slot = est_shm_sess_slot(arg, id, id_len);
+    seq = slot->seq;
+    __sync_synchronize();
+    if (seq & 1) {
+        return (0);
+    }
+    der_len = slot->der_len;
+    if (slot->id_len != (unsigned int)id_len ||
+        memcmp(slot->id, id, id_len) ||
+        der_len <= 0 || der_len > der_max || der_len > EST_SESS_DER_MAX ||
+        slot->expires < time(NULL)) {
+        return (0);
+    }
+    memcpy(der, slot->der, der_len);
+    __sync_synchronize();
+    if (slot->seq != seq) {
+        return (0);
+    }
+    return (der_len);
+}
+
+static void est_shm_sess_remove (const unsigned char *id, int id_len,
+                                 void *arg)
+{
+    EST_SHM_SESS_SLOT *slot;
+    unsigned int seq;
+
+    if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) {
+        return;
+    }
+    slot = est_shm_sess_slot(arg, id, id_len);
+    seq = slot->seq;
+    if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1)) {
+        return;
+    }
+    if (slot->id_len == (unsigned int)id_len && !memcmp(slot->id, id, id_len)) {
+        slot->id_len = 0;
+        slot->der_len = 0;
+    }
+    __sync_fetch_and_add(&slot->seq, 1);
+}
+
+/*! @brief est_server_set_session_cache_cb() is used by an application
+    to store TLS sessions outside of the server process.
+
+    @param ctx Pointer to the EST context
+    @param new_cb Called with the DER encoded session after a full
+           handshake.  The session should be kept until the expires
+           time.  Return 1 if the session was stored, 0 otherwise.
+    @param get_cb Called with a session ID offered by a client.  Copy
+           the DER encoded session into der, which holds der_max bytes,
+           and return its length.  Return 0 when the session is unknown.
+    @param remove_cb Called when OpenSSL invalidates a session.  May be
+           NULL.
+    @param arg Passed unchanged to the callbacks.
+
+    OpenSSL keeps a session cache per process.  When several server
+    processes accept connections for the same address, a client is
+    unlikely to reach the process that holds its session and must do
+    a full handshake.  These callbacks let the application share the
+    sessions between processes, for example in memcached.  The callbacks
+    may be invoked from any thread handling a connection.
+
+    The TLS session ID context is derived from the server certificate
+    when an external cache is used, so every process using the same
+    certificate accepts the other processes' sessions.
+
+    This function must be called prior to est_server_start().  Pass in
+    NULL for new_cb and get_cb to remove the callbacks.
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_session_cache_cb (EST_CTX *ctx,
+                int (*new_cb)(const unsigned char *id, int id_len,
+                              const unsigned char *der, int der_len,
+                              time_t expires, void *arg),
+                int (*get_cb)(const unsigned char *id, int id_len,
+                              unsigned char *der, int der_max, void *arg),
+                void (*remove_cb)(const unsigned char *id, int id_len,
+                                  void *arg),
+                void *arg)
+{
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if ((new_cb == NULL) != (get_cb == NULL)) {
+	EST_LOG_ERR("Both the new and get session callbacks are required");
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    ctx->sess_new_cb = new_cb;
+    ctx->sess_get_cb = get_cb;
+    ctx->sess_remove_cb = new_cb ? remove_cb : NULL;
+    ctx->sess_cb_arg = arg;
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_server_set_shm_session_cache() is used by an application
+    to share TLS sessions between server processes on the same host.
+
+    @param ctx Pointer to the EST context
+    @param path Name of the file holding the cache.  The file is
+           created when it doesn't exist.
+    @param entries Number of sessions the cache can hold
+
+    The file is mapped into memory by every process using the cache, so
+    it should live on a memory backed file system such as /dev/shm.
+    Each entry takes about 4KB.  All processes must use the same number
+    of entries, a file created with a different size is rejected.  The
+    cache is installed using est_server_set_session_cache_cb() and
+    replaces any callbacks set earlier.
+
+    This function must be called prior to est_server_start().
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_set_shm_session_cache (EST_CTX *ctx, const char *path,
+                                            int entries)
+{
+#ifndef _WIN32
+    EST_SHM_SESS_CACHE *cache;
+    struct flock fl;
+    struct stat st;
+    size_t size;
+    int fd;
+
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (!path || entries < 1 || entries > EST_SHM_SESS_ENTRIES_MAX) {
+	EST_LOG_ERR("Session cache entries must be between 1 and %d",
+		EST_SHM_SESS_ENTRIES_MAX);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    size = offsetof(EST_SHM_SESS_CACHE, slots) +
+           (size_t)entries * sizeof(EST_SHM_SESS_SLOT);
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+	EST_LOG_ERR("Unable to open session cache %s: %s", path,
+		    strerror(errno));
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    /*
+     * Serialize the sizing and initialization of the file with
+     * the other processes starting up at the same time
+     */
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if (fcntl(fd, F_SETLKW, &fl) < 0 || fstat(fd, &st) < 0) {
+	EST_LOG_ERR("Unable to lock session cache %s: %s", path,
+		    strerror(errno));
+        close(fd);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    if (st.st_size != 0 && (size_t)st.st_size != size) {
+	EST_LOG_ERR("Session cache %s was created with a different size", path);
+        close(fd);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    if (st.st_size == 0 && ftruncate(fd, size) < 0) {
+	EST_LOG_ERR("Unable to size session cache %s: %s", path,
+		    strerror(errno));
+        close(fd);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+    cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cache == MAP_FAILED) {
+	EST_LOG_ERR("Unable to map session cache %s: %s", path,
+		    strerror(errno));
+        close(fd);
+        return (EST_ERR_MALLOC);
+    }
+    if (cache->magic != EST_SHM_SESS_MAGIC) {
+        cache->num_slots = entries;
+        cache->slot_size = sizeof(EST_SHM_SESS_SLOT);
+        __sync_synchronize();
+        cache->magic = EST_SHM_SESS_MAGIC;
+    }
+    /* Closing the file also releases the lock, the mapping stays */
+    close(fd);
+
+    if (cache->num_slots != (unsigned int)entries ||
+        cache->slot_size != sizeof(EST_SHM_SESS_SLOT)) {
+	EST_LOG_ERR("Session cache %s has an incompatible layout", path);
+        munmap(cache, size);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    if (ctx->shm_sess_cache) {
+        munmap(ctx->shm_sess_cache, ctx->shm_sess_cache_size);
+    }
+    ctx->shm_sess_cache = cache;
+    ctx->shm_sess_cache_size = size;
+    return (est_server_set_session_cache_cb(ctx, est_shm_sess_new,
+                                            est_shm_sess_get,
+                                            est_shm_sess_remove, cache));
+#else
+    EST_LOG_ERR("Shared memory session cache not supported on this platform");
+    return (EST_ERR_INVALID_PARAMETERS);
+#endif
+}
+
+/*! @brief est_server_add_ticket_key() is used by an application
+    to enable TLS session tickets and to rotate the ticket keys.
+
+    @param ctx Pointer to the EST context
+    @param key The key, 16 bytes of key name followed by a 16 byte
+           HMAC key and a 16 byte AES key
+    @param key_len Length of key, must be EST_TICKET_KEY_LEN
+
+    With session tickets the client holds its encrypted session, so
+    any server process that knows the key can resume it.  The most
+    recently added key protects new tickets.  Up to three earlier
+    keys are still accepted, clients presenting one of these get a
+    new ticket.  Adding a fifth key drops the oldest.
+
+    Tickets are only enabled when a key has been added prior to
+    est_server_start().  Keys may be rotated at any time after that.
+    The application is responsible for distributing the same keys
+    to every process and for generating them with a strong RNG.
+
+    @return EST_ERROR.
+ */
+EST_ERROR est_server_add_ticket_key (EST_CTX *ctx, const unsigned char *key,
+                                     int key_len)
+{
+    EST_TICKET_KEY *ring;
+    int n;
+
+    if (!ctx) {
+	EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    if (!key || key_len != EST_TICKET_KEY_LEN) {
+	EST_LOG_ERR("Ticket key must be %d bytes", EST_TICKET_KEY_LEN);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    est_spin_lock(&ctx->ticket_keys_lock);
+    ring = ctx->ticket_keys;
+    n = ctx->num_ticket_keys;
+    if (n == EST_TICKET_KEYS_MAX) {
+        n--;
+        OPENSSL_cleanse(&ring[n], sizeof(EST_TICKET_KEY));
+    }
+    memmove(&ring[1], &ring[0], n * sizeof(EST_TICKET_KEY));
+    memcpy(ring[0].name, key, 16);
+    memcpy(ring[0].hmac_key, key + 16, 16);
+    memcpy(ring[0].aes_key, key + 32, 16);
+    ctx->num_ticket_keys = n + 1;
+    est_spin_unlock(&ctx->ticket_keys_lock);
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Releases the shared session cache mapping and wipes the
+ * ticket keys, called from est_destroy().
+ */
+void est_server_free_session_cache (EST_CTX *ctx)
+{
+#ifndef _WIN32
+    if (ctx->shm_sess_cache) {
+        munmap(ctx->shm_sess_cache, ctx->shm_sess_cache_size);
+        ctx->shm_sess_cache = NULL;
+    }
+#endif
+    OPENSSL_cleanse(ctx->ticket_keys, sizeof(ctx->ticket_keys));
+    ctx->num_ticket_keys = 0;
+}
+
 // Dynamically load SSL library. Set up ctx->ssl_ctx pointer.
 static int set_ssl_option (struct mg_context *ctx)
 {
@@ -1229,6 +1908,8 @@ static int set_ssl_option (struct mg_context *ctx)
     EC_KEY *ecdh = NULL;
     X509_VERIFY_PARAM *vpm = NULL;
     char sic[12] = "EST";
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
 
     if ((ssl_ctx = SSL_CTX_new(SSLv23_server_method())) == NULL) {
         cry(fc(ctx), "SSL_CTX_new (server) error: %s", ssl_error());
@@ -1246,12 +1927,28 @@ static int set_ssl_option (struct mg_context *ctx)
     /*
      * Set the Session ID context to enable OpenSSL session
      * reuse, which improves performance.  We set the ID to
-     * ESTxxxxxxxx, where the x values are random numbers
+     * ESTxxxxxxxx, where the x values are random numbers.
+     * When sessions are shared with other processes, through
+     * an external cache or tickets, the x values are taken
+     * from the server certificate digest instead so that all
+     * processes agree on the ID.
      */
-    if (!RAND_bytes((unsigned char*)&sic[3], 8)) {
+    if (ectx->sess_new_cb || ectx->num_ticket_keys) {
+	if (!X509_digest(ectx->server_cert, EVP_sha256(), md, &md_len)) {
+	    EST_LOG_ERR("Unable to digest server certificate: %s", ssl_error());
+	    return 0;
+	}
+	memcpy(&sic[3], md, 8);
+    } else if (!RAND_bytes((unsigned char*)&sic[3], 8)) {
 	EST_LOG_WARN("RNG failure while setting SIC: %s", ssl_error());
     }
     SSL_CTX_set_session_id_context(ssl_ctx, (void*)&sic, 11);
+    SSL_CTX_set_app_data(ssl_ctx, ectx);
+    if (ectx->sess_new_cb) {
+	SSL_CTX_sess_set_new_cb(ssl_ctx, est_sess_new_cb);
+	SSL_CTX_sess_set_get_cb(ssl_ctx, est_sess_get_cb);
+	SSL_CTX_sess_set_remove_cb(ssl_ctx, est_sess_remove_cb);
+    }
 
     // load in the CA cert(s) used to verify client certificates
     SSL_CTX_set_cert_store(ssl_ctx, ectx->trusted_certs_store);
@@ -1259,14 +1956,11 @@ static int set_ssl_option (struct mg_context *ctx)
     ectx->trusted_certs_store = NULL;  
 
     /*
-     * Note that we disable TLS tickets, which is another
-     * way to reuse TLS sessions to avoid all the key exchange
-     * overhead of the TLS handshake.  We've enabled session
-     * reuse above.  But session reuse will not 
-     * work when ticket support is enabled on the server.
-     * We may want to look into enabling tickets
-     * in the future, but for now the session reuse
-     * above gives us a performance boost.
+     * TLS tickets are another way to reuse TLS sessions to
+     * avoid the key exchange overhead of the TLS handshake.
+     * They're disabled unless the application has provided
+     * ticket keys, since OpenSSL would otherwise use a random
+     * key that no other server process knows about.
      *
      * The other options set here are to improve forward
      * secrecty and comply with the EST draft.
@@ -1274,8 +1968,12 @@ static int set_ssl_option (struct mg_context *ctx)
     SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_SSLv2 |
                         SSL_OP_NO_SSLv3 |
                         SSL_OP_NO_TLSv1 |
-                        SSL_OP_SINGLE_ECDH_USE | 
-			SSL_OP_NO_TICKET);
+                        SSL_OP_SINGLE_ECDH_USE);
+    if (ectx->num_ticket_keys) {
+	SSL_CTX_set_tlsext_ticket_key_cb(ssl_ctx, est_ticket_key_cb);
+    } else {
+	SSL_CTX_set_options(ssl_ctx, SSL_OP_NO_TICKET);
+    }
 
     /* 
      * Set the ECDH single use parms.  Use the configured
@@ -1380,6 +2078,12 @@ static void reset_per_request_attributes (struct mg_connection *conn)
     conn->num_bytes_sent = conn->consumed_content = 0;
     conn->status_code = -1;
     conn->must_close = conn->request_len = 0;
+    conn->user_id[0] = '\0';
+    if (conn->body) {
+        free(conn->body);
+        conn->body = NULL;
+    }
+    conn->body_len = 0;
 }
 
 static int is_valid_uri (const char *uri)
@@ -1389,18 +2093,99 @@ static int is_valid_uri (const char *uri)
     return uri[0] == '/' || (uri[0] == '*' && uri[1] == '\0');
 }
 
-static void process_new_connection (struct mg_connection *conn)
+// Parse and validate the request that has been framed in conn->buf.
+// Sends the error response and returns 0 for requests which must not
+// be handed to the EST layer, returns 1 otherwise.
+static int prepare_request (struct mg_connection *conn)
 {
     struct mg_request_info *ri = &conn->request_info;
-    int keep_alive_enabled, keep_alive, discard_len;
     const char *cl;
 
+    if (parse_http_request(conn->buf, conn->request_len, ri) <= 0 ||
+        !is_valid_uri(ri->uri)) {
+        // Do not put garbage in the access log, just send it back to the client
+        send_http_error(conn, 400, "Bad Request",
+                        "Cannot parse HTTP request: [%.*s]", conn->data_len, conn->buf);
+        conn->must_close = 1;
+        return 0;
+    }
+    if (strcmp(ri->http_version, "1.0") &&
+        strcmp(ri->http_version, "1.1")) {
+        // Request seems valid, but HTTP version is strange
+        send_http_error(conn, 505, "HTTP version not supported", "%s", "");
+        log_access(conn);
+        return 0;
+    }
+    // Request is valid, handle it
+    if ((cl = ri->known_headers[MG_HDR_CONTENT_LENGTH]) != NULL) {
+        conn->content_len = strtoll(cl, NULL, 10);
+        if (conn->content_len < 0) {
+            send_http_error(conn, 400, "Bad Request", "%s", "");
+            conn->must_close = 1;
+            return 0;
+        }
+        if (conn->content_len > conn->ctx->est_ctx->max_content_len) {
+            EST_LOG_WARN("HTTP request content length greater than %d",
+                         conn->ctx->est_ctx->max_content_len);
+            send_http_error(conn, 413, "Request Too Large", "%s", "");
+            conn->must_close = 1;
+            return 0;
+        }
+    } else if (!mg_strcasecmp(ri->request_method, "POST") ||
+               !mg_strcasecmp(ri->request_method, "PUT")) {
+        conn->content_len = -1;
+    } else {
+        conn->content_len = 0;
+    }
+    return 1;
+}
+
+// Release the per-request state once the response has been generated
+// and discard the request from the receive buffer, leaving any
+// pipelined data that follows it in place.
+static void complete_request (struct mg_connection *conn)
+{
+    struct mg_request_info *ri = &conn->request_info;
+    int discard_len;
+
+    if (ri->remote_user != NULL) {
+        free((void*)ri->remote_user);
+        ri->remote_user = NULL;
+    }
+
+    // NOTE(lsm): order is important here. should_keep_alive() call
+    // is using parsed request, which will be invalid after memmove's below.
+    // Therefore, memorize should_keep_alive() result now for later use
+    // in loop exit condition.
+    conn->keep_alive = should_keep_alive(conn);
+
+    est_stats_status(conn->ctx->est_ctx, conn->status_code);
+    est_stats_bytes(conn->ctx->est_ctx, conn->request_len +
+                    (conn->content_len > 0 ? conn->content_len : 0), 0);
+
+    // Discard all buffered data for this request
+    discard_len = conn->content_len >= 0 &&
+                  conn->request_len + conn->content_len < (int64_t)conn->data_len ?
+                  (int)(conn->request_len + conn->content_len) : conn->data_len;
+    if ((conn->data_len - discard_len) > 0) {
+        memmove(conn->buf, conn->buf + discard_len, conn->data_len - discard_len);
+    }
+    conn->data_len -= discard_len;
+    conn->scan_len = 0;
+    assert(conn->data_len >= 0);
+    assert(conn->data_len <= conn->buf_size);
+}
+
+static void process_new_connection (struct mg_connection *conn)
+{
+    int keep_alive_enabled;
+
     keep_alive_enabled = conn->ctx->enable_keepalives;
-    keep_alive = 0;
 
     // Important: on new connection, reset the receiving buffer. Credit goes
     // to crule42.
     conn->data_len = 0;
+    conn->scan_len = 0;
     do {
         reset_per_request_attributes(conn);
         conn->request_len = read_request(NULL, conn, conn->buf, conn->buf_size,
@@ -1408,89 +2193,172 @@ static void process_new_connection (struct mg_connection *conn)
         assert(conn->request_len < 0 || conn->data_len >= conn->request_len);
         if (conn->request_len == 0 && conn->data_len == conn->buf_size) {
             send_http_error(conn, 413, "Request Too Large", "%s", "");
+            est_stats_status(conn->ctx->est_ctx, 413);
             return;
         }
         if (conn->request_len <= 0) {
             return; // Remote end closed the connection
         }
-        if (parse_http_request(conn->buf, conn->buf_size, ri) <= 0 ||
-            !is_valid_uri(ri->uri)) {
-            // Do not put garbage in the access log, just send it back to the client
-            send_http_error(conn, 400, "Bad Request",
-                            "Cannot parse HTTP request: [%.*s]", conn->data_len, conn->buf);
-            conn->must_close = 1;
-        } else if (strcmp(ri->http_version, "1.0") &&
-                   strcmp(ri->http_version, "1.1")) {
-            // Request seems valid, but HTTP version is strange
-            send_http_error(conn, 505, "HTTP version not supported", "%s", "");
-            log_access(conn);
-        } else {
-            // Request is valid, handle it
-            if ((cl = get_header(ri, "Content-Length")) != NULL) {
-                conn->content_len = strtoll(cl, NULL, 10);
-            } else if (!mg_strcasecmp(ri->request_method, "POST") ||
-                       !mg_strcasecmp(ri->request_method, "PUT")) {
-                conn->content_len = -1;
-            } else {
-                conn->content_len = 0;
-            }
+        if (prepare_request(conn)) {
             conn->birth_time = time(NULL);
             handle_request(conn);
             log_access(conn);
         }
-        if (ri->remote_user != NULL) {
-            free((void*)ri->remote_user);
-        }
-
-        // NOTE(lsm): order is important here. should_keep_alive() call
-        // is using parsed request, which will be invalid after memmove's below.
-        // Therefore, memorize should_keep_alive() result now for later use
-        // in loop exit condition.
-        keep_alive = should_keep_alive(conn);
-
-        // Discard all buffered data for this request
-        discard_len = conn->content_len >= 0 &&
-                      conn->request_len + conn->content_len < (int64_t)conn->data_len ?
-                      (int)(conn->request_len + conn->content_len) : conn->data_len;
-	if ((conn->data_len - discard_len) > 0) {
-	    memmove(conn->buf, conn->buf + discard_len, conn->data_len - discard_len);
-	}
-        conn->data_len -= discard_len;
-        assert(conn->data_len >= 0);
-        assert(conn->data_len <= conn->buf_size);
-
+        complete_request(conn);
     } while (conn->ctx->stop_flag == 0 &&
              keep_alive_enabled &&
              conn->content_len >= 0 &&
-             keep_alive);
+             conn->keep_alive);
 }
 
+/*
+ * Logs the reason an SSL_accept() call failed and maps it to
+ * an EST error code.  WANT_READ/WANT_WRITE are not failures,
+ * the caller is expected to retry the handshake for those.
+ */
+static EST_ERROR ssl_accept_error (int err_code)
+{
+    EST_ERROR rv = EST_ERR_NONE;
 
-/*! @brief est_server_handle_request() is used by an application 
-    to process and EST request.  The application is responsible
-    for opening a listener socket.  When an EST request comes in
-    on the socket, the application uses this function to hand-off
-    the request to libest.
-
-    @param ctx Pointer to the EST_CTX, which was provided
-               when est_server_init()  or est_proxy_init() was invoked.
-    @param fd File descriptor that will be read to retrieve the
-              HTTP request from the client.  This is typically
-	      a TCP socket file descriptor.
+    switch (err_code) {
+    case SSL_ERROR_SYSCALL:
+        EST_LOG_ERR("OpenSSL system call error");
+        rv = EST_ERR_SYSCALL;
+        break;
+    case SSL_ERROR_SSL:
+        /* Some unknown OpenSSL error, dump the
+         * OpenSSL error log to learn more about this */
+        ossl_dump_ssl_errors();
+        rv = EST_ERR_UNKNOWN;
+        break;
+    case SSL_ERROR_WANT_X509_LOOKUP:
+        EST_LOG_ERR("SSL_accept error, wants lookup");
+        rv = EST_ERR_UNKNOWN;
+        break;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+    case SSL_ERROR_NONE:
+    default:
+        break;
+    }
+    return (rv);
+}
 
-    est_server_handle_request() is used by an application 
-    when an incoming EST request needs to be processed.  This request
-    would be a cacerts, simpleenroll, reenroll, or csrattrs request. 
-    This is used when implementing an EST server.  The application 
-    is responsible for opening and listening to a TCP socket for
-    incoming EST requests.  When data is ready to be read from
-    the socket, this API entry point should be used to allow libest 
-    to read the request from the socket and respond to the request.
- 
+static void mg_lock_conn_pool (struct mg_context *ctx)
+{
+#ifndef DISABLE_PTHREADS
+    pthread_mutex_lock(&ctx->conn_pool_lock);
+#endif
+}
 
-    @return EST_ERROR.
-*/
-EST_ERROR est_server_handle_request (EST_CTX *ctx, int fd)
+static void mg_unlock_conn_pool (struct mg_context *ctx)
+{
+#ifndef DISABLE_PTHREADS
+    pthread_mutex_unlock(&ctx->conn_pool_lock);
+#endif
+}
+
+// Takes a connection from the pool and accounts for it as in use.
+// Returns NULL when the pool is empty, the caller must then allocate
+// a new connection.
+static struct mg_connection *mg_get_pooled_connection (struct mg_context *ctx)
+{
+    struct mg_connection *conn;
+    SSL *ssl;
+    char *wbuf;
+    int wbuf_size;
+
+    mg_lock_conn_pool(ctx);
+    conn = ctx->free_conns;
+    if (conn) {
+        ctx->free_conns = conn->next_free;
+        ctx->num_free_conns--;
+    }
+    ctx->conns_in_use++;
+    if (ctx->conns_in_use > ctx->conns_high_water) {
+        ctx->conns_high_water = ctx->conns_in_use;
+    }
+    mg_unlock_conn_pool(ctx);
+
+    if (conn) {
+        ssl = conn->ssl;
+        wbuf = conn->wbuf;
+        wbuf_size = conn->wbuf_size;
+        memset(conn, 0, sizeof(*conn));
+        conn->ssl = ssl;
+        conn->wbuf = wbuf;
+        conn->wbuf_size = wbuf_size;
+        conn->buf_size = MAX_REQUEST_SIZE;
+        conn->buf = (char*)(conn + 1);
+        conn->buf[0] = '\0';
+    }
+    return (conn);
+}
+
+// Ends the accounting for a connection and places it on the pool if
+// there's room.  Returns the connection if the caller must free it.
+static struct mg_connection *mg_put_pooled_connection (struct mg_context *ctx,
+                                                      struct mg_connection *conn)
+{
+    mg_lock_conn_pool(ctx);
+    ctx->conns_in_use--;
+    if (conn && !ctx->stop_flag &&
+        ctx->num_free_conns < ctx->est_ctx->conn_pool_size) {
+        conn->next_free = ctx->free_conns;
+        ctx->free_conns = conn;
+        ctx->num_free_conns++;
+        conn = NULL;
+    }
+    mg_unlock_conn_pool(ctx);
+    return (conn);
+}
+
+static void mg_destroy_connection (struct mg_connection *conn)
+{
+    if (conn->body) {
+        free(conn->body);
+    }
+    if (conn->ssl) {
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+    if (conn->wbuf) {
+        free(conn->wbuf);
+    }
+    free(conn);
+}
+
+// Returns a connection to the pool, or releases it when the pool is
+// full.  The request buffer, write buffer and SSL object are kept so
+// the next connection does not need to allocate them again.
+static void mg_free_connection (struct mg_connection *conn)
+{
+    if (conn->enroll_req) {
+        est_server_enroll_detach(conn->enroll_req);
+        conn->enroll_req = NULL;
+    }
+    est_server_conn_auth_clear(&conn->auth);
+    if (conn->body) {
+        free(conn->body);
+        conn->body = NULL;
+    }
+    if (conn->ssl && !SSL_clear(conn->ssl)) {
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+    }
+    conn = mg_put_pooled_connection(conn->ctx, conn);
+    if (conn) {
+        mg_destroy_connection(conn);
+    }
+}
+
+/*
+ * Allocates the connection structure for an accepted socket,
+ * records the peer address and attaches a new SSL object.
+ * The TLS handshake is not started here.
+ */
+static EST_ERROR mg_new_connection (EST_CTX *ctx, int fd,
+                                    struct mg_connection **new_conn)
 {
     struct mg_connection *conn;
     struct socket accepted;
@@ -1498,19 +2366,9 @@ EST_ERROR est_server_handle_request (EST_CTX *ctx, int fd)
     char ipstr[INET6_ADDRSTRLEN];
     int port;
     struct sockaddr_storage addr;
-    int ssl_err, err_code;
-    EST_ERROR rv = EST_ERR_NONE;
     int rc;
 
-    if (!ctx) {
-        EST_LOG_ERR("Null EST context");
-        return (EST_ERR_NO_CTX);
-    }
-    if (!ctx->mg_ctx) {
-        EST_LOG_ERR("Null EST MG context");
-        return (EST_ERR_NO_CTX);
-    }
-
+    memset(&accepted, 0, sizeof(accepted));
     accepted.sock = fd;
 
     len = sizeof(struct sockaddr_storage);
@@ -1533,90 +2391,926 @@ EST_ERROR est_server_handle_request (EST_CTX *ctx, int fd)
     EST_LOG_INFO("Peer IP address: %s", ipstr);
     EST_LOG_INFO("Peer port      : %d", port);
 
-    conn = (struct mg_connection*)calloc(1, sizeof(*conn) + MAX_REQUEST_SIZE);
+    conn = mg_get_pooled_connection(ctx->mg_ctx);
     if (conn == NULL) {
-        cry(fc(ctx->mg_ctx), "%s", "Cannot create new connection struct, OOM");
-	return (EST_ERR_MALLOC);
-    } else {
+        conn = (struct mg_connection*)calloc(1, sizeof(*conn) + MAX_REQUEST_SIZE);
+        if (conn == NULL) {
+            cry(fc(ctx->mg_ctx), "%s", "Cannot create new connection struct, OOM");
+            mg_put_pooled_connection(ctx->mg_ctx, NULL);
+            return (EST_ERR_MALLOC);
+        }
         conn->buf_size = MAX_REQUEST_SIZE;
         conn->buf = (char*)(conn + 1);
+    }
 
-        conn->client = accepted;
-        conn->birth_time = time(NULL);
-        conn->ctx = ctx->mg_ctx;
+    conn->client = accepted;
+    conn->birth_time = time(NULL);
+    conn->ctx = ctx->mg_ctx;
 
-        // Fill in IP, port info early so even if SSL setup below fails,
-        // error handler would have the corresponding info.
-        conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
-        memcpy(&conn->request_info.remote_ip, &conn->client.rsa.sin.sin_addr.s_addr, 4);
-        conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
-        conn->request_info.is_ssl = 1;
+    // Fill in IP, port info early so even if SSL setup below fails,
+    // error handler would have the corresponding info.
+    conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
+    memcpy(&conn->request_info.remote_ip, &conn->client.rsa.sin.sin_addr.s_addr, 4);
+    conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
+    conn->request_info.is_ssl = 1;
 
-        /*
-         * EST require TLS,  Setup the TLS tunnel
-         */
+    /*
+     * EST require TLS,  Setup the TLS tunnel.  A pooled
+     * connection already carries an SSL object that was
+     * reset with SSL_clear() when it was released.
+     */
+    if (conn->ssl == NULL) {
         conn->ssl = SSL_new(conn->ctx->ssl_ctx);
-        if (conn->ssl != NULL) {
-            SSL_set_fd(conn->ssl, conn->client.sock);
-            ssl_err = SSL_accept(conn->ssl); 
-            if (ssl_err <= 0) {
-		err_code = SSL_get_error(conn->ssl, ssl_err);
-		switch (err_code) {
-		case SSL_ERROR_SYSCALL:
-		    EST_LOG_ERR("OpenSSL system call error");
-		    rv = EST_ERR_SYSCALL;
-		    break;
-		case SSL_ERROR_SSL:
-		    /* Some unknown OpenSSL error, dump the 
-		     * OpenSSL error log to learn more about this */
-		    ossl_dump_ssl_errors();
-		    rv = EST_ERR_UNKNOWN;
-		    break;
-		case SSL_ERROR_WANT_READ:
-		case SSL_ERROR_WANT_WRITE:
-		    EST_LOG_INFO("App using non-blocking socket");
-		    process_new_connection(conn);
-		    break;
-		case SSL_ERROR_WANT_X509_LOOKUP:
-		    EST_LOG_ERR("SSL_accept error, wants lookup");
-		    rv = EST_ERR_UNKNOWN;
-		    break;
-		case SSL_ERROR_NONE:
-		default:
-		    break;
-		}
-	    } else {
-		process_new_connection(conn);
-	    }
-            ssl_err = SSL_shutdown(conn->ssl);
-	    switch (ssl_err) {
-	    case 0:
-		/* OpenSSL docs say to call shutdown again for this case */
-		SSL_shutdown(conn->ssl);
-		EST_LOG_INFO("Two-phase SSL_shutdown initiated");
-		break;
-	    case 1:
-		/* Nothing to do, shutdown worked */
-		EST_LOG_INFO("SSL_shutdown succeeded");
-		break;
-	    default:
-		/* Log an error */
-		EST_LOG_WARN("SSL_shutdown failed");
-		break;
-	    }
-            SSL_free(conn->ssl);
-            conn->ssl = NULL;
+    }
+    if (conn->ssl == NULL) {
+        EST_LOG_ERR("SSL_new failed");
+        ossl_dump_ssl_errors();
+        mg_free_connection(conn);
+        return (EST_ERR_SSL_NEW);
+    }
+    SSL_set_fd(conn->ssl, conn->client.sock);
+    conn->state = MG_CONN_HANDSHAKE;
+
+    *new_conn = conn;
+    return (EST_ERR_NONE);
+}
+
+/*! @brief est_server_handle_request() is used by an application
+    to process and EST request.  The application is responsible
+    for opening a listener socket.  When an EST request comes in
+    on the socket, the application uses this function to hand-off
+    the request to libest.
+
+    @param ctx Pointer to the EST_CTX, which was provided
+               when est_server_init()  or est_proxy_init() was invoked.
+    @param fd File descriptor that will be read to retrieve the
+              HTTP request from the client.  This is typically
+	      a TCP socket file descriptor.
+
+    est_server_handle_request() is used by an application
+    when an incoming EST request needs to be processed.  This request
+    would be a cacerts, simpleenroll, reenroll, or csrattrs request.
+    This is used when implementing an EST server.  The application
+    is responsible for opening and listening to a TCP socket for
+    incoming EST requests.  When data is ready to be read from
+    the socket, this API entry point should be used to allow libest
+    to read the request from the socket and respond to the request.
+    This function blocks the calling thread until the connection
+    is finished.  Applications that multiplex many connections on
+    a single thread should use est_server_conn_new() instead.
+
+
+    @return EST_ERROR.
+*/
+EST_ERROR est_server_handle_request (EST_CTX *ctx, int fd)
+{
+    struct mg_connection *conn;
+    int ssl_err, err_code = SSL_ERROR_NONE;
+    EST_ERROR rv = EST_ERR_NONE;
+
+    if (!ctx) {
+        EST_LOG_ERR("Null EST context");
+        return (EST_ERR_NO_CTX);
+    }
+    if (!ctx->mg_ctx) {
+        EST_LOG_ERR("Null EST MG context");
+        return (EST_ERR_NO_CTX);
+    }
+
+    rv = mg_new_connection(ctx, fd, &conn);
+    if (rv != EST_ERR_NONE) {
+        return (rv);
+    }
+
+    /*
+     * When the application hands us a non-blocking socket the
+     * handshake may need several round trips.  Wait for the socket
+     * rather than spinning on SSL_accept().
+     */
+    ssl_err = SSL_accept(conn->ssl);
+    while (ssl_err <= 0) {
+        err_code = SSL_get_error(conn->ssl, ssl_err);
+        if ((err_code != SSL_ERROR_WANT_READ &&
+             err_code != SSL_ERROR_WANT_WRITE) ||
+            !wait_until_socket_is_ready(conn,
+                                        err_code == SSL_ERROR_WANT_WRITE)) {
+            break;
+        }
+        ssl_err = SSL_accept(conn->ssl);
+    }
+    if (ssl_err <= 0) {
+        rv = ssl_accept_error(err_code);
+        est_stats_tls_failure(ctx);
+    } else {
+        conn->state = MG_CONN_READ_REQUEST;
+        process_new_connection(conn);
+    }
+
+    ssl_err = SSL_shutdown(conn->ssl);
+    switch (ssl_err) {
+    case 0:
+	/* OpenSSL docs say to call shutdown again for this case */
+	SSL_shutdown(conn->ssl);
+	EST_LOG_INFO("Two-phase SSL_shutdown initiated");
+	break;
+    case 1:
+	/* Nothing to do, shutdown worked */
+	EST_LOG_INFO("SSL_shutdown succeeded");
+	break;
+    default:
+	/* Log an error */
+	EST_LOG_WARN("SSL_shutdown failed");
+	break;
+    }
+    conn->state = MG_CONN_CLOSED;
+    mg_free_connection(conn);
+    return (rv);
+}
+
+/*
+ * Maps the result of a failed non-blocking SSL call to the socket
+ * events the connection is waiting on.  Returns zero when the
+ * failure is fatal for the connection.  SSL_get_error() looks at
+ * the thread's error queue, which the caller clears before the
+ * SSL call, otherwise an error left behind by another connection
+ * would make this one fail.
+ */
+static int conn_wanted_events (struct mg_connection *conn, int ssl_rv)
+{
+    switch (SSL_get_error(conn->ssl, ssl_rv)) {
+    case SSL_ERROR_WANT_READ:
+        return (EST_CONN_EV_READ);
+    case SSL_ERROR_WANT_WRITE:
+        return (EST_CONN_EV_WRITE);
+    default:
+        return (0);
+    }
+}
+
+/*
+ * Each of the conn_* state handlers below either advances the
+ * connection to its next state and returns zero, or returns the
+ * socket events it is blocked on.
+ */
+static int conn_handshake (struct mg_connection *conn)
+{
+    int rv, want;
+
+    ERR_clear_error();
+    rv = SSL_accept(conn->ssl);
+    if (rv > 0) {
+        conn->data_len = 0;
+        reset_per_request_attributes(conn);
+        conn->state = MG_CONN_READ_REQUEST;
+        return (0);
+    }
+    want = conn_wanted_events(conn, rv);
+    if (!want) {
+        ssl_accept_error(SSL_get_error(conn->ssl, rv));
+        est_stats_tls_failure(conn->ctx->est_ctx);
+        conn->state = MG_CONN_CLOSED;
+    }
+    return (want);
+}
+
+/*
+ * Answers a request that can not be buffered and makes sure
+ * the connection is closed once the error has been sent.
+ */
+static void conn_reject_request (struct mg_connection *conn)
+{
+    send_http_error(conn, 413, "Request Too Large", "%s", "");
+    est_stats_status(conn->ctx->est_ctx, 413);
+    conn->keep_alive = 0;
+    conn->state = MG_CONN_WRITE_RESPONSE;
+}
+
+/*
+ * Moves the part of the body already received out of the
+ * receive buffer into a buffer sized for the whole body.  Used
+ * when the request doesn't fit in the receive buffer.
+ * Returns 1 on success, 0 when memory can't be allocated.
+ */
+static int conn_alloc_body (struct mg_connection *conn)
+{
+    int buffered = conn->data_len - conn->request_len;
+
+    conn->body = malloc((size_t)conn->content_len + 1);
+    if (!conn->body) {
+        EST_LOG_ERR("malloc failed");
+        return (0);
+    }
+    memcpy(conn->body, conn->buf + conn->request_len, buffered);
+    conn->body_len = buffered;
+    conn->data_len = conn->request_len;
+    return (1);
+}
+
+static int conn_read_request (struct mg_connection *conn)
+{
+    int n, want;
+    int64_t needed;
+    char *dst;
+    int room;
+
+    for (;;) {
+        if (conn->request_len == 0) {
+            conn->request_len = scan_request_len(conn->buf, conn->data_len,
+                                                 &conn->scan_len);
+            if (conn->request_len < 0) {
+                conn->state = MG_CONN_SHUTDOWN;
+                return (0);
+            }
+            if (conn->request_len > 0 && !prepare_request(conn)) {
+                complete_request(conn);
+                conn->state = MG_CONN_WRITE_RESPONSE;
+                return (0);
+            }
+        }
+
+        if (conn->request_len > 0) {
+            /*
+             * Headers are parsed, wait for the whole body so the
+             * handler never has to block in mg_read().  A body
+             * that doesn't fit behind the headers is collected
+             * in its own buffer, prepare_request() has already
+             * bounded its size.
+             */
+            needed = conn->request_len;
+            if (conn->content_len > 0) {
+                needed += conn->content_len;
+            }
+            if (needed >= conn->buf_size && !conn->body &&
+                !conn_alloc_body(conn)) {
+                conn_reject_request(conn);
+                return (0);
+            }
+            if ((conn->body && conn->body_len == conn->content_len) ||
+                (!conn->body && conn->data_len >= needed)) {
+                conn->birth_time = time(NULL);
+                handle_request(conn);
+                if (conn->enroll_req) {
+                    conn->state = MG_CONN_ENROLL_WAIT;
+                    return (0);
+                }
+                log_access(conn);
+                complete_request(conn);
+                conn->state = MG_CONN_WRITE_RESPONSE;
+                return (0);
+            }
+        } else if (conn->data_len == conn->buf_size) {
+            conn_reject_request(conn);
+            return (0);
+        }
+
+        if (conn->body) {
+            dst = conn->body + conn->body_len;
+            room = (int)(conn->content_len - conn->body_len);
+        } else {
+            dst = conn->buf + conn->data_len;
+            room = conn->buf_size - conn->data_len;
+        }
+        ERR_clear_error();
+        n = SSL_read(conn->ssl, dst, room);
+        if (n > 0) {
+            if (conn->body) {
+                conn->body_len += n;
+            } else {
+                conn->data_len += n;
+            }
+            continue;
+        }
+        want = conn_wanted_events(conn, n);
+        if (!want) {
+            /* Peer closed the connection or a TLS error occurred */
+            conn->state = MG_CONN_SHUTDOWN;
+        }
+        return (want);
+    }
+}
+
+/*
+ * The request is with an asynchronous CA handler.  The socket is
+ * left alone until the application is told the CA has answered,
+ * the request stays in the buffer until the response is queued.
+ */
+static int conn_enroll_wait (struct mg_connection *conn)
+{
+    if (est_server_enroll_pending(conn->enroll_req)) {
+        return (EST_CONN_EV_ENROLL);
+    }
+    est_server_enroll_resume(conn);
+    log_access(conn);
+    complete_request(conn);
+    conn->state = MG_CONN_WRITE_RESPONSE;
+    return (0);
+}
+
+static int conn_write_response (struct mg_connection *conn)
+{
+    int n, want;
+
+    while (conn->wbuf_sent < conn->wbuf_len) {
+        ERR_clear_error();
+        n = SSL_write(conn->ssl, conn->wbuf + conn->wbuf_sent,
+                      conn->wbuf_len - conn->wbuf_sent);
+        if (n > 0) {
+            conn->wbuf_sent += n;
+            continue;
+        }
+        want = conn_wanted_events(conn, n);
+        if (!want) {
+            EST_LOG_WARN("SSL_write failed, dropping connection");
+            conn->state = MG_CONN_CLOSED;
+        }
+        return (want);
+    }
+    conn->wbuf_len = conn->wbuf_sent = 0;
+
+    if (conn->ctx->stop_flag == 0 &&
+        conn->ctx->enable_keepalives &&
+        conn->content_len >= 0 &&
+        conn->keep_alive) {
+        reset_per_request_attributes(conn);
+        conn->state = MG_CONN_READ_REQUEST;
+    } else {
+        conn->state = MG_CONN_SHUTDOWN;
+    }
+    return (0);
+}
+
+static void set_close_on_exec (SOCKET fd)
+{
+#ifndef _WIN32
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+static int set_blocking_mode (SOCKET sock, int blocking)
+{
+#ifndef _WIN32
+    int flags = fcntl(sock, F_GETFL, 0);
+
+    if (flags < 0) {
+        return (-1);
+    }
+    flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    return (fcntl(sock, F_SETFL, flags));
+#else
+    unsigned long on = !blocking;
+
+    return (ioctlsocket(sock, FIONBIO, &on));
+#endif
+}
+
+/*! @brief est_server_conn_new() is used by an application with its
+    own event loop to hand an accepted socket to libest without
+    dedicating a thread to it.
+
+    @param ctx Pointer to the EST_CTX, which was provided
+               when est_server_init() or est_proxy_init() was invoked.
+    @param fd Accepted TCP socket for the client connection.
+
+    The socket is switched to non-blocking mode.  No I/O is performed
+    by this call.  The application should then invoke
+    est_server_conn_on_event(), passing zero for the events, to start
+    the TLS handshake and learn which socket events to wait for.
+    The application continues to own the socket and must close it
+    after the connection has been released using est_server_conn_free().
+    All connections must be released before est_server_stop() or
+    est_proxy_stop() is invoked.
+
+    @return EST_SERVER_CONN* on success, NULL on failure.
+*/
+EST_SERVER_CONN *est_server_conn_new (EST_CTX *ctx, int fd)
+{
+    struct mg_connection *conn;
+
+    if (!ctx) {
+        EST_LOG_ERR("Null EST context");
+        return (NULL);
+    }
+    if (!ctx->mg_ctx) {
+        EST_LOG_ERR("Null EST MG context");
+        return (NULL);
+    }
+
+    if (set_blocking_mode(fd, 0)) {
+        EST_LOG_ERR("Unable to set socket to non-blocking mode");
+        return (NULL);
+    }
+
+    if (mg_new_connection(ctx, fd, &conn) != EST_ERR_NONE) {
+        return (NULL);
+    }
+    conn->nonblocking = 1;
+    return (conn);
+}
+
+/*! @brief est_server_conn_on_event() advances a connection created
+    with est_server_conn_new() as far as it can go without blocking.
+
+    @param conn Pointer to the EST_SERVER_CONN returned by
+                est_server_conn_new().
+    @param events The EST_CONN_EV_READ and/or EST_CONN_EV_WRITE events
+                  reported by the application's event loop for the
+                  socket, or zero on the first invocation.
+
+    Each invocation performs as much of the TLS handshake, request
+    processing and response transmission as the socket allows.  The
+    connection keeps its own state, so the events parameter is only
+    informational; it is always safe to invoke this function again.
+    A connection must only be driven by one thread at a time.
+
+    @return The socket events the application should wait for before
+            invoking this function again.  EST_CONN_EV_ENROLL is returned
+            while an enrollment is parked with an asynchronous CA
+            handler, see est_server_set_enroll_wakeup_cb().
+            EST_CONN_EV_CLOSED is returned
+            once the connection is finished, at which point the
+            application should invoke est_server_conn_free() and close
+            the socket.
+*/
+int est_server_conn_on_event (EST_SERVER_CONN *conn, int events)
+{
+    int want = 0;
+
+    if (!conn) {
+        return (EST_CONN_EV_CLOSED);
+    }
+
+    while (!want) {
+        if (conn->ctx->stop_flag && conn->state < MG_CONN_SHUTDOWN) {
+            conn->state = MG_CONN_SHUTDOWN;
+        }
+        switch (conn->state) {
+        case MG_CONN_HANDSHAKE:
+            want = conn_handshake(conn);
+            break;
+        case MG_CONN_READ_REQUEST:
+            want = conn_read_request(conn);
+            break;
+        case MG_CONN_ENROLL_WAIT:
+            want = conn_enroll_wait(conn);
+            break;
+        case MG_CONN_WRITE_RESPONSE:
+            want = conn_write_response(conn);
+            break;
+        case MG_CONN_SHUTDOWN:
+            /*
+             * Send our close_notify, but don't wait around for
+             * the peer to send its own.
+             */
+            ERR_clear_error();
+            SSL_shutdown(conn->ssl);
+            conn->state = MG_CONN_CLOSED;
+            break;
+        case MG_CONN_CLOSED:
+        default:
+            want = EST_CONN_EV_CLOSED;
+            break;
+        }
+    }
+    return (want);
+}
+
+/*! @brief est_server_conn_free() releases a connection created with
+    est_server_conn_new().
+
+    @param conn Pointer to the EST_SERVER_CONN to release.
+
+    The socket itself is not closed, this remains the responsibility
+    of the application.  This may be invoked at any point, for
+    example when the application times out an idle connection,
+    but all connections must be released before est_server_stop()
+    is invoked.
+
+    @return void.
+*/
+void est_server_conn_free (EST_SERVER_CONN *conn)
+{
+    if (conn) {
+        mg_free_connection(conn);
+    }
+}
+
+#ifndef DISABLE_PTHREADS
+/*
+ * Each worker thread owns a small queue of accepted sockets.  The
+ * master thread is the only producer and the worker the only
+ * consumer, so the lock is never contended by more than two threads.
+ */
+struct mg_worker {
+    struct mg_context *ctx;
+    pthread_t thread_id;
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    SOCKET *queue;
+    int queue_len;
+    volatile int head;           // Number of sockets produced
+    volatile int tail;           // Number of sockets consumed
+    volatile int busy;           // 1 while a request is being serviced
+};
+
+// Hand an accepted socket to a worker.  Prefer an idle worker, starting
+// the search after the last one used, otherwise pick the shortest queue.
+// Blocks while the chosen queue is full.
+static void produce_socket (struct mg_context *ctx, SOCKET sock)
+{
+    struct mg_worker *w, *best = NULL;
+    int i, load, best_load = INT_MAX;
+
+    for (i = 0; i < ctx->num_workers; i++) {
+        w = &ctx->workers[(ctx->next_worker + i) % ctx->num_workers];
+        load = w->head - w->tail + w->busy;
+        if (load < best_load) {
+            best = w;
+            best_load = load;
+            if (load == 0) {
+                break;
+            }
+        }
+    }
+    ctx->next_worker = (int)(best - ctx->workers + 1) % ctx->num_workers;
+
+    pthread_mutex_lock(&best->mutex);
+    while (best->head - best->tail >= best->queue_len && !ctx->stop_flag) {
+        pthread_cond_wait(&best->not_full, &best->mutex);
+    }
+    if (ctx->stop_flag) {
+        closesocket(sock);
+    } else {
+        best->queue[best->head % best->queue_len] = sock;
+        best->head++;
+        pthread_cond_signal(&best->not_empty);
+    }
+    pthread_mutex_unlock(&best->mutex);
+}
+
+static int consume_socket (struct mg_worker *w, SOCKET *sock)
+{
+    pthread_mutex_lock(&w->mutex);
+    w->busy = 0;
+    while (w->head == w->tail && !w->ctx->stop_flag) {
+        pthread_cond_wait(&w->not_empty, &w->mutex);
+    }
+    if (w->ctx->stop_flag) {
+        pthread_mutex_unlock(&w->mutex);
+        return 0;
+    }
+    *sock = w->queue[w->tail % w->queue_len];
+    w->tail++;
+    w->busy = 1;
+    pthread_cond_signal(&w->not_full);
+    pthread_mutex_unlock(&w->mutex);
+    return 1;
+}
+
+static void *worker_thread (void *data)
+{
+    struct mg_worker *w = (struct mg_worker *)data;
+    SOCKET sock;
+
+    while (consume_socket(w, &sock)) {
+        est_server_handle_request(w->ctx->est_ctx, sock);
+        closesocket(sock);
+    }
+    return NULL;
+}
+
+// Waits in poll() for either a new connection or a stop request,
+// so an idle server consumes no CPU.
+static void *master_thread (void *data)
+{
+    struct mg_context *ctx = (struct mg_context *)data;
+    struct pollfd pfd[2];
+    SOCKET sock;
+
+    pfd[0].fd = ctx->listen_sock;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = ctx->wakeup_fds[0];
+    pfd[1].events = POLLIN;
+
+    while (!ctx->stop_flag) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (ERRNO == EINTR) {
+                continue;
+            }
+            EST_LOG_ERR("poll() failed on listening socket, errno=%d", ERRNO);
+            break;
+        }
+        if (ctx->stop_flag || !(pfd[0].revents & POLLIN)) {
+            continue;
+        }
+        // The listening socket is non-blocking, drain the backlog
+        while (!ctx->stop_flag &&
+               (sock = accept(ctx->listen_sock, NULL, NULL)) != INVALID_SOCKET) {
+            set_close_on_exec(sock);
+            set_blocking_mode(sock, 1);
+            produce_socket(ctx, sock);
+        }
+        if (ERRNO == EMFILE || ERRNO == ENFILE) {
+            EST_LOG_WARN("accept() failed, out of file descriptors");
+            mg_sleep(10);
         }
-        free(conn);
+    }
+    return NULL;
+}
+
+static EST_ERROR mg_open_listener (struct mg_context *ctx, int port,
+                                   int family, int backlog)
+{
+    struct addrinfo hints, *ai, *aiptr;
+    char portstr[12];
+    SOCKET sock = INVALID_SOCKET;
+    int on = 1;
+    int rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    rc = getaddrinfo(NULL, portstr, &hints, &aiptr);
+    if (rc) {
+        EST_LOG_ERR("getaddrinfo() failed: %s", gai_strerror(rc));
+        return (EST_ERR_IP_GETADDR);
+    }
+    for (ai = aiptr; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock == INVALID_SOCKET) {
+            continue;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&on, sizeof(on));
+        if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(sock, backlog) == 0) {
+            break;
+        }
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(aiptr);
+
+    if (sock == INVALID_SOCKET) {
+        EST_LOG_ERR("Unable to listen on port %d, errno=%d", port, ERRNO);
+        return (EST_ERR_SYSCALL);
+    }
+    set_close_on_exec(sock);
+    set_blocking_mode(sock, 0);
+    ctx->listen_sock = sock;
+    return (EST_ERR_NONE);
+}
+
+// Stops the threads started by est_server_run().  Workers notice the
+// stop flag within one select() timeout, even in the middle of a request.
+static void mg_stop_workers (struct mg_context *ctx, int join_master)
+{
+    struct mg_worker *w;
+    int i;
+
+    if (join_master) {
+        if (write(ctx->wakeup_fds[1], "x", 1) != 1) {
+            EST_LOG_WARN("Unable to wake up listener thread");
+        }
+        pthread_join(ctx->master_thread_id, NULL);
+    }
+
+    for (i = 0; i < ctx->num_workers; i++) {
+        w = &ctx->workers[i];
+        pthread_mutex_lock(&w->mutex);
+        pthread_cond_broadcast(&w->not_empty);
+        pthread_cond_broadcast(&w->not_full);
+        pthread_mutex_unlock(&w->mutex);
+    }
+    for (i = 0; i < ctx->num_workers; i++) {
+        w = &ctx->workers[i];
+        pthread_join(w->thread_id, NULL);
+        // Sockets accepted but never serviced
+        while (w->tail != w->head) {
+            closesocket(w->queue[w->tail % w->queue_len]);
+            w->tail++;
+        }
+        pthread_mutex_destroy(&w->mutex);
+        pthread_cond_destroy(&w->not_empty);
+        pthread_cond_destroy(&w->not_full);
+        free(w->queue);
+    }
+    free(ctx->workers);
+    ctx->workers = NULL;
+    ctx->num_workers = 0;
+
+    close(ctx->wakeup_fds[0]);
+    close(ctx->wakeup_fds[1]);
+    closesocket(ctx->listen_sock);
+    ctx->listen_sock = INVALID_SOCKET;
+}
+#endif
+
+/*! @brief est_server_run() starts a listener and a pool of worker
+    threads inside libest to service EST requests.
+
+    @param ctx Pointer to the EST context
+    @param port TCP port number to listen on
+    @param nthreads Number of worker threads to start
+
+    This function may be used instead of accepting connections in
+    the application and invoking est_server_handle_request().  It
+    must be called after est_server_start() or est_proxy_start(), and
+    returns once the threads are running.  The threads are stopped
+    by est_server_stop() or est_proxy_stop().
+
+    A single thread accepts new connections and hands each one to the
+    least busy worker thread.  Each worker has its own queue of
+    accepted connections, the length of which is set with
+    est_server_set_worker_queue_len().  The listen backlog and
+    address family are set with est_server_set_listen_backlog() and
+    est_server_set_listen_family().
+
+    This function is not available when libest is built without
+    pthreads support.
+
+    @return EST_ERROR.
+*/
+EST_ERROR est_server_run (EST_CTX *ctx, int port, int nthreads)
+{
+#ifndef DISABLE_PTHREADS
+    struct mg_context *mgctx;
+    struct mg_worker *w;
+    int queue_len;
+    int backlog;
+    EST_ERROR rv;
+    int i;
+
+    if (!ctx) {
+        EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+    if (ctx->est_mode != EST_SERVER && ctx->est_mode != EST_PROXY) {
+        return (EST_ERR_BAD_MODE);
+    }
+    mgctx = (struct mg_context *)ctx->mg_ctx;
+    if (!mgctx) {
+        EST_LOG_ERR("Server must be started prior to est_server_run()");
+        return (EST_ERR_NO_SSL_CTX);
+    }
+    if (mgctx->workers) {
+        EST_LOG_ERR("Server is already running");
+        return (EST_ERR_BAD_MODE);
+    }
+    if (port <= 0 || port > 65535) {
+        EST_LOG_ERR("Invalid port number %d", port);
+        return (EST_ERR_INVALID_PORT_NUM);
+    }
+    if (nthreads <= 0 || nthreads > EST_WORKER_THREADS_MAX) {
+        EST_LOG_ERR("Number of worker threads must be between 1 and %d",
+                    EST_WORKER_THREADS_MAX);
+        return (EST_ERR_INVALID_PARAMETERS);
+    }
+
+    backlog = ctx->listen_backlog ? ctx->listen_backlog : SOMAXCONN;
+    queue_len = ctx->worker_queue_len ? ctx->worker_queue_len :
+                EST_WORKER_QUEUE_LEN_DEF;
+
+    rv = mg_open_listener(mgctx, port,
+                          ctx->listen_family ? ctx->listen_family : AF_INET,
+                          backlog);
+    if (rv != EST_ERR_NONE) {
+        return (rv);
+    }
+    if (pipe(mgctx->wakeup_fds)) {
+        EST_LOG_ERR("Unable to create wakeup pipe, errno=%d", ERRNO);
+        closesocket(mgctx->listen_sock);
+        mgctx->listen_sock = INVALID_SOCKET;
+        return (EST_ERR_SYSCALL);
+    }
+
+    mgctx->workers = (struct mg_worker *)calloc(nthreads,
+                                                sizeof(struct mg_worker));
+    if (!mgctx->workers) {
+        close(mgctx->wakeup_fds[0]);
+        close(mgctx->wakeup_fds[1]);
+        closesocket(mgctx->listen_sock);
+        mgctx->listen_sock = INVALID_SOCKET;
+        return (EST_ERR_MALLOC);
+    }
+    mgctx->next_worker = 0;
+    mgctx->stop_flag = 0;
+
+    /*
+     * From here on mg_stop_workers() is used to unwind, which
+     * expects every worker in the array to be fully initialized.
+     * Workers that fail to start are dropped from the count.
+     */
+    for (i = 0; i < nthreads; i++) {
+        w = &mgctx->workers[mgctx->num_workers];
+        w->ctx = mgctx;
+        w->queue_len = queue_len;
+        w->queue = (SOCKET *)malloc(queue_len * sizeof(SOCKET));
+        if (!w->queue) {
+            rv = EST_ERR_MALLOC;
+            break;
+        }
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_cond_init(&w->not_empty, NULL);
+        pthread_cond_init(&w->not_full, NULL);
+        if (pthread_create(&w->thread_id, NULL, worker_thread, w)) {
+            EST_LOG_ERR("Unable to start worker thread, errno=%d", ERRNO);
+            pthread_mutex_destroy(&w->mutex);
+            pthread_cond_destroy(&w->not_empty);
+            pthread_cond_destroy(&w->not_full);
+            free(w->queue);
+            rv = EST_ERR_SYSCALL;
+            break;
+        }
+        mgctx->num_workers++;
+    }
+
+    if (rv == EST_ERR_NONE &&
+        pthread_create(&mgctx->master_thread_id, NULL, master_thread, mgctx)) {
+        EST_LOG_ERR("Unable to start listener thread, errno=%d", ERRNO);
+        rv = EST_ERR_SYSCALL;
+    }
+    if (rv != EST_ERR_NONE) {
+        mgctx->stop_flag = 1;
+        mg_stop_workers(mgctx, 0);
+        mgctx->stop_flag = 0;
     }
     return (rv);
+#else
+    EST_LOG_ERR("est_server_run() requires pthreads support");
+    return (EST_ERR_BAD_MODE);
+#endif
 }
 
+/*! @brief est_server_get_conn_pool_stats() returns usage statistics
+    for the pool of connection objects.
+
+    @param ctx Pointer to the EST context
+    @param idle Returns the number of connection objects currently
+           on the pool.  May be NULL.
+    @param in_use Returns the number of connections currently being
+           serviced.  May be NULL.
+    @param high_water Returns the largest number of connections
+           serviced at the same time since the server was started.
+           May be NULL.
+
+    The high water mark is a useful guide when choosing a value for
+    est_server_set_conn_pool_size().  This function must be called
+    after est_server_start() or est_proxy_start().
+
+    @return EST_ERROR.
+*/
+EST_ERROR est_server_get_conn_pool_stats (EST_CTX *ctx, int *idle,
+                                          int *in_use, int *high_water)
+{
+    struct mg_context *mgctx;
+
+    if (!ctx) {
+        EST_LOG_ERR("Null context");
+        return (EST_ERR_NO_CTX);
+    }
+    mgctx = (struct mg_context *)ctx->mg_ctx;
+    if (!mgctx) {
+        EST_LOG_ERR("Server has not been started");
+        return (EST_ERR_NO_SSL_CTX);
+    }
+
+    mg_lock_conn_pool(mgctx);
+    if (idle) {
+        *idle = mgctx->num_free_conns;
+    }
+    if (in_use) {
+        *in_use = mgctx->conns_in_use;
+    }
+    if (high_water) {
+        *high_water = mgctx->conns_high_water;
+    }
+    mg_unlock_conn_pool(mgctx);
+    return (EST_ERR_NONE);
+}
 
 static void free_context (struct mg_context *ctx)
 {
+    struct mg_connection *conn;
+
+    // Release the pooled connections
+    while ((conn = ctx->free_conns) != NULL) {
+        ctx->free_conns = conn->next_free;
+        mg_destroy_connection(conn);
+    }
+#ifndef DISABLE_PTHREADS
+    pthread_mutex_destroy(&ctx->conn_pool_lock);
+#endif
+
     // Deallocate SSL context
     if (ctx->ssl_ctx != NULL) {
+        /*
+         * Freeing the context flushes its sessions through the
+         * remove callback.  Sessions in an external cache stay
+         * there for the server processes that remain.
+         */
+        SSL_CTX_sess_set_remove_cb(ctx->ssl_ctx, NULL);
         SSL_CTX_free(ctx->ssl_ctx);
     }
 
@@ -1628,6 +3322,12 @@ void mg_stop (struct mg_context *ctx)
 {
     ctx->stop_flag = 1;
 
+#ifndef DISABLE_PTHREADS
+    if (ctx->workers) {
+        mg_stop_workers(ctx, 1);
+    }
+#endif
+
     free_context(ctx);
 
 #if defined(_WIN32) && !defined(__SYMBIAN32__)
@@ -1662,6 +3362,10 @@ struct mg_context *mg_start (void *user_data)
     ctx->user_data = user_data;
     ctx->est_ctx = (EST_CTX*)user_data;
     ctx->enable_keepalives = 1; 
+    ctx->listen_sock = INVALID_SOCKET;
+#ifndef DISABLE_PTHREADS
+    pthread_mutex_init(&ctx->conn_pool_lock, NULL);
+#endif
     if (!set_ssl_option(ctx)) {
         free_context(ctx);
         return NULL;
@@ -1670,37 +3374,133 @@ struct mg_context *mg_start (void *user_data)
     return ctx;
 }
 
+/*
+ * Sends an HTTP 200 response with a base64 encoded body of the given
+ * content type.  The header and body go out in a single write, see
+ * mg_write_response().
+ */
+static int est_format_http_200 (char *hdr, int max, const char *content_type,
+                                int body_len)
+{
+    int hdrlen;
+
+    hdrlen = snprintf(hdr, max, "%s%s%s%s%s: %s%s%s: %s%s%s: %d%s%s",
+                      EST_HTTP_HDR_200, EST_HTTP_HDR_EOL,
+                      EST_HTTP_HDR_STAT_200, EST_HTTP_HDR_EOL,
+                      EST_HTTP_HDR_CT, content_type, EST_HTTP_HDR_EOL,
+                      EST_HTTP_HDR_CE, EST_HTTP_CE_BASE64, EST_HTTP_HDR_EOL,
+                      EST_HTTP_HDR_CL, body_len, EST_HTTP_HDR_EOL,
+                      EST_HTTP_HDR_EOL);
+    if (hdrlen <= 0 || hdrlen >= max) {
+        return (0);
+    }
+    return (hdrlen);
+}
+
+EST_ERROR est_send_http_200 (void *http_ctx, const char *content_type,
+                             const void *body, int body_len)
+{
+    char http_hdr[EST_HTTP_HDR_MAX];
+    int hdrlen;
+
+    hdrlen = est_format_http_200(http_hdr, EST_HTTP_HDR_MAX, content_type,
+                                 body_len);
+    if (!hdrlen) {
+        return (EST_ERR_HTTP_CANNOT_BUILD_HEADER);
+    }
+    ((struct mg_connection*)http_ctx)->status_code = 200;
+    if (!mg_write_response((struct mg_connection*)http_ctx, http_hdr, hdrlen,
+                           body, body_len)) {
+        return (EST_ERR_HTTP_WRITE);
+    }
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Allocates an HTTP 200 response with the header already rendered,
+ * body is set to where the caller writes body_len bytes of content.
+ * The new response holds one reference, owned by the caller.
+ */
+EST_HTTP_RESP *est_http_resp_alloc_200 (const char *content_type,
+                                        int body_len, char **body)
+{
+    char http_hdr[EST_HTTP_HDR_MAX];
+    EST_HTTP_RESP *resp;
+    int hdrlen;
+
+    hdrlen = est_format_http_200(http_hdr, EST_HTTP_HDR_MAX, content_type,
+                                 body_len);
+    if (!hdrlen) {
+        return (NULL);
+    }
+    resp = (EST_HTTP_RESP *)malloc(sizeof(EST_HTTP_RESP) + hdrlen + body_len);
+    if (!resp) {
+        EST_LOG_ERR("malloc failed");
+        return (NULL);
+    }
+    resp->refcnt = 1;
+    resp->len = hdrlen + body_len;
+    memcpy(resp->data, http_hdr, hdrlen);
+    *body = resp->data + hdrlen;
+    return (resp);
+}
+
+/*
+ * Renders a complete HTTP 200 response into a single buffer that
+ * can be sent any number of times with est_send_http_resp().  The
+ * new response holds one reference, owned by the caller.
+ */
+EST_HTTP_RESP *est_http_resp_new_200 (const char *content_type,
+                                      const void *body, int body_len)
+{
+    EST_HTTP_RESP *resp;
+    char *dst;
+
+    resp = est_http_resp_alloc_200(content_type, body_len, &dst);
+    if (resp) {
+        memcpy(dst, body, body_len);
+    }
+    return (resp);
+}
+
+void est_http_resp_hold (EST_HTTP_RESP *resp)
+{
+    __sync_fetch_and_add(&resp->refcnt, 1);
+}
+
+void est_http_resp_release (EST_HTTP_RESP *resp)
+{
+    if (resp && __sync_sub_and_fetch(&resp->refcnt, 1) == 0) {
+        free(resp);
+    }
+}
+
+/*
+ * Sends a response rendered by est_http_resp_new_200().  This
+ * is a single write, nothing is formatted per request.
+ */
+EST_ERROR est_send_http_resp (void *http_ctx, EST_HTTP_RESP *resp)
+{
+    ((struct mg_connection*)http_ctx)->status_code = 200;
+    if (mg_write((struct mg_connection*)http_ctx, resp->data,
+                 resp->len) != resp->len) {
+        return (EST_ERR_HTTP_WRITE);
+    }
+    return (EST_ERR_NONE);
+}
+
 EST_ERROR est_send_csrattr_data (EST_CTX *ctx, char *csr_data, int csr_len, void *http_ctx)
 {
-   char http_hdr[EST_HTTP_HDR_MAX];
-   int hdrlen;
+   EST_ERROR rv;
 
    if ((csr_len > 0) && csr_data) {
         /*
-         * Send HTTP 200 header
-         */
-        snprintf(http_hdr, EST_HTTP_HDR_MAX, "%s%s%s%s", EST_HTTP_HDR_200, EST_HTTP_HDR_EOL,
-                 EST_HTTP_HDR_STAT_200, EST_HTTP_HDR_EOL);
-        hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-        snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %s%s", EST_HTTP_HDR_CT,
-                 EST_HTTP_CT_CSRATTRS, EST_HTTP_HDR_EOL);
-        hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-        snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %s%s", EST_HTTP_HDR_CE,
-                 EST_HTTP_CE_BASE64, EST_HTTP_HDR_EOL);
-        hdrlen = strnlen(http_hdr, EST_HTTP_HDR_MAX);
-        snprintf(http_hdr + hdrlen, EST_HTTP_HDR_MAX, "%s: %d%s%s", EST_HTTP_HDR_CL,
-                 csr_len, EST_HTTP_HDR_EOL, EST_HTTP_HDR_EOL);
-        if (!mg_write(http_ctx, http_hdr, strnlen(http_hdr, EST_HTTP_HDR_MAX))) {
-            free(csr_data);
-            return (EST_ERR_HTTP_WRITE);
-        }
-
-        /*
-         * Send the CSR in the body
+         * Send HTTP 200 header and the CSR attributes in the body
          */
-        if (!mg_write(http_ctx, csr_data, csr_len)) {
+        rv = est_send_http_200(http_ctx, EST_HTTP_CT_CSRATTRS, csr_data, csr_len);
+        if (rv != EST_ERR_NONE) {
             free(csr_data);
-            return (EST_ERR_HTTP_WRITE);
+            return (rv);
         }
         free(csr_data);
     } else {
@@ -165,6 +165,9 @@ typedef struct DIR {
 #include <pwd.h>
 #include <unistd.h>
 #include <dirent.h>
+#ifndef DISABLE_PTHREADS
+#include <pthread.h>
+#endif
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -220,12 +223,37 @@ struct socket {
 };
 
 // Handle for the HTTP service itself
+struct mg_worker;
+
 struct mg_context {
     volatile int stop_flag;      // Should we stop event loop
     SSL_CTX *ssl_ctx;            // SSL context
     void *user_data;             // User-defined data
     EST_CTX *est_ctx;
     int enable_keepalives;
+    SOCKET listen_sock;          // Listening socket opened by est_server_run()
+#ifndef DISABLE_PTHREADS
+    int wakeup_fds[2];           // Pipe used to wake up the master thread
+    pthread_t master_thread_id;  // Accepting thread started by est_server_run()
+    struct mg_worker *workers;   // Worker pool started by est_server_run()
+    int num_workers;             // Number of entries in workers
+    int next_worker;             // Where the master starts looking for a worker
+    pthread_mutex_t conn_pool_lock; // Protects the connection pool below
+#endif
+    struct mg_connection *free_conns; // Released connections available for reuse
+    int num_free_conns;          // Number of entries on free_conns
+    int conns_in_use;            // Connections currently being serviced
+    int conns_high_water;        // Most connections ever in use at once
+};
+
+// Headers looked up on every request.  parse_http_headers() records
+// their values as it parses, so no lookup has to scan all the headers.
+enum mg_known_header {
+    MG_HDR_CONTENT_LENGTH = 0,
+    MG_HDR_CONTENT_TYPE,
+    MG_HDR_CONNECTION,
+    MG_HDR_AUTHORIZATION,
+    MG_HDR_KNOWN_MAX
 };
 
 // This structure contains information about the HTTP request.
@@ -243,10 +271,25 @@ struct mg_request_info {
         const char *name;       // HTTP header name
         const char *value;      // HTTP header value
     } http_headers[64];         // Maximum 64 headers
+    const char *known_headers[MG_HDR_KNOWN_MAX]; // Values of the headers
+                                // libest looks up, indexed by mg_known_header
     void *user_data;            // User data pointer passed to the mg_start()
     void *ev_data;              // Event-specific data pointer
 };
 
+// States of the per-connection engine.  A connection handed to
+// est_server_handle_request() runs through these in one call, while
+// one created with est_server_conn_new() is advanced by the application
+// through est_server_conn_on_event() whenever its socket is ready.
+enum mg_conn_state {
+    MG_CONN_HANDSHAKE = 0,       // TLS handshake in progress
+    MG_CONN_READ_REQUEST,        // Reading request headers and body
+    MG_CONN_ENROLL_WAIT,         // Enrollment parked until the CA answers
+    MG_CONN_WRITE_RESPONSE,      // Flushing the queued response
+    MG_CONN_SHUTDOWN,            // Sending TLS close_notify
+    MG_CONN_CLOSED               // Done, connection may be freed
+};
+
 // Handle for the individual connection
 struct mg_connection {
     struct mg_request_info request_info;
@@ -265,6 +308,20 @@ struct mg_connection {
     int data_len;                // Total size of data in a buffer
     int status_code;             // HTTP reply status code, e.g. 200
     char user_id[MG_UID_MAX];    // User ID from HTTP auth header
+    int nonblocking;             // 1 if driven by est_server_conn_on_event()
+    enum mg_conn_state state;    // Connection engine state
+    int keep_alive;              // should_keep_alive() result for last request
+    char *wbuf;                  // Queued response data (non-blocking mode)
+    int wbuf_size;               // Allocated size of wbuf
+    int wbuf_len;                // Number of bytes queued in wbuf
+    int wbuf_sent;               // Number of queued bytes already written
+    struct mg_connection *next_free; // Link on the context's connection pool
+    int scan_len;                // Bytes of buf already searched for the
+                                 // end of the request headers
+    char *body;                  // Request body that did not fit in buf
+    int64_t body_len;            // Number of bytes read into body
+    struct est_enroll_req *enroll_req; // Parked asynchronous enrollment
+    EST_CONN_AUTH auth;          // Client identity from the TLS session
 };
 
 
@@ -409,6 +466,14 @@ struct mg_request_info *mg_get_request_info(struct mg_connection *);
 //  number of bytes written on success
 int mg_write(struct mg_connection *, const void *buf, size_t len);
 
+// Send a complete response, header followed by body, using a single
+// write to the connection.
+// Return:
+//  0   on error
+//  number of bytes written on success
+int mg_write_response(struct mg_connection *conn, const char *hdr, int hdr_len,
+                      const void *body, int body_len);
+
 
 // Send data to the browser using printf() semantics.
 //
@@ -548,7 +613,7 @@ void mg_send_http_error(struct mg_connection *conn, int status,
 
 const void* mg_get_conn_ssl(struct mg_connection *conn);
 
-void mg_send_authorization_request(struct mg_connection *conn);
+void mg_send_authorization_request(struct mg_connection *conn, int stale);
 
 // Return 1 if request is authorised, 0 otherwise.
 // the degenerate flag forces this to occur w/o respsect to the "PROTECT_URI" status of the current URL
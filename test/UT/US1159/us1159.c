@@ -31,6 +31,8 @@
 
 #define US1159_ATTR_POP_ONLY	"MAsGCSqGSIb3DQEJBw==\0"
 #define US1159_ATTR_CN_ONLY	"MAUGA1UEAw==\0"
+#define US1159_ATTR_CN_999_1	"MAoGA1UEAwYDiDcB\0"
+#define US1159_ATTR_CN_999_3	"MAoGA1UEAwYDiDcD\0"
 #define US1159_ATTR_TEST	"MHEGBysGAQEBARYwIgYDiDcBMRsTGVBhcnNlIFNFVCBhcyAyLjk5OS4xIGRhdGEwLAYDiDcCMSUGA4g3AwYDiDcEExlQYXJzZSBTRVQgYXMgMi45OTkuMiBkYXRhBgUrgQQAIgYDVQQDBggqhkjOPQQDAg==\0"
 
 extern EST_CTX *ectx;
@@ -955,6 +957,126 @@ static void us1159_test21 (void)
 
 
 
+/*
+ * Enrolls a CSR carrying the CommonName and, when oid is
+ * not NULL, one additional attribute.  Returns the result
+ * of the enroll.
+ */
+static int us1159_enroll_attr (char *cn, char *oid)
+{
+    X509_REQ *req;
+    EVP_PKEY *key;
+    EST_CTX *ctx;
+    X509_NAME *subj;
+    int pkcs7_len = 0;
+    int rv;
+
+    key = generate_private_key();
+    CU_ASSERT(key != NULL);
+    req = X509_REQ_new();
+    CU_ASSERT(req != NULL);
+    subj = X509_REQ_get_subject_name(req);
+    rv = X509_NAME_add_entry_by_txt(subj, "CN", MBSTRING_ASC, (const unsigned char*)cn, -1, -1, 0);
+    CU_ASSERT(rv != 0);
+    if (oid) {
+	rv = X509_REQ_add1_attr_by_txt(req, oid, MBSTRING_ASC, (const unsigned char*)"dummy", -1);
+	CU_ASSERT(rv != 0);
+    }
+    rv = X509_REQ_set_pubkey(req, key);
+    CU_ASSERT(rv != 0);
+
+    ctx = est_client_init(cacerts, cacerts_len, 
+                           EST_CERT_FORMAT_PEM,
+                           NULL);
+    CU_ASSERT(ctx != NULL);
+    rv = est_client_force_pop(ctx);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_auth(ctx, US1159_UID, US1159_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    est_client_set_server(ctx, US1159_SERVER_IP, US1159_SERVER_PORT);
+
+    rv = est_client_enroll_csr(ctx, req, &pkcs7_len, key);
+
+    est_destroy(ctx);
+    X509_REQ_free(req);
+    EVP_PKEY_free(key);
+    return (rv);
+}
+
+/*
+ * The server requires 2.999.1 and the client only provides
+ * 2.999.1.5, whose encoding starts with the required OID.
+ * Only an exact match satisfies the requirement, so the
+ * enroll fails until the client provides 2.999.1 itself.
+ */
+static void us1159_test30 (void)
+{
+    int rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_set_csr_cb(ectx, &handle_csrattrs_request);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    attrs = US1159_ATTR_CN_999_1;
+
+    rv = us1159_enroll_attr("Test 30", "2.999.1.5");
+    CU_ASSERT(rv == EST_ERR_HTTP_BAD_REQ);
+
+    rv = us1159_enroll_attr("Test 30", "2.999.1");
+    CU_ASSERT(rv == EST_ERR_NONE);
+}
+
+/*
+ * The server requires 2.999.3, the client provides other
+ * attributes but not that one.  The enroll should fail.
+ */
+static void us1159_test31 (void)
+{
+    int rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_set_csr_cb(ectx, &handle_csrattrs_request);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    attrs = US1159_ATTR_CN_999_3;
+
+    rv = us1159_enroll_attr("Test 31", NULL);
+    CU_ASSERT(rv == EST_ERR_HTTP_BAD_REQ);
+
+    rv = us1159_enroll_attr("Test 31", "2.999.2");
+    CU_ASSERT(rv == EST_ERR_HTTP_BAD_REQ);
+}
+
+/*
+ * The attributes returned by the callback change between
+ * enrolls.  The server compiles them again each time they
+ * change, so the same CSR is accepted, then rejected, then
+ * accepted again.
+ */
+static void us1159_test32 (void)
+{
+    int rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_set_csr_cb(ectx, &handle_csrattrs_request);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    attrs = US1159_ATTR_CN_ONLY;
+    rv = us1159_enroll_attr("Test 32", "2.999.2");
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    attrs = US1159_ATTR_CN_999_3;
+    rv = us1159_enroll_attr("Test 32", "2.999.2");
+    CU_ASSERT(rv == EST_ERR_HTTP_BAD_REQ);
+    rv = us1159_enroll_attr("Test 32", "2.999.3");
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    attrs = US1159_ATTR_CN_ONLY;
+    rv = us1159_enroll_attr("Test 32", "2.999.2");
+    CU_ASSERT(rv == EST_ERR_NONE);
+}
+
 /*
  * This test attempts does a simple enroll when the
  * server has no CSR attributes configured with
@@ -1107,6 +1229,9 @@ int us1159_add_suite (void)
        (NULL == CU_add_test(pSuite, "CN only using static config w/pop", us1159_test10)) || 
        (NULL == CU_add_test(pSuite, "A lot of attributes w/pop", us1159_test20)) || 
        (NULL == CU_add_test(pSuite, "Long attribute w/pop", us1159_test21)) || 
+       (NULL == CU_add_test(pSuite, "Required OID is a prefix w/pop", us1159_test30)) || 
+       (NULL == CU_add_test(pSuite, "Required attribute missing w/pop", us1159_test31)) || 
+       (NULL == CU_add_test(pSuite, "Callback attributes change w/pop", us1159_test32)) || 
        (NULL == CU_add_test(pSuite, "No CSR attrs on server w/pop", us1159_test50)) || 
        (NULL == CU_add_test(pSuite, "No CSR attrs on server w/o pop", us1159_test51))) 
    {
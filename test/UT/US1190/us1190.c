@@ -0,0 +1,305 @@
+/*------------------------------------------------------------------
+ * us1190.c - Unit Tests for User Story 1190 - Non-blocking server
+ *                                             connections
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1190_SERVER_PORT      31190
+#define US1190_SERVER_IP        "127.0.0.1"
+#define US1190_UID              "estuser"
+#define US1190_PWD              "estpwd"
+#define US1190_CACERTS          "CA/estCA/cacert.crt"
+#define US1190_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1190_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1190_CLIENT_THREADS   8
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The server is started in event mode, where all
+ * connections are serviced by a single thread through
+ * est_server_conn_on_event().
+ */
+static int us1190_init_suite (void)
+{
+    int rv;
+
+    cacerts_len = read_binary_file(US1190_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_event_mode(1);
+    rv = st_start(US1190_SERVER_PORT,
+                  US1190_SERVER_CERTKEY,
+                  US1190_SERVER_CERTKEY,
+                  "US1190 test realm",
+                  US1190_CACERTS,
+                  US1190_TRUST_CERTS,
+                  "CA/estExampleCA.cnf",
+                  0, 0, 0);
+    return rv;
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1190_destroy_suite (void)
+{
+    st_stop();
+    st_set_event_mode(0);
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+static EST_CTX *us1190_client_ctx (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return NULL;
+    }
+    rv = est_client_set_auth(cctx, US1190_UID, US1190_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1190_SERVER_IP, US1190_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return cctx;
+}
+
+/*
+ * Parameter checks on the non-blocking connection API
+ */
+static void us1190_test1 (void)
+{
+    EST_SERVER_CONN *conn;
+
+    LOG_FUNC_NM;
+
+    conn = est_server_conn_new(NULL, 0);
+    CU_ASSERT(conn == NULL);
+
+    CU_ASSERT(est_server_conn_on_event(NULL, EST_CONN_EV_READ) ==
+              EST_CONN_EV_CLOSED);
+
+    /* Should be a no-op */
+    est_server_conn_free(NULL);
+}
+
+/*
+ * Retrieve the CA certs from the event driven server
+ */
+static void us1190_test2 (void)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    int len = 0;
+
+    LOG_FUNC_NM;
+
+    cctx = us1190_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    rv = est_client_get_cacerts(cctx, &len);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(len > 0);
+    est_destroy(cctx);
+}
+
+/*
+ * Enrolls a new EC key through the event driven server and
+ * checks the outcome against what the caller expects.
+ */
+static void us1190_enroll_expect (int success)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+    int pkcs7_len = 0;
+    unsigned char *new_cert;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    CU_ASSERT(eckey != NULL);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+
+    cctx = us1190_client_ctx();
+    if (!cctx) {
+        EVP_PKEY_free(key);
+        return;
+    }
+    rv = est_client_enroll(cctx, "US1190-TEST3", &pkcs7_len, key);
+    if (!success) {
+        CU_ASSERT(rv != EST_ERR_NONE);
+    } else {
+        CU_ASSERT(rv == EST_ERR_NONE);
+        CU_ASSERT(pkcs7_len > 0);
+    }
+    if (rv == EST_ERR_NONE) {
+        new_cert = malloc(pkcs7_len);
+        rv = est_client_copy_enrolled_cert(cctx, new_cert);
+        CU_ASSERT(rv == EST_ERR_NONE);
+        free(new_cert);
+    }
+    est_destroy(cctx);
+    EVP_PKEY_free(key);
+}
+
+/*
+ * Simple enroll through the event driven server.  The
+ * request body and HTTP authentication are both exercised.
+ */
+static void us1190_test3 (void)
+{
+    LOG_FUNC_NM;
+
+    us1190_enroll_expect(1);
+}
+
+static void *us1190_client_thread (void *arg)
+{
+    int *failures = (int *)arg;
+    EST_CTX *cctx;
+    int i, len;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    if (!cctx) {
+        (*failures)++;
+        return NULL;
+    }
+    est_client_set_auth(cctx, US1190_UID, US1190_PWD, NULL, NULL);
+    est_client_set_server(cctx, US1190_SERVER_IP, US1190_SERVER_PORT);
+    for (i = 0; i < 5; i++) {
+        if (est_client_get_cacerts(cctx, &len) != EST_ERR_NONE) {
+            (*failures)++;
+        }
+    }
+    est_destroy(cctx);
+    return NULL;
+}
+
+/*
+ * Several clients at once.  The server has only one thread,
+ * so this only passes when no connection blocks the others.
+ */
+static void us1190_test4 (void)
+{
+    pthread_t threads[US1190_CLIENT_THREADS];
+    int failures[US1190_CLIENT_THREADS];
+    int i;
+
+    LOG_FUNC_NM;
+
+    for (i = 0; i < US1190_CLIENT_THREADS; i++) {
+        failures[i] = 0;
+        pthread_create(&threads[i], NULL, us1190_client_thread, &failures[i]);
+    }
+    for (i = 0; i < US1190_CLIENT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT(failures[i] == 0);
+    }
+}
+
+/*
+ * Request body limits.  A CSR larger than the configured
+ * maximum is refused, raising the limit lets it through.
+ */
+static void us1190_test5 (void)
+{
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_server_set_max_content_len(NULL, 4096);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_max_content_len(ectx, 0);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_set_max_content_len(ectx, 1024*1024*1024);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+
+    /*
+     * The CSR from test3 is a few hundred bytes, a 64 byte
+     * limit must cause the server to reject it.
+     */
+    rv = est_server_set_max_content_len(ectx, 64);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    us1190_enroll_expect(0);
+
+    rv = est_server_set_max_content_len(ectx, 65536);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    us1190_enroll_expect(1);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1190_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1190_server_nonblocking",
+                         us1190_init_suite,
+                         us1190_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Connection API parameters", us1190_test1)) ||
+       (NULL == CU_add_test(pSuite, "Get CA certs", us1190_test2)) ||
+       (NULL == CU_add_test(pSuite, "Simple enroll", us1190_test3)) ||
+       (NULL == CU_add_test(pSuite, "Concurrent clients", us1190_test4)) ||
+       (NULL == CU_add_test(pSuite, "Request body limits", us1190_test5)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
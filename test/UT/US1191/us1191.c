@@ -0,0 +1,325 @@
+/*------------------------------------------------------------------
+ * us1191.c - Unit Tests for User Story 1191 - Built-in listener and
+ *                                             worker pool
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1191_SERVER_PORT      31191
+#define US1191_SERVER_IP        "127.0.0.1"
+#define US1191_UID              "estuser"
+#define US1191_PWD              "estpwd"
+#define US1191_CACERTS          "CA/estCA/cacert.crt"
+#define US1191_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1191_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1191_CLIENT_THREADS   16
+#define US1191_WORKER_THREADS   4
+
+extern EST_CTX *ectx;
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The listening socket and worker threads are
+ * provided by est_server_run().
+ */
+static int us1191_init_suite (void)
+{
+    int rv;
+
+    cacerts_len = read_binary_file(US1191_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_pool_threads(US1191_WORKER_THREADS);
+    rv = st_start(US1191_SERVER_PORT,
+                  US1191_SERVER_CERTKEY,
+                  US1191_SERVER_CERTKEY,
+                  "US1191 test realm",
+                  US1191_CACERTS,
+                  US1191_TRUST_CERTS,
+                  "CA/estExampleCA.cnf",
+                  0, 0, 0);
+    return rv;
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1191_destroy_suite (void)
+{
+    st_stop();
+    st_set_pool_threads(0);
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+static EST_CTX *us1191_client_ctx (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return NULL;
+    }
+    rv = est_client_set_auth(cctx, US1191_UID, US1191_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1191_SERVER_IP, US1191_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return cctx;
+}
+
+/*
+ * Parameter checks on est_server_run() and the
+ * associated configuration functions
+ */
+static void us1191_test1 (void)
+{
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_server_run(NULL, US1191_SERVER_PORT + 1, 1);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+
+    rv = est_server_run(ectx, US1191_SERVER_PORT + 1, 0);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+
+    rv = est_server_run(ectx, 0, 1);
+    CU_ASSERT(rv == EST_ERR_INVALID_PORT_NUM);
+
+    /*
+     * The pool is already running for this context
+     */
+    rv = est_server_run(ectx, US1191_SERVER_PORT + 1, 1);
+    CU_ASSERT(rv == EST_ERR_BAD_MODE);
+
+    rv = est_server_set_listen_backlog(NULL, 10);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_listen_backlog(ectx, -1);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+
+    rv = est_server_set_listen_family(NULL, AF_INET);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_listen_family(ectx, AF_UNIX);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+
+    rv = est_server_set_worker_queue_len(NULL, 10);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_worker_queue_len(ectx, 0);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+}
+
+/*
+ * Retrieve the CA certs through the worker pool
+ */
+static void us1191_test2 (void)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    int len = 0;
+
+    LOG_FUNC_NM;
+
+    cctx = us1191_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    rv = est_client_get_cacerts(cctx, &len);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(len > 0);
+    est_destroy(cctx);
+}
+
+/*
+ * Simple enroll through the worker pool
+ */
+static void us1191_test3 (void)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+    int pkcs7_len = 0;
+    unsigned char *new_cert;
+
+    LOG_FUNC_NM;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    CU_ASSERT(eckey != NULL);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+
+    cctx = us1191_client_ctx();
+    if (!cctx) {
+        EVP_PKEY_free(key);
+        return;
+    }
+    rv = est_client_enroll(cctx, "US1191-TEST3", &pkcs7_len, key);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(pkcs7_len > 0);
+    if (rv == EST_ERR_NONE) {
+        new_cert = malloc(pkcs7_len);
+        rv = est_client_copy_enrolled_cert(cctx, new_cert);
+        CU_ASSERT(rv == EST_ERR_NONE);
+        free(new_cert);
+    }
+    est_destroy(cctx);
+    EVP_PKEY_free(key);
+}
+
+static void *us1191_client_thread (void *arg)
+{
+    int *failures = (int *)arg;
+    EST_CTX *cctx;
+    int i, len;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    if (!cctx) {
+        (*failures)++;
+        return NULL;
+    }
+    est_client_set_auth(cctx, US1191_UID, US1191_PWD, NULL, NULL);
+    est_client_set_server(cctx, US1191_SERVER_IP, US1191_SERVER_PORT);
+    for (i = 0; i < 5; i++) {
+        if (est_client_get_cacerts(cctx, &len) != EST_ERR_NONE) {
+            (*failures)++;
+        }
+    }
+    est_destroy(cctx);
+    return NULL;
+}
+
+/*
+ * More clients than worker threads, which requires
+ * connections to wait in the per-worker queues.
+ */
+static void us1191_test4 (void)
+{
+    pthread_t threads[US1191_CLIENT_THREADS];
+    int failures[US1191_CLIENT_THREADS];
+    int i;
+
+    LOG_FUNC_NM;
+
+    for (i = 0; i < US1191_CLIENT_THREADS; i++) {
+        failures[i] = 0;
+        pthread_create(&threads[i], NULL, us1191_client_thread, &failures[i]);
+    }
+    for (i = 0; i < US1191_CLIENT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT(failures[i] == 0);
+    }
+}
+
+/*
+ * Connection objects are returned to the pool once
+ * the clients above have disconnected.
+ */
+static void us1191_test5 (void)
+{
+    EST_ERROR rv;
+    int idle = -1, in_use = -1, high_water = -1;
+
+    LOG_FUNC_NM;
+
+    rv = est_server_set_conn_pool_size(NULL, 8);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_conn_pool_size(ectx, -1);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+
+    rv = est_server_get_conn_pool_stats(NULL, &idle, &in_use, &high_water);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+
+    /*
+     * Give the workers a moment to finish closing the
+     * connections from the previous test
+     */
+    sleep(1);
+    rv = est_server_get_conn_pool_stats(ectx, &idle, &in_use, &high_water);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(in_use == 0);
+    CU_ASSERT(idle > 0);
+    CU_ASSERT(idle <= US1191_WORKER_THREADS);
+    CU_ASSERT(high_water >= idle);
+
+    /*
+     * Shrinking the pool takes effect as connections
+     * are released, existing idle objects are kept.
+     */
+    rv = est_server_set_conn_pool_size(ectx, 0);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    us1191_test2();
+    rv = est_server_get_conn_pool_stats(ectx, &idle, &in_use, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(idle <= US1191_WORKER_THREADS);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1191_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1191_server_run",
+                         us1191_init_suite,
+                         us1191_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1191_test1)) ||
+       (NULL == CU_add_test(pSuite, "Get CA certs", us1191_test2)) ||
+       (NULL == CU_add_test(pSuite, "Simple enroll", us1191_test3)) ||
+       (NULL == CU_add_test(pSuite, "Concurrent clients", us1191_test4)) ||
+       (NULL == CU_add_test(pSuite, "Connection pool stats", us1191_test5)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
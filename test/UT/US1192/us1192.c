@@ -0,0 +1,263 @@
+/*------------------------------------------------------------------
+ * us1192.c - Unit Tests for User Story 1192 - TLS session resumption
+ *                                             across server instances
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+#include <openssl/rand.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1192_SERVER_PORT      31192
+#define US1192_SERVER_PORT_STR  "31192"
+#define US1192_SESS_CACHE       "/tmp/us1192_sess_cache"
+#define US1192_CACERTS          "CA/estCA/cacert.crt"
+#define US1192_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1192_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+
+extern EST_CTX *ectx;
+
+static int us1192_start_server (void)
+{
+    return (st_start(US1192_SERVER_PORT,
+                     US1192_SERVER_CERTKEY,
+                     US1192_SERVER_CERTKEY,
+                     "US1192 test realm",
+                     US1192_CACERTS,
+                     US1192_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  Each test starts and stops its own server, since
+ * a restart is what shows a session survived outside of the
+ * OpenSSL session cache.
+ */
+static int us1192_init_suite (void)
+{
+    unlink(US1192_SESS_CACHE);
+    return 0;
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1192_destroy_suite (void)
+{
+    unlink(US1192_SESS_CACHE);
+    return 0;
+}
+
+/*
+ * Opens a TLS 1.2 connection to the server, offering sess for
+ * resumption when it's not NULL.  Returns the session negotiated
+ * on the connection, which the caller must free, and sets reused
+ * when the server resumed the offered session.
+ */
+static SSL_SESSION *us1192_connect (SSL_SESSION *sess, int *reused)
+{
+    SSL_CTX *ssl_ctx;
+    SSL *ssl;
+    BIO *conn;
+    SSL_SESSION *new_sess = NULL;
+
+    *reused = 0;
+    ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
+    CU_ASSERT(ssl_ctx != NULL);
+    if (!ssl_ctx) {
+        return NULL;
+    }
+    conn = open_tcp_socket("127.0.0.1", US1192_SERVER_PORT_STR);
+    CU_ASSERT(conn != NULL);
+    if (!conn) {
+        SSL_CTX_free(ssl_ctx);
+        return NULL;
+    }
+    ssl = SSL_new(ssl_ctx);
+    SSL_set_bio(ssl, conn, conn);
+    if (sess) {
+        SSL_set_session(ssl, sess);
+    }
+    if (SSL_connect(ssl) > 0) {
+        *reused = SSL_session_reused(ssl);
+        new_sess = SSL_get1_session(ssl);
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    SSL_CTX_free(ssl_ctx);
+    return new_sess;
+}
+
+/*
+ * Performs a full handshake, restarts the server and checks
+ * whether the restarted server resumes the session.
+ */
+static void us1192_resume_after_restart (int expect_reuse)
+{
+    SSL_SESSION *sess;
+    SSL_SESSION *sess2;
+    int reused;
+    int rv;
+
+    rv = us1192_start_server();
+    CU_ASSERT(rv == 0);
+    sess = us1192_connect(NULL, &reused);
+    CU_ASSERT(sess != NULL);
+    CU_ASSERT(reused == 0);
+    st_stop();
+
+    rv = us1192_start_server();
+    CU_ASSERT(rv == 0);
+    sess2 = us1192_connect(sess, &reused);
+    CU_ASSERT(sess2 != NULL);
+    CU_ASSERT(reused == expect_reuse);
+    st_stop();
+
+    SSL_SESSION_free(sess);
+    SSL_SESSION_free(sess2);
+}
+
+/*
+ * Parameter checks on the session resumption API
+ */
+static void us1192_test1 (void)
+{
+    unsigned char key[EST_TICKET_KEY_LEN];
+    EST_ERROR rv;
+    int i;
+
+    LOG_FUNC_NM;
+
+    memset(key, 0x11, sizeof(key));
+
+    rv = est_server_set_session_cache_cb(NULL, NULL, NULL, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_shm_session_cache(NULL, US1192_SESS_CACHE, 64);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_add_ticket_key(NULL, key, EST_TICKET_KEY_LEN);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+
+    rv = us1192_start_server();
+    CU_ASSERT(rv == 0);
+    rv = est_server_set_shm_session_cache(ectx, US1192_SESS_CACHE, 0);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_set_shm_session_cache(ectx, NULL, 64);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_add_ticket_key(ectx, key, EST_TICKET_KEY_LEN - 1);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_add_ticket_key(ectx, NULL, EST_TICKET_KEY_LEN);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+
+    /*
+     * The key ring holds a limited number of keys, adding
+     * more keys drops the oldest ones
+     */
+    for (i = 0; i < 10; i++) {
+        key[0] = i;
+        rv = est_server_add_ticket_key(ectx, key, EST_TICKET_KEY_LEN);
+        CU_ASSERT(rv == EST_ERR_NONE);
+    }
+
+    /*
+     * A cache file created with one size can't be opened
+     * with another
+     */
+    rv = est_server_set_shm_session_cache(ectx, US1192_SESS_CACHE, 64);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_server_set_shm_session_cache(ectx, US1192_SESS_CACHE, 32);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    st_stop();
+}
+
+/*
+ * Without a shared cache or tickets the session is lost
+ * when the server restarts
+ */
+static void us1192_test2 (void)
+{
+    LOG_FUNC_NM;
+
+    st_set_shm_session_cache(NULL);
+    st_set_ticket_key(NULL);
+    us1192_resume_after_restart(0);
+}
+
+/*
+ * The shared memory cache outlives the server instance
+ * that stored the session
+ */
+static void us1192_test3 (void)
+{
+    LOG_FUNC_NM;
+
+    st_set_shm_session_cache(US1192_SESS_CACHE);
+    st_set_ticket_key(NULL);
+    us1192_resume_after_restart(1);
+    st_set_shm_session_cache(NULL);
+}
+
+/*
+ * A session ticket can be resumed by any server instance
+ * that holds the ticket key
+ */
+static void us1192_test4 (void)
+{
+    unsigned char key[EST_TICKET_KEY_LEN];
+
+    LOG_FUNC_NM;
+
+    CU_ASSERT(RAND_bytes(key, sizeof(key)) == 1);
+    st_set_shm_session_cache(NULL);
+    st_set_ticket_key(key);
+    us1192_resume_after_restart(1);
+    st_set_ticket_key(NULL);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1192_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1192_tls_session_resumption",
+                         us1192_init_suite,
+                         us1192_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1192_test1)) ||
+       (NULL == CU_add_test(pSuite, "No resumption after restart", us1192_test2)) ||
+       (NULL == CU_add_test(pSuite, "Shared memory session cache", us1192_test3)) ||
+       (NULL == CU_add_test(pSuite, "Session tickets", us1192_test4)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -0,0 +1,215 @@
+/*------------------------------------------------------------------
+ * us1193.c - Unit Tests for User Story 1193 - Asynchronous logging
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <est.h>
+#include "test_utils.h"
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1193_QUEUE_LEN        4
+#define US1193_LOG_BURST        64
+#define US1193_LOG_THREADS      8
+#define US1193_LOG_LOOPS        2000
+#define US1193_TOGGLES          50
+#define US1193_LOG_TARGET       "Invalid log queue length"
+
+/*
+ * While us1193_hold is set the logger stalls, which keeps
+ * every queue entry it has not yet written occupied.
+ */
+static volatile int us1193_hold = 0;
+static volatile int us1193_in_logger = 0;
+static int us1193_target_cnt = 0;
+
+static void us1193_logger (char *format, va_list l)
+{
+    char t_log[1024];
+
+    us1193_in_logger = 1;
+    while (us1193_hold) {
+        usleep(1000);
+    }
+    vsnprintf(t_log, 1024, format, l);
+    if (strstr(t_log, US1193_LOG_TARGET)) {
+        __sync_fetch_and_add(&us1193_target_cnt, 1);
+    }
+}
+
+/*
+ * Logs a single error message through the public API
+ */
+static void us1193_log_one (void)
+{
+    EST_ERROR rv;
+
+    rv = est_enable_async_logger(0);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+}
+
+static int us1193_init_suite (void)
+{
+    return 0;
+}
+
+/*
+ * Leave the logger the way the other suites expect it
+ */
+static int us1193_destroy_suite (void)
+{
+    est_disable_async_logger();
+    est_init_logger(EST_LOG_LVL_INFO, NULL);
+    return 0;
+}
+
+/*
+ * Parameter checks
+ */
+static void us1193_test1 (void)
+{
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_enable_async_logger(0);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_enable_async_logger(EST_LOG_QUEUE_MAX + 1);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+
+    rv = est_enable_async_logger(US1193_QUEUE_LEN);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_enable_async_logger(US1193_QUEUE_LEN);
+    CU_ASSERT(rv == EST_ERR_BAD_MODE);
+
+    est_disable_async_logger();
+    /* A second disable is a no-op */
+    est_disable_async_logger();
+}
+
+/*
+ * Stall the logger and make sure a full queue drops
+ * messages instead of blocking the logging thread.
+ * Nothing leaves the queue while the logger is held, so
+ * exactly US1193_QUEUE_LEN messages are accepted.
+ */
+static void us1193_test2 (void)
+{
+    EST_ERROR rv;
+    uint64_t drops;
+    int i;
+
+    LOG_FUNC_NM;
+
+    est_init_logger(EST_LOG_LVL_ERR, &us1193_logger);
+    us1193_target_cnt = 0;
+    us1193_in_logger = 0;
+    us1193_hold = 1;
+    rv = est_enable_async_logger(US1193_QUEUE_LEN);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    drops = est_get_log_drops();
+    for (i = 0; i < US1193_LOG_BURST; i++) {
+        us1193_log_one();
+    }
+    CU_ASSERT(est_get_log_drops() - drops ==
+              US1193_LOG_BURST - US1193_QUEUE_LEN);
+
+    /*
+     * The drain thread is stuck on the first message
+     */
+    while (!us1193_in_logger) {
+        usleep(1000);
+    }
+    CU_ASSERT(us1193_target_cnt == 0);
+
+    us1193_hold = 0;
+    est_disable_async_logger();
+    CU_ASSERT(us1193_target_cnt == US1193_QUEUE_LEN);
+
+    est_init_logger(EST_LOG_LVL_INFO, NULL);
+}
+
+static void *us1193_log_thread (void *arg)
+{
+    int i;
+
+    for (i = 0; i < US1193_LOG_LOOPS; i++) {
+        us1193_log_one();
+    }
+    return NULL;
+}
+
+/*
+ * Enable and disable the queue while other threads are
+ * logging.  Disabling waits for those threads to leave the
+ * queue before it is released.
+ */
+static void us1193_test3 (void)
+{
+    pthread_t threads[US1193_LOG_THREADS];
+    EST_ERROR rv;
+    int i;
+
+    LOG_FUNC_NM;
+
+    est_init_logger(EST_LOG_LVL_ERR, &us1193_logger);
+    us1193_hold = 0;
+    for (i = 0; i < US1193_LOG_THREADS; i++) {
+        CU_ASSERT(!pthread_create(&threads[i], NULL, us1193_log_thread, NULL));
+    }
+    for (i = 0; i < US1193_TOGGLES; i++) {
+        rv = est_enable_async_logger(US1193_QUEUE_LEN);
+        CU_ASSERT(rv == EST_ERR_NONE);
+        usleep(100);
+        est_disable_async_logger();
+    }
+    for (i = 0; i < US1193_LOG_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    est_init_logger(EST_LOG_LVL_INFO, NULL);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1193_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1193_async_logger",
+                         us1193_init_suite,
+                         us1193_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1193_test1)) ||
+       (NULL == CU_add_test(pSuite, "Full queue drops", us1193_test2)) ||
+       (NULL == CU_add_test(pSuite, "Disable while logging", us1193_test3)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
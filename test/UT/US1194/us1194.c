@@ -0,0 +1,302 @@
+/*------------------------------------------------------------------
+ * us1194.c - Unit Tests for User Story 1194 - Pending enrollment
+ *                                             table
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1194_SERVER_PORT      31194
+#define US1194_SERVER_IP        "127.0.0.1"
+#define US1194_UID              "estuser"
+#define US1194_UID2             "estuser2"
+#define US1194_PWD              "estpwd"
+#define US1194_CACERTS          "CA/estCA/cacert.crt"
+#define US1194_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1194_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1194_PENDING_ENTRIES  2
+
+extern EST_CTX *ectx;
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * Accepts two users, so a poll can come from a client other
+ * than the one the CA asked to retry
+ */
+static int us1194_http_auth (EST_CTX *ctx, EST_HTTP_AUTH_HDR *ah,
+                             X509 *peer_cert, void *app_data)
+{
+    if (ah->mode != AUTH_BASIC || !ah->user || !ah->pwd) {
+        return 0;
+    }
+    if (strcmp(ah->user, US1194_UID) && strcmp(ah->user, US1194_UID2)) {
+        return 0;
+    }
+    return (!strcmp(ah->pwd, US1194_PWD));
+}
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The CA in st_server simulates manual enrollment, it
+ * asks for a retry the first time it sees a key and signs it
+ * the second time.
+ */
+static int us1194_init_suite (void)
+{
+    int rv;
+
+    cacerts_len = read_binary_file(US1194_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_pending_table(US1194_PENDING_ENTRIES);
+    rv = st_start(US1194_SERVER_PORT,
+                  US1194_SERVER_CERTKEY,
+                  US1194_SERVER_CERTKEY,
+                  "US1194 test realm",
+                  US1194_CACERTS,
+                  US1194_TRUST_CERTS,
+                  "CA/estExampleCA.cnf",
+                  1, 0, 0);
+    st_set_pending_table(0);
+    if (rv) {
+        return rv;
+    }
+    return (est_set_http_auth_cb(ectx, &us1194_http_auth));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1194_destroy_suite (void)
+{
+    st_stop();
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+static EVP_PKEY *us1194_new_key (void)
+{
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    CU_ASSERT(eckey != NULL);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+    return key;
+}
+
+/*
+ * Polls as uid for an enrollment of key, returning the outcome
+ */
+static EST_ERROR us1194_poll (EVP_PKEY *key, char *uid)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    int len = 0;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return (EST_ERR_NO_CTX);
+    }
+    rv = est_client_set_auth(cctx, uid, US1194_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1194_SERVER_IP, US1194_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_enroll(cctx, "US1194", &len, key);
+    est_destroy(cctx);
+    return (rv);
+}
+
+/*
+ * Parameter checks
+ */
+static void us1194_test1 (void)
+{
+    EVP_PKEY *key;
+    unsigned char pkcs7[] = "MIIB";
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    key = us1194_new_key();
+
+    rv = est_server_enable_pending_table(NULL, 16, 60);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_approve_pending(NULL, key, pkcs7, 4);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_reject_pending(NULL, key);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+
+    rv = est_server_enable_pending_table(ectx, 0, 60);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_enable_pending_table(ectx, 16, EST_PENDING_LIFETIME_MAX + 1);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_approve_pending(ectx, NULL, pkcs7, 4);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_approve_pending(ectx, key, NULL, 0);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+
+    EVP_PKEY_free(key);
+}
+
+/*
+ * With the table enabled the second request does not reach
+ * the CA until an answer was posted for the key.
+ */
+static void us1194_test2 (void)
+{
+    EVP_PKEY *key;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    key = us1194_new_key();
+
+    /*
+     * The first request is recorded, the second one is
+     * answered from the table
+     */
+    CU_ASSERT(us1194_poll(key, US1194_UID) == EST_ERR_CA_ENROLL_RETRY);
+    CU_ASSERT(us1194_poll(key, US1194_UID) == EST_ERR_CA_ENROLL_RETRY);
+
+    /*
+     * The rejection is delivered once, after that the CA
+     * sees the request again and signs it
+     */
+    rv = est_server_reject_pending(ectx, key);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(us1194_poll(key, US1194_UID) == EST_ERR_HTTP_BAD_REQ);
+    CU_ASSERT(us1194_poll(key, US1194_UID) == EST_ERR_NONE);
+
+    EVP_PKEY_free(key);
+}
+
+/*
+ * Only the client that was told to retry collects the CA's
+ * answer.  A poll for the same key by another user goes to
+ * the CA, which signs it, and leaves the answer in place.
+ */
+static void us1194_test3 (void)
+{
+    EVP_PKEY *key;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    key = us1194_new_key();
+
+    CU_ASSERT(us1194_poll(key, US1194_UID) == EST_ERR_CA_ENROLL_RETRY);
+    rv = est_server_reject_pending(ectx, key);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    CU_ASSERT(us1194_poll(key, US1194_UID2) == EST_ERR_NONE);
+    CU_ASSERT(us1194_poll(key, US1194_UID) == EST_ERR_HTTP_BAD_REQ);
+
+    EVP_PKEY_free(key);
+}
+
+/*
+ * Fill the table with clients waiting for an answer.  The
+ * CA's answers take their place, and once the table only
+ * holds answers a new one is refused.
+ */
+static void us1194_test4 (void)
+{
+    EVP_PKEY *keys[US1194_PENDING_ENTRIES * 2 + 1];
+    unsigned char pkcs7[] = "MIIB";
+    EST_ERROR rv;
+    int i;
+
+    LOG_FUNC_NM;
+
+    for (i = 0; i < US1194_PENDING_ENTRIES * 2 + 1; i++) {
+        keys[i] = us1194_new_key();
+    }
+
+    for (i = 0; i < US1194_PENDING_ENTRIES; i++) {
+        CU_ASSERT(us1194_poll(keys[i], US1194_UID) == EST_ERR_CA_ENROLL_RETRY);
+    }
+    for (; i < US1194_PENDING_ENTRIES * 2; i++) {
+        rv = est_server_approve_pending(ectx, keys[i], pkcs7, 4);
+        CU_ASSERT(rv == EST_ERR_NONE);
+    }
+    rv = est_server_approve_pending(ectx, keys[i], pkcs7, 4);
+    CU_ASSERT(rv == EST_ERR_PENDING_FULL);
+
+    /*
+     * The waiting entries are gone, so the CA sees those
+     * keys again and signs them
+     */
+    for (i = 0; i < US1194_PENDING_ENTRIES; i++) {
+        CU_ASSERT(us1194_poll(keys[i], US1194_UID) == EST_ERR_NONE);
+    }
+
+    for (i = 0; i < US1194_PENDING_ENTRIES * 2 + 1; i++) {
+        EVP_PKEY_free(keys[i]);
+    }
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1194_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1194_pending_table",
+                         us1194_init_suite,
+                         us1194_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1194_test1)) ||
+       (NULL == CU_add_test(pSuite, "Retry and reject", us1194_test2)) ||
+       (NULL == CU_add_test(pSuite, "Answer bound to the client", us1194_test3)) ||
+       (NULL == CU_add_test(pSuite, "Full table", us1194_test4)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -0,0 +1,276 @@
+/*------------------------------------------------------------------
+ * us1195.c - Unit Tests for User Story 1195 - Request statistics
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1195_SERVER_PORT      31195
+#define US1195_SERVER_IP        "127.0.0.1"
+#define US1195_UID              "estuser"
+#define US1195_PWD              "estpwd"
+#define US1195_CACERTS          "CA/estCA/cacert.crt"
+#define US1195_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1195_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1195_CACERTS_REQS     3
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The server is only used by this suite, so the
+ * counters start from zero.
+ */
+static int us1195_init_suite (void)
+{
+    cacerts_len = read_binary_file(US1195_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    return (st_start(US1195_SERVER_PORT,
+                     US1195_SERVER_CERTKEY,
+                     US1195_SERVER_CERTKEY,
+                     "US1195 test realm",
+                     US1195_CACERTS,
+                     US1195_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1195_destroy_suite (void)
+{
+    st_stop();
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+static EST_CTX *us1195_client_ctx (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return NULL;
+    }
+    rv = est_client_set_auth(cctx, US1195_UID, US1195_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1195_SERVER_IP, US1195_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return cctx;
+}
+
+/*
+ * Enrolls a new EC key and returns the outcome
+ */
+static EST_ERROR us1195_enroll (void)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+    int len = 0;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    CU_ASSERT(eckey != NULL);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+
+    cctx = us1195_client_ctx();
+    if (!cctx) {
+        EVP_PKEY_free(key);
+        return (EST_ERR_NO_CTX);
+    }
+    rv = est_client_enroll(cctx, "US1195", &len, key);
+    est_destroy(cctx);
+    EVP_PKEY_free(key);
+    return (rv);
+}
+
+/*
+ * Parameter checks
+ */
+static void us1195_test1 (void)
+{
+    EST_ERROR rv;
+    EST_STATS stats;
+    EST_CTX *cctx;
+    char buf[16];
+    int len;
+
+    LOG_FUNC_NM;
+
+    rv = est_server_get_stats(NULL, &stats);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_get_stats(ectx, NULL);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+
+    cctx = us1195_client_ctx();
+    if (cctx) {
+        rv = est_server_get_stats(cctx, &stats);
+        CU_ASSERT(rv == EST_ERR_BAD_MODE);
+        est_destroy(cctx);
+    }
+
+    len = sizeof(buf);
+    rv = est_stats_to_prometheus(NULL, buf, &len);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_stats_to_prometheus(&stats, buf, NULL);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+}
+
+/*
+ * Send a known set of requests and check the counters moved
+ * by what was sent: CA certs requests, an enrollment that is
+ * signed and one refused for its size.
+ */
+static void us1195_test2 (void)
+{
+    EST_STATS before, after;
+    EST_ERROR rv;
+    EST_CTX *cctx;
+    int i, len;
+
+    LOG_FUNC_NM;
+
+    rv = est_server_get_stats(ectx, &before);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    cctx = us1195_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    for (i = 0; i < US1195_CACERTS_REQS; i++) {
+        rv = est_client_get_cacerts(cctx, &len);
+        CU_ASSERT(rv == EST_ERR_NONE);
+    }
+    est_destroy(cctx);
+
+    CU_ASSERT(us1195_enroll() == EST_ERR_NONE);
+
+    /*
+     * A CSR of a few hundred bytes is refused with a 413
+     */
+    rv = est_server_set_max_content_len(ectx, 64);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(us1195_enroll() != EST_ERR_NONE);
+    rv = est_server_set_max_content_len(ectx, 65536);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    rv = est_server_get_stats(ectx, &after);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    CU_ASSERT(after.requests[EST_STATS_URI_CACERTS] -
+              before.requests[EST_STATS_URI_CACERTS] == US1195_CACERTS_REQS);
+    CU_ASSERT(after.uri_latency[EST_STATS_URI_CACERTS].count -
+              before.uri_latency[EST_STATS_URI_CACERTS].count ==
+              US1195_CACERTS_REQS);
+    CU_ASSERT(after.requests[EST_STATS_URI_SIMPLE_ENROLL] >
+              before.requests[EST_STATS_URI_SIMPLE_ENROLL]);
+    CU_ASSERT(after.status[200] - before.status[200] >= US1195_CACERTS_REQS + 1);
+    CU_ASSERT(after.status[413] - before.status[413] == 1);
+    CU_ASSERT(after.auth[EST_STATS_AUTH_HTTP] > before.auth[EST_STATS_AUTH_HTTP]);
+    CU_ASSERT(after.stage_latency[EST_STATS_STAGE_CA].count >
+              before.stage_latency[EST_STATS_STAGE_CA].count);
+    CU_ASSERT(after.bytes_in > before.bytes_in);
+    CU_ASSERT(after.bytes_out > before.bytes_out);
+}
+
+/*
+ * Prometheus exposition.  A buffer too small for the text
+ * reports the length that is needed.
+ */
+static void us1195_test3 (void)
+{
+    EST_STATS stats;
+    EST_ERROR rv;
+    char small[16];
+    char *buf;
+    int len;
+
+    LOG_FUNC_NM;
+
+    rv = est_server_get_stats(ectx, &stats);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    len = sizeof(small);
+    rv = est_stats_to_prometheus(&stats, small, &len);
+    CU_ASSERT(rv == EST_ERR_READ_BUFFER_TOO_SMALL);
+    CU_ASSERT(len > (int)sizeof(small));
+
+    buf = malloc(len);
+    CU_ASSERT(buf != NULL);
+    if (buf) {
+        rv = est_stats_to_prometheus(&stats, buf, &len);
+        CU_ASSERT(rv == EST_ERR_NONE);
+        CU_ASSERT(strstr(buf, "est_requests_total") != NULL);
+        free(buf);
+    }
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1195_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1195_request_stats",
+                         us1195_init_suite,
+                         us1195_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1195_test1)) ||
+       (NULL == CU_add_test(pSuite, "Counters follow traffic", us1195_test2)) ||
+       (NULL == CU_add_test(pSuite, "Prometheus exposition", us1195_test3)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
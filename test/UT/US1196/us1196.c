@@ -0,0 +1,253 @@
+/*------------------------------------------------------------------
+ * us1196.c - Unit Tests for User Story 1196 - Decoded CSR callback
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1196_SERVER_PORT      31196
+#define US1196_SERVER_IP        "127.0.0.1"
+#define US1196_UID              "estuser"
+#define US1196_PWD              "estpwd"
+#define US1196_CACERTS          "CA/estCA/cacert.crt"
+#define US1196_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1196_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1196_CN               "US1196-TEST"
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * What us1196_csr_cb() was handed by libest
+ */
+static EVP_PKEY *us1196_seen_key = NULL;
+static char us1196_seen_cn[64];
+static char us1196_seen_uid[64];
+static int us1196_seen_der = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.
+ */
+static int us1196_init_suite (void)
+{
+    cacerts_len = read_binary_file(US1196_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    return (st_start(US1196_SERVER_PORT,
+                     US1196_SERVER_CERTKEY,
+                     US1196_SERVER_CERTKEY,
+                     "US1196 test realm",
+                     US1196_CACERTS,
+                     US1196_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1196_destroy_suite (void)
+{
+    st_stop();
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Records the decoded request and its DER encoding, then
+ * refuses to sign it
+ */
+static int us1196_csr_cb (X509_REQ *csr, unsigned char *der, int der_len,
+                          unsigned char **pkcs7, int *pkcs7_len,
+                          char *user_id, X509 *peer_cert, void *ex_data)
+{
+    const unsigned char *p = der;
+    X509_REQ *decoded;
+    X509_NAME *subj;
+
+    subj = X509_REQ_get_subject_name(csr);
+    X509_NAME_get_text_by_NID(subj, NID_commonName, us1196_seen_cn,
+                              sizeof(us1196_seen_cn));
+    us1196_seen_key = X509_REQ_get_pubkey(csr);
+    if (user_id) {
+        strncpy(us1196_seen_uid, user_id, sizeof(us1196_seen_uid) - 1);
+    }
+
+    /*
+     * The DER must be the same request
+     */
+    decoded = d2i_X509_REQ(NULL, &p, der_len);
+    if (decoded && p == der + der_len &&
+        !X509_NAME_cmp(X509_REQ_get_subject_name(decoded), subj)) {
+        us1196_seen_der = 1;
+    }
+    X509_REQ_free(decoded);
+
+    return (EST_ERR_CA_ENROLL_FAIL);
+}
+
+/*
+ * Enrolls key as US1196_CN and returns the outcome
+ */
+static EST_ERROR us1196_enroll (EVP_PKEY *key)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    int len = 0;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return (EST_ERR_NO_CTX);
+    }
+    rv = est_client_set_auth(cctx, US1196_UID, US1196_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1196_SERVER_IP, US1196_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_enroll(cctx, US1196_CN, &len, key);
+    if (rv == EST_ERR_NONE) {
+        CU_ASSERT(len > 0);
+    }
+    est_destroy(cctx);
+    return (rv);
+}
+
+static EVP_PKEY *us1196_new_key (void)
+{
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    CU_ASSERT(eckey != NULL);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+    return key;
+}
+
+/*
+ * Parameter checks
+ */
+static void us1196_test1 (void)
+{
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_set_ca_enroll_csr_cb(NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_set_ca_reenroll_csr_cb(NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+}
+
+/*
+ * The test server signs requests through the handler that
+ * receives the decoded CSR, enrollment exercises it end to end.
+ */
+static void us1196_test2 (void)
+{
+    EVP_PKEY *key;
+
+    LOG_FUNC_NM;
+
+    key = us1196_new_key();
+    CU_ASSERT(us1196_enroll(key) == EST_ERR_NONE);
+    EVP_PKEY_free(key);
+}
+
+/*
+ * The handler gets the request libest decoded along with its
+ * DER encoding, the authenticated user and the CA's error is
+ * passed back to the client.
+ */
+static void us1196_test3 (void)
+{
+    EVP_PKEY *key;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_set_ca_enroll_csr_cb(ectx, &us1196_csr_cb);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    memset(us1196_seen_cn, 0, sizeof(us1196_seen_cn));
+    memset(us1196_seen_uid, 0, sizeof(us1196_seen_uid));
+    us1196_seen_der = 0;
+
+    key = us1196_new_key();
+    CU_ASSERT(us1196_enroll(key) != EST_ERR_NONE);
+
+    CU_ASSERT(!strcmp(us1196_seen_cn, US1196_CN));
+    CU_ASSERT(!strcmp(us1196_seen_uid, US1196_UID));
+    CU_ASSERT(us1196_seen_der == 1);
+    CU_ASSERT(us1196_seen_key != NULL);
+    if (us1196_seen_key) {
+        CU_ASSERT(EVP_PKEY_cmp(us1196_seen_key, key) == 1);
+        EVP_PKEY_free(us1196_seen_key);
+        us1196_seen_key = NULL;
+    }
+    EVP_PKEY_free(key);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1196_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1196_csr_cb",
+                         us1196_init_suite,
+                         us1196_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1196_test1)) ||
+       (NULL == CU_add_test(pSuite, "Enroll through the CSR handler", us1196_test2)) ||
+       (NULL == CU_add_test(pSuite, "Decoded request handed over", us1196_test3)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
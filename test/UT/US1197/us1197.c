@@ -0,0 +1,253 @@
+/*------------------------------------------------------------------
+ * us1197.c - Unit Tests for User Story 1197 - Asynchronous
+ *                                             enrollment
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1197_SERVER_PORT      31197
+#define US1197_SERVER_IP        "127.0.0.1"
+#define US1197_UID              "estuser"
+#define US1197_PWD              "estpwd"
+#define US1197_CACERTS          "CA/estCA/cacert.crt"
+#define US1197_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1197_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1197_CLIENT_THREADS   8
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * Starts the server with a CA that signs each request from a
+ * thread of its own
+ */
+static int us1197_start (int event_mode)
+{
+    int rv;
+
+    st_set_event_mode(event_mode);
+    st_set_async_enroll(1);
+    rv = st_start(US1197_SERVER_PORT,
+                  US1197_SERVER_CERTKEY,
+                  US1197_SERVER_CERTKEY,
+                  "US1197 test realm",
+                  US1197_CACERTS,
+                  US1197_TRUST_CERTS,
+                  "CA/estExampleCA.cnf",
+                  0, 0, 0);
+    st_set_async_enroll(0);
+    return rv;
+}
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The server is started in event mode, where the
+ * connection is parked until the CA has answered.
+ */
+static int us1197_init_suite (void)
+{
+    cacerts_len = read_binary_file(US1197_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    return (us1197_start(1));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1197_destroy_suite (void)
+{
+    st_stop();
+    st_set_event_mode(0);
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Enrolls a new EC key, returning the outcome
+ */
+static EST_ERROR us1197_enroll (void)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+    int len = 0;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    if (!cctx) {
+        EVP_PKEY_free(key);
+        return (EST_ERR_NO_CTX);
+    }
+    est_client_set_auth(cctx, US1197_UID, US1197_PWD, NULL, NULL);
+    est_client_set_server(cctx, US1197_SERVER_IP, US1197_SERVER_PORT);
+    rv = est_client_enroll(cctx, "US1197", &len, key);
+    if (rv == EST_ERR_NONE && len <= 0) {
+        rv = EST_ERR_CA_ENROLL_FAIL;
+    }
+    est_destroy(cctx);
+    EVP_PKEY_free(key);
+    return (rv);
+}
+
+static void *us1197_enroll_thread (void *arg)
+{
+    int *failures = (int *)arg;
+
+    if (us1197_enroll() != EST_ERR_NONE) {
+        (*failures)++;
+    }
+    return NULL;
+}
+
+/*
+ * Enrolls from several clients at once
+ */
+static void us1197_enroll_concurrent (void)
+{
+    pthread_t threads[US1197_CLIENT_THREADS];
+    int failures[US1197_CLIENT_THREADS];
+    int i;
+
+    for (i = 0; i < US1197_CLIENT_THREADS; i++) {
+        failures[i] = 0;
+        pthread_create(&threads[i], NULL, us1197_enroll_thread, &failures[i]);
+    }
+    for (i = 0; i < US1197_CLIENT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT(failures[i] == 0);
+    }
+}
+
+/*
+ * Parameter checks
+ */
+static void us1197_test1 (void)
+{
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_set_ca_enroll_async_cb(NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_set_ca_reenroll_async_cb(NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_enroll_wakeup_cb(NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_enroll_complete(NULL, NULL, 0);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_enroll_fail(NULL, EST_ERR_CA_ENROLL_FAIL);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+}
+
+/*
+ * A single enrollment answered from the CA's thread
+ */
+static void us1197_test2 (void)
+{
+    LOG_FUNC_NM;
+
+    CU_ASSERT(us1197_enroll() == EST_ERR_NONE);
+}
+
+/*
+ * The server has only one thread, so this only passes when
+ * the parked connections don't hold up the others.
+ */
+static void us1197_test3 (void)
+{
+    LOG_FUNC_NM;
+
+    us1197_enroll_concurrent();
+}
+
+/*
+ * Without event mode the thread serving the connection waits
+ * for the CA's answer instead.
+ */
+static void us1197_test4 (void)
+{
+    int rv;
+
+    LOG_FUNC_NM;
+
+    st_stop();
+    rv = us1197_start(0);
+    CU_ASSERT(rv == 0);
+    if (rv) {
+        return;
+    }
+
+    CU_ASSERT(us1197_enroll() == EST_ERR_NONE);
+    us1197_enroll_concurrent();
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1197_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1197_async_enroll",
+                         us1197_init_suite,
+                         us1197_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1197_test1)) ||
+       (NULL == CU_add_test(pSuite, "Simple enroll", us1197_test2)) ||
+       (NULL == CU_add_test(pSuite, "Concurrent enrollments", us1197_test3)) ||
+       (NULL == CU_add_test(pSuite, "Threaded server", us1197_test4)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -0,0 +1,282 @@
+/*------------------------------------------------------------------
+ * us1198.c - Unit Tests for User Story 1198 - Batched enrollment
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1198_SERVER_PORT      31198
+#define US1198_SERVER_IP        "127.0.0.1"
+#define US1198_UID              "estuser"
+#define US1198_PWD              "estpwd"
+#define US1198_CACERTS          "CA/estCA/cacert.crt"
+#define US1198_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1198_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1198_CLIENT_THREADS   8
+#define US1198_BATCH_WAIT_MS    100
+/*
+ * A slow CA taking two requests at a time, with a third one
+ * left over while it signs the first two
+ */
+#define US1198_SLOW_BATCH       2
+#define US1198_SLOW_WAIT_MS     1000
+#define US1198_SLOW_CA_MS       1500
+#define US1198_SLOW_THREADS     3
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The server is started in event mode with a CA that
+ * signs the requests gathered within US1198_BATCH_WAIT_MS
+ * together.
+ */
+static int us1198_init_suite (void)
+{
+    int rv;
+
+    cacerts_len = read_binary_file(US1198_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_event_mode(1);
+    st_set_enroll_batch(US1198_CLIENT_THREADS, US1198_BATCH_WAIT_MS);
+    rv = st_start(US1198_SERVER_PORT,
+                  US1198_SERVER_CERTKEY,
+                  US1198_SERVER_CERTKEY,
+                  "US1198 test realm",
+                  US1198_CACERTS,
+                  US1198_TRUST_CERTS,
+                  "CA/estExampleCA.cnf",
+                  0, 0, 0);
+    st_set_enroll_batch(0, 0);
+    return rv;
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1198_destroy_suite (void)
+{
+    st_stop();
+    st_set_event_mode(0);
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Enrolls a new EC key, returning the outcome
+ */
+static EST_ERROR us1198_enroll (void)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+    int len = 0;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    if (!cctx) {
+        EVP_PKEY_free(key);
+        return (EST_ERR_NO_CTX);
+    }
+    est_client_set_auth(cctx, US1198_UID, US1198_PWD, NULL, NULL);
+    est_client_set_server(cctx, US1198_SERVER_IP, US1198_SERVER_PORT);
+    rv = est_client_enroll(cctx, "US1198", &len, key);
+    if (rv == EST_ERR_NONE && len <= 0) {
+        rv = EST_ERR_CA_ENROLL_FAIL;
+    }
+    est_destroy(cctx);
+    EVP_PKEY_free(key);
+    return (rv);
+}
+
+static void *us1198_enroll_thread (void *arg)
+{
+    int *failures = (int *)arg;
+
+    if (us1198_enroll() != EST_ERR_NONE) {
+        (*failures)++;
+    }
+    return NULL;
+}
+
+/*
+ * Parameter checks
+ */
+static void us1198_test1 (void)
+{
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_set_ca_enroll_batch_cb(NULL, NULL, 8, 100);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+
+    /*
+     * The dispatcher is running, the limits can't change now
+     */
+    rv = est_set_ca_enroll_batch_cb(ectx, NULL, 0, 0);
+    CU_ASSERT(rv == EST_ERR_BAD_MODE);
+}
+
+/*
+ * A request arriving on its own is signed once the wait is
+ * over.
+ */
+static void us1198_test2 (void)
+{
+    LOG_FUNC_NM;
+
+    CU_ASSERT(us1198_enroll() == EST_ERR_NONE);
+}
+
+/*
+ * Concurrent requests are gathered and signed together, each
+ * client still gets its own certificate.
+ */
+static void us1198_test3 (void)
+{
+    pthread_t threads[US1198_CLIENT_THREADS];
+    int failures[US1198_CLIENT_THREADS];
+    int i;
+
+    LOG_FUNC_NM;
+
+    for (i = 0; i < US1198_CLIENT_THREADS; i++) {
+        failures[i] = 0;
+        pthread_create(&threads[i], NULL, us1198_enroll_thread, &failures[i]);
+    }
+    for (i = 0; i < US1198_CLIENT_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT(failures[i] == 0);
+    }
+}
+
+/*
+ * A request left over from a full batch is due once it has
+ * waited max_wait_ms since it arrived, not since the full batch
+ * went to the CA.
+ */
+static void us1198_test4 (void)
+{
+    pthread_t threads[US1198_SLOW_THREADS];
+    int failures[US1198_SLOW_THREADS];
+    struct timeval start, end;
+    long elapsed_ms;
+    int i, rv;
+
+    LOG_FUNC_NM;
+
+    st_stop();
+    st_set_enroll_batch(US1198_SLOW_BATCH, US1198_SLOW_WAIT_MS);
+    st_set_enroll_batch_delay(US1198_SLOW_CA_MS);
+    rv = st_start(US1198_SERVER_PORT,
+                  US1198_SERVER_CERTKEY,
+                  US1198_SERVER_CERTKEY,
+                  "US1198 test realm",
+                  US1198_CACERTS,
+                  US1198_TRUST_CERTS,
+                  "CA/estExampleCA.cnf",
+                  0, 0, 0);
+    st_set_enroll_batch(0, 0);
+    CU_ASSERT(rv == 0);
+    if (rv) {
+        st_set_enroll_batch_delay(0);
+        return;
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < US1198_SLOW_THREADS; i++) {
+        failures[i] = 0;
+        pthread_create(&threads[i], NULL, us1198_enroll_thread, &failures[i]);
+    }
+    for (i = 0; i < US1198_SLOW_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        CU_ASSERT(failures[i] == 0);
+    }
+    gettimeofday(&end, NULL);
+    st_set_enroll_batch_delay(0);
+
+    /*
+     * The request left over is already due when the CA is done
+     * with the full batch, so all are signed after two passes
+     * through the CA.  Waiting from the flush adds another
+     * US1198_SLOW_WAIT_MS.
+     */
+    elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 +
+                 (end.tv_usec - start.tv_usec) / 1000;
+    printf("\nThree requests were signed in %ld ms\n", elapsed_ms);
+    CU_ASSERT(elapsed_ms >= 2 * US1198_SLOW_CA_MS);
+    CU_ASSERT(elapsed_ms < 2 * US1198_SLOW_CA_MS + US1198_SLOW_WAIT_MS / 2);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1198_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1198_batch_enroll",
+                         us1198_init_suite,
+                         us1198_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1198_test1)) ||
+       (NULL == CU_add_test(pSuite, "Single request", us1198_test2)) ||
+       (NULL == CU_add_test(pSuite, "Concurrent requests", us1198_test3)) ||
+       (NULL == CU_add_test(pSuite, "Leftover request deadline", us1198_test4)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
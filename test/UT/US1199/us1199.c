@@ -0,0 +1,246 @@
+/*------------------------------------------------------------------
+ * us1199.c - Unit Tests for User Story 1199 - Enrollment cache
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1199_SERVER_PORT      31199
+#define US1199_SERVER_IP        "127.0.0.1"
+#define US1199_UID              "estuser"
+#define US1199_UID2             "estuser2"
+#define US1199_PWD              "estpwd"
+#define US1199_CACERTS          "CA/estCA/cacert.crt"
+#define US1199_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1199_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1199_CACHE_ENTRIES    16
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * Accepts two users, so the same CSR can be sent by a client
+ * other than the one it was issued to
+ */
+static int us1199_http_auth (EST_CTX *ctx, EST_HTTP_AUTH_HDR *ah,
+                             X509 *peer_cert, void *app_data)
+{
+    if (ah->mode != AUTH_BASIC || !ah->user || !ah->pwd) {
+        return 0;
+    }
+    if (strcmp(ah->user, US1199_UID) && strcmp(ah->user, US1199_UID2)) {
+        return 0;
+    }
+    return (!strcmp(ah->pwd, US1199_PWD));
+}
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The CA in st_server asks for a retry the first time
+ * it sees a key, signs it the second time and then forgets
+ * about it.  A third request for the same key is only signed
+ * when it is answered from the cache.
+ */
+static int us1199_init_suite (void)
+{
+    int rv;
+
+    cacerts_len = read_binary_file(US1199_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_enroll_cache(US1199_CACHE_ENTRIES);
+    rv = st_start(US1199_SERVER_PORT,
+                  US1199_SERVER_CERTKEY,
+                  US1199_SERVER_CERTKEY,
+                  "US1199 test realm",
+                  US1199_CACERTS,
+                  US1199_TRUST_CERTS,
+                  "CA/estExampleCA.cnf",
+                  1, 0, 0);
+    st_set_enroll_cache(0);
+    if (rv) {
+        return rv;
+    }
+    return (est_set_http_auth_cb(ectx, &us1199_http_auth));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1199_destroy_suite (void)
+{
+    st_stop();
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Builds a CSR for a new EC key, returning the key in *key
+ */
+static X509_REQ *us1199_new_csr (EVP_PKEY **key)
+{
+    EC_KEY *eckey;
+    X509_REQ *csr;
+    X509_NAME *subj;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    CU_ASSERT(eckey != NULL);
+    EC_KEY_generate_key(eckey);
+    *key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(*key, eckey);
+
+    csr = X509_REQ_new();
+    CU_ASSERT(csr != NULL);
+    subj = X509_REQ_get_subject_name(csr);
+    X509_NAME_add_entry_by_txt(subj, "CN", MBSTRING_ASC,
+                               (unsigned char *)"US1199", -1, -1, 0);
+    X509_REQ_set_pubkey(csr, *key);
+    CU_ASSERT(X509_REQ_sign(csr, *key, EVP_sha256()) > 0);
+    return (csr);
+}
+
+/*
+ * Enrolls the CSR as it is, without libest signing it again
+ */
+static EST_ERROR us1199_enroll_csr (X509_REQ *csr, char *uid)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+    int len = 0;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return (EST_ERR_NO_CTX);
+    }
+    rv = est_client_set_auth(cctx, uid, US1199_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1199_SERVER_IP, US1199_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_enroll_csr(cctx, csr, &len, NULL);
+    est_destroy(cctx);
+    return (rv);
+}
+
+/*
+ * Parameter checks
+ */
+static void us1199_test1 (void)
+{
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_server_set_enroll_cache(NULL, US1199_CACHE_ENTRIES, 60);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_enroll_cache(ectx, -1, 60);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_set_enroll_cache(ectx, US1199_CACHE_ENTRIES,
+                                     EST_ENROLL_CACHE_WINDOW_MAX + 1);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+}
+
+/*
+ * A client repeating the signed CSR is answered from the
+ * cache instead of being asked to retry.
+ */
+static void us1199_test2 (void)
+{
+    EVP_PKEY *key;
+    X509_REQ *csr;
+
+    LOG_FUNC_NM;
+
+    csr = us1199_new_csr(&key);
+    CU_ASSERT(us1199_enroll_csr(csr, US1199_UID) == EST_ERR_CA_ENROLL_RETRY);
+    CU_ASSERT(us1199_enroll_csr(csr, US1199_UID) == EST_ERR_NONE);
+    CU_ASSERT(us1199_enroll_csr(csr, US1199_UID) == EST_ERR_NONE);
+    CU_ASSERT(us1199_enroll_csr(csr, US1199_UID) == EST_ERR_NONE);
+
+    X509_REQ_free(csr);
+    EVP_PKEY_free(key);
+}
+
+/*
+ * The certificate is only handed to the user it was issued
+ * to.  The same CSR from another user goes to the CA, which
+ * has forgotten it and asks for a retry.
+ */
+static void us1199_test3 (void)
+{
+    EVP_PKEY *key;
+    X509_REQ *csr;
+
+    LOG_FUNC_NM;
+
+    csr = us1199_new_csr(&key);
+    CU_ASSERT(us1199_enroll_csr(csr, US1199_UID) == EST_ERR_CA_ENROLL_RETRY);
+    CU_ASSERT(us1199_enroll_csr(csr, US1199_UID) == EST_ERR_NONE);
+    CU_ASSERT(us1199_enroll_csr(csr, US1199_UID2) == EST_ERR_CA_ENROLL_RETRY);
+    CU_ASSERT(us1199_enroll_csr(csr, US1199_UID) == EST_ERR_NONE);
+
+    X509_REQ_free(csr);
+    EVP_PKEY_free(key);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1199_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1199_enroll_cache",
+                         us1199_init_suite,
+                         us1199_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1199_test1)) ||
+       (NULL == CU_add_test(pSuite, "Repeated request", us1199_test2)) ||
+       (NULL == CU_add_test(pSuite, "Other user", us1199_test3)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -0,0 +1,238 @@
+/*------------------------------------------------------------------
+ * us1200.c - Unit Tests for User Story 1200 - X509 enrollment
+ *                                             callback
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1200_SERVER_PORT      31200
+#define US1200_SERVER_IP        "127.0.0.1"
+#define US1200_UID              "estuser"
+#define US1200_PWD              "estpwd"
+#define US1200_CACERTS          "CA/estCA/cacert.crt"
+#define US1200_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1200_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The test CA returns the issued certificate as an
+ * X509 and the chain sent with it is read from US1200_CACERTS.
+ */
+static int us1200_init_suite (void)
+{
+    int rv;
+
+    cacerts_len = read_binary_file(US1200_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_enroll_x509(1);
+    rv = st_start(US1200_SERVER_PORT,
+                  US1200_SERVER_CERTKEY,
+                  US1200_SERVER_CERTKEY,
+                  "US1200 test realm",
+                  US1200_CACERTS,
+                  US1200_TRUST_CERTS,
+                  "CA/estExampleCA.cnf",
+                  0, 0, 0);
+    st_set_enroll_x509(0);
+    return rv;
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1200_destroy_suite (void)
+{
+    st_stop();
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+static EST_CTX *us1200_client_ctx (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return NULL;
+    }
+    rv = est_client_set_auth(cctx, US1200_UID, US1200_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1200_SERVER_IP, US1200_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return cctx;
+}
+
+/*
+ * Counts the certificates in the PEM file the server sends
+ * as the chain
+ */
+static int us1200_chain_len (void)
+{
+    X509 *x;
+    BIO *in;
+    int n = 0;
+
+    in = BIO_new_file(US1200_CACERTS, "r");
+    CU_ASSERT(in != NULL);
+    if (!in) {
+        return 0;
+    }
+    while ((x = PEM_read_bio_X509(in, NULL, NULL, NULL)) != NULL) {
+        X509_free(x);
+        n++;
+    }
+    BIO_free(in);
+    ERR_clear_error();
+    return n;
+}
+
+/*
+ * Parameter checks
+ */
+static void us1200_test1 (void)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_set_ca_enroll_x509_cb(NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_set_ca_reenroll_x509_cb(NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_enroll_chain(NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+
+    cctx = us1200_client_ctx();
+    if (cctx) {
+        rv = est_server_set_enroll_chain(cctx, NULL);
+        CU_ASSERT(rv == EST_ERR_BAD_MODE);
+        est_destroy(cctx);
+    }
+}
+
+/*
+ * libest wraps the certificate returned by the CA in a PKCS7,
+ * the issued certificate comes first and the chain follows.
+ */
+static void us1200_test2 (void)
+{
+    EST_CTX *cctx;
+    EVP_PKEY *key, *cert_key;
+    EC_KEY *eckey;
+    BIO *b64, *in;
+    PKCS7 *p7;
+    unsigned char *new_cert;
+    int pkcs7_len = 0;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    CU_ASSERT(eckey != NULL);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+
+    cctx = us1200_client_ctx();
+    if (!cctx) {
+        EVP_PKEY_free(key);
+        return;
+    }
+    rv = est_client_enroll(cctx, "US1200", &pkcs7_len, key);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    if (rv == EST_ERR_NONE) {
+        new_cert = malloc(pkcs7_len);
+        rv = est_client_copy_enrolled_cert(cctx, new_cert);
+        CU_ASSERT(rv == EST_ERR_NONE);
+
+        b64 = BIO_new(BIO_f_base64());
+        in = BIO_new_mem_buf(new_cert, pkcs7_len);
+        in = BIO_push(b64, in);
+        p7 = d2i_PKCS7_bio(in, NULL);
+        CU_ASSERT(p7 != NULL);
+        BIO_free_all(in);
+        if (p7) {
+            CU_ASSERT(OBJ_obj2nid(p7->type) == NID_pkcs7_signed);
+            CU_ASSERT(sk_X509_num(p7->d.sign->cert) == 1 + us1200_chain_len());
+            cert_key = X509_get_pubkey(sk_X509_value(p7->d.sign->cert, 0));
+            CU_ASSERT(cert_key != NULL);
+            if (cert_key) {
+                CU_ASSERT(EVP_PKEY_cmp(cert_key, key) == 1);
+                EVP_PKEY_free(cert_key);
+            }
+            PKCS7_free(p7);
+        }
+        free(new_cert);
+    }
+    est_destroy(cctx);
+    EVP_PKEY_free(key);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1200_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1200_x509_enroll",
+                         us1200_init_suite,
+                         us1200_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1200_test1)) ||
+       (NULL == CU_add_test(pSuite, "Issued certificate and chain", us1200_test2)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
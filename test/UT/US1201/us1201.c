@@ -0,0 +1,287 @@
+/*------------------------------------------------------------------
+ * us1201.c - Unit Tests for User Story 1201 - Client keep-alive
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <est.h>
+#include "../../src/est/est_locl.h"
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1201_SERVER_PORT      31201
+#define US1201_SERVER_IP        "127.0.0.1"
+#define US1201_UID              "estuser"
+#define US1201_PWD              "estpwd"
+#define US1201_CACERTS          "CA/estCA/cacert.crt"
+#define US1201_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1201_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1201_ROUNDS           3
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+static int us1201_start (void)
+{
+    return (st_start(US1201_SERVER_PORT,
+                     US1201_SERVER_CERTKEY,
+                     US1201_SERVER_CERTKEY,
+                     "US1201 test realm",
+                     US1201_CACERTS,
+                     US1201_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.
+ */
+static int us1201_init_suite (void)
+{
+    cacerts_len = read_binary_file(US1201_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_event_mode(1);
+    return (us1201_start());
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1201_destroy_suite (void)
+{
+    st_stop();
+    st_set_event_mode(0);
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns a client context with keep-alive enabled
+ */
+static EST_CTX *us1201_client_ctx (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return NULL;
+    }
+    rv = est_client_set_auth(cctx, US1201_UID, US1201_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1201_SERVER_IP, US1201_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_keep_alive(cctx, 1);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return cctx;
+}
+
+/*
+ * Number of TLS handshakes the client has started
+ */
+static long us1201_handshakes (EST_CTX *cctx)
+{
+    return (SSL_CTX_sess_connect(cctx->ssl_ctx));
+}
+
+static void us1201_get_cacerts (EST_CTX *cctx)
+{
+    EST_ERROR rv;
+    int len = 0;
+
+    rv = est_client_get_cacerts(cctx, &len);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(len > 0);
+}
+
+/*
+ * Parameter checks
+ */
+static void us1201_test1 (void)
+{
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_client_set_keep_alive(NULL, 1);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_client_set_keep_alive(ectx, 1);
+    CU_ASSERT(rv == EST_ERR_BAD_MODE);
+}
+
+/*
+ * Several operations run over a single connection.  The first
+ * enrollment is challenged for HTTP authentication, the client
+ * drops the connection after an error status and answers the
+ * challenge on a new one.  The operations after it reuse that
+ * connection.  Turning keep-alive off closes it, after that
+ * every operation connects again.
+ */
+static void us1201_test2 (void)
+{
+    EST_CTX *cctx;
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+    int len = 0;
+    int i;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    CU_ASSERT(eckey != NULL);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+
+    cctx = us1201_client_ctx();
+    if (!cctx) {
+        EVP_PKEY_free(key);
+        return;
+    }
+
+    us1201_get_cacerts(cctx);
+    us1201_get_cacerts(cctx);
+    CU_ASSERT(us1201_handshakes(cctx) == 1);
+
+    for (i = 0; i < US1201_ROUNDS; i++) {
+        rv = est_client_enroll(cctx, "US1201", &len, key);
+        CU_ASSERT(rv == EST_ERR_NONE);
+        CU_ASSERT(len > 0);
+        us1201_get_cacerts(cctx);
+    }
+    CU_ASSERT(us1201_handshakes(cctx) == 2);
+
+    rv = est_client_set_keep_alive(cctx, 0);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    us1201_get_cacerts(cctx);
+    CU_ASSERT(us1201_handshakes(cctx) == 3);
+    us1201_get_cacerts(cctx);
+    CU_ASSERT(us1201_handshakes(cctx) == 4);
+
+    est_destroy(cctx);
+    EVP_PKEY_free(key);
+}
+
+/*
+ * Changing the server closes the held connection
+ */
+static void us1201_test3 (void)
+{
+    EST_CTX *cctx;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    cctx = us1201_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    us1201_get_cacerts(cctx);
+    us1201_get_cacerts(cctx);
+    CU_ASSERT(us1201_handshakes(cctx) == 1);
+
+    rv = est_client_set_server(cctx, US1201_SERVER_IP, US1201_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    us1201_get_cacerts(cctx);
+    us1201_get_cacerts(cctx);
+    CU_ASSERT(us1201_handshakes(cctx) == 2);
+
+    est_destroy(cctx);
+}
+
+/*
+ * A connection the server closed while it was held is noticed
+ * before it is used, the operation connects again and succeeds.
+ */
+static void us1201_test4 (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    LOG_FUNC_NM;
+
+    cctx = us1201_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    us1201_get_cacerts(cctx);
+    CU_ASSERT(us1201_handshakes(cctx) == 1);
+
+    st_stop();
+    rv = us1201_start();
+    CU_ASSERT(rv == 0);
+    if (rv) {
+        est_destroy(cctx);
+        return;
+    }
+
+    us1201_get_cacerts(cctx);
+    us1201_get_cacerts(cctx);
+    CU_ASSERT(us1201_handshakes(cctx) == 2);
+
+    est_destroy(cctx);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1201_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1201_client_keep_alive",
+                         us1201_init_suite,
+                         us1201_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1201_test1)) ||
+       (NULL == CU_add_test(pSuite, "Connection reuse", us1201_test2)) ||
+       (NULL == CU_add_test(pSuite, "Server change", us1201_test3)) ||
+       (NULL == CU_add_test(pSuite, "Closed by the server", us1201_test4)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -0,0 +1,297 @@
+/*------------------------------------------------------------------
+ * us1202.c - Unit Tests for User Story 1202 - Client pool
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1202_SERVER_PORT      31202
+#define US1202_SERVER_IP        "127.0.0.1"
+#define US1202_UID              "estuser"
+#define US1202_PWD              "estpwd"
+#define US1202_CACERTS          "CA/estCA/cacert.crt"
+#define US1202_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1202_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1202_CLIENT_THREADS   8
+#define US1202_POOL_SLOTS       3
+#define US1202_ENROLLS          3
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The server runs in event mode so it serves all the
+ * pool's connections at once.
+ */
+static int us1202_init_suite (void)
+{
+    cacerts_len = read_binary_file(US1202_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_event_mode(1);
+    return (st_start(US1202_SERVER_PORT,
+                     US1202_SERVER_CERTKEY,
+                     US1202_SERVER_CERTKEY,
+                     "US1202 test realm",
+                     US1202_CACERTS,
+                     US1202_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1202_destroy_suite (void)
+{
+    st_stop();
+    st_set_event_mode(0);
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+static EVP_PKEY *us1202_new_key (void)
+{
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+    return key;
+}
+
+/*
+ * Returns a pool set up for the test server
+ */
+static EST_CLIENT_POOL *us1202_pool (void)
+{
+    EST_CLIENT_POOL *pool;
+    EST_ERROR rv;
+
+    pool = est_client_pool_new(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                               client_manual_cert_verify, US1202_POOL_SLOTS);
+    CU_ASSERT(pool != NULL);
+    if (!pool) {
+        return NULL;
+    }
+    rv = est_client_pool_set_auth(pool, US1202_UID, US1202_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_pool_set_server(pool, US1202_SERVER_IP, US1202_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return pool;
+}
+
+/*
+ * Checks that the PKCS7 in result holds a certificate for key
+ */
+static int us1202_check_result (EST_CLIENT_RESULT *result, EVP_PKEY *key)
+{
+    EVP_PKEY *cert_key;
+    BIO *b64, *in;
+    PKCS7 *p7;
+    int ok = 0;
+
+    if (!result || result->rv != EST_ERR_NONE || !result->pkcs7 ||
+        result->pkcs7_len != (int)strlen((char *)result->pkcs7)) {
+        return 0;
+    }
+    b64 = BIO_new(BIO_f_base64());
+    in = BIO_new_mem_buf(result->pkcs7, result->pkcs7_len);
+    in = BIO_push(b64, in);
+    p7 = d2i_PKCS7_bio(in, NULL);
+    BIO_free_all(in);
+    if (p7 && OBJ_obj2nid(p7->type) == NID_pkcs7_signed &&
+        sk_X509_num(p7->d.sign->cert) > 0) {
+        cert_key = X509_get_pubkey(sk_X509_value(p7->d.sign->cert, 0));
+        ok = cert_key && EVP_PKEY_cmp(cert_key, key) == 1;
+        EVP_PKEY_free(cert_key);
+    }
+    PKCS7_free(p7);
+    return ok;
+}
+
+static void *us1202_pool_thread (void *arg)
+{
+    EST_CLIENT_POOL *pool = (EST_CLIENT_POOL *)arg;
+    EST_CLIENT_RESULT *result;
+    EVP_PKEY *key;
+    EST_ERROR rv;
+    long failures = 0;
+    int i;
+
+    key = us1202_new_key();
+    for (i = 0; i < US1202_ENROLLS; i++) {
+        result = NULL;
+        rv = est_client_pool_enroll(pool, "US1202", key, &result);
+        if (rv != EST_ERR_NONE || !us1202_check_result(result, key)) {
+            failures++;
+        }
+        est_client_result_free(result);
+    }
+    EVP_PKEY_free(key);
+    return ((void *)failures);
+}
+
+/*
+ * Parameter checks
+ */
+static void us1202_test1 (void)
+{
+    EST_CLIENT_POOL *pool;
+    EST_CLIENT_RESULT *result;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    pool = est_client_pool_new(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                               client_manual_cert_verify, 0);
+    CU_ASSERT(pool == NULL);
+    pool = est_client_pool_new(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                               client_manual_cert_verify,
+                               EST_CLIENT_POOL_SLOTS_MAX + 1);
+    CU_ASSERT(pool == NULL);
+    rv = est_client_pool_enroll(NULL, "US1202", NULL, &result);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+
+    pool = us1202_pool();
+    if (!pool) {
+        return;
+    }
+    rv = est_client_pool_enroll(pool, "US1202", NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    est_client_pool_destroy(pool);
+
+    /* Should be a no-op */
+    est_client_pool_destroy(NULL);
+}
+
+/*
+ * A CSR built by the application is sent as it is
+ */
+static void us1202_test2 (void)
+{
+    EST_CLIENT_POOL *pool;
+    EST_CLIENT_RESULT *result = NULL;
+    EVP_PKEY *key;
+    X509_REQ *csr;
+    X509_NAME *subj;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    pool = us1202_pool();
+    if (!pool) {
+        return;
+    }
+
+    key = us1202_new_key();
+    csr = X509_REQ_new();
+    CU_ASSERT(csr != NULL);
+    subj = X509_REQ_get_subject_name(csr);
+    X509_NAME_add_entry_by_txt(subj, "CN", MBSTRING_ASC,
+                               (unsigned char *)"US1202", -1, -1, 0);
+    X509_REQ_set_pubkey(csr, key);
+    CU_ASSERT(X509_REQ_sign(csr, key, EVP_sha256()) > 0);
+
+    rv = est_client_pool_enroll_csr(pool, csr, NULL, &result);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(us1202_check_result(result, key));
+    est_client_result_free(result);
+
+    X509_REQ_free(csr);
+    EVP_PKEY_free(key);
+    est_client_pool_destroy(pool);
+}
+
+/*
+ * More threads than slots enroll through one pool, each
+ * getting its own certificate back in its own result.
+ */
+static void us1202_test3 (void)
+{
+    pthread_t threads[US1202_CLIENT_THREADS];
+    EST_CLIENT_POOL *pool;
+    void *failures;
+    int i;
+
+    LOG_FUNC_NM;
+
+    pool = us1202_pool();
+    if (!pool) {
+        return;
+    }
+
+    for (i = 0; i < US1202_CLIENT_THREADS; i++) {
+        pthread_create(&threads[i], NULL, us1202_pool_thread, pool);
+    }
+    for (i = 0; i < US1202_CLIENT_THREADS; i++) {
+        pthread_join(threads[i], &failures);
+        CU_ASSERT(failures == NULL);
+    }
+    est_client_pool_destroy(pool);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1202_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1202_client_pool",
+                         us1202_init_suite,
+                         us1202_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1202_test1)) ||
+       (NULL == CU_add_test(pSuite, "Application CSR", us1202_test2)) ||
+       (NULL == CU_add_test(pSuite, "Concurrent enrollments", us1202_test3)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
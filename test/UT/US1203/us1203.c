@@ -0,0 +1,322 @@
+/*------------------------------------------------------------------
+ * us1203.c - Unit Tests for User Story 1203 - Client batch
+ *                                             enrollment
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1203_SERVER_PORT      31203
+#define US1203_SERVER_IP        "127.0.0.1"
+#define US1203_UID              "estuser"
+#define US1203_PWD              "estpwd"
+#define US1203_CACERTS          "CA/estCA/cacert.crt"
+#define US1203_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1203_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1203_BATCH_CSRS       6
+#define US1203_BAD_CSR          2
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.
+ */
+static int us1203_init_suite (void)
+{
+    cacerts_len = read_binary_file(US1203_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_event_mode(1);
+    return (st_start(US1203_SERVER_PORT,
+                     US1203_SERVER_CERTKEY,
+                     US1203_SERVER_CERTKEY,
+                     "US1203 test realm",
+                     US1203_CACERTS,
+                     US1203_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1203_destroy_suite (void)
+{
+    st_stop();
+    st_set_event_mode(0);
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+static EST_CTX *us1203_client_ctx (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return NULL;
+    }
+    rv = est_client_set_auth(cctx, US1203_UID, US1203_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1203_SERVER_IP, US1203_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return cctx;
+}
+
+/*
+ * Builds a CSR for key, signed with signer
+ */
+static X509_REQ *us1203_csr (EVP_PKEY *key, EVP_PKEY *signer)
+{
+    X509_REQ *csr;
+    X509_NAME *subj;
+
+    csr = X509_REQ_new();
+    CU_ASSERT(csr != NULL);
+    subj = X509_REQ_get_subject_name(csr);
+    X509_NAME_add_entry_by_txt(subj, "CN", MBSTRING_ASC,
+                               (unsigned char *)"US1203", -1, -1, 0);
+    X509_REQ_set_pubkey(csr, key);
+    CU_ASSERT(X509_REQ_sign(csr, signer, EVP_sha256()) > 0);
+    return (csr);
+}
+
+/*
+ * Builds a key and a CSR for each slot, the CSR at bad is
+ * signed with the wrong key when bad is not negative
+ */
+static void us1203_setup (EVP_PKEY **keys, X509_REQ **csrs, int bad)
+{
+    EC_KEY *eckey;
+    int i;
+
+    for (i = 0; i < US1203_BATCH_CSRS; i++) {
+        eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+        CU_ASSERT(eckey != NULL);
+        EC_KEY_generate_key(eckey);
+        keys[i] = EVP_PKEY_new();
+        EVP_PKEY_assign_EC_KEY(keys[i], eckey);
+    }
+    for (i = 0; i < US1203_BATCH_CSRS; i++) {
+        csrs[i] = us1203_csr(keys[i], i == bad ? keys[0] : keys[i]);
+    }
+}
+
+static void us1203_cleanup (EVP_PKEY **keys, X509_REQ **csrs)
+{
+    int i;
+
+    for (i = 0; i < US1203_BATCH_CSRS; i++) {
+        X509_REQ_free(csrs[i]);
+        EVP_PKEY_free(keys[i]);
+    }
+}
+
+/*
+ * Checks that the PKCS7 in result holds a certificate for key
+ */
+static int us1203_cert_for (EST_CLIENT_RESULT *result, EVP_PKEY *key)
+{
+    EVP_PKEY *cert_key;
+    BIO *b64, *in;
+    PKCS7 *p7;
+    int ok = 0;
+
+    b64 = BIO_new(BIO_f_base64());
+    in = BIO_new_mem_buf(result->pkcs7, result->pkcs7_len);
+    in = BIO_push(b64, in);
+    p7 = d2i_PKCS7_bio(in, NULL);
+    BIO_free_all(in);
+    if (p7 && OBJ_obj2nid(p7->type) == NID_pkcs7_signed &&
+        sk_X509_num(p7->d.sign->cert) > 0) {
+        cert_key = X509_get_pubkey(sk_X509_value(p7->d.sign->cert, 0));
+        ok = cert_key && EVP_PKEY_cmp(cert_key, key) == 1;
+        EVP_PKEY_free(cert_key);
+    }
+    PKCS7_free(p7);
+    return ok;
+}
+
+/*
+ * Enrolls the CSRs as one batch and checks each result, the
+ * CSR at bad is expected to be rejected
+ */
+static void us1203_enroll_batch (int window, int bad)
+{
+    EST_CTX *cctx;
+    EVP_PKEY *keys[US1203_BATCH_CSRS];
+    X509_REQ *csrs[US1203_BATCH_CSRS];
+    EST_CLIENT_RESULT *results[US1203_BATCH_CSRS];
+    EST_ERROR rv;
+    int i;
+
+    us1203_setup(keys, csrs, bad);
+
+    cctx = us1203_client_ctx();
+    if (!cctx) {
+        us1203_cleanup(keys, csrs);
+        return;
+    }
+    rv = est_client_set_batch_window(cctx, window);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    rv = est_client_enroll_batch(cctx, csrs, US1203_BATCH_CSRS, results);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    for (i = 0; i < US1203_BATCH_CSRS; i++) {
+        CU_ASSERT(results[i] != NULL);
+        if (!results[i]) {
+            continue;
+        }
+        if (i == bad) {
+            CU_ASSERT(results[i]->rv == EST_ERR_HTTP_BAD_REQ);
+            CU_ASSERT(results[i]->pkcs7 == NULL);
+        } else {
+            CU_ASSERT(results[i]->rv == EST_ERR_NONE);
+            CU_ASSERT(results[i]->pkcs7 != NULL);
+            CU_ASSERT(results[i]->pkcs7_len > 0);
+            if (results[i]->pkcs7) {
+                CU_ASSERT(us1203_cert_for(results[i], keys[i]));
+            }
+        }
+        est_client_result_free(results[i]);
+    }
+    est_destroy(cctx);
+    us1203_cleanup(keys, csrs);
+}
+
+/*
+ * Parameter checks
+ */
+static void us1203_test1 (void)
+{
+    EST_CTX *cctx;
+    EVP_PKEY *keys[US1203_BATCH_CSRS];
+    X509_REQ *csrs[US1203_BATCH_CSRS];
+    EST_CLIENT_RESULT *results[US1203_BATCH_CSRS];
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_client_set_batch_window(NULL, 4);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_client_set_batch_window(ectx, 4);
+    CU_ASSERT(rv == EST_ERR_BAD_MODE);
+
+    us1203_setup(keys, csrs, -1);
+    rv = est_client_enroll_batch(NULL, csrs, US1203_BATCH_CSRS, results);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+
+    cctx = us1203_client_ctx();
+    if (cctx) {
+        rv = est_client_set_batch_window(cctx, 0);
+        CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+        rv = est_client_set_batch_window(cctx, EST_CLIENT_BATCH_WINDOW_MAX + 1);
+        CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+        rv = est_client_enroll_batch(cctx, csrs, 0, results);
+        CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+        rv = est_client_enroll_batch(cctx, csrs, US1203_BATCH_CSRS, NULL);
+        CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+        est_destroy(cctx);
+    }
+    us1203_cleanup(keys, csrs);
+}
+
+/*
+ * The CSRs are pipelined over one connection and each
+ * result holds the certificate for its own CSR.
+ */
+static void us1203_test2 (void)
+{
+    LOG_FUNC_NM;
+
+    us1203_enroll_batch(4, -1);
+}
+
+/*
+ * One of the CSRs carries a bad signature, the server rejects
+ * it and closes the connection.  The requests behind it are
+ * sent again and still succeed.
+ */
+static void us1203_test3 (void)
+{
+    LOG_FUNC_NM;
+
+    us1203_enroll_batch(4, US1203_BAD_CSR);
+}
+
+/*
+ * A window of one sends the requests one at a time
+ */
+static void us1203_test4 (void)
+{
+    LOG_FUNC_NM;
+
+    us1203_enroll_batch(1, US1203_BAD_CSR);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1203_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1203_client_batch_enroll",
+                         us1203_init_suite,
+                         us1203_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1203_test1)) ||
+       (NULL == CU_add_test(pSuite, "Pipelined requests", us1203_test2)) ||
+       (NULL == CU_add_test(pSuite, "Rejected request", us1203_test3)) ||
+       (NULL == CU_add_test(pSuite, "Window of one", us1203_test4)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -0,0 +1,359 @@
+/*------------------------------------------------------------------
+ * us1204.c - Unit Tests for User Story 1204 - Client non-blocking
+ *                                             operations
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1204_SERVER_PORT      31204
+#define US1204_SERVER_IP        "127.0.0.1"
+#define US1204_UID              "estuser"
+#define US1204_PWD              "estpwd"
+#define US1204_CACERTS          "CA/estCA/cacert.crt"
+#define US1204_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1204_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1204_CLIENT_OPS       8
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.
+ */
+static int us1204_init_suite (void)
+{
+    cacerts_len = read_binary_file(US1204_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    st_set_event_mode(1);
+    return (st_start(US1204_SERVER_PORT,
+                     US1204_SERVER_CERTKEY,
+                     US1204_SERVER_CERTKEY,
+                     "US1204 test realm",
+                     US1204_CACERTS,
+                     US1204_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1204_destroy_suite (void)
+{
+    st_stop();
+    st_set_event_mode(0);
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+static EST_CTX *us1204_client_ctx (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return NULL;
+    }
+    rv = est_client_set_auth(cctx, US1204_UID, US1204_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1204_SERVER_IP, US1204_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return cctx;
+}
+
+/*
+ * Checks that the PKCS7 in result holds a certificate for key
+ */
+static int us1204_cert_for (EST_CLIENT_RESULT *result, EVP_PKEY *key)
+{
+    EVP_PKEY *cert_key;
+    BIO *b64, *in;
+    PKCS7 *p7;
+    int ok = 0;
+
+    b64 = BIO_new(BIO_f_base64());
+    in = BIO_new_mem_buf(result->pkcs7, result->pkcs7_len);
+    in = BIO_push(b64, in);
+    p7 = d2i_PKCS7_bio(in, NULL);
+    BIO_free_all(in);
+    if (p7 && OBJ_obj2nid(p7->type) == NID_pkcs7_signed &&
+        sk_X509_num(p7->d.sign->cert) > 0) {
+        cert_key = X509_get_pubkey(sk_X509_value(p7->d.sign->cert, 0));
+        ok = cert_key && EVP_PKEY_cmp(cert_key, key) == 1;
+        EVP_PKEY_free(cert_key);
+    }
+    PKCS7_free(p7);
+    return ok;
+}
+
+/*
+ * Parameter checks
+ */
+static void us1204_test1 (void)
+{
+    EST_CTX *cctx;
+    EST_CLIENT_OP *op;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_client_op_start(NULL, EST_CLIENT_OP_CACERTS, NULL, NULL, &op);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_client_op_start(ectx, EST_CLIENT_OP_CACERTS, NULL, NULL, &op);
+    CU_ASSERT(rv == EST_ERR_BAD_MODE);
+    CU_ASSERT(est_client_op_continue(NULL, 0) == EST_CONN_EV_CLOSED);
+    CU_ASSERT(est_client_op_get_fd(NULL) == -1);
+    /* Should be a no-op */
+    est_client_op_free(NULL);
+
+    cctx = us1204_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    rv = est_client_op_start(cctx, EST_CLIENT_OP_CACERTS, NULL, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_client_op_start(cctx, EST_CLIENT_OP_ENROLL, NULL, NULL, &op);
+    CU_ASSERT(rv == EST_ERR_NO_CSR);
+    est_destroy(cctx);
+}
+
+/*
+ * A CA certs request and several
+ * enrollments are driven together from this thread with poll().  The
+ * enrollments answer the HTTP authentication challenge on a new
+ * connection.
+ */
+static void us1204_test2 (void)
+{
+    EST_CTX *cctx;
+    EST_CLIENT_OP *ops[US1204_CLIENT_OPS];
+    EVP_PKEY *keys[US1204_CLIENT_OPS];
+    X509_REQ *csrs[US1204_CLIENT_OPS];
+    EST_CLIENT_RESULT *result;
+    struct pollfd pfds[US1204_CLIENT_OPS];
+    int wanted[US1204_CLIENT_OPS];
+    X509_NAME *subj;
+    EC_KEY *eckey;
+    EST_ERROR rv;
+    int i, rc, left, ev;
+
+    LOG_FUNC_NM;
+
+    memset(keys, 0, sizeof(keys));
+    memset(csrs, 0, sizeof(csrs));
+    for (i = 1; i < US1204_CLIENT_OPS; i++) {
+        eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+        CU_ASSERT(eckey != NULL);
+        EC_KEY_generate_key(eckey);
+        keys[i] = EVP_PKEY_new();
+        EVP_PKEY_assign_EC_KEY(keys[i], eckey);
+        csrs[i] = X509_REQ_new();
+        CU_ASSERT(csrs[i] != NULL);
+        subj = X509_REQ_get_subject_name(csrs[i]);
+        X509_NAME_add_entry_by_txt(subj, "CN", MBSTRING_ASC,
+                                   (unsigned char *)"US1204", -1, -1, 0);
+        X509_REQ_set_pubkey(csrs[i], keys[i]);
+    }
+
+    cctx = us1204_client_ctx();
+    if (!cctx) {
+        goto done;
+    }
+    /*
+     * The first operation retrieves the CA certs, the others enroll
+     */
+    left = 0;
+    for (i = 0; i < US1204_CLIENT_OPS; i++) {
+        rv = est_client_op_start(cctx, i ? EST_CLIENT_OP_ENROLL :
+                                 EST_CLIENT_OP_CACERTS, csrs[i], keys[i],
+                                 &ops[i]);
+        CU_ASSERT(rv == EST_ERR_NONE);
+        if (rv != EST_ERR_NONE) {
+            wanted[i] = EST_CONN_EV_CLOSED;
+            continue;
+        }
+        rv = est_client_op_get_result(ops[i], &result);
+        CU_ASSERT(rv == EST_ERR_BAD_MODE);
+        wanted[i] = est_client_op_continue(ops[i], 0);
+        if (!(wanted[i] & EST_CONN_EV_CLOSED)) {
+            left++;
+        }
+    }
+
+    while (left > 0) {
+        for (i = 0; i < US1204_CLIENT_OPS; i++) {
+            pfds[i].fd = -1;
+            pfds[i].events = 0;
+            pfds[i].revents = 0;
+            if (!(wanted[i] & EST_CONN_EV_CLOSED)) {
+                pfds[i].fd = est_client_op_get_fd(ops[i]);
+                if (wanted[i] & EST_CONN_EV_READ) {
+                    pfds[i].events |= POLLIN;
+                }
+                if (wanted[i] & EST_CONN_EV_WRITE) {
+                    pfds[i].events |= POLLOUT;
+                }
+            }
+        }
+        rc = poll(pfds, US1204_CLIENT_OPS, 10000);
+        CU_ASSERT(rc > 0);
+        if (rc <= 0) {
+            break;
+        }
+        for (i = 0; i < US1204_CLIENT_OPS; i++) {
+            if (!pfds[i].revents) {
+                continue;
+            }
+            ev = 0;
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ev |= EST_CONN_EV_READ;
+            }
+            if (pfds[i].revents & POLLOUT) {
+                ev |= EST_CONN_EV_WRITE;
+            }
+            wanted[i] = est_client_op_continue(ops[i], ev);
+            if (wanted[i] & EST_CONN_EV_CLOSED) {
+                left--;
+            }
+        }
+    }
+
+    for (i = 0; i < US1204_CLIENT_OPS; i++) {
+        if (!(wanted[i] & EST_CONN_EV_CLOSED)) {
+            est_client_op_free(ops[i]);
+            continue;
+        }
+        result = NULL;
+        rv = est_client_op_get_result(ops[i], &result);
+        CU_ASSERT(rv == EST_ERR_NONE);
+        CU_ASSERT(result != NULL);
+        if (result) {
+            CU_ASSERT(result->rv == EST_ERR_NONE);
+            CU_ASSERT(result->pkcs7 != NULL);
+            CU_ASSERT(result->pkcs7_len > 0);
+            if (i && result->pkcs7) {
+                CU_ASSERT(us1204_cert_for(result, keys[i]));
+            }
+            est_client_result_free(result);
+        }
+        /*
+         * The result is only passed back once
+         */
+        rv = est_client_op_get_result(ops[i], &result);
+        CU_ASSERT(rv == EST_ERR_NONE);
+        CU_ASSERT(result == NULL);
+        est_client_op_free(ops[i]);
+    }
+    est_destroy(cctx);
+
+done:
+    for (i = 1; i < US1204_CLIENT_OPS; i++) {
+        X509_REQ_free(csrs[i]);
+        EVP_PKEY_free(keys[i]);
+    }
+}
+
+/*
+ * An operation the application gives up on is released while
+ * its connection is still open
+ */
+static void us1204_test3 (void)
+{
+    EST_CTX *cctx;
+    EST_CLIENT_OP *op;
+    EST_CLIENT_RESULT *result;
+    EST_ERROR rv;
+    int wanted;
+
+    LOG_FUNC_NM;
+
+    cctx = us1204_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    rv = est_client_op_start(cctx, EST_CLIENT_OP_CACERTS, NULL, NULL, &op);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    if (rv == EST_ERR_NONE) {
+        wanted = est_client_op_continue(op, 0);
+        CU_ASSERT(!(wanted & EST_CONN_EV_CLOSED));
+        CU_ASSERT(est_client_op_get_fd(op) >= 0);
+        rv = est_client_op_get_result(op, &result);
+        CU_ASSERT(rv == EST_ERR_BAD_MODE);
+        est_client_op_free(op);
+    }
+
+    /*
+     * The context can still be used for a blocking request
+     */
+    rv = est_client_get_cacerts(cctx, &wanted);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    est_destroy(cctx);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1204_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1204_client_ops",
+                         us1204_init_suite,
+                         us1204_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Parameter checks", us1204_test1)) ||
+       (NULL == CU_add_test(pSuite, "Operations driven with poll", us1204_test2)) ||
+       (NULL == CU_add_test(pSuite, "Operation given up on", us1204_test3)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -0,0 +1,407 @@
+/*------------------------------------------------------------------
+ * us1205.c - Unit Tests for User Story 1205 - Client response
+ *                                             reader
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <est.h>
+#include "test_utils.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1205_SERVER_PORT      31205
+#define US1205_SERVER_IP        "127.0.0.1"
+#define US1205_CACERTS          "CA/estCA/cacert.crt"
+#define US1205_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1205_HDR              "HTTP/1.1 200 OK\r\n" \
+                                "Status: 200 OK\r\n" \
+                                "Content-Type: application/pkcs7-mime\r\n"
+/*
+ * Larger than the first read buffer, so reading it grows the buffer
+ */
+#define US1205_LONG_BODY        10000
+/*
+ * One past the largest response the client reads, EST_CA_MAX
+ */
+#define US1205_CL_TOO_LARGE     1000001
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+static SSL_CTX *server_ctx = NULL;
+static int listen_sock = -1;
+
+/*
+ * One response sent by the test server.  The headers and the
+ * body are written separately, the body in chunks of chunk
+ * bytes.  The connection is closed after them, or when hold
+ * is set, left open until the client closes it.
+ */
+typedef struct {
+    char *hdr;
+    unsigned char *body;
+    int body_len;
+    int chunk;
+    int hold;
+} US1205_RESP;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The server here isn't an EST server, it answers a
+ * single request with a response built by the test.
+ */
+static int us1205_init_suite (void)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    cacerts_len = read_binary_file(US1205_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    server_ctx = SSL_CTX_new(SSLv23_server_method());
+    if (!server_ctx) {
+        return 1;
+    }
+    if (SSL_CTX_use_certificate_chain_file(server_ctx,
+                                           US1205_SERVER_CERTKEY) != 1 ||
+        SSL_CTX_use_PrivateKey_file(server_ctx, US1205_SERVER_CERTKEY,
+                                    SSL_FILETYPE_PEM) != 1) {
+        return 1;
+    }
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(US1205_SERVER_PORT);
+    addr.sin_addr.s_addr = inet_addr(US1205_SERVER_IP);
+    listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_sock < 0) {
+        return 1;
+    }
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&on,
+               sizeof(on));
+    if (bind(listen_sock, (const struct sockaddr*)&addr, sizeof(addr)) ||
+        listen(listen_sock, SOMAXCONN)) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1205_destroy_suite (void)
+{
+    if (listen_sock >= 0) {
+        close(listen_sock);
+    }
+    SSL_CTX_free(server_ctx);
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Accepts one connection, reads the request and writes the
+ * response
+ */
+static void *us1205_server_thread (void *arg)
+{
+    US1205_RESP *resp = (US1205_RESP *)arg;
+    char req[4096];
+    SSL *ssl;
+    int sock;
+    int off, n;
+
+    sock = accept(listen_sock, NULL, NULL);
+    if (sock < 0) {
+        return NULL;
+    }
+    ssl = SSL_new(server_ctx);
+    SSL_set_fd(ssl, sock);
+    if (SSL_accept(ssl) == 1 && SSL_read(ssl, req, sizeof(req)) > 0) {
+        SSL_write(ssl, resp->hdr, strlen(resp->hdr));
+        for (off = 0; off < resp->body_len; off += n) {
+            n = resp->body_len - off;
+            if (n > resp->chunk) {
+                n = resp->chunk;
+            }
+            if (SSL_write(ssl, resp->body + off, n) <= 0) {
+                break;
+            }
+        }
+        if (resp->hold) {
+            SSL_read(ssl, req, sizeof(req));
+        }
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(sock);
+    return NULL;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Has the test server send resp and returns what the client
+ * made of it when asking for the CA certs
+ */
+static EST_ERROR us1205_get_cacerts (US1205_RESP *resp, int *len)
+{
+    pthread_t thread;
+    EST_CTX *cctx;
+    EST_ERROR rv;
+
+    *len = 0;
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return (EST_ERR_NO_CTX);
+    }
+    rv = est_client_set_server(cctx, US1205_SERVER_IP, US1205_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    pthread_create(&thread, NULL, us1205_server_thread, resp);
+    rv = est_client_get_cacerts(cctx, len);
+    pthread_join(thread, NULL);
+
+    est_destroy(cctx);
+    return (rv);
+}
+
+/*
+ * Builds the body of a CA certs response from US1205_CACERTS,
+ * a base64 encoded certs-only PKCS7
+ */
+static int us1205_cacerts_body (unsigned char **body)
+{
+    PKCS7 *p7;
+    X509 *x;
+    BIO *in, *out, *b64;
+    BUF_MEM *bptr;
+    int len = 0;
+
+    *body = NULL;
+    p7 = PKCS7_new();
+    PKCS7_set_type(p7, NID_pkcs7_signed);
+    PKCS7_content_new(p7, NID_pkcs7_data);
+    in = BIO_new_file(US1205_CACERTS, "r");
+    CU_ASSERT(in != NULL);
+    if (!in) {
+        PKCS7_free(p7);
+        return 0;
+    }
+    while ((x = PEM_read_bio_X509(in, NULL, NULL, NULL)) != NULL) {
+        PKCS7_add_certificate(p7, x);
+        X509_free(x);
+    }
+    BIO_free(in);
+    ERR_clear_error();
+
+    b64 = BIO_new(BIO_f_base64());
+    out = BIO_new(BIO_s_mem());
+    out = BIO_push(b64, out);
+    i2d_PKCS7_bio(out, p7);
+    (void)BIO_flush(out);
+    BIO_get_mem_ptr(out, &bptr);
+    if (bptr->length > 0) {
+        *body = malloc(bptr->length);
+        memcpy(*body, bptr->data, bptr->length);
+        len = bptr->length;
+    }
+    BIO_free_all(out);
+    PKCS7_free(p7);
+    return len;
+}
+
+/*
+ * The response arrives in small pieces, the reader puts it
+ * back together and stops at its Content-Length.  The server
+ * keeps the connection open, so this only returns if the
+ * client doesn't wait for it to close.
+ */
+static void us1205_test1 (void)
+{
+    US1205_RESP resp;
+    unsigned char *body;
+    char hdr[256];
+    int body_len, len;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    body_len = us1205_cacerts_body(&body);
+    CU_ASSERT(body_len > 0);
+    if (body_len <= 0) {
+        return;
+    }
+    snprintf(hdr, sizeof(hdr), "%sContent-Length: %d\r\n\r\n",
+             US1205_HDR, body_len);
+    resp.hdr = hdr;
+    resp.body = body;
+    resp.body_len = body_len;
+    resp.chunk = 7;
+    resp.hold = 1;
+
+    rv = us1205_get_cacerts(&resp, &len);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(len > 0);
+    free(body);
+}
+
+/*
+ * The server closes the connection before sending the whole
+ * body, the truncated response is rejected.
+ */
+static void us1205_test2 (void)
+{
+    US1205_RESP resp;
+    unsigned char *body;
+    char hdr[256];
+    int body_len, len;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    body_len = us1205_cacerts_body(&body);
+    CU_ASSERT(body_len > 0);
+    if (body_len <= 0) {
+        return;
+    }
+    snprintf(hdr, sizeof(hdr), "%sContent-Length: %d\r\n\r\n",
+             US1205_HDR, body_len);
+    resp.hdr = hdr;
+    resp.body = body;
+    resp.body_len = body_len / 2;
+    resp.chunk = body_len;
+    resp.hold = 0;
+
+    rv = us1205_get_cacerts(&resp, &len);
+    CU_ASSERT(rv == EST_ERR_UNKNOWN);
+    CU_ASSERT(len == 0);
+    free(body);
+}
+
+/*
+ * A Content-Length above the largest response the client
+ * accepts is rejected, the client doesn't try to size its
+ * buffer from it.
+ */
+static void us1205_test3 (void)
+{
+    US1205_RESP resp;
+    unsigned char *body;
+    char hdr[256];
+    int body_len, len;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    body_len = us1205_cacerts_body(&body);
+    CU_ASSERT(body_len > 0);
+    if (body_len <= 0) {
+        return;
+    }
+    snprintf(hdr, sizeof(hdr), "%sContent-Length: %d\r\n\r\n",
+             US1205_HDR, US1205_CL_TOO_LARGE);
+    resp.hdr = hdr;
+    resp.body = body;
+    resp.body_len = body_len;
+    resp.chunk = body_len;
+    resp.hold = 0;
+
+    rv = us1205_get_cacerts(&resp, &len);
+    CU_ASSERT(rv == EST_ERR_UNKNOWN);
+    CU_ASSERT(len == 0);
+    free(body);
+}
+
+/*
+ * Without a Content-Length the response is read until the
+ * server closes the connection, growing the buffer on the
+ * way.  EST requires the header, so the response then has no
+ * payload.
+ */
+static void us1205_test4 (void)
+{
+    US1205_RESP resp;
+    unsigned char *body;
+    int len;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    body = malloc(US1205_LONG_BODY);
+    CU_ASSERT(body != NULL);
+    if (!body) {
+        return;
+    }
+    memset(body, 'A', US1205_LONG_BODY);
+    resp.hdr = US1205_HDR "\r\n";
+    resp.body = body;
+    resp.body_len = US1205_LONG_BODY;
+    resp.chunk = 1000;
+    resp.hold = 0;
+
+    rv = us1205_get_cacerts(&resp, &len);
+    CU_ASSERT(rv == EST_ERR_ZERO_LENGTH_BUF);
+    CU_ASSERT(len == 0);
+    free(body);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1205_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1205_client_response_reader",
+                         us1205_init_suite,
+                         us1205_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Response in pieces", us1205_test1)) ||
+       (NULL == CU_add_test(pSuite, "Short body", us1205_test2)) ||
+       (NULL == CU_add_test(pSuite, "Content-Length too large", us1205_test3)) ||
+       (NULL == CU_add_test(pSuite, "No Content-Length", us1205_test4)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
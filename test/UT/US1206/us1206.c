@@ -0,0 +1,239 @@
+/*------------------------------------------------------------------
+ * us1206.c - Unit Tests for User Story 1206 - Server connection
+ *                                             auth cache
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <est.h>
+#include "../../src/est/est_locl.h"
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1206_SERVER_PORT      31206
+#define US1206_SERVER_IP        "127.0.0.1"
+#define US1206_UID              "estuser"
+#define US1206_PWD              "estpwd"
+#define US1206_CACERTS          "CA/estCA/cacert.crt"
+#define US1206_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1206_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1206_ROUNDS           3
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.  The server requires proof of possession, so every
+ * enrollment is checked against the tls-unique value the
+ * server holds for the connection.
+ */
+static int us1206_init_suite (void)
+{
+    cacerts_len = read_binary_file(US1206_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    return (st_start(US1206_SERVER_PORT,
+                     US1206_SERVER_CERTKEY,
+                     US1206_SERVER_CERTKEY,
+                     "US1206 test realm",
+                     US1206_CACERTS,
+                     US1206_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 1, 0));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1206_destroy_suite (void)
+{
+    st_stop();
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns a client context with keep-alive enabled that
+ * always sends proof of possession
+ */
+static EST_CTX *us1206_client_ctx (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return NULL;
+    }
+    rv = est_client_set_auth(cctx, US1206_UID, US1206_PWD, NULL, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_server(cctx, US1206_SERVER_IP, US1206_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_set_keep_alive(cctx, 1);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_client_force_pop(cctx);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return cctx;
+}
+
+static EVP_PKEY *us1206_new_key (void)
+{
+    EVP_PKEY *key;
+    EC_KEY *eckey;
+
+    eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+    CU_ASSERT(eckey != NULL);
+    EC_KEY_generate_key(eckey);
+    key = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key, eckey);
+    return key;
+}
+
+/*
+ * Number of TLS handshakes the client has started
+ */
+static long us1206_handshakes (EST_CTX *cctx)
+{
+    return (SSL_CTX_sess_connect(cctx->ssl_ctx));
+}
+
+static void us1206_enroll (EST_CTX *cctx, EVP_PKEY *key)
+{
+    EST_ERROR rv;
+    int len = 0;
+
+    rv = est_client_enroll(cctx, "US1206", &len, key);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(len > 0);
+}
+
+/*
+ * Enrollments that follow the first on a connection are
+ * checked against the tls-unique value the server kept for
+ * it.  The first enrollment is challenged for HTTP
+ * authentication and answered on a new connection, the rest
+ * share that one.
+ */
+static void us1206_test1 (void)
+{
+    EST_CTX *cctx;
+    EVP_PKEY *key;
+    int i;
+
+    LOG_FUNC_NM;
+
+    cctx = us1206_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    key = us1206_new_key();
+
+    for (i = 0; i < US1206_ROUNDS; i++) {
+        us1206_enroll(cctx, key);
+    }
+    CU_ASSERT(us1206_handshakes(cctx) == 2);
+
+    EVP_PKEY_free(key);
+    est_destroy(cctx);
+}
+
+/*
+ * A renegotiation on a held connection changes tls-unique.
+ * The server notices the new handshake and the enrollment
+ * after it is checked against the new value.
+ */
+static void us1206_test2 (void)
+{
+    EST_CTX *cctx;
+    EVP_PKEY *key;
+    unsigned char before[EST_TLS_FINISHED_MAX];
+    unsigned char after[EST_TLS_FINISHED_MAX];
+    size_t before_len, after_len;
+
+    LOG_FUNC_NM;
+
+    cctx = us1206_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    key = us1206_new_key();
+
+    us1206_enroll(cctx, key);
+    us1206_enroll(cctx, key);
+    CU_ASSERT(us1206_handshakes(cctx) == 2);
+
+    CU_ASSERT(cctx->ka_ssl != NULL);
+    if (cctx->ka_ssl) {
+        before_len = SSL_get_finished(cctx->ka_ssl, before, sizeof(before));
+        CU_ASSERT(SSL_renegotiate(cctx->ka_ssl) == 1);
+        CU_ASSERT(SSL_do_handshake(cctx->ka_ssl) == 1);
+        after_len = SSL_get_finished(cctx->ka_ssl, after, sizeof(after));
+        CU_ASSERT(before_len != after_len ||
+                  memcmp(before, after, before_len));
+
+        us1206_enroll(cctx, key);
+        us1206_enroll(cctx, key);
+        CU_ASSERT(cctx->ka_ssl != NULL);
+    }
+
+    EVP_PKEY_free(key);
+    est_destroy(cctx);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1206_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1206_conn_auth_cache",
+                         us1206_init_suite,
+                         us1206_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Reuse on a held connection", us1206_test1)) ||
+       (NULL == CU_add_test(pSuite, "Renegotiation", us1206_test2)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
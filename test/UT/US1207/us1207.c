@@ -0,0 +1,377 @@
+/*------------------------------------------------------------------
+ * us1207.c - Unit Tests for User Story 1207 - CSR attributes cache
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1207_SERVER_PORT      31207
+#define US1207_SERVER_IP        "127.0.0.1"
+#define US1207_CACERTS          "CA/estCA/cacert.crt"
+#define US1207_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1207_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1207_CLIENTS          4
+
+#define TEST_ATTR1 "MCYGBysGAQEBARYGCSqGSIb3DQEJBwYFK4EEACIGCWCGSAFlAwQCAg==\0"
+#define TEST_ATTR8 "MAthisis badsGCSqGSIb3DQEJBw==\0"
+
+extern EST_CTX *ectx;
+
+static unsigned char *cacerts = NULL;
+static int cacerts_len = 0;
+
+/*
+ * What the CSR attributes callback answers with.  A bad answer
+ * is one the server rejects when checking the attributes.
+ */
+static volatile int csrattrs_bad = 0;
+static volatile int csrattrs_delay = 0;
+static int csrattrs_cb_count = 0;
+
+static unsigned char * handle_counted_csrattrs_request (int *csr_len, void *app_data)
+{
+    unsigned char *csr_data;
+    char *attrs = csrattrs_bad ? TEST_ATTR8 : TEST_ATTR1;
+
+    __sync_fetch_and_add(&csrattrs_cb_count, 1);
+    if (csrattrs_delay) {
+        sleep(csrattrs_delay);
+    }
+    *csr_len = strlen(attrs);
+    csr_data = malloc(*csr_len + 1);
+    strncpy((char *)csr_data, attrs, *csr_len);
+    csr_data[*csr_len] = 0;
+    return (csr_data);
+}
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.
+ */
+static int us1207_init_suite (void)
+{
+    cacerts_len = read_binary_file(US1207_CACERTS, &cacerts);
+    if (cacerts_len <= 0) {
+        return 1;
+    }
+
+    return (st_start(US1207_SERVER_PORT,
+                     US1207_SERVER_CERTKEY,
+                     US1207_SERVER_CERTKEY,
+                     "US1207 test realm",
+                     US1207_CACERTS,
+                     US1207_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1207_destroy_suite (void)
+{
+    st_stop();
+    free(cacerts);
+    return 0;
+}
+
+/*
+ * Callback function passed to est_client_init()
+ */
+static int client_manual_cert_verify (X509 *cur_cert, int openssl_cert_error)
+{
+    if (openssl_cert_error == X509_V_ERR_UNABLE_TO_GET_CRL) {
+        return 1;
+    }
+    return 0;
+}
+
+static EST_CTX *us1207_client_ctx (void)
+{
+    EST_CTX *cctx;
+    int rv;
+
+    cctx = est_client_init(cacerts, cacerts_len, EST_CERT_FORMAT_PEM,
+                           client_manual_cert_verify);
+    CU_ASSERT(cctx != NULL);
+    if (!cctx) {
+        return NULL;
+    }
+    rv = est_client_set_server(cctx, US1207_SERVER_IP, US1207_SERVER_PORT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    return cctx;
+}
+
+/*
+ * Asks the server for its CSR attributes, returns 1 when they
+ * are TEST_ATTR1
+ */
+static int us1207_get_attr1 (EST_CTX *cctx)
+{
+    unsigned char *csr_data = NULL;
+    int csr_len = 0;
+    EST_ERROR rv;
+
+    rv = est_client_get_csrattrs(cctx, &csr_data, &csr_len);
+    return (rv == EST_ERR_NONE && csr_len == strlen(TEST_ATTR1) &&
+            !strncmp(TEST_ATTR1, (const char *)csr_data, csr_len));
+}
+
+/*
+ * Installs the counting callback and a cache with the given TTL
+ */
+static void us1207_set_cache (int ttl)
+{
+    EST_ERROR rv;
+
+    csrattrs_bad = 0;
+    csrattrs_delay = 0;
+    csrattrs_cb_count = 0;
+    rv = est_set_csr_cb(ectx, &handle_counted_csrattrs_request);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    rv = est_server_set_csrattrs_cache_ttl(ectx, ttl);
+    CU_ASSERT(rv == EST_ERR_NONE);
+}
+
+static void us1207_clear_cache (void)
+{
+    est_server_set_csrattrs_cache_ttl(ectx, 0);
+    est_set_csr_cb(ectx, NULL);
+}
+
+/*
+ * Parameter checks of est_server_set_csrattrs_cache_ttl()
+ */
+static void us1207_test1 (void)
+{
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    rv = est_server_set_csrattrs_cache_ttl(NULL, 1);
+    CU_ASSERT(rv == EST_ERR_NO_CTX);
+    rv = est_server_set_csrattrs_cache_ttl(ectx, -1);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+    rv = est_server_set_csrattrs_cache_ttl(ectx, EST_CSRATTRS_CACHE_TTL_MAX + 1);
+    CU_ASSERT(rv == EST_ERR_INVALID_PARAMETERS);
+}
+
+/*
+ * Only the first request reaches the callback.  Once expired the
+ * cached attributes are still returned while they are refreshed
+ * in the background.  Disabling the cache sends every request to
+ * the callback again.
+ */
+static void us1207_test2 (void)
+{
+    EST_CTX *cctx;
+
+    LOG_FUNC_NM;
+
+    cctx = us1207_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    us1207_set_cache(1);
+
+    CU_ASSERT(us1207_get_attr1(cctx));
+    CU_ASSERT(us1207_get_attr1(cctx));
+    CU_ASSERT(csrattrs_cb_count == 1);
+
+    sleep(2);
+    CU_ASSERT(us1207_get_attr1(cctx));
+    sleep(1);
+    CU_ASSERT(csrattrs_cb_count == 2);
+
+    est_server_set_csrattrs_cache_ttl(ectx, 0);
+    CU_ASSERT(us1207_get_attr1(cctx));
+    CU_ASSERT(csrattrs_cb_count == 3);
+
+    us1207_clear_cache();
+    est_destroy(cctx);
+}
+
+/*
+ * A failed refresh keeps the previous attributes, and the
+ * callback isn't asked again on each request until the retry
+ * delay, here the TTL, has passed.
+ */
+static void us1207_test3 (void)
+{
+    EST_CTX *cctx;
+    int i;
+
+    LOG_FUNC_NM;
+
+    cctx = us1207_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    us1207_set_cache(3);
+
+    CU_ASSERT(us1207_get_attr1(cctx));
+    CU_ASSERT(csrattrs_cb_count == 1);
+
+    csrattrs_bad = 1;
+    sleep(4);
+    CU_ASSERT(us1207_get_attr1(cctx));
+    sleep(1);
+    CU_ASSERT(csrattrs_cb_count == 2);
+
+    for (i = 0; i < 3; i++) {
+        CU_ASSERT(us1207_get_attr1(cctx));
+    }
+    sleep(1);
+    CU_ASSERT(csrattrs_cb_count == 2);
+
+    /*
+     * After the retry delay the callback is asked again and its
+     * attributes, good this time, replace the old ones
+     */
+    csrattrs_bad = 0;
+    sleep(2);
+    CU_ASSERT(us1207_get_attr1(cctx));
+    sleep(1);
+    CU_ASSERT(csrattrs_cb_count == 3);
+    CU_ASSERT(us1207_get_attr1(cctx));
+    CU_ASSERT(csrattrs_cb_count == 3);
+
+    us1207_clear_cache();
+    est_destroy(cctx);
+}
+
+/*
+ * When the callback fails on an empty cache the client gets a
+ * 204, and nothing is cached, so the next request asks again.
+ */
+static void us1207_test4 (void)
+{
+    EST_CTX *cctx;
+    unsigned char *csr_data = NULL;
+    int csr_len = -1;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    cctx = us1207_client_ctx();
+    if (!cctx) {
+        return;
+    }
+    us1207_set_cache(60);
+    csrattrs_bad = 1;
+
+    rv = est_client_get_csrattrs(cctx, &csr_data, &csr_len);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    CU_ASSERT(csr_len == 0);
+    CU_ASSERT(csrattrs_cb_count == 1);
+
+    csrattrs_bad = 0;
+    CU_ASSERT(us1207_get_attr1(cctx));
+    CU_ASSERT(csrattrs_cb_count == 2);
+    CU_ASSERT(us1207_get_attr1(cctx));
+    CU_ASSERT(csrattrs_cb_count == 2);
+
+    us1207_clear_cache();
+    est_destroy(cctx);
+}
+
+static void *us1207_client_thread (void *arg)
+{
+    EST_CTX *cctx = (EST_CTX *)arg;
+
+    return (us1207_get_attr1(cctx) ? arg : NULL);
+}
+
+/*
+ * Requests arriving while a slow callback fills the empty cache
+ * are answered without waiting for it, each asking the callback
+ * itself.  Later requests are served from the cache.
+ */
+static void us1207_test5 (void)
+{
+    EST_CTX *cctx[US1207_CLIENTS];
+    pthread_t thread[US1207_CLIENTS];
+    void *res;
+    int i;
+
+    LOG_FUNC_NM;
+
+    for (i = 0; i < US1207_CLIENTS; i++) {
+        cctx[i] = us1207_client_ctx();
+        if (!cctx[i]) {
+            return;
+        }
+    }
+    us1207_set_cache(60);
+    csrattrs_delay = 2;
+
+    for (i = 0; i < US1207_CLIENTS; i++) {
+        pthread_create(&thread[i], NULL, us1207_client_thread, cctx[i]);
+    }
+    for (i = 0; i < US1207_CLIENTS; i++) {
+        pthread_join(thread[i], &res);
+        CU_ASSERT(res == cctx[i]);
+    }
+    CU_ASSERT(csrattrs_cb_count >= 1);
+    CU_ASSERT(csrattrs_cb_count <= US1207_CLIENTS);
+
+    csrattrs_delay = 0;
+    i = csrattrs_cb_count;
+    CU_ASSERT(us1207_get_attr1(cctx[0]));
+    CU_ASSERT(csrattrs_cb_count == i);
+
+    us1207_clear_cache();
+    for (i = 0; i < US1207_CLIENTS; i++) {
+        est_destroy(cctx[i]);
+    }
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1207_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1207_csrattrs_cache",
+                         us1207_init_suite,
+                         us1207_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Cache TTL parameters", us1207_test1)) ||
+       (NULL == CU_add_test(pSuite, "Cache hit and refresh", us1207_test2)) ||
+       (NULL == CU_add_test(pSuite, "Failed refresh backoff", us1207_test3)) ||
+       (NULL == CU_add_test(pSuite, "Failure on empty cache", us1207_test4)) ||
+       (NULL == CU_add_test(pSuite, "Concurrent empty cache", us1207_test5)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -0,0 +1,316 @@
+/*------------------------------------------------------------------
+ * us1208.c - Unit Tests for User Story 1208 - HTTP request parsing
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <est.h>
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1208_SERVER_PORT      31208
+#define US1208_SERVER_IP        "127.0.0.1"
+#define US1208_CACERTS          "CA/estCA/cacert.crt"
+#define US1208_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1208_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+
+#define US1208_CACERTS_REQ  "GET /.well-known/est/cacerts HTTP/1.1\r\n" \
+                            "Host: 127.0.0.1\r\n" \
+                            "Connection: close\r\n\r\n"
+#define US1208_ENROLL_LINE  "POST /.well-known/est/simpleenroll HTTP/1.1\r\n" \
+                            "Host: 127.0.0.1\r\n" \
+                            "Connection: close\r\n"
+#define US1208_CT_GOOD      "application/pkcs10"
+#define US1208_CT_BAD       "text/plain"
+/* estuser:estpwd and estuser:bogus */
+#define US1208_AUTH_GOOD    "Basic ZXN0dXNlcjplc3Rwd2Q="
+#define US1208_AUTH_BAD     "Basic ZXN0dXNlcjpib2d1cw=="
+#define US1208_PKCS10_REQ   "MIIChjCCAW4CAQAwQTElMCMGA1UEAxMccmVxIGJ5IGNsaWVudCBpbiBkZW1vIHN0\nZXAgMjEYMBYGA1UEBRMPUElEOldpZGdldCBTTjoyMIIBIjANBgkqhkiG9w0BAQEF\nAAOCAQ8AMIIBCgKCAQEA/6JUWpXXDwCkvWPDWO0yANDQzFMxroLEIh6/vdNwfRSG\neNGC0efcL5L4NxHZOmO14yqMEMGpCyHz7Ob3hhNPu0K81gMUzRqzwmmJHXwRqobA\ni59OQEkHaPhI1T4RkVnSYZLOowSqonMZjWbT0iqZDY/RD8l3GjH3gEIBMQFv62NT\n1CSu9dfHEg76+DnJAhdddUDJDXO3AWI5s7zsLlzBoPlgd4oK5K1wqEE2pqhnZxei\nc94WFqXQ1kyrW0POVlQ+32moWTQTFA7SQE2uEF+GBXsRPaEO+FLQjE8JHOewLf/T\nqX0ngywnvxKRpKguSBic31WVkswPs8E34pjjZAvdxQIDAQABoAAwDQYJKoZIhvcN\nAQEFBQADggEBAAZXVoorRxAvQPiMNDpRZHhiD5O2Yd7APBBznVgRll1HML5dpgnu\nXY7ZCYwQtxwNGYVtKJaZCiW7dWrZhvnF5ua3wUr9R2ZNoLwVR0Z9Y5wwn1cJrdSG\ncUuBN/0XBGI6g6fQlDDImQoPSF8gygcTCCHba7Uv0i8oiCiwf5UF+F3NYBoBL/PP\nlO2zBEYNQ65+W3YgfUyYP0Cr0NyXgkz3Qh2Xa2eRFeW56oejmcEaMjq6yx7WAC2X\nk3w1G6Le1UInzuenMScNgnt8FaI43eAILMdLQ/Ekxc30fjxA12RDh/YzDYiExFv0\ndPd4o5uPKt4jRitvGiAPm/OCdXiYAwqiu2w=\n"
+
+static SSL_CTX *client_ctx = NULL;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.
+ */
+static int us1208_init_suite (void)
+{
+    client_ctx = SSL_CTX_new(SSLv23_client_method());
+    if (!client_ctx) {
+        return 1;
+    }
+    return (st_start(US1208_SERVER_PORT,
+                     US1208_SERVER_CERTKEY,
+                     US1208_SERVER_CERTKEY,
+                     "US1208 test realm",
+                     US1208_CACERTS,
+                     US1208_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1208_destroy_suite (void)
+{
+    st_stop();
+    SSL_CTX_free(client_ctx);
+    return 0;
+}
+
+/*
+ * Sends the request in the given pieces, pausing after each one
+ * so the server reads them separately, and returns the HTTP
+ * status of the response.  The request asks the server to close
+ * the connection after it.
+ */
+static int us1208_send (char **frags, int num_frags)
+{
+    struct sockaddr_in addr;
+    char resp[4096];
+    SSL *ssl;
+    int sock;
+    int i, n, len = 0;
+    int status = 0;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(US1208_SERVER_PORT);
+    addr.sin_addr.s_addr = inet_addr(US1208_SERVER_IP);
+    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    CU_ASSERT(sock >= 0);
+    if (sock < 0) {
+        return 0;
+    }
+    if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr))) {
+        CU_ASSERT(0);
+        close(sock);
+        return 0;
+    }
+    ssl = SSL_new(client_ctx);
+    SSL_set_fd(ssl, sock);
+    if (SSL_connect(ssl) == 1) {
+        for (i = 0; i < num_frags; i++) {
+            if (SSL_write(ssl, frags[i], strlen(frags[i])) <= 0) {
+                break;
+            }
+            usleep(50000);
+        }
+        while (len < (int)sizeof(resp) - 1 &&
+               (n = SSL_read(ssl, resp + len, sizeof(resp) - 1 - len)) > 0) {
+            len += n;
+        }
+        resp[len] = '\0';
+        if (sscanf(resp, "HTTP/1.1 %d", &status) != 1) {
+            status = 0;
+        }
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(sock);
+    return (status);
+}
+
+/*
+ * Builds an enroll request with the given headers after the
+ * request line, each one "Name: value\r\n", and sends it whole
+ */
+static int us1208_enroll (char *headers)
+{
+    char req[4096];
+    char *frags[1];
+
+    snprintf(req, sizeof(req), "%s%s\r\n%s", US1208_ENROLL_LINE, headers,
+             US1208_PKCS10_REQ);
+    frags[0] = req;
+    return (us1208_send(frags, 1));
+}
+
+/*
+ * The request line and the headers arrive in pieces, split in the
+ * middle of a line and of the URI
+ */
+static void us1208_test1 (void)
+{
+    char *frags[] = {
+        "GET /.well-kno",
+        "wn/est/cacerts HTTP/1.1\r\nHo",
+        "st: 127.0.0.1\r\n",
+        "Connection: close\r\n",
+        "\r\n"
+    };
+
+    LOG_FUNC_NM;
+
+    CU_ASSERT(us1208_send(frags, 5) == 200);
+}
+
+/*
+ * The blank line ending the headers is split, in each place it
+ * can be
+ */
+static void us1208_test2 (void)
+{
+    char req[] = US1208_CACERTS_REQ;
+    char head[sizeof(req)];
+    char *frags[2];
+    int len = strlen(req);
+    int split;
+
+    LOG_FUNC_NM;
+
+    for (split = len - 3; split < len; split++) {
+        memcpy(head, req, split);
+        head[split] = '\0';
+        frags[0] = head;
+        frags[1] = req + split;
+        CU_ASSERT(us1208_send(frags, 2) == 200);
+    }
+}
+
+/*
+ * The request arrives one byte at a time
+ */
+static void us1208_test3 (void)
+{
+    char req[] = US1208_CACERTS_REQ;
+    char bytes[sizeof(req)][2];
+    char *frags[sizeof(req)];
+    int i, n = strlen(req);
+
+    LOG_FUNC_NM;
+
+    for (i = 0; i < n; i++) {
+        bytes[i][0] = req[i];
+        bytes[i][1] = '\0';
+        frags[i] = bytes[i];
+    }
+    CU_ASSERT(us1208_send(frags, n) == 200);
+}
+
+/*
+ * An enroll request with its blank line split and the body
+ * arriving in several pieces after the headers
+ */
+static void us1208_test4 (void)
+{
+    char head[1024];
+    char body[3][sizeof(US1208_PKCS10_REQ)];
+    char *frags[5];
+    int len = strlen(US1208_PKCS10_REQ);
+    int i, piece = len / 3;
+
+    LOG_FUNC_NM;
+
+    snprintf(head, sizeof(head), "%sContent-Type: %s\r\n"
+             "Authorization: %s\r\nContent-Length: %d\r\n\r",
+             US1208_ENROLL_LINE, US1208_CT_GOOD, US1208_AUTH_GOOD, len);
+    frags[0] = head;
+    frags[1] = "\n";
+    for (i = 0; i < 3; i++) {
+        strcpy(body[i], US1208_PKCS10_REQ + i * piece);
+        if (i < 2) {
+            body[i][piece] = '\0';
+        }
+        frags[2 + i] = body[i];
+    }
+    CU_ASSERT(us1208_send(frags, 5) == 200);
+}
+
+/*
+ * The headers libest looks up are found whatever their case
+ */
+static void us1208_test5 (void)
+{
+    char hdrs[1024];
+    int len = strlen(US1208_PKCS10_REQ);
+
+    LOG_FUNC_NM;
+
+    snprintf(hdrs, sizeof(hdrs), "content-type: %s\r\n"
+             "AUTHORIZATION: %s\r\ncontent-LENGTH: %d\r\n",
+             US1208_CT_GOOD, US1208_AUTH_GOOD, len);
+    CU_ASSERT(us1208_enroll(hdrs) == 200);
+}
+
+/*
+ * When a header is repeated, the first occurrence is used
+ */
+static void us1208_test6 (void)
+{
+    char hdrs[1024];
+    int len = strlen(US1208_PKCS10_REQ);
+
+    LOG_FUNC_NM;
+
+    snprintf(hdrs, sizeof(hdrs), "Content-Type: %s\r\ncontent-type: %s\r\n"
+             "Authorization: %s\r\nContent-Length: %d\r\n",
+             US1208_CT_GOOD, US1208_CT_BAD, US1208_AUTH_GOOD, len);
+    CU_ASSERT(us1208_enroll(hdrs) == 200);
+
+    snprintf(hdrs, sizeof(hdrs), "Content-Type: %s\r\nContent-Type: %s\r\n"
+             "Authorization: %s\r\nContent-Length: %d\r\n",
+             US1208_CT_BAD, US1208_CT_GOOD, US1208_AUTH_GOOD, len);
+    CU_ASSERT(us1208_enroll(hdrs) == 400);
+
+    snprintf(hdrs, sizeof(hdrs), "Content-Type: %s\r\n"
+             "Authorization: %s\r\nAuthorization: %s\r\nContent-Length: %d\r\n",
+             US1208_CT_GOOD, US1208_AUTH_GOOD, US1208_AUTH_BAD, len);
+    CU_ASSERT(us1208_enroll(hdrs) == 200);
+
+    snprintf(hdrs, sizeof(hdrs), "Content-Type: %s\r\n"
+             "authorization: %s\r\nAuthorization: %s\r\nContent-Length: %d\r\n",
+             US1208_CT_GOOD, US1208_AUTH_BAD, US1208_AUTH_GOOD, len);
+    CU_ASSERT(us1208_enroll(hdrs) == 401);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1208_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1208_http_request_parsing",
+                         us1208_init_suite,
+                         us1208_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Request in pieces", us1208_test1)) ||
+       (NULL == CU_add_test(pSuite, "Split end of headers", us1208_test2)) ||
+       (NULL == CU_add_test(pSuite, "One byte at a time", us1208_test3)) ||
+       (NULL == CU_add_test(pSuite, "Body in pieces", us1208_test4)) ||
+       (NULL == CU_add_test(pSuite, "Header name case", us1208_test5)) ||
+       (NULL == CU_add_test(pSuite, "Repeated headers", us1208_test6)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -0,0 +1,285 @@
+/*------------------------------------------------------------------
+ * us1210.c - Unit Tests for User Story 1210 - Pre-rendered CA
+ *                                             certs response
+ *
+ * October, 2026
+ *
+ * Copyright (c) 2026 by cisco Systems, Inc.
+ * All rights reserved.
+ *------------------------------------------------------------------
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <est.h>
+#include "../../src/est/est_locl.h"
+#include "test_utils.h"
+#include "st_server.h"
+#include <openssl/ssl.h>
+
+#ifdef HAVE_CUNIT
+#include "CUnit/Basic.h"
+#include "CUnit/Automated.h"
+#endif
+
+#define US1210_SERVER_PORT      31210
+#define US1210_SERVER_IP        "127.0.0.1"
+#define US1210_CACERTS          "CA/estCA/cacert.crt"
+#define US1210_EXTCERT          "CA/extCA/cacert.crt"
+#define US1210_TRUST_CERTS      "CA/trustedcerts.crt"
+#define US1210_SERVER_CERTKEY   "CA/estCA/private/estservercertandkey.pem"
+#define US1210_CACERTS_REQ      "GET /.well-known/est/cacerts HTTP/1.1\r\n" \
+                                "Host: 127.0.0.1\r\n" \
+                                "Connection: close\r\n\r\n"
+#define US1210_RESP_MAX         65536
+
+extern EST_CTX *ectx;
+
+static SSL_CTX *client_ctx = NULL;
+
+/*
+ * This routine is called when CUnit initializes this test
+ * suite.
+ */
+static int us1210_init_suite (void)
+{
+    client_ctx = SSL_CTX_new(SSLv23_client_method());
+    if (!client_ctx) {
+        return 1;
+    }
+    return (st_start(US1210_SERVER_PORT,
+                     US1210_SERVER_CERTKEY,
+                     US1210_SERVER_CERTKEY,
+                     "US1210 test realm",
+                     US1210_CACERTS,
+                     US1210_TRUST_CERTS,
+                     "CA/estExampleCA.cnf",
+                     0, 0, 0));
+}
+
+/*
+ * This routine is called when CUnit uninitializes this test
+ * suite.
+ */
+static int us1210_destroy_suite (void)
+{
+    st_stop();
+    SSL_CTX_free(client_ctx);
+    return 0;
+}
+
+/*
+ * Fetches /cacerts and returns the length of the complete
+ * response, header and body, read into resp
+ */
+static int us1210_fetch (char *resp, int resp_max)
+{
+    struct sockaddr_in addr;
+    SSL *ssl;
+    int sock;
+    int n, len = 0;
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(US1210_SERVER_PORT);
+    addr.sin_addr.s_addr = inet_addr(US1210_SERVER_IP);
+    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    CU_ASSERT(sock >= 0);
+    if (sock < 0) {
+        return 0;
+    }
+    CU_ASSERT(!connect(sock, (const struct sockaddr*)&addr, sizeof(addr)));
+    ssl = SSL_new(client_ctx);
+    SSL_set_fd(ssl, sock);
+    if (SSL_connect(ssl) == 1) {
+        n = strlen(US1210_CACERTS_REQ);
+        CU_ASSERT(SSL_write(ssl, US1210_CACERTS_REQ, n) == n);
+        while (len < resp_max &&
+               (n = SSL_read(ssl, resp + len, resp_max - len)) > 0) {
+            len += n;
+        }
+        SSL_shutdown(ssl);
+    }
+    SSL_free(ssl);
+    close(sock);
+    return (len);
+}
+
+/*
+ * Loads the CA certs in the given files, one after the other,
+ * as the /cacerts response of the server
+ */
+static EST_ERROR us1210_load (char *file1, char *file2)
+{
+    unsigned char *pem1 = NULL, *pem2 = NULL, *pem;
+    unsigned char *old_certs;
+    int len1, len2 = 0;
+    EST_ERROR rv;
+
+    len1 = read_binary_file(file1, &pem1);
+    if (file2) {
+        len2 = read_binary_file(file2, &pem2);
+    }
+    CU_ASSERT(len1 > 0 && len2 >= 0);
+    pem = malloc(len1 + len2);
+    CU_ASSERT(pem != NULL);
+    if (len1 <= 0 || len2 < 0 || !pem) {
+        free(pem1);
+        free(pem2);
+        free(pem);
+        return (EST_ERR_LOAD_CACERTS);
+    }
+    memcpy(pem, pem1, len1);
+    if (len2) {
+        memcpy(pem + len1, pem2, len2);
+    }
+
+    old_certs = ectx->ca_certs;
+    rv = est_load_ca_certs(ectx, pem, len1 + len2);
+    if (rv == EST_ERR_NONE) {
+        free(old_certs);
+    }
+    free(pem1);
+    free(pem2);
+    free(pem);
+    return (rv);
+}
+
+/*
+ * The response is rendered once and served as is
+ */
+static void us1210_test1 (void)
+{
+    EST_HTTP_RESP *resp;
+    char *buf;
+    int len;
+
+    LOG_FUNC_NM;
+
+    buf = malloc(US1210_RESP_MAX);
+    CU_ASSERT(buf != NULL);
+    if (!buf) {
+        return;
+    }
+    resp = est_get_cacerts_resp(ectx);
+    CU_ASSERT(resp != NULL);
+    if (resp) {
+        len = us1210_fetch(buf, US1210_RESP_MAX);
+        CU_ASSERT(len == resp->len);
+        CU_ASSERT(len == resp->len && !memcmp(buf, resp->data, len));
+        CU_ASSERT(!strncmp(buf, "HTTP/1.1 200 OK\r\n", 17));
+        est_http_resp_release(resp);
+    }
+    free(buf);
+}
+
+/*
+ * The CA certs are replaced while a fetch holds the response.
+ * That response is left untouched until released, and the
+ * next fetch gets the new certs.
+ */
+static void us1210_test2 (void)
+{
+    EST_HTTP_RESP *old_resp, *new_resp;
+    char *old_copy, *buf;
+    int old_len, len;
+    EST_ERROR rv;
+
+    LOG_FUNC_NM;
+
+    buf = malloc(US1210_RESP_MAX);
+    CU_ASSERT(buf != NULL);
+    if (!buf) {
+        return;
+    }
+
+    /*
+     * Hold the response as a request being sent does
+     */
+    old_resp = est_get_cacerts_resp(ectx);
+    CU_ASSERT(old_resp != NULL);
+    if (!old_resp) {
+        free(buf);
+        return;
+    }
+    old_len = old_resp->len;
+    old_copy = malloc(old_len);
+    CU_ASSERT(old_copy != NULL);
+    if (!old_copy) {
+        est_http_resp_release(old_resp);
+        free(buf);
+        return;
+    }
+    memcpy(old_copy, old_resp->data, old_len);
+
+    rv = us1210_load(US1210_CACERTS, US1210_EXTCERT);
+    CU_ASSERT(rv == EST_ERR_NONE);
+
+    /*
+     * The held response still has its reference and its data
+     */
+    CU_ASSERT(old_resp->refcnt == 1);
+    CU_ASSERT(old_resp->len == old_len);
+    CU_ASSERT(!memcmp(old_resp->data, old_copy, old_len));
+
+    /*
+     * The next fetch is answered with the new certs
+     */
+    new_resp = est_get_cacerts_resp(ectx);
+    CU_ASSERT(new_resp != NULL && new_resp != old_resp);
+    if (new_resp) {
+        CU_ASSERT(new_resp->len > old_len);
+        len = us1210_fetch(buf, US1210_RESP_MAX);
+        CU_ASSERT(len == new_resp->len);
+        CU_ASSERT(len == new_resp->len && !memcmp(buf, new_resp->data, len));
+        est_http_resp_release(new_resp);
+    }
+
+    /*
+     * Fetching didn't disturb the response still held
+     */
+    CU_ASSERT(!memcmp(old_resp->data, old_copy, old_len));
+    est_http_resp_release(old_resp);
+
+    rv = us1210_load(US1210_CACERTS, NULL);
+    CU_ASSERT(rv == EST_ERR_NONE);
+    len = us1210_fetch(buf, US1210_RESP_MAX);
+    CU_ASSERT(len == old_len && !memcmp(buf, old_copy, old_len));
+
+    free(old_copy);
+    free(buf);
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int us1210_add_suite (void)
+{
+#ifdef HAVE_CUNIT
+   CU_pSuite pSuite = NULL;
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("us1210_cacerts_response",
+                         us1210_init_suite,
+                         us1210_destroy_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* add the tests to the suite */
+   if ((NULL == CU_add_test(pSuite, "Pre-rendered response", us1210_test1)) ||
+       (NULL == CU_add_test(pSuite, "Replace while held", us1210_test2)))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   return CUE_SUCCESS;
+#endif
+}
@@ -8,6 +8,8 @@
  *------------------------------------------------------------------
  */
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <est.h>
 #include <curl/curl.h>
@@ -42,6 +44,8 @@
 #define US901_EXTCERT "CA/extCA/cacert.crt"
 #define US901_SERVER_CERT "CA/estCA/private/estservercertandkey.pem"
 #define US901_SERVER_KEY "CA/estCA/private/estservercertandkey.pem"
+#define US901_HA1 "36807fa200741bb0e8fb04fcf08e2de6"
+#define US901_CNONCE "us901cnonce"
 
 static char test5_outfile[FILENAME_MAX] = "US901/test5.crt";
 
@@ -810,6 +814,178 @@ static void us901_test23 (void)
 }
 
 
+/*
+ * This test exercises est_server_set_auth_nonce_lifetime()
+ * on a server context that uses HTTP Digest auth.
+ */
+static void us901_test24 (void)
+{
+    unsigned char *cacerts = NULL;
+    int cacerts_len = 0;
+    BIO *certin;
+    X509 *x;
+    EVP_PKEY *priv_key;
+    int rv;
+    EST_CTX *ctx;
+    EST_ERROR est_rv;
+
+    LOG_FUNC_NM;
+
+    cacerts_len = read_binary_file(US901_CACERT, &cacerts);
+    CU_ASSERT(cacerts_len > 0);
+
+    /*
+     * Read the server cert and key, both live in the same file
+     */
+    certin = BIO_new(BIO_s_file_internal());
+    rv = BIO_read_filename(certin, US901_SERVER_CERT); 
+    CU_ASSERT(rv > 0);
+    x = PEM_read_bio_X509(certin, NULL, NULL, NULL);
+    CU_ASSERT(x != NULL);
+    rv = BIO_reset(certin);
+    priv_key = PEM_read_bio_PrivateKey(certin, NULL, NULL, NULL);
+    CU_ASSERT(priv_key != NULL);
+    BIO_free(certin);
+
+    est_rv = est_server_set_auth_nonce_lifetime(NULL, 60);
+    CU_ASSERT(est_rv == EST_ERR_NO_CTX);
+
+    ctx = est_server_init(cacerts, cacerts_len, cacerts, cacerts_len, 
+	                  EST_CERT_FORMAT_PEM, "estrealm", x, priv_key);
+    CU_ASSERT(ctx != NULL);
+    if (ctx) {
+        est_rv = est_server_set_auth_mode(ctx, AUTH_DIGEST);
+        CU_ASSERT(est_rv == EST_ERR_NONE);
+
+        est_rv = est_server_set_auth_nonce_lifetime(ctx, EST_NONCE_LIFETIME_MIN - 1);
+        CU_ASSERT(est_rv == EST_ERR_INVALID_PARAMETERS);
+        est_rv = est_server_set_auth_nonce_lifetime(ctx, EST_NONCE_LIFETIME_MAX + 1);
+        CU_ASSERT(est_rv == EST_ERR_INVALID_PARAMETERS);
+        est_rv = est_server_set_auth_nonce_lifetime(ctx, 60);
+        CU_ASSERT(est_rv == EST_ERR_NONE);
+
+        est_destroy(ctx);
+    }
+
+    if (cacerts) free(cacerts);
+    X509_free(x);
+    EVP_PKEY_free(priv_key);
+}
+
+
+/*
+ * Nonce taken from the WWW-Authenticate header of a 401
+ */
+static char us901_nonce[MAX_NONCE+1];
+static size_t us901_nonce_hdr (void *ptr, size_t size, size_t nmemb,
+                               void *userdata)
+{
+    char hdr[1024];
+    char *n, *e;
+    size_t len = size * nmemb;
+
+    if (len >= sizeof(hdr)) {
+        return len;
+    }
+    memcpy(hdr, ptr, len);
+    hdr[len] = '\0';
+    if (!strncasecmp(hdr, "WWW-Authenticate:", 17)) {
+        n = strstr(hdr, "nonce=\"");
+        if (n) {
+            n += 7;
+            e = strchr(n, '"');
+            if (e && e - n <= MAX_NONCE) {
+                memcpy(us901_nonce, n, e - n);
+                us901_nonce[e - n] = '\0';
+            }
+        }
+    }
+    return len;
+}
+
+/*
+ * Posts the enroll request to the Digest server with an
+ * Authorization header built here instead of by libcurl, so
+ * the nonce count and response can be chosen by the test.
+ */
+static long us901_digest_post (char *nc, char *response)
+{
+    long http_code = 0;
+    CURL *hnd;
+    struct curl_slist *slist1 = NULL;
+    char auth[1024];
+
+    snprintf(auth, sizeof(auth), "Authorization: Digest username=\"estuser\", "
+             "realm=\"estrealm\", nonce=\"%s\", "
+             "uri=\"/.well-known/est/simpleenroll\", cnonce=\"%s\", "
+             "nc=%s, qop=\"auth\", response=\"%s\"",
+             us901_nonce, US901_CNONCE, nc, response);
+    slist1 = curl_slist_append(slist1, US901_PKCS10_CT);
+    slist1 = curl_slist_append(slist1, auth);
+
+    hnd = curl_easy_init();
+    curl_easy_setopt(hnd, CURLOPT_URL, US901_ENROLL_URL_DA);
+    curl_easy_setopt(hnd, CURLOPT_NOPROGRESS, 1L);
+    curl_easy_setopt(hnd, CURLOPT_POSTFIELDS, US901_PKCS10_REQ);
+    curl_easy_setopt(hnd, CURLOPT_POSTFIELDSIZE_LARGE,
+                     (curl_off_t)strlen(US901_PKCS10_REQ));
+    curl_easy_setopt(hnd, CURLOPT_USERAGENT, "curl/7.27.0");
+    curl_easy_setopt(hnd, CURLOPT_HTTPHEADER, slist1);
+    curl_easy_setopt(hnd, CURLOPT_CAINFO, US901_CACERTS);
+    curl_easy_setopt(hnd, CURLOPT_SSL_VERIFYPEER, 1L);
+    curl_easy_setopt(hnd, CURLOPT_FORBID_REUSE, 1L);
+    curl_easy_perform(hnd);
+    curl_easy_getinfo(hnd, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_cleanup(hnd);
+    curl_slist_free_all(slist1);
+
+    return (http_code);
+}
+
+/*
+ * A request with a wrong digest response and the highest
+ * nonce count must not use up the nonce.  The valid request
+ * that follows on the same nonce with a count of 1 is
+ * still accepted.
+ */
+static void us901_test25 (void)
+{
+    EST_HTTP_AUTH_HDR ah;
+    char *digest;
+    long rv;
+
+    LOG_FUNC_NM;
+
+    sleep(1);
+
+    /*
+     * Get a nonce from the server's challenge
+     */
+    us901_nonce[0] = '\0';
+    rv = curl_http_post(US901_ENROLL_URL_DA, US901_PKCS10_CT, US901_PKCS10_REQ,
+                        NULL, US901_CACERTS, CURLAUTH_NONE,
+                        NULL, NULL, us901_nonce_hdr);
+    CU_ASSERT(rv == 401);
+    CU_ASSERT(us901_nonce[0] != '\0');
+
+    rv = us901_digest_post("ffffffff", "00000000000000000000000000000000");
+    CU_ASSERT(rv == 401);
+
+    memset(&ah, 0x0, sizeof(ah));
+    ah.uri = "/.well-known/est/simpleenroll";
+    ah.nonce = us901_nonce;
+    ah.nc = "00000001";
+    ah.cnonce = US901_CNONCE;
+    digest = est_server_generate_auth_digest(&ah, US901_HA1);
+    CU_ASSERT(digest != NULL);
+    if (!digest) {
+        return;
+    }
+    rv = us901_digest_post("00000001", digest);
+    CU_ASSERT(rv == 200);
+    free(digest);
+}
+
 
 /* The main() function for setting up and running the tests.
  * Returns a CUE_SUCCESS on successful running, another
@@ -853,7 +1029,9 @@ int us901_add_suite (void)
        (NULL == CU_add_test(pSuite, "HTTP POST cacerts", us901_test20)) ||
        (NULL == CU_add_test(pSuite, "SimpleEnroll - good HTTP auth/good Cert", us901_test21)) ||
        (NULL == CU_add_test(pSuite, "SimpleEnroll - bad HTTP auth/good Cert", us901_test22)) ||
-       (NULL == CU_add_test(pSuite, "SimpleEnroll - no HTTP auth/no Cert", us901_test23)))
+       (NULL == CU_add_test(pSuite, "SimpleEnroll - no HTTP auth/no Cert", us901_test23)) ||
+       (NULL == CU_add_test(pSuite, "Digest nonce lifetime", us901_test24)) ||
+       (NULL == CU_add_test(pSuite, "Digest nonce count", us901_test25)))
    {
       CU_cleanup_registry();
       return CU_get_error();
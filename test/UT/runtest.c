@@ -33,6 +33,27 @@ extern int us903_add_suite(void);
 extern int us1005_add_suite(void);
 extern int us1060_add_suite(void);
 extern int us1159_add_suite(void);
+extern int us1190_add_suite(void);
+extern int us1191_add_suite(void);
+extern int us1192_add_suite(void);
+extern int us1193_add_suite(void);
+extern int us1194_add_suite(void);
+extern int us1195_add_suite(void);
+extern int us1196_add_suite(void);
+extern int us1197_add_suite(void);
+extern int us1198_add_suite(void);
+extern int us1199_add_suite(void);
+extern int us1200_add_suite(void);
+extern int us1201_add_suite(void);
+extern int us1202_add_suite(void);
+extern int us1203_add_suite(void);
+extern int us1204_add_suite(void);
+extern int us1205_add_suite(void);
+extern int us1206_add_suite(void);
+extern int us1207_add_suite(void);
+extern int us1208_add_suite(void);
+extern int us1209_add_suite(void);
+extern int us1210_add_suite(void);
 
 /* The main() function for setting up and running the tests.
  * Returns a CUE_SUCCESS on successful running, another
@@ -165,6 +186,153 @@ int main(int argc, char *argv[])
 	exit(1);
     }
 #endif
+#if 10 
+    rv = us1190_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1190 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1191_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1191 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1192_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1192 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1193_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1193 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1194_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1194 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1195_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1195 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1196_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1196 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1197_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1197 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1198_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1198 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1199_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1199 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1200_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1200 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1201_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1201 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1202_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1202 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1203_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1203 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1204_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1204 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1205_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1205 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1206_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1206 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1207_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1207 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1208_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1208 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1209_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1209 (%d)", rv);
+	exit(1);
+    }
+#endif
+#if 10 
+    rv = us1210_add_suite();
+    if (rv != CUE_SUCCESS) {
+	printf("\nFailed to add test suite for US1210 (%d)", rv);
+	exit(1);
+    }
+#endif
 
     if (xml) {
 	/* Run all test using automated interface, which
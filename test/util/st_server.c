@@ -32,6 +32,7 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <netinet/in.h>
+#include <poll.h>
 
 
 BIO *bio_err = NULL;
@@ -46,6 +47,18 @@ unsigned char *trustcerts = NULL;
 int trustcerts_len = 0;
 static char conf_file[255];
 static char *csr_attr_value = NULL;
+static int event_mode = 0;
+static int pool_threads = 0;
+static char *shm_sess_cache = NULL;
+static unsigned char *ticket_key = NULL;
+static int async_enroll = 0;
+static int enroll_batch = 0;
+static int enroll_batch_wait = 0;
+static int enroll_batch_delay = 0;
+static int pending_table = 0;
+static int enroll_cache = 0;
+static int x509_enroll = 0;
+static volatile int enroll_woken = 0;
 
 extern void dumpbin(char *buf, size_t len);
 
@@ -151,31 +164,15 @@ static int compare (const void *pa, const void *pb)
  * case we'll add the public key from the cert request into
  * our lookup table so it can be correlated later.
  */
-static int lookup_pkcs10_request(unsigned char *pkcs10, int p10_len)
+static int lookup_pkcs10_request(X509_REQ *req)
 {
-    X509_REQ *req = NULL;
-    BIO *in = NULL;
     BIO *out = NULL;
-    BIO *b64;
     EVP_PKEY *pkey;
     BUF_MEM *bptr;
     int rv;
     LOOKUP_ENTRY *l;
     LOOKUP_ENTRY *n;
 
-    /*
-     * Decode the request into an X509_REQ structure
-     */
-    b64 = BIO_new(BIO_f_base64());
-    in = BIO_new_mem_buf(pkcs10, p10_len);
-    in = BIO_push(b64, in);
-    if ((req = d2i_X509_REQ_bio(in, NULL)) == NULL) {
-	/* Unable to parse the request, just let this fall through
-	 * and the enrollment will fail */
-	rv = 1;
-	goto DONE;
-    }
-
     /*
      * Get the public key from the request, this will be our index into
      * the lookup table.  Frankly, I'm not sure how a real CA
@@ -216,8 +213,6 @@ static int lookup_pkcs10_request(unsigned char *pkcs10, int p10_len)
     }
 DONE:
     if (out) BIO_free_all(out);
-    if (in) BIO_free_all(in);
-    if (req) X509_REQ_free(req);
     if (pkey) EVP_PKEY_free(pkey);
 
     return (rv);
@@ -233,7 +228,7 @@ DONE:
  * Callback function used by EST stack to process a PKCS10
  * enrollment request with the CA.
  */
-static int process_pkcs10_enrollment (unsigned char * pkcs10, int p10_len, 
+static int process_pkcs10_enrollment (X509_REQ *req, unsigned char *der, int der_len,
                                unsigned char **cert, int *cert_len,
 			       char *uid, X509 *peercert, void *app_data)
 {
@@ -253,7 +248,7 @@ static int process_pkcs10_enrollment (unsigned char * pkcs10, int p10_len,
      * enroll on the second request.
      */
     if (manual_enroll) {
-	if (lookup_pkcs10_request(pkcs10, p10_len)) {
+	if (lookup_pkcs10_request(req)) {
 	    /*
 	     * We've seen this cert request in the past.  
 	     * Remove it from the lookup table and allow
@@ -271,7 +266,7 @@ static int process_pkcs10_enrollment (unsigned char * pkcs10, int p10_len,
 
     }
 
-    result = ossl_simple_enroll(pkcs10, p10_len, conf_file);
+    result = ossl_simple_enroll_req(req, conf_file);
 
     /*
      * The result is a BIO containing the pkcs7 signed certificate
@@ -288,6 +283,164 @@ static int process_pkcs10_enrollment (unsigned char * pkcs10, int p10_len,
     return EST_ERR_NONE;
 }
 
+/*
+ * Callback function used by EST stack to process a PKCS10
+ * enrollment request with a CA that hands back the issued
+ * X509.  The test CA only produces PKCS7, the certificate is
+ * taken back out of it here.
+ */
+static int process_x509_enrollment (X509_REQ *req, unsigned char *der, int der_len,
+                                    X509 **cert, char *uid, X509 *peercert,
+				    void *app_data)
+{
+    unsigned char *pkcs7 = NULL;
+    int pkcs7_len = 0;
+    BIO *b64, *in;
+    PKCS7 *p7;
+    int rv;
+
+    rv = process_pkcs10_enrollment(req, der, der_len, &pkcs7, &pkcs7_len,
+	                           uid, peercert, app_data);
+    if (rv != EST_ERR_NONE) {
+	return (rv);
+    }
+
+    b64 = BIO_new(BIO_f_base64());
+    in = BIO_new_mem_buf(pkcs7, pkcs7_len);
+    in = BIO_push(b64, in);
+    p7 = d2i_PKCS7_bio(in, NULL);
+    BIO_free_all(in);
+    free(pkcs7);
+    if (!p7 || OBJ_obj2nid(p7->type) != NID_pkcs7_signed ||
+	sk_X509_num(p7->d.sign->cert) < 1) {
+	PKCS7_free(p7);
+	return (EST_ERR_CA_ENROLL_FAIL);
+    }
+    *cert = X509_dup(sk_X509_value(p7->d.sign->cert, 0));
+    PKCS7_free(p7);
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Sends the CA chain along with the certificates issued
+ * through process_x509_enrollment()
+ */
+static int st_set_enroll_chain (char *ca_chain_file)
+{
+    STACK_OF(X509) *chain;
+    X509 *x;
+    BIO *in;
+    int rv;
+
+    in = BIO_new_file(ca_chain_file, "r");
+    if (!in) {
+	return (-1);
+    }
+    chain = sk_X509_new_null();
+    while ((x = PEM_read_bio_X509(in, NULL, NULL, NULL)) != NULL) {
+	sk_X509_push(chain, x);
+    }
+    ERR_clear_error();
+    BIO_free(in);
+    rv = est_server_set_enroll_chain(ectx, chain);
+    sk_X509_pop_free(chain, X509_free);
+    return (rv);
+}
+
+/*
+ * An enrollment accepted by process_async_enrollment(), the
+ * CSR remains valid until the request is finished.
+ */
+struct st_async_enroll {
+    EST_ENROLL_REQ *req;
+    X509_REQ *csr;
+    unsigned char *der;
+    int der_len;
+};
+
+/*
+ * Plays the part of a CA that signs the request some time
+ * after it was received.
+ */
+static void *async_enroll_thread (void *arg)
+{
+    struct st_async_enroll *ae = (struct st_async_enroll *)arg;
+    unsigned char *cert = NULL;
+    int cert_len = 0;
+    int rv;
+
+    usleep(10000);
+    rv = process_pkcs10_enrollment(ae->csr, ae->der, ae->der_len,
+	                           &cert, &cert_len, NULL, NULL, NULL);
+    if (rv == EST_ERR_NONE) {
+	est_server_enroll_complete(ae->req, cert, cert_len);
+    } else {
+	est_server_enroll_fail(ae->req, rv);
+    }
+    free(ae);
+    return NULL;
+}
+
+/*
+ * Callback function used by EST stack to hand a PKCS10
+ * enrollment request to the CA without waiting for it.
+ */
+static int process_async_enrollment (EST_ENROLL_REQ *req, X509_REQ *csr,
+                                     unsigned char *der, int der_len,
+				     char *uid, X509 *peercert, void *app_data)
+{
+    struct st_async_enroll *ae;
+    pthread_t tid;
+
+    ae = malloc(sizeof(struct st_async_enroll));
+    if (!ae) {
+	return (EST_ERR_MALLOC);
+    }
+    ae->req = req;
+    ae->csr = csr;
+    ae->der = der;
+    ae->der_len = der_len;
+    if (pthread_create(&tid, NULL, async_enroll_thread, ae)) {
+	free(ae);
+	return (EST_ERR_CA_ENROLL_FAIL);
+    }
+    pthread_detach(tid);
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Callback function used by EST stack to sign a batch of
+ * PKCS10 enrollment requests with the CA.
+ */
+static int process_enrollment_batch (EST_ENROLL_ITEM *items, int count,
+                                     void *app_data)
+{
+    int i;
+
+    if (enroll_batch_delay) {
+	usleep(enroll_batch_delay * 1000);
+    }
+    for (i = 0; i < count; i++) {
+	items[i].rv = process_pkcs10_enrollment(items[i].csr, items[i].der,
+		                                items[i].der_len,
+						&items[i].pkcs7,
+						&items[i].pkcs7_len,
+						items[i].user_id,
+						items[i].peer_cert, app_data);
+    }
+    return (EST_ERR_NONE);
+}
+
+/*
+ * Invoked by libest once the CA has finished a parked
+ * enrollment.  The event loop resumes the connections
+ * waiting on the CA the next time around.
+ */
+static void process_enroll_wakeup (EST_SERVER_CONN *conn, void *app_data)
+{
+    enroll_woken = 1;
+}
+
 //This CSR attributes contains the challengePassword OID and others
 #define TEST_CSR "MCYGBysGAQEBARYGCSqGSIb3DQEJBwYFK4EEACIGCWCGSAFlAwQCAg==\0"
 
@@ -438,6 +591,81 @@ static void cleanup()
     //est_apps_shutdown();
 }
 
+#define ST_MAX_EVENT_CONNS 64
+/*
+ * Services all the client connections from this one thread
+ * using the non-blocking connection API.  The listening socket
+ * occupies the first slot in the poll set.
+ */
+static void event_loop (int sock)
+{
+    struct pollfd pfd[ST_MAX_EVENT_CONNS+1];
+    EST_SERVER_CONN *conns[ST_MAX_EVENT_CONNS+1];
+    int num_fds = 1;
+    int i, new, want, rc, woken;
+
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN;
+    conns[0] = NULL;
+
+    while (stop_flag == 0) {
+	rc = poll(pfd, num_fds, 100);
+	woken = __sync_lock_test_and_set(&enroll_woken, 0);
+	if (rc <= 0 && !woken) {
+	    continue;
+	}
+	if (woken) {
+	    /*
+	     * Connections waiting on the CA aren't polled
+	     */
+	    for (i = 1; i < num_fds; i++) {
+		if (!pfd[i].events) {
+		    pfd[i].revents |= POLLIN;
+		}
+	    }
+	}
+	if (pfd[0].revents & POLLIN && num_fds <= ST_MAX_EVENT_CONNS) {
+	    new = accept(sock, NULL, NULL);
+	    if (new >= 0) {
+		conns[num_fds] = est_server_conn_new(ectx, new);
+		if (!conns[num_fds]) {
+		    close(new);
+		} else {
+		    pfd[num_fds].fd = new;
+		    pfd[num_fds].events = 0;
+		    pfd[num_fds].revents = POLLIN;
+		    num_fds++;
+		}
+	    }
+	}
+	for (i = 1; i < num_fds; i++) {
+	    if (!pfd[i].revents) {
+		continue;
+	    }
+	    want = est_server_conn_on_event(conns[i], 
+		    (pfd[i].revents & POLLIN ? EST_CONN_EV_READ : 0) |
+		    (pfd[i].revents & POLLOUT ? EST_CONN_EV_WRITE : 0));
+	    if (want & EST_CONN_EV_CLOSED) {
+		est_server_conn_free(conns[i]);
+		close(pfd[i].fd);
+		/* Move the last connection into this slot */
+		num_fds--;
+		pfd[i] = pfd[num_fds];
+		conns[i] = conns[num_fds];
+		i--;
+		continue;
+	    }
+	    pfd[i].events = (want & EST_CONN_EV_READ ? POLLIN : 0) |
+		            (want & EST_CONN_EV_WRITE ? POLLOUT : 0);
+	    pfd[i].revents = 0;
+	}
+    }
+    for (i = 1; i < num_fds; i++) {
+	est_server_conn_free(conns[i]);
+	close(pfd[i].fd);
+    }
+}
+
 static void* master_thread (void *arg)
 {
     int sock;                 
@@ -474,6 +702,10 @@ static void* master_thread (void *arg)
     listen(sock, SOMAXCONN);
     stop_flag = 0;
 
+    if (event_mode) {
+	event_loop(sock);
+    }
+
     while (stop_flag == 0) {
         len = sizeof(addr);
         new = accept(sock, (struct sockaddr*)&addr, &len);
@@ -501,6 +733,14 @@ static void* master_thread (void *arg)
 void st_stop ()
 {
     stop_flag = 1;
+    if (pool_threads) {
+	/*
+	 * There's no master thread to do the cleanup,
+	 * est_server_stop() waits for the worker pool.
+	 */
+	cleanup();
+	return;
+    }
     sleep(2);
 }
 
@@ -646,14 +886,50 @@ static int st_start_internal (
 	est_server_disable_pop(ectx);
     }
 
-    if (est_set_ca_enroll_cb(ectx, &process_pkcs10_enrollment)) {
+    if (est_set_ca_enroll_csr_cb(ectx, &process_pkcs10_enrollment)) {
         printf("\nUnable to set EST pkcs10 enrollment callback.  Aborting!!!\n");
         return (-1);
     }
-    if (est_set_ca_reenroll_cb(ectx, &process_pkcs10_enrollment)) {
+    if (est_set_ca_reenroll_csr_cb(ectx, &process_pkcs10_enrollment)) {
         printf("\nUnable to set EST pkcs10 enrollment callback.  Aborting!!!\n");
         return (-1);
     }
+    if (x509_enroll) {
+	if (est_set_ca_enroll_x509_cb(ectx, &process_x509_enrollment) ||
+	    est_set_ca_reenroll_x509_cb(ectx, &process_x509_enrollment) ||
+	    st_set_enroll_chain(ca_chain_file)) {
+	    printf("\nUnable to set EST X509 enrollment callbacks.  Aborting!!!\n");
+	    return (-1);
+	}
+    }
+    if (async_enroll) {
+	if (est_set_ca_enroll_async_cb(ectx, &process_async_enrollment) ||
+	    est_set_ca_reenroll_async_cb(ectx, &process_async_enrollment) ||
+	    est_server_set_enroll_wakeup_cb(ectx, &process_enroll_wakeup)) {
+	    printf("\nUnable to set EST async enrollment callbacks.  Aborting!!!\n");
+	    return (-1);
+	}
+    }
+    if (enroll_batch) {
+	if (est_set_ca_enroll_batch_cb(ectx, &process_enrollment_batch,
+		                       enroll_batch, enroll_batch_wait) ||
+	    est_server_set_enroll_wakeup_cb(ectx, &process_enroll_wakeup)) {
+	    printf("\nUnable to set EST batch enrollment callback.  Aborting!!!\n");
+	    return (-1);
+	}
+    }
+    if (pending_table) {
+	if (est_server_enable_pending_table(ectx, pending_table, 60)) {
+	    printf("\nUnable to enable the pending enrollment table.  Aborting!!!\n");
+	    return (-1);
+	}
+    }
+    if (enroll_cache) {
+	if (est_server_set_enroll_cache(ectx, enroll_cache, 60)) {
+	    printf("\nUnable to enable the enrollment cache.  Aborting!!!\n");
+	    return (-1);
+	}
+    }
     if (est_set_csr_cb(ectx, &process_csrattrs_request)) {
         printf("\nUnable to set EST CSR Attributes callback.  Aborting!!!\n");
         return (-1);
@@ -692,6 +968,21 @@ static int st_start_internal (
 	}
     }
 
+    if (shm_sess_cache) {
+	rv = est_server_set_shm_session_cache(ectx, shm_sess_cache, 64);
+	if (rv != EST_ERR_NONE) {
+	    printf("\nUnable to set session cache.  Aborting!!!\n");
+	    return (-1);
+	}
+    }
+    if (ticket_key) {
+	rv = est_server_add_ticket_key(ectx, ticket_key, EST_TICKET_KEY_LEN);
+	if (rv != EST_ERR_NONE) {
+	    printf("\nUnable to set ticket key.  Aborting!!!\n");
+	    return (-1);
+	}
+    }
+
     printf("\nLaunching EST server...\n");
 
     rv = est_server_start(ectx);
@@ -700,9 +991,20 @@ static int st_start_internal (
         return (-1);
     }
 
-    // Start master (listening) thread
     tcp_port = listen_port;
-    pthread_create(&thread, NULL, master_thread, NULL);
+    if (pool_threads) {
+	/*
+	 * Let libest run the listener and worker threads
+	 */
+	rv = est_server_run(ectx, listen_port, pool_threads);
+	if (rv != EST_ERR_NONE) {
+	    printf("\nFailed to run server: %s\n", EST_ERR_NUM_TO_STR(rv));
+	    return (-1);
+	}
+    } else {
+	// Start master (listening) thread
+	pthread_create(&thread, NULL, master_thread, NULL);
+    }
 
     sleep(2);
     /*
@@ -858,4 +1160,106 @@ void st_enable_csrattr_enforce ()
     est_server_enforce_csrattr(ectx);
 }
 
+/*
+ * Call this prior to st_start() to have the server
+ * process connections using the non-blocking connection
+ * API from a single thread, rather than handing each
+ * connection to est_server_handle_request().
+ */
+void st_set_event_mode (int enable)
+{
+    event_mode = enable;
+}
+
+/*
+ * Call this prior to st_start() to have enrollment requests
+ * signed by a separate thread through the asynchronous CA
+ * handlers, rather than while libest waits.
+ */
+void st_set_async_enroll (int enable)
+{
+    async_enroll = enable;
+}
+
+/*
+ * Call this prior to st_start() to have enrollment requests
+ * signed in batches of up to max_batch, waiting at most
+ * max_wait_ms for a batch to fill.  Pass in zero to sign
+ * each request on its own.
+ */
+void st_set_enroll_batch (int max_batch, int max_wait_ms)
+{
+    enroll_batch = max_batch;
+    enroll_batch_wait = max_wait_ms;
+}
+
+/*
+ * Call this to have the CA take delay_ms over each batch it
+ * is handed.  Pass in zero to sign without delay.
+ */
+void st_set_enroll_batch_delay (int delay_ms)
+{
+    enroll_batch_delay = delay_ms;
+}
+
+/*
+ * Call this prior to st_start() to have libest remember up
+ * to max_entries enrollments the CA asked to be retried.
+ * Pass in zero to send every poll to the CA.
+ */
+void st_set_pending_table (int max_entries)
+{
+    pending_table = max_entries;
+}
+
+/*
+ * Call this prior to st_start() to have libest send the
+ * certificate issued earlier to a client repeating one of
+ * its last max_entries enrollments.  Pass in zero to send
+ * every enrollment to the CA.
+ */
+void st_set_enroll_cache (int max_entries)
+{
+    enroll_cache = max_entries;
+}
 
+/*
+ * Call this prior to st_start() to have the CA hand the
+ * issued certificates to libest as an X509, sent along
+ * with the CA chain.
+ */
+void st_set_enroll_x509 (int enable)
+{
+    x509_enroll = enable;
+}
+
+/*
+ * Call this prior to st_start() to have libest accept
+ * connections itself using est_server_run() with the
+ * given number of worker threads.  Pass in zero to
+ * use the single-threaded accept loop in this file.
+ */
+void st_set_pool_threads (int nthreads)
+{
+    pool_threads = nthreads;
+}
+
+/*
+ * Call this prior to st_start() to have the server keep
+ * its TLS sessions in the shared memory cache at path.
+ * Pass in NULL to use only the OpenSSL session cache.
+ */
+void st_set_shm_session_cache (char *path)
+{
+    shm_sess_cache = path;
+}
+
+/*
+ * Call this prior to st_start() to enable TLS session
+ * tickets protected with the given EST_TICKET_KEY_LEN
+ * byte key.  Pass in NULL to disable tickets.
+ */
+void st_set_ticket_key (unsigned char *key)
+{
+    ticket_key = key;
+}
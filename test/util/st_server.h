@@ -41,5 +41,15 @@ void st_set_csrattrs(char *value);
 void st_set_http_auth_optional();
 void st_set_http_auth_required();
 void st_enable_csrattr_enforce();
+void st_set_event_mode(int enable);
+void st_set_async_enroll(int enable);
+void st_set_enroll_batch(int max_batch, int max_wait_ms);
+void st_set_enroll_batch_delay(int delay_ms);
+void st_set_pending_table(int max_entries);
+void st_set_enroll_cache(int max_entries);
+void st_set_enroll_x509(int enable);
+void st_set_pool_threads(int nthreads);
+void st_set_shm_session_cache(char *path);
+void st_set_ticket_key(unsigned char *key);
 #endif
 